@@ -0,0 +1,17 @@
+/* animation.h - keyframed positions for objects and lights, rendered a frame at a time with --frames */
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "raytracer.h"
+
+/* what animate_scene() moved, so that refit_scene() only updates the structures that depend on it */
+#define MOVED_SPHERES 1     // binned by the grid
+#define MOVED_INSTANCES 2   // bounded by the instance BVH
+#define MOVED_LIGHTS 4      // copied into the light arrays and the light tree
+
+/* function definitions */
+int animate_scene(int frame);
+void refit_scene(int moved);
+
+#endif //ANIMATION_H
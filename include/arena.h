@@ -0,0 +1,35 @@
+/* arena.h - bump allocators for scene data and per-thread render temporaries */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* one chunk of arena memory, taken from the heap */
+typedef struct arena_block_t {
+    struct arena_block_t *next;
+    char *data;         // start of the block's memory, aligned to ARENA_ALIGN
+    size_t size;        // bytes in data
+    size_t used;        // bytes handed out so far
+} ArenaBlock;
+
+/* hands out memory from a chain of blocks, all of it given back at once by arena_reset() or arena_free() */
+typedef struct arena_t {
+    ArenaBlock *first;  // every block the arena owns
+    ArenaBlock *current;    // block allocations are coming from
+    void *last;         // most recent allocation, which arena_grow() can extend in place
+} Arena;
+
+/* global variables */
+extern Arena scene_arena;           // everything read from the scene file, lives until the program exits
+extern __thread Arena frame_arena;  // temporaries of the tile or pixel being rendered by the calling thread
+
+/* function definitions */
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_calloc(Arena *arena, size_t count, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+char *arena_strdup(Arena *arena, const char *str);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif //ARENA_H
@@ -4,6 +4,8 @@
 
 #ifndef BASE_H
 #define BASE_H
+#include <stdint.h>
+#include <float.h>
 
 #define false 0
 #define true 1
@@ -12,4 +14,13 @@
 /* variables and types */
 typedef int8_t boolean;
 
+/* precision of geometry, rays and shading. Building with -DSINGLE_PRECISION=ON in CMake selects float */
+#ifdef SINGLE_PRECISION
+typedef float real;
+#define REAL_EPSILON FLT_EPSILON
+#else
+typedef double real;
+#define REAL_EPSILON DBL_EPSILON
+#endif
+
 #endif //BASE_H
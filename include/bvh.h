@@ -0,0 +1,55 @@
+/* bvh.h - bounding volume hierarchies, built by the surface area heuristic over anything with bounds */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdint.h>
+#include "raytracer.h"
+
+#define BVH_LEAF_SIZE 4     // items a node has before the build tries to split it
+#define BVH_BINS 16         // centroid bins the surface area heuristic picks splits between
+#define BVH_MAX_DEPTH 60    // the build makes leaves past this depth, so traversal stacks can't overflow
+
+/* one node of a BVH, 32 bytes. The first child of an inner node is the node right after it */
+typedef struct bvh_node_t {
+    float lo[3], hi[3];     // bounds of the node's items, rounded outward
+    uint32_t first;         // leaf: first item, inner: index of the second child
+    uint32_t count;         // items in a leaf, 0 for an inner node
+} BVHNode;
+
+/* bounds of one item handed to bvh_build() */
+typedef struct bvh_item_t {
+    float lo[3], hi[3];
+    float centroid[3];      // set by bvh_build()
+    uint32_t index;         // which item this is, for the caller to put its items in leaf order
+} BVHItem;
+
+/* function definitions */
+BVHNode *bvh_build(BVHItem *items, int n, int *nnodes);
+void bvh_refit(BVHNode *nodes, int nnodes, const BVHItem *items);
+float bvh_cost(const BVHNode *nodes, int nnodes);
+float bvh_round_down(double v);
+float bvh_round_up(double v);
+
+/**
+ * Finds where a ray enters a node's bounds
+ * @param node - node to test
+ * @param org - ray origin
+ * @param inv_dir - 1 / ray direction, per axis
+ * @param t_far - entries beyond this don't count
+ * @return - the distance, or INFINITY if the ray misses the bounds or enters them beyond t_far
+ */
+static inline real bvh_box_entry(const BVHNode *node, const real org[3], const real inv_dir[3], real t_far) {
+    real t_near = 0;
+    for (int k = 0; k < 3; k++) {
+        real t0 = (node->lo[k] - org[k]) * inv_dir[k];
+        real t1 = (node->hi[k] - org[k]) * inv_dir[k];
+        real t_enter = t0 < t1 ? t0 : t1;
+        real t_exit = (t0 < t1 ? t1 : t0) * (1 + 4 * REAL_EPSILON);   // rounding can't cut a grazing ray short
+        t_near = t_enter > t_near ? t_enter : t_near;
+        t_far = t_exit < t_far ? t_exit : t_far;
+    }
+    return t_near <= t_far ? t_near : INFINITY;
+}
+
+#endif //BVH_H
@@ -0,0 +1,41 @@
+/* checkpoint.h - the finished tiles of a render saved as it goes, so a killed render can pick up where it stopped */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "raytracer.h"
+#include "tiles.h"
+#include "tilecache.h"
+
+#define CHECKPOINT_SECONDS 60       // default time between saves
+#define CHECKPOINT_MAGIC 0x31504B43 // "CKP1" at the start of a checkpoint file, changed if the layout changes
+
+/* the checkpoint of the view being rendered and what this run has done with checkpoints */
+typedef struct checkpoint_t {
+    char *path;             // file of the view being rendered, set before each view is rendered
+    double interval;        // seconds between saves
+    boolean resume;         // whether tiles already in path are read back instead of rendered
+    CacheKey binary;        // hash of the running executable, a checkpoint from another build is ignored
+    CacheKey view;          // hash of the scene, settings and camera of the view being rendered
+    image *img;             // the view being rendered
+    int cols, ntiles;       // tiles across the image and in all
+    unsigned char *done;    // one per tile, set once the tile's pixels are final
+    double next_save;       // wall clock time of the next save
+    int saving;             // set while a thread is saving, so the others carry on rendering
+    int saves;
+    int resumed;            // tiles read back instead of rendered
+    int skipped;            // views whose checkpoint said they were already written
+    size_t bytes_written;
+    double seconds;         // spent reading and saving
+} Checkpoint;
+
+/* function definitions */
+void checkpoint_open(Checkpoint *ck, double interval, boolean resume);
+boolean checkpoint_finished(Checkpoint *ck, Camera *camera, int width, int height);
+int checkpoint_resume(Checkpoint *ck, image *img, Camera *camera, Tile *tiles, int ntiles);
+void checkpoint_tile_done(Checkpoint *ck, Tile *tile);
+boolean checkpoint_stopping();
+void checkpoint_end(Checkpoint *ck);
+void checkpoint_complete(Checkpoint *ck);
+
+#endif //CHECKPOINT_H
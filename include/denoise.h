@@ -0,0 +1,32 @@
+/* denoise.h - edge-avoiding a-trous wavelet filter over the linear colors of a finished image */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "raytracer.h"
+
+#define DENOISE_PASSES 5            // default passes, each twice as wide as the last, reaching 62 pixels out
+#define DENOISE_SIGMA_COLOR 4.0     // default luminance difference, in units of the center pixel's estimated noise,
+                                    // at which a neighbor's weight falls to 1/e. Halved every pass so that later,
+                                    // wider passes only smooth what is left of the noise
+#define DENOISE_MIN_VARIANCE 1e-4f  // added to a pixel's estimated luminance variance, so clean areas still blend
+#define DENOISE_SIGMA_ALBEDO 0.1    // albedo difference at which a neighbor's weight falls to 1/e
+#define DENOISE_SIGMA_DEPTH 0.02    // depth difference per pixel apart, relative to the depth, for the same
+#define DENOISE_NORMAL_POWER 128    // the normal weight is dot(n_p, n_q) raised to this, a power of 2
+#define DENOISE_MIN_COSINE 0.9f     // taps whose normals are further apart than this are skipped, 0.9^128 ~ 1e-6
+#define DENOISE_MAX_EXPONENT 16     // ... as are taps whose other terms weigh them down by more than e^-16
+
+/* what each pixel center sees first, used to keep the filter from blurring across edges */
+typedef struct aux_buffers_t {
+    int width, height;
+    float *normal;      // 3 per pixel, unit surface normal of the first hit, 0 for none
+    float *depth;       // distance to the first hit along the primary ray, INFINITY for none
+    float *albedo;      // 3 per pixel, diffuse color of the first hit, 0 for none
+} AuxBuffers;
+
+/* function definitions */
+void aux_buffers_init(AuxBuffers *aux, int width, int height);
+void aux_buffers_free(AuxBuffers *aux);
+void denoise_image(float *color, float *out, AuxBuffers *aux, int passes, double sigma_color);
+
+#endif //DENOISE_H
@@ -0,0 +1,49 @@
+/* gbuffer.h - the first hit and shadow ray results of every pixel, kept so lights can be changed without tracing */
+
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <stdint.h>
+#include "raytracer.h"
+
+#define GBUFFER_MAGIC 0x32464247    // "GBF2" at the start of a G-buffer file, changed if the layout changes
+
+/* what a pixel's first hit knows about each light, two bits per light */
+#define VISIBILITY_UNKNOWN 0        // no shadow ray was cast, the light couldn't reach the point
+#define VISIBILITY_LIT 1            // the shadow ray reached the light
+#define VISIBILITY_SHADOWED 2       // something was in the way
+
+/* per pixel first hits of one view, captured by raycast_scene() and read back by relight_scene() */
+typedef struct gbuffer_t {
+    int width, height;
+    int nobjects;           // objects in the scene it was captured from, a different count means a different scene
+    int nlights;
+    int words;              // 32 bit words of visibility per pixel
+    int32_t *obj;           // hit index of the first hit through each pixel center, -1 for none
+    int32_t *triangle;      // triangle of it that was hit if it is a mesh, -1 otherwise
+    real *t;                // distance to it along the primary ray
+    real (*indirect)[3];    // everything in the pixel's color but the direct light at the first hit: reflections,
+                            // refractions and the object's own color, or the background color
+    uint32_t *visibility;   // words per pixel, VISIBILITY_* of light l in bits 2 * l and 2 * l + 1
+    real (*light_positions)[3]; // where the lights were, a light that has moved since needs its shadow rays again
+} GBuffer;
+
+/* function definitions */
+void gbuffer_init(GBuffer *gb, int width, int height);
+void gbuffer_free(GBuffer *gb);
+void gbuffer_write(GBuffer *gb, const char *path);
+void gbuffer_read(GBuffer *gb, const char *path, int width, int height);
+
+/**
+ * Finds what a pixel's first hit knows about a light
+ * @return - VISIBILITY_UNKNOWN, VISIBILITY_LIT or VISIBILITY_SHADOWED
+ */
+static inline int gbuffer_visibility(GBuffer *gb, int pixel, int light) {
+    return gb->visibility[(size_t)pixel * gb->words + light / 16] >> (2 * (light % 16)) & 3;
+}
+
+static inline void gbuffer_set_visibility(GBuffer *gb, int pixel, int light, int visibility) {
+    gb->visibility[(size_t)pixel * gb->words + light / 16] |= (uint32_t)visibility << (2 * (light % 16));
+}
+
+#endif //GBUFFER_H
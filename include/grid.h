@@ -0,0 +1,44 @@
+/* grid.h - uniform grid over the spheres, traversed with a 3D DDA instead of testing every object */
+
+#ifndef GRID_H
+#define GRID_H
+
+#include "raytracer.h"
+
+/* how shoot() finds the closest object along a ray */
+#define ACCEL_LINEAR 0      // test every object in index order
+#define ACCEL_GRID 1        // walk the cells of a uniform grid over the spheres, see grid.c
+
+#define GRID_DENSITY 2      // cells per sphere the automatic resolution aims for
+#define GRID_MAX_RES 512    // most cells along any one axis
+
+/* spheres binned into equal sized cells covering their bounds, plus the objects that can't be bounded */
+typedef struct uniform_grid_t {
+    real lo[3], hi[3];      // bounds of all the spheres
+    int res[3];             // cells along each axis
+    real cell[3];           // size of a cell along each axis
+    real inv_cell[3];       // 1 / cell
+    int *cell_start;        // res[0] * res[1] * res[2] + 1 offsets into cell_items, x varying fastest
+    int *cell_items;        // sphere indices in each cell, in index order
+    int *unbounded;         // objects tested for every ray, planes and meshes
+    real (*spheres)[4];     // center and radius of each sphere by object index, 0 for the other objects
+    int nunbounded;
+    int nspheres;
+    int nobjects;           // objects in the scene when the grid was built
+    size_t bytes;           // memory held by the arrays above
+    double build_seconds;   // how long grid_build() took
+} UniformGrid;
+
+/* global variables */
+extern UniformGrid grid;
+
+/* function definitions */
+void grid_build();
+void grid_refit();
+void grid_free();
+void grid_replicate();
+void grid_thread_free();
+void grid_shoot(Ray *ray, int self_index, real max_distance, int *ret_index, real *ret_best_t, boolean *ret_in_sphere,
+                int *ret_triangle);
+
+#endif //GRID_H
@@ -7,26 +7,70 @@
 
 #include "json.h"
 
+#define SHININESS 20        // default specular exponent, see settings.h
+
+/* lights shaded per vector operation by shade_light_batch(), as many reals as the target's registers hold */
+#if defined(__AVX512F__)
+#define VECTOR_BYTES 64
+#elif defined(__AVX__)
+#define VECTOR_BYTES 32
+#else
+#define VECTOR_BYTES 16
+#endif
+#define LIGHT_LANES (VECTOR_BYTES / (int)sizeof(real))
+
+/* the scene's lights with one array per field, so that a block of lights loads straight into vector registers */
+typedef struct light_soa_t {
+    int count;
+    int spots;                  // how many of the lights are spotlights
+    real *px, *py, *pz;         // position
+    real *r, *g, *b;            // color
+    real *a0, *a1, *a2;         // radial attenuation, a0 being the constant term calculate_radial_att() uses
+    real *dx, *dy, *dz;         // spotlight direction, 0 for point lights
+    real *cos_theta;            // cosine of the spotlight half angle, -2 for point lights so every direction passes
+    real *ang_exp;              // angular attenuation exponent, 0 for point lights
+} LightSoA;
+
+/* lights to shade at one point along with the results of their shadow rays */
+typedef struct light_batch_t {
+    int n, cap;
+    int *light;                 // index of the light
+    real *lx, *ly, *lz;         // normalized direction from the point to the light
+    real *dist;                 // distance to the light
+    real *mask;                 // weight of the light's contribution, 0 where its shadow ray was blocked
+} LightBatch;
+
+extern LightSoA light_soa;
+extern int shininess;        // specular exponent of every surface
+
 /* function declarations */
-void calculate_diffuse(double *normal_vector,
-                       double *light_vector,
-                       double *light_color,
-                       double *obj_color,
-                       double *out_color);
-
-void calculate_specular(double ns,
-                        double *L,
-                        double *R,
-                        double *N,
-                        double *V,
-                        double *KS,
-                        double *IL,
-                        double *out_color);
-
-double clamp(double color_val);
-void scale_color(double* color, double scalar, double* out_color);
-void copy_color(double* color, double* out_color);
-double calculate_angular_att(Light *light, double direction_to_object[3]);
-double calculate_radial_att(Light *light, double distance_to_light);
+void calculate_diffuse(real *normal_vector,
+                       real *light_vector,
+                       real *light_color,
+                       real *obj_color,
+                       real *out_color);
+
+void calculate_specular(real ns,
+                        real *L,
+                        real *R,
+                        real *N,
+                        real *V,
+                        real *KS,
+                        real *IL,
+                        real *out_color);
+
+real clamp(real color_val);
+void scale_color(real* color, real scalar, real* out_color);
+void copy_color(real* color, real* out_color);
+real calculate_angular_att(Light *light, real direction_to_object[3]);
+real calculate_radial_att(Light *light, real distance_to_light);
+real calculate_influence_radius(Light *light, real threshold);
+boolean light_reaches(Light *light, real to_light[3], real distance_to_light);
+void light_soa_build();
+void light_soa_replicate();
+void light_batch_push(LightBatch *batch, int light, real to_light[3], real distance, real weight);
+void light_batch_free(LightBatch *batch);
+void shade_light_batch(LightBatch *batch, real normal[3], real view[3], real kd[3], real ks[3],
+                       real color[3]);
 
 #endif //ILLUMINATION_H
@@ -0,0 +1,71 @@
+/* instance.h - named groups of spheres and meshes placed any number of times in a scene, each copy only a transform */
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "raytracer.h"
+#include "json.h"
+#include "bvh.h"
+
+#define INSTANCE_REFIT_SLACK 2  // instances_refit() builds the BVH again once refits make it this much costlier
+
+/* the spheres and meshes sharing one group name, in the group's own coordinates */
+typedef struct group_t {
+    char *name;
+    object *members;        // copies of the grouped objects, in the order the BVH leaves list them
+    int nmembers;
+    BVHNode *nodes;         // BVH over the members
+    int nnodes;
+} Group;
+
+/* one instance of a group, with the transform taking the group's coordinates into the scene */
+typedef struct instance_entry_t {
+    int object;             // index of the instance in objects
+    Group *group;
+    real position[3];
+    real rotation[3][3];    // rotates group coordinates into the scene, its transpose rotates them back
+    real scale;
+    real inv_scale;         // 1 / scale
+    int first_hit;          // hit index of the group's first member in this instance, the rest follow it
+} InstanceEntry;
+
+/* every instance in the scene, under a BVH over their bounds in the scene */
+typedef struct instance_table_t {
+    InstanceEntry *entries; // in the order the BVH leaves list them, so first_hit increases along the table
+    int nentries;
+    BVHNode *nodes;
+    int nnodes;
+    Group *groups;
+    int ngroups;
+    int nhits;              // hit indices handed out, from nobjects up. Hit indices below nobjects are objects
+    size_t bytes;           // memory held by the arrays above and the groups
+    double build_seconds;   // how long instances_build() took
+    float built_cost;       // bvh_cost() of the instance BVH when it was last built
+    int refits;             // times instances_refit() has refit the instance BVH
+    int rebuilds;           // times instances_refit() has built it again instead
+} InstanceTable;
+
+/* global variables */
+extern InstanceTable instance_table;
+
+/* function definitions */
+void instances_build();
+void instances_free();
+void instances_refit();
+void instances_shoot(Ray *ray, int self_index, real max_distance, int *best_o, real *best_t, boolean *best_in_sphere,
+                     int *best_triangle);
+object *instance_member(int hit);
+int instance_owner(int hit);
+void instance_object_bounds(int object, real lo[3], real hi[3]);
+void instance_normal(int hit, int triangle, real point[3], real normal[3]);
+
+/**
+ * Finds the object a hit index from shoot() refers to
+ * @param hit - index of an object, or of a group member in one instance if it is nobjects or more
+ * @return - the object, in the group's coordinates for a member
+ */
+static inline object *hit_object(int hit) {
+    return hit < nobjects ? &objects[hit] : instance_member(hit);
+}
+
+#endif //INSTANCE_H
@@ -9,74 +9,132 @@
 #include <string.h>
 #include <ctype.h>
 #include "base.h"
+#include "arena.h"
 
-#define MAX_OBJECTS 128     // maximum number of objects supported in json file
+#define MAX_OBJECTS 128     // objects and lights room is made for up front, both grow past it as needed
 #define CAMERA 1
 #define SPHERE 2
 #define PLANE 3
 #define LIGHT 4
 #define SPOTLIGHT 5
 #define OBJECT 6
+#define MESH 7
+#define INSTANCE 8
+#define RENDER 9            // the scene's render settings, read into scene_settings rather than kept as an object
 
 // structs to store different types of objects
+typedef struct position_key_t {
+    real frame;             // frame the object is at this position on, see animation.h
+    real position[3];
+} PositionKey;
+
 typedef struct camera_t {
-    double width;
-    double height;
+    real width;             // viewplane width one unit in front of the camera, set from fov if not given
+    real height;            // viewplane height
+    real *position;         // where the camera is, the origin if not given
+    real *look_at;          // point the camera looks at, straight down +z if not given
+    real *up;               // which way is up in the image, +y if not given
+    real fov;               // vertical field of view in degrees, 0 to use width and height instead
 } Camera;
 
 typedef struct sphere_t {
-    double *diff_color;
-    double *spec_color;
-    double *position;
-    double reflect;
-    double refract;
-    double radius;
-    double ior;
+    real *diff_color;
+    real *spec_color;
+    real *position;
+    real reflect;
+    real refract;
+    real radius;
+    real ior;
 } Sphere;
 
 typedef struct plane_t {
-    double *diff_color;     // diffuse color
-    double *spec_color;     // specular color
-    double *position;
-    double *normal;
-    double reflect;        // reflectivity
-    double refract;        // refractivity
-    double ior;            // index of refraction of the volume
+    real *diff_color;       // diffuse color
+    real *spec_color;       // specular color
+    real *position;
+    real *normal;
+    real reflect;          // reflectivity
+    real refract;          // refractivity
+    real ior;              // index of refraction of the volume
 } Plane;
 
+typedef struct mesh_t {
+    real *diff_color;       // diffuse color, first like the other objects so shade() can read it from any of them
+    real *spec_color;       // specular color
+    real *position;         // where the OBJ file's origin goes in the scene, set by prepare_scene() if not given
+    real reflect;           // reflectivity
+    real refract;           // refractivity
+    real ior;               // index of refraction of the volume
+    real scale;             // uniform scale of the OBJ file's coordinates
+    char *file;             // OBJ file the triangles are read from
+    struct mesh_data_t *data;   // triangles and their BVH, shared with meshes of the same file, set by prepare_scene()
+} Mesh;
+
+typedef struct instance_t {
+    real *position;         // where the group's origin goes in the scene, set by prepare_scene() if not given
+    real *rotation;         // degrees about x, then y, then z, none if not given
+    real scale;             // uniform scale of the group's coordinates
+    char *group;            // name of the group it is a copy of
+} Instance;
+
 typedef struct light_t {
     int type;
-    double *color;
-    double *position;
-    double *direction;
-    double theta_deg;
-    double rad_att0;
-    double rad_att1;
-    double rad_att2;
-    double ang_att0;
+    real *color;
+    real *position;
+    real *direction;
+    real theta_deg;
+    real rad_att0;
+    real rad_att1;
+    real rad_att2;
+    real ang_att0;
+    real cos_theta;             // cosine of the spotlight half angle, set by prepare_scene()
+    real influence_radius;      // beyond this distance the light is too dim to matter, set by prepare_scene()
+    PositionKey *keys;          // where the light is on each key frame, in frame order, NULL if it stays put
+    int nkeys;
 } Light;
 
 // object datatype to store json data
 typedef struct object_t {
     int type;  // -1 so we can check if the object has been populated
+    char *group;            // sphere or mesh: the group it belongs to, which leaves it out of the scene itself
+    PositionKey *keys;      // where the object is on each key frame, in frame order, NULL if it stays put
+    int nkeys;
     union {
         Camera camera;
         Sphere sphere;
         Plane plane;
+        Mesh mesh;
+        Instance instance;
     };
 } object;
 
+/* a parsed scene set aside by scene_detach(), so that the file can be read again and compared with it */
+typedef struct scene_copy_t {
+    object *objects;
+    int nobjects;
+    Light *lights;
+    int nlights;
+    object *grouped_objects;
+    int ngrouped_objects;
+    Arena arena;            // what scene_arena held for the scene
+} SceneCopy;
+
 /* global variables */
 extern int line;
-extern object objects[MAX_OBJECTS];
-extern Light lights[MAX_OBJECTS];
+extern object *objects;    // nobjects objects followed by one with type 0, no fixed limit
+extern Light *lights;      // nlights lights, no fixed limit
 extern int nlights;
 extern int nobjects;
+extern object *grouped_objects;    // ngrouped_objects spheres and meshes that belong to a group, see instance.h
+extern int ngrouped_objects;
 
 /* function definitions */
-void read_json(FILE *json);
+void read_json(FILE *json, const char *path);
 void init_objects();
 void init_lights();
+void grow_objects(int n);
+void grow_lights(int n);
 void print_objects(object *obj);
+void scene_detach(SceneCopy *copy);
+void scene_copy_free(SceneCopy *copy);
 
 #endif //JSON_H
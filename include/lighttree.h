@@ -0,0 +1,39 @@
+/* lighttree.h - bounding hierarchy over the lights for scenes with many of them */
+
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+#include <stdint.h>
+#include "json.h"
+
+/* how shading points pick the lights they evaluate */
+#define LIGHTS_ALL 0            // every light, after light_reaches()
+#define LIGHTS_SIGNIFICANT 1    // walk the tree and skip whole subtrees too dim to matter
+#define LIGHTS_SAMPLED 2        // importance sample a fixed number of lights through the tree
+
+/* a node covers a range of lights, bounding their positions and the cone their light leaves in */
+typedef struct light_node_t {
+    real lo[3], hi[3];      // bounding box of the light positions
+    real axis[3];           // axis of the cone bounding the spotlight directions
+    real theta_o;           // half angle of that cone, M_PI if any light shines everywhere
+    real theta_e;           // largest spotlight half angle, the spread around each direction
+    real power;             // sum of the brightest color channel of each light
+    real max_power;         // brightest color channel of any one light
+    real min_a0, min_a1, min_a2;    // smallest radial attenuation coefficients
+    int first, count;       // range of light_order covered by this node
+    int left, right;        // child nodes, -1 for a leaf
+} LightNode;
+
+/* a light picked for a shading point and the weight its contribution is scaled by */
+typedef struct light_choice_t {
+    int light;
+    real weight;
+} LightChoice;
+
+/* function definitions */
+void light_tree_build();
+void light_tree_free();
+void light_tree_seed(uint64_t seed);
+int select_lights(real position[3], LightChoice **choices);
+
+#endif //LIGHTTREE_H
@@ -0,0 +1,42 @@
+/* mesh.h - triangle meshes read from OBJ files, each with its own bounding volume hierarchy */
+
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+#include "raytracer.h"
+#include "bvh.h"
+
+/* precision vertex positions are kept in. Float halves the memory of big meshes in a double build, configuring
+ * CMake with -DMESH_FLOAT_POSITIONS=OFF keeps them as real */
+#ifdef MESH_FLOAT_POSITIONS
+typedef float vertex_real;
+#else
+typedef real vertex_real;
+#endif
+
+/* triangles of one OBJ file, shared by every mesh object that uses the file */
+typedef struct mesh_data_t {
+    char *path;
+    vertex_real *vertices;  // x, y, z of each vertex
+    uint32_t *indices;      // three vertex indices per triangle, in the order the BVH leaves list them
+    BVHNode *nodes;
+    int nvertices;
+    int ntriangles;
+    int nnodes;
+    size_t bytes;           // memory held by the arrays above
+    double load_seconds;    // reading the OBJ file
+    double build_seconds;   // building the BVH
+    struct mesh_data_t *next;   // the next file loaded
+} MeshData;
+
+/* global variables */
+extern MeshData *loaded_meshes;     // every OBJ file loaded so far
+
+/* function definitions */
+MeshData *mesh_load(const char *path);
+void mesh_free_all();
+real mesh_intersect(Ray *ray, Mesh *mesh, real t_min, real t_max, boolean *back_face, int *triangle);
+void mesh_normal(Mesh *mesh, int triangle, real normal[3]);
+
+#endif //MESH_H
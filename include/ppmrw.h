@@ -26,9 +26,13 @@ typedef struct RGBPixel_t {
 // image info
 typedef struct image_t {
     RGBPixel *pixmap;
+    float *hdr;     // linear color of each pixel as 3 floats, quantized into pixmap by resolve_image(), or NULL
     int width, height, max_color_val;
 } image;
 
 void print_pixels(RGBPixel *pixmap, int width, int height);
 void create_ppm(FILE *fh, int type, image *img);
+int write_p6_data(FILE *fh, image *img);
+int write_pfm(FILE *fh, image *img);
+int read_ppm(FILE *fh, image *img);
 #endif //PPMRW_H
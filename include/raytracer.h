@@ -12,16 +12,113 @@
 #include "json.h"
 #include "base.h"
 #include "vector_math.h"
+#include "stats.h"
 
 #define MAX_COLOR_VAL 255   // maximum color to support for RGB
+#define MAX_REC_LEVEL 7     // default maximum recursion level for raytracing, see settings.h
+
+/* how secondary rays are traced */
+#define RAYS_RECURSIVE 0    // depth first, one pixel at a time
+#define RAYS_BATCHED 1      // breadth first over a tile, see wavefront.c
+#define RAYS_SORTED 2       // breadth first with rays sorted for coherence
+
+/* how resolve_image() maps linear colors into the 0 to 1 range of the image */
+#define TONEMAP_CLAMP 0     // cut off at 0 and 1
+#define TONEMAP_REINHARD 1  // c / (1 + c), bright colors roll off instead of clipping
+
+/* tolerances, written so they hold with either precision of real */
+#define PARALLEL_EPSILON ((real)0.0001)     // cosine below which a ray counts as parallel to a plane
+#define RAY_EPSILON ((real)0.001)           // default smallest distance secondary rays start away from their surface
 
 /* custom types */
 typedef struct ray_t {
-    double origin[3];
-    double direction[3];
+    real origin[3];
+    real direction[3];
 } Ray;
 
+#define PRIMARY_BATCH 8     // primary rays built together by primary_ray_row(), a few SIMD registers wide
+
+/* camera and the viewplane one unit in front of it that the primary rays are shot through, see view_init() */
+typedef struct view_t {
+    real width;         // viewplane width (camera width)
+    real height;        // viewplane height (camera height)
+    real pixwidth;      // width of one pixel on the viewplane
+    real pixheight;     // height of one pixel on the viewplane
+    real origin[3];     // camera position
+    real right[3];      // unit vector across the image, left to right
+    real up[3];         // unit vector up the image
+    real forward[3];    // unit vector the camera looks along, through the viewplane center
+} View;
+
+/* options that change how raycast_scene() renders, set from the command line and settings.h */
+typedef struct render_options_t {
+    CostMap *cost_map;      // if not NULL, per-pixel cost is recorded here
+    int max_samples;        // sample budget for each pixel, 1 shoots a single ray through the pixel center
+    int max_depth;          // recursion level past which secondary rays are no longer followed
+    double min_weight;      // reflected and refracted rays adding less than this to the pixel are not traced
+    boolean shadows;        // whether shadow rays are cast, every light reaches every point it faces if not
+    real ray_epsilon;       // smallest distance secondary rays start away from their surface
+    int min_samples;        // stratified samples taken before checking the variance
+    double variance_threshold;  // stop adding samples once the variance of the pixel color drops below this
+    double time_budget;     // milliseconds for a progressive render, 0 renders the whole image
+    int ray_order;          // RAYS_RECURSIVE, RAYS_BATCHED or RAYS_SORTED
+    double light_threshold; // lights contributing less than this at a point are culled before casting shadow rays
+    int light_mode;         // LIGHTS_ALL, LIGHTS_SIGNIFICANT or LIGHTS_SAMPLED, see lighttree.h
+    int light_samples;      // lights sampled per shading point with LIGHTS_SAMPLED
+    int accel;              // ACCEL_LINEAR or ACCEL_GRID, see grid.h
+    struct tile_cache_t *tile_cache;    // if not NULL, raycast_scene() reads tiles from it and writes the rest to it
+    double exposure;        // stops the linear colors are scaled by before they are quantized, 0 leaves them
+    int tonemap;            // TONEMAP_CLAMP or TONEMAP_REINHARD
+    struct gbuffer_t *gbuffer;  // if not NULL, raycast_scene() captures every pixel's first hit into it, see gbuffer.h
+    struct checkpoint_t *checkpoint;    // if not NULL, raycast_scene() resumes from it and saves to it, see checkpoint.h
+} RenderOptions;
+
+/* global variables */
+extern RenderOptions render_options;
+extern V3 background_color;
+
+/**
+ * Finds how far a secondary ray should start from the point it leaves so that it can't hit the same surface again.
+ * This is render_options.ray_epsilon until the point is so far from the origin that rounding its coordinates could move it further
+ * than that, which happens much sooner with single precision
+ * @param point - point the ray leaves from
+ * @return - distance to move the ray's origin along its direction
+ */
+static inline real ray_offset(real point[3]) {
+    real m = fmax(fabs(point[0]), fmax(fabs(point[1]), fabs(point[2])));
+    real offset = m * (64 * REAL_EPSILON);
+    return offset > render_options.ray_epsilon ? offset : render_options.ray_epsilon;
+}
+
 /* functions */
-void raycast_scene(image*, double, double);
+void prepare_object(object *obj);
+void prepare_scene();
+void replicate_scene();
+real sphere_intersect(Ray *ray, real *C, real r, boolean *in_sphere);
+real plane_intersect(Ray *ray, real *Pos, real *Norm);
+void shoot(Ray *ray, int self_index, real max_distance, int *ret_index, real *ret_best_t, boolean *ret_in_sphere,
+           int *ret_triangle);
+real get_reflectivity(int obj_index);
+real get_refractivity(int obj_index);
+real get_ior(int obj_index);
+void reflection_vector(V3 direction, V3 position, int obj_index, int triangle, V3 reflection);
+void refraction_vector(V3 direction, V3 position, int obj_index, int triangle, real ext_ior, V3 refracted_vector,
+                       boolean *in_sphere);
+void surface_shading(int obj_index, int triangle, real point[3], real normal[3], real diff_color[3],
+                     real spec_color[3]);
+void direct_shade(Ray *ray, int obj_index, int triangle, real position[3], Light *light, real max_dist,
+                  real color[3]);
+void view_init(View *view, Camera *camera, int img_width, int img_height);
+void raycast_scene(image*, Camera*);
+void resolve_image(image*);
+void first_touch_image(image*);
+struct tile_t;          // tiles.h
+struct tile_deps_t;     // watch.h
+void raycast_tiles(image*, Camera*, struct tile_t*, int, struct tile_deps_t*);
+double raycast_progressive(image*, Camera*, double);
+struct gbuffer_t;       // gbuffer.h
+void relight_scene(image*, Camera*, struct gbuffer_t*);
+struct aux_buffers_t;   // denoise.h
+void raycast_aux(image*, Camera*, struct aux_buffers_t*);
 int get_camera(object*);
 #endif
@@ -0,0 +1,42 @@
+/* settings.h - the quality settings of a render, from a named preset, the scene's render object and the command
+ * line, each overriding the one before */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdio.h>
+#include "base.h"
+
+/* which fields of a RenderSettings were given */
+#define SETTING_DEPTH 1
+#define SETTING_SAMPLES 2
+#define SETTING_MIN_WEIGHT 4
+#define SETTING_SHADOWS 8
+#define SETTING_SHININESS 16
+#define SETTING_RAY_EPSILON 32
+#define SETTING_BACKGROUND 64
+
+/* settings from one place, only the fields in given are set */
+typedef struct render_settings_t {
+    int given;              // SETTING_* of the fields that were set
+    const char *preset;     // name of the preset they start from, NULL for none
+    int max_depth;          // secondary rays followed from each primary hit before the color is cut off
+    int samples;            // most samples per pixel, 1 shoots a single ray through the pixel center
+    double min_weight;      // reflected and refracted rays adding less than this to a pixel aren't traced, 0 traces all
+    boolean shadows;        // whether shadow rays are cast, lights reach every point they face if not
+    int shininess;          // specular exponent of every surface
+    double ray_epsilon;     // smallest distance secondary rays start away from their surface
+    real background[3];     // color of rays that hit nothing
+} RenderSettings;
+
+/* global variables */
+extern RenderSettings scene_settings;  // the scene's render object, filled in by read_json()
+
+/* function definitions */
+boolean settings_preset(RenderSettings *settings, const char *name);
+void settings_resolve(RenderSettings *options, RenderSettings *settings);
+boolean settings_equal(RenderSettings *a, RenderSettings *b);
+void settings_apply(RenderSettings *settings);
+void settings_print(FILE *out, RenderSettings *settings);
+
+#endif //SETTINGS_H
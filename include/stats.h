@@ -0,0 +1,46 @@
+/* stats.h - counters and per-pixel cost accounting for the renderer */
+
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include <stdint.h>
+#include "ppmrw.h"
+
+/* running totals of the work done while rendering */
+typedef struct render_counters_t {
+    uint64_t rays;      // rays passed to shoot()
+    uint64_t tests;     // ray/object intersection tests
+    uint64_t samples;   // primary rays traced
+    uint64_t pixels;    // pixels written
+    uint64_t lights_considered;     // light/shading point pairs checked before casting a shadow ray
+    uint64_t lights_culled;         // ... of which the light could not contribute
+    uint64_t arena_allocs;  // allocations served by an arena, see arena.c
+    uint64_t heap_allocs;   // ... and blocks the arenas took from the heap to serve them
+} RenderCounters;
+
+/* per-pixel cost recorded during raycast_scene() */
+typedef struct cost_map_t {
+    int width, height;
+    float *rays;        // rays cast for the pixel
+    float *tests;       // intersection tests for the pixel
+    float *cycles;      // elapsed cycles for the pixel
+} CostMap;
+
+/* global variables */
+extern __thread RenderCounters counters;   // counters for the calling thread
+extern RenderCounters render_totals;        // counters from all threads, see flush_counters()
+
+/* function definitions */
+uint64_t read_cycles();
+double wall_seconds();
+void flush_counters();
+void cache_counter_start();
+long long cache_counter_stop();
+void print_stats(FILE *out, double seconds);
+void cost_map_init(CostMap *map, int width, int height);
+void cost_map_record(CostMap *map, int row, int col, RenderCounters *start, uint64_t cycles);
+void cost_map_spread(CostMap *map, int row0, int col0, int row1, int col1, RenderCounters *start, uint64_t cycles);
+void cost_map_write(CostMap *map, char *filename);
+void cost_map_free(CostMap *map);
+
+#endif //STATS_H
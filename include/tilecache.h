@@ -0,0 +1,41 @@
+/* tilecache.h - rendered tiles kept on disk, found again by a hash of everything that went into their pixels */
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <stdint.h>
+#include "raytracer.h"
+#include "tiles.h"
+
+#define TILE_CACHE_MB 1024          // default size the cache is evicted down to, in megabytes
+#define TILE_CACHE_MAGIC 0x32544352 // "RCT2" at the start of each tile file, changed if the layout changes
+
+/* 128 bit hash, two independent 64 bit lanes */
+typedef struct cache_key_t {
+    uint64_t a, b;
+} CacheKey;
+
+/* a cache directory and what this run has done with it */
+typedef struct tile_cache_t {
+    char *dir;
+    size_t max_bytes;       // once the files take more than this the least recently used are removed
+    CacheKey binary;        // hash of the running executable, so a rebuilt renderer never reads older tiles
+    CacheKey view;          // hash of the scene, settings and camera of the view being rendered
+    int hits;               // tiles read from the cache
+    int misses;             // tiles rendered and written to it
+    int evicted;            // files removed to stay under max_bytes
+    size_t bytes_read;
+    size_t bytes_written;
+    size_t bytes_held;      // size of the cache after the last eviction scan, 0 if there wasn't one
+    double seconds;         // spent hashing, reading, writing and evicting
+} TileCache;
+
+/* function definitions */
+CacheKey hash_binary();
+CacheKey hash_view(CacheKey binary, Camera *camera);
+void tile_cache_open(TileCache *cache, const char *dir, size_t max_bytes);
+int tile_cache_fetch(TileCache *cache, image *img, Camera *camera, Tile *tiles, int ntiles);
+void tile_cache_store(TileCache *cache, image *img, Tile *tiles, int ntiles);
+void tile_cache_close(TileCache *cache);
+
+#endif //TILECACHE_H
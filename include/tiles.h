@@ -0,0 +1,33 @@
+/* tiles.h - splits the image into tiles and renders them on a pool of threads */
+
+#ifndef TILES_H
+#define TILES_H
+
+#include "base.h"
+
+#define TILE_SIZE 32        // tile width and height in pixels, a multiple of the coarsest progressive step
+
+/* rectangle of pixels, x1 and y1 are exclusive */
+typedef struct tile_t {
+    int x0, y0;
+    int x1, y1;
+} Tile;
+
+/* work done on a single tile. thread is the index of the worker running it, 0 is the calling thread */
+typedef void (*tile_func)(Tile *tile, int thread, void *arg);
+
+/* work done once for each NUMA node, on one of the node's threads */
+typedef void (*node_func)(int node, void *arg);
+
+/* function definitions */
+int default_thread_count();
+void tile_pool_init(int nthreads, boolean pin);
+void tile_pool_shutdown();
+int tile_pool_threads();
+int tile_pool_nodes();
+int tile_pool_node();
+int make_tiles(int width, int height, Tile **tiles);
+void tile_pool_run(Tile *tiles, int ntiles, int height, tile_func func, void *arg);
+void tile_pool_run_nodes(node_func func, void *arg);
+
+#endif //TILES_H
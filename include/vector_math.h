@@ -6,13 +6,29 @@
 #define VECTOR_MATH_H
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
-
-
-typedef double V3[3];   // represents a 3d vector
-
-
-static inline double sqr(double v) {
+#include <tgmath.h>     // sqrt() and friends follow the type of real
+#include "base.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+typedef real V3[3];     // represents a 3d vector
+
+/* a 3d vector in the lanes of SIMD registers, with the 4th lane kept at 0. A float V4 is one SSE register. A double V4
+ * is two SSE halves split by hand: the compiler lowers a 32 byte vector through memory without AVX, and with AVX the
+ * 256 bit divide in v4_normalize() measured slower than the three scalar divides it replaces. The V4 functions are
+ * only ever inlined, which is why the build turns off the warnings about passing vectors by value changing the ABI */
+#ifdef SINGLE_PRECISION
+typedef real V4 __attribute__((vector_size(4 * sizeof(real))));
+#else
+typedef real V2 __attribute__((vector_size(2 * sizeof(real))));
+typedef struct v4_t {
+    V2 xy;
+    V2 zw;
+} V4;
+#endif
+
+static inline real sqr(real v) {
     return v*v;
 }
 
@@ -28,15 +44,15 @@ static inline void v3_copy(V3 from, V3 to) {
     to[2] = from[2];
 }
 
-static inline void normalize(double *v) {
-    double len = sqr(v[0]) + sqr(v[1]) + sqr(v[2]);
+static inline void normalize(real *v) {
+    real len = sqr(v[0]) + sqr(v[1]) + sqr(v[2]);
     len = sqrt(len);
     v[0] /= len;
     v[1] /= len;
     v[2] /= len;
 }
 
-static inline double v3_len(V3 a) {
+static inline real v3_len(V3 a) {
     return sqrt(sqr(a[0]) + sqr(a[1]) + sqr(a[2]));
 }
 
@@ -52,13 +68,13 @@ static inline void v3_sub(V3 a, V3 b, V3 c) {
     c[2] = a[2] - b[2];
 }
 
-static inline void v3_scale(V3 a, double s, V3 b) {
+static inline void v3_scale(V3 a, real s, V3 b) {
     b[0] = s * a[0];
     b[1] = s * a[1];
     b[2] = s * a[2];
 }
 
-static inline double v3_dot(V3 a, V3 b) {
+static inline real v3_dot(V3 a, V3 b) {
     return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
 }
 
@@ -70,12 +86,138 @@ static inline void v3_cross(V3 a, V3 b, V3 c) {
 
 static inline void v3_reflect(V3 v, V3 n, V3 v_r) {
     normalize(n);
-    double scalar = 2.0 * v3_dot(n, v);
+    real scalar = 2 * v3_dot(n, v);
     V3 tmp_vector;
     v3_scale(n, scalar, tmp_vector);
     v3_sub(v, tmp_vector, v_r);
 }
 
+#ifndef SINGLE_PRECISION
+static inline V4 v4_load(V3 a) {
+    return (V4){{a[0], a[1]}, {a[2], 0}};
+}
+
+static inline void v4_store(V4 a, V3 b) {
+    b[0] = a.xy[0];
+    b[1] = a.xy[1];
+    b[2] = a.zw[0];
+}
+
+static inline V4 v4_add(V4 a, V4 b) {
+    return (V4){a.xy + b.xy, a.zw + b.zw};
+}
+
+static inline V4 v4_sub(V4 a, V4 b) {
+    return (V4){a.xy - b.xy, a.zw - b.zw};
+}
+
+static inline V4 v4_mul(V4 a, V4 b) {
+    return (V4){a.xy * b.xy, a.zw * b.zw};
+}
+
+static inline V4 v4_scale(V4 a, real s) {
+    return (V4){a.xy * s, a.zw * s};
+}
+
+static inline V4 v4_div(V4 a, real s) {
+    return (V4){a.xy / s, a.zw / s};
+}
+
+/* summed in the same order as v3_dot() so both give the same result */
+static inline real v4_dot(V4 a, V4 b) {
+    V2 xy = a.xy * b.xy;
+    V2 zw = a.zw * b.zw;
+    return xy[0] + xy[1] + zw[0];
+}
+
+static inline V4 v4_cross(V4 a, V4 b) {
+    return (V4){{a.xy[1]*b.zw[0] - a.zw[0]*b.xy[1], a.zw[0]*b.xy[0] - a.xy[0]*b.zw[0]},
+                {a.xy[0]*b.xy[1] - a.xy[1]*b.xy[0], 0}};
+}
+#else
+static inline V4 v4_load(V3 a) {
+    return (V4){a[0], a[1], a[2], 0};
+}
+
+static inline void v4_store(V4 a, V3 b) {
+    b[0] = a[0];
+    b[1] = a[1];
+    b[2] = a[2];
+}
+
+static inline V4 v4_add(V4 a, V4 b) {
+    return a + b;
+}
+
+static inline V4 v4_sub(V4 a, V4 b) {
+    return a - b;
+}
+
+static inline V4 v4_mul(V4 a, V4 b) {
+    return a * b;
+}
+
+static inline V4 v4_scale(V4 a, real s) {
+    return a * s;
+}
+
+static inline V4 v4_div(V4 a, real s) {
+    return a / s;
+}
+
+/* summed in the same order as v3_dot() so both give the same result */
+static inline real v4_dot(V4 a, V4 b) {
+    V4 p = a * b;
+    return p[0] + p[1] + p[2];
+}
+
+static inline V4 v4_cross(V4 a, V4 b) {
+    typedef int32_t lanes __attribute__((vector_size(16)));
+    lanes yzx = {1, 2, 0, 3};
+    lanes zxy = {2, 0, 1, 3};
+    return __builtin_shuffle(a, yzx) * __builtin_shuffle(b, zxy) - __builtin_shuffle(a, zxy) * __builtin_shuffle(b, yzx);
+}
+#endif
+
+static inline real v4_len(V4 a) {
+    return sqrt(v4_dot(a, a));
+}
+
+static inline V4 v4_normalize(V4 a) {
+    return v4_div(a, v4_len(a));
+}
+
+/**
+ * Approximates 1 / sqrt(x) with the SSE reciprocal square root estimate, good to 12 bits, refined by one
+ * Newton-Raphson step to about 23 bits. That is as good as float gets, but only about half of what double holds
+ */
+static inline real rsqrt(real x) {
+#ifdef __SSE__
+    real y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((float)x)));
+#else
+    real y = 1 / sqrt((float)x);
+#endif
+    return y * ((real)1.5 - (real)0.5 * x * y * y);
+}
+
+/**
+ * Normalizes a vector where a relative error around 1e-7 in its length doesn't matter, like a shading normal. With
+ * double this multiplies by rsqrt() instead of taking a square root and dividing. A float V4 divides all its lanes in
+ * one instruction, which is already faster than the estimate and its Newton step, so it just uses v4_normalize()
+ */
+static inline V4 v4_normalize_fast(V4 a) {
+#ifdef SINGLE_PRECISION
+    return v4_normalize(a);
+#else
+    return v4_scale(a, rsqrt(v4_dot(a, a)));
+#endif
+}
+
+/* reflects v about n, which has to be normalized already */
+static inline V4 v4_reflect(V4 v, V4 n) {
+    return v4_sub(v, v4_scale(n, 2 * v4_dot(n, v)));
+}
+
 /* testing/debug functions */
 //void print_v3(V3 data){
 //    printf("V3: (%lf, %lf, %lf)\n", data[0], data[1], data[2]);
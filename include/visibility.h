@@ -0,0 +1,38 @@
+/* visibility.h - primary ray visibility from projected object bounds */
+
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include "raytracer.h"
+
+/* closest object seen through a pixel center */
+typedef struct first_hit_t {
+    int obj;            // index into objects, -1 if nothing was hit
+    real t;             // distance along the primary ray
+    boolean in_sphere;  // whether the hit was from inside of a sphere
+    int triangle;       // triangle that was hit if obj is a mesh, -1 otherwise, see mesh_intersect()
+} FirstHit;
+
+/* spheres binned by the screen tiles their projections cover, plus the planes and meshes */
+typedef struct primary_visibility_t {
+    View *view;
+    int img_width, img_height;
+    int tiles_x, tiles_y;
+    real (*rect)[4];    // per object: x0, x1, y0, y1 of the projected bounds on the viewplane
+    int *bin_start;     // tiles_x * tiles_y + 1 offsets into bin_items
+    int *bin_items;     // sphere indices for each tile, in index order
+    int *always;        // spheres whose projection is unbounded (they surround or straddle the camera)
+    int nalways;
+    int *planes;        // plane indices
+    real *plane_num;    // per plane: dot(position - camera, normal), the same for every primary ray
+    int nplanes;
+    int *meshes;        // mesh indices, each tested through its own BVH
+    int nmeshes;
+} PrimaryVisibility;
+
+/* function definitions */
+void visibility_init(PrimaryVisibility *vis, View *view, int img_width, int img_height);
+void visibility_free(PrimaryVisibility *vis);
+void primary_shoot(PrimaryVisibility *vis, Ray *ray, real spot[2], int row, int col, FirstHit *hit);
+
+#endif //VISIBILITY_H
@@ -0,0 +1,74 @@
+/* watch.h - renders a scene again each time its file is saved, tracing only the tiles the edit can have changed */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include "raytracer.h"
+#include "tiles.h"
+
+#define WATCH_SETTLE_MS 100 // quiet time after a save before the file is read, editors often write in several steps
+#define WATCH_CELLS 4096    // cells in the coarse grid the rays of each tile are recorded on
+#define WATCH_MAX_RES 64    // most of those cells along any one axis
+#define WATCH_MARGIN 0.25   // the grid reaches this fraction of the scene's size past it, so objects can move in it
+#define WATCH_PLAIN_TILES 3 // a save that traces more than 1 in this many tiles traces them without recording, as
+                            // recording makes tracing up to 2.5 times slower
+
+/* how an object differs between two reads of the scene file */
+#define CHANGE_MATERIAL 1   // colors, reflectivity, refractivity or ior: only tiles whose rays hit it
+#define CHANGE_GEOMETRY 2   // where it is or its shape: also tiles whose rays pass through its new bounds
+
+/* what the rays of one tile touched the last time it was rendered */
+typedef struct tile_deps_t {
+    uint64_t *crossed;          // bit per watch cell any ray passed through, from its origin to its end
+    uint64_t *lit;              // bit per watch cell holding a point a ray hit, the only places lights were evaluated
+    int words;                  // length of each of the bit sets
+    int *objects;               // objects hit by any ray, instances for their members, each listed once
+    int nobjects;
+    int capacity;
+} TileDeps;
+
+/* the differences between a scene and the same file read again, see scene_diff() */
+typedef struct scene_diff_t {
+    boolean everything;     // no tile can be kept, like when the camera moved or objects were added
+    unsigned char *change;  // per object: 0, CHANGE_MATERIAL or CHANGE_GEOMETRY
+    real (*bounds)[6];      // per object with CHANGE_GEOMETRY: low and high corner of its new bounds
+    int *moved;             // the objects with CHANGE_GEOMETRY
+    int nmoved;
+    real (*light_reach)[4]; // per changed light, before and after: position and influence radius
+    int nlight_reach;
+} SceneDiff;
+
+/* global variables */
+extern __thread TileDeps *tile_deps;   // tile the calling thread is recording, NULL when nothing is recorded
+
+/* function definitions */
+void watch_cells_build();
+void tile_deps_begin(TileDeps *deps);
+void tile_deps_end();
+void tile_deps_forget(TileDeps *deps);
+boolean tile_deps_known(TileDeps *deps);
+void tile_deps_thread_free();
+void tile_deps_record(Ray *ray, real max_distance, int hit, real t);
+void tile_deps_free(TileDeps *deps, int n);
+void scene_diff(SceneCopy *old, SceneDiff *diff);
+void scene_diff_free(SceneDiff *diff);
+boolean tile_dirty(SceneDiff *diff, TileDeps *deps);
+int watch_open(const char *path);
+void watch_wait(int fd, const char *path);
+boolean scene_file_valid(const char *path);
+
+/**
+ * Records what a ray touched in the tile being rendered, if there is one. Called with the final result of every
+ * ray shoot() and primary_shoot() trace
+ * @param ray - the ray
+ * @param max_distance - hits past this didn't count
+ * @param hit - hit index of the closest hit, -1 if there was none
+ * @param t - distance to the hit
+ */
+static inline void watch_record(Ray *ray, real max_distance, int hit, real t) {
+    if (tile_deps != NULL)
+        tile_deps_record(ray, max_distance, hit, t);
+}
+
+#endif //WATCH_H
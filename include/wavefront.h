@@ -0,0 +1,12 @@
+/* wavefront.h - breadth-first shading with batched, optionally sorted, secondary and shadow rays */
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "raytracer.h"
+#include "visibility.h"
+
+/* function definitions */
+void shade_batch(Ray *rays, FirstHit *hits, int n, real (*colors)[3], boolean sort);
+
+#endif //WAVEFRONT_H
@@ -0,0 +1,37 @@
+#!/bin/sh
+# bench_accel.sh - times --accel linear against --accel grid on scenes of N spheres, one per unit cube, with a plane
+# and a light, written by scenegen. Both render the same 4x4 image, so they trace the same rays and their rays/s
+# compare directly; it is small because the linear scan takes 20 s on 100000 spheres even at 4x4. The linear scan
+# has nothing to build and no memory beyond the scene, and it is skipped past 100000 spheres, where it would take
+# minutes per scene (about 4 on 1000000), so only the grid is timed on the largest default scene
+# usage: bench_accel.sh RAYTRACE SCENEGEN [N...]
+
+raytrace=${1:?usage: bench_accel.sh RAYTRACE SCENEGEN [N...]}
+scenegen=${2:?usage: bench_accel.sh RAYTRACE SCENEGEN [N...]}
+shift 2
+[ $# -eq 0 ] && set -- 1000 10000 100000 1000000
+size="4 4"
+linear_max=100000
+
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+# prints the value of one line of --stats output
+stat() {
+    sed -n "s|^$1: *||p" "$out/stats"
+}
+
+printf "%10s %14s %14s %14s %12s\n" spheres "rays/s linear" "rays/s grid" "grid build ms" "grid MB"
+for n in "$@"; do
+    "$scenegen" --spheres $n --planes 1 --lights 1 --reflective 0 --refractive 0 "$out/scene.json" || exit 1
+    linear=skipped
+    if [ $n -le $linear_max ]; then
+        "$raytrace" --stats --accel linear $size "$out/scene.json" "$out/image.ppm" 2>"$out/stats" || exit 1
+        linear=$(stat rays/sec)
+    fi
+    "$raytrace" --stats --accel grid $size "$out/scene.json" "$out/image.ppm" 2>"$out/stats" || exit 1
+    # the grid line reads "RxRxR cells, M MB, built in T ms"
+    build=$(stat grid | sed -n 's|^.* built in \(.*\) ms$|\1|p')
+    memory=$(stat grid | sed -n 's|^.* cells, \(.*\) MB, .*$|\1|p')
+    printf "%10s %14s %14s %14s %12s\n" $n "$linear" "$(stat rays/sec)" "$build" "$memory"
+done
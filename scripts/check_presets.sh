@@ -0,0 +1,63 @@
+#!/bin/sh
+# check_presets.sh - checks that a preset given with --preset sits under the scene's render object and the other
+# options, wherever it is on the command line, by comparing the settings --stats prints, and that a render object
+# refuses the keys of the objects around it
+# usage: check_presets.sh RAYTRACE
+
+raytrace=${1:?usage: check_presets.sh RAYTRACE}
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+# a scene whose render object turns shadows off on top of the draft preset
+cat > "$out/scene.json" <<EOF
+[
+  {"type": "camera", "width": 0.5, "height": 0.5},
+  {"type": "render", "preset": "draft", "shadows": false},
+  {"type": "sphere", "position": [0, 0, 10], "diffuse_color": [1, 1, 1], "specular_color": [1, 0, 0], "radius": 1}
+]
+EOF
+
+# prints the settings line of a render with the given options
+settings() {
+    "$raytrace" --stats "$@" 8 8 "$out/scene.json" "$out/image.ppm" 2>&1 | sed -n 's/^settings: *//p'
+}
+
+status=0
+# expect NAME EXPECTED OPTIONS... - fails unless the render's settings are EXPECTED
+expect() {
+    name=$1
+    expected=$2
+    shift 2
+    got=$(settings "$@")
+    if [ "$got" = "$expected" ]; then
+        echo "$name: $got"
+    else
+        echo "$name: expected '$expected', got '${got:-nothing}'"
+        status=1
+    fi
+}
+
+base="ray epsilon 0.001, background 0 0 0"
+expect "scene only" "draft, depth 3, 1 samples, min weight 0.02, shadows off, shininess 20, $base"
+expect "preset then depth" "final, depth 2, 16 samples, min weight 0.000976562, shadows off, shininess 20, $base" \
+       --preset final --depth 2
+expect "depth then preset" "final, depth 2, 16 samples, min weight 0.000976562, shadows off, shininess 20, $base" \
+       --depth 2 --preset final
+expect "shadows on" "preview, depth 1, 1 samples, min weight 0.1, shadows on, shininess 20, $base" \
+       --shadows on --preset preview
+
+# position keys on a render object would move the next object in the scene instead
+cat > "$out/keys.json" <<EOF
+[
+  {"type": "camera", "width": 0.5, "height": 0.5},
+  {"type": "render", "keys": [{"frame": 0, "position": [0, 0, 5]}, {"frame": 1, "position": [0.5, 0, 5]}]},
+  {"type": "sphere", "position": [-0.3, 0, 10], "diffuse_color": [1, 1, 1], "specular_color": [1, 0, 0], "radius": 1}
+]
+EOF
+if "$raytrace" --frames 0..1 8 8 "$out/keys.json" "$out/image.ppm" 2>/dev/null; then
+    echo "render keys: accepted, expected an error"
+    status=1
+else
+    echo "render keys: refused"
+fi
+exit $status
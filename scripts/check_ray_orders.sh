@@ -0,0 +1,30 @@
+#!/bin/sh
+# check_ray_orders.sh - renders the refractive sample scenes recursively and again with --batch-rays, --sort-rays
+# and --accel grid, with and without a --min-weight cutoff, and fails unless every image is the same as the recursive
+# one
+# usage: check_ray_orders.sh RAYTRACE [SCENE_DIR]
+
+raytrace=${1:?usage: check_ray_orders.sh RAYTRACE [SCENE_DIR]}
+scenes=${2:-.}
+size="120 120"
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+status=0
+for cutoff in "" "--min-weight 0.05"; do
+    for scene in simple_refraction project_test_file mesh brandon instances; do
+        "$raytrace" $cutoff $size "$scenes/$scene.json" "$out/recursive.ppm" 2>/dev/null || {
+            echo "$scene $cutoff: failed to render"; status=1; continue; }
+        for mode in --batch-rays --sort-rays "--accel grid"; do
+            psnr=$("$raytrace" $cutoff $mode --reference "$out/recursive.ppm" $size "$scenes/$scene.json" \
+                   "$out/other.ppm" 2>&1 | sed -n 's/^psnr: \(.*\) dB against the reference.*$/\1/p')
+            if [ "$psnr" = "inf" ]; then
+                echo "$scene $cutoff $mode: same image"
+            else
+                echo "$scene $cutoff $mode: differs from the recursive image (psnr ${psnr:-?} dB)"
+                status=1
+            fi
+        done
+    done
+done
+exit $status
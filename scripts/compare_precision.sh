@@ -0,0 +1,29 @@
+#!/bin/sh
+# compare_precision.sh - builds the renderer in double and in single precision (-DSINGLE_PRECISION=ON), renders the
+# sample scenes with both and prints how far apart the images are
+# usage: compare_precision.sh [BUILD_DIR]
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${1:-$src/_precision}
+size="200 200"
+
+for precision in double float; do
+    flag=OFF
+    [ $precision = float ] && flag=ON
+    cmake -S "$src" -B "$build/$precision" -DSINGLE_PRECISION=$flag >/dev/null &&
+        cmake --build "$build/$precision" --target raytrace >/dev/null || exit 1
+done
+
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+cd "$src" || exit 1
+
+printf "%-20s %8s %10s\n" scene "max diff" "psnr (dB)"
+for scene in test_scene brandon project_test_file simple_refraction spotlight 4_lights_sphere pointlight mesh \
+             instances; do
+    "$build/double/raytrace" $size $scene.json "$out/double.ppm" 2>/dev/null || {
+        echo "$scene: failed to render"; exit 1; }
+    result=$("$build/float/raytrace" --reference "$out/double.ppm" $size $scene.json "$out/float.ppm" 2>&1 |
+             sed -n 's/^psnr: \(.*\) dB against the reference, max difference \(.*\)$/\2 \1/p')
+    printf "%-20s %8s %10s\n" $scene $result
+done
@@ -0,0 +1,110 @@
+/* animation.c - keyframed motion. Objects and lights can have position keys, and animate_scene() puts each of them
+ * where its keys say it is on a frame, moving in a straight line between keys and staying at the first and last key
+ * before and after them. Only positions change from one frame to the next, so instead of preparing the scene again
+ * refit_scene() updates what was built over the objects that moved: the instance BVH keeps its tree and only has its
+ * bounds redone, the grid bins the spheres into the cells it already has, and the light arrays are filled again.
+ * Planes and meshes are tested where they are, and the views are set up for every render anyway */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/animation.h"
+#include "../include/illumination.h"
+#include "../include/lighttree.h"
+#include "../include/arena.h"
+#include "../include/grid.h"
+#include "../include/instance.h"
+
+/**
+ * Finds the position keys give on a frame
+ * @param keys - keys in increasing frame order
+ * @param nkeys - number of keys, at least 1
+ * @param frame - frame to find the position on
+ * @param position - set to the position
+ */
+static void key_position(PositionKey *keys, int nkeys, double frame, real position[3]) {
+    int k = 0;
+    while (k < nkeys - 1 && keys[k + 1].frame <= frame)
+        k++;
+    if (k == nkeys - 1 || frame <= keys[k].frame) {
+        v3_copy(keys[k].position, position);
+        return;
+    }
+    real s = (frame - keys[k].frame) / (keys[k + 1].frame - keys[k].frame);
+    for (int i = 0; i < 3; i++)
+        position[i] = keys[k].position[i] + s * (keys[k + 1].position[i] - keys[k].position[i]);
+}
+
+/**
+ * Moves one object or light to where its keys put it on a frame
+ * @param keys - its keys, NULL if it doesn't move
+ * @param nkeys - number of keys
+ * @param frame - frame to move it to
+ * @param position - its position, allocated if it had none
+ * @return - whether the position changed
+ */
+static boolean move_to_key(PositionKey *keys, int nkeys, int frame, real **position) {
+    if (keys == NULL)
+        return false;
+    if (*position == NULL)
+        *position = arena_calloc(&scene_arena, 3, sizeof(real));
+    real p[3];
+    key_position(keys, nkeys, frame, p);
+    boolean moved = memcmp(p, *position, sizeof(p)) != 0;
+    v3_copy(p, *position);
+    return moved;
+}
+
+/**
+ * Moves every keyed object and light to where it is on a frame. Called once before prepare_scene() for the first
+ * frame, and before every frame after that followed by refit_scene()
+ * @param frame - frame to move to
+ * @return - MOVED_ flags for what changed position
+ */
+int animate_scene(int frame) {
+    int moved = 0;
+    for (int i = 0; i < nobjects; i++) {
+        object *obj = &objects[i];
+        if (obj->keys == NULL)
+            continue;
+        switch (obj->type) {
+            case SPHERE:
+                if (move_to_key(obj->keys, obj->nkeys, frame, &obj->sphere.position))
+                    moved |= MOVED_SPHERES;
+                break;
+            case INSTANCE:
+                if (move_to_key(obj->keys, obj->nkeys, frame, &obj->instance.position))
+                    moved |= MOVED_INSTANCES;
+                break;
+            case CAMERA:
+                move_to_key(obj->keys, obj->nkeys, frame, &obj->camera.position);
+                break;
+            case PLANE:
+                move_to_key(obj->keys, obj->nkeys, frame, &obj->plane.position);
+                break;
+            case MESH:
+                move_to_key(obj->keys, obj->nkeys, frame, &obj->mesh.position);
+                break;
+        }
+    }
+    for (int i = 0; i < nlights; i++) {
+        if (move_to_key(lights[i].keys, lights[i].nkeys, frame, &lights[i].position))
+            moved |= MOVED_LIGHTS;
+    }
+    return moved;
+}
+
+/**
+ * Updates what prepare_scene() built over the objects and lights after animate_scene() has moved some of them
+ * @param moved - MOVED_ flags returned by animate_scene()
+ */
+void refit_scene(int moved) {
+    if (moved & MOVED_INSTANCES)
+        instances_refit();
+    if ((moved & MOVED_SPHERES) && render_options.accel == ACCEL_GRID)
+        grid_refit();
+    if (moved & MOVED_LIGHTS) {
+        light_soa_build();
+        if (render_options.light_mode != LIGHTS_ALL)
+            light_tree_build();
+    }
+}
@@ -0,0 +1,127 @@
+/* arena.c - bump allocators. Allocating is a pointer increment inside a block taken from the heap, and nothing is
+ * freed on its own: a frame arena is reset once its tile or pixel is done and reuses the same blocks for the next
+ * one, and the scene arena is freed in one call when the program is done with the scene */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/arena.h"
+#include "../include/stats.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)    // smallest block taken from the heap
+#define ARENA_ALIGN 32                  // wide enough for any vector type used by the renderer
+
+Arena scene_arena = {NULL, NULL, NULL};
+__thread Arena frame_arena = {NULL, NULL, NULL};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/**
+ * Takes a new block of at least size bytes from the heap and chains it after the current block
+ */
+static ArenaBlock *arena_new_block(Arena *arena, size_t size) {
+    if (size < ARENA_BLOCK_SIZE)
+        size = ARENA_BLOCK_SIZE;
+    size_t header = align_up(sizeof(ArenaBlock));
+    size = align_up(size);
+    ArenaBlock *block = aligned_alloc(ARENA_ALIGN, header + size);
+    if (block == NULL) {
+        fprintf(stderr, "Error: arena_alloc: Out of memory\n");
+        exit(1);
+    }
+    counters.heap_allocs++;
+    block->data = (char*)block + header;
+    block->size = size;
+    block->used = 0;
+    if (arena->current == NULL) {
+        block->next = NULL;
+        arena->first = block;
+    }
+    else {
+        block->next = arena->current->next;
+        arena->current->next = block;
+    }
+    return block;
+}
+
+/**
+ * Allocates size bytes from an arena, aligned for any type. The memory is not zeroed
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = align_up(size > 0 ? size : 1);
+    counters.arena_allocs++;
+    // data is aligned and sizes are rounded up, so every pointer handed out is aligned
+    ArenaBlock *block = arena->current;
+    while (block != NULL && block->size - block->used < size) {
+        // blocks after the current one are left over from before a reset, reuse them if they are big enough
+        block = block->next;
+        if (block != NULL)
+            block->used = 0;
+    }
+    if (block == NULL)
+        block = arena_new_block(arena, size);
+    arena->current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void *arena_calloc(Arena *arena, size_t count, size_t size) {
+    void *ptr = arena_alloc(arena, count * size);
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+/**
+ * Grows an allocation, like realloc(). The most recent allocation is extended in place when its block has room,
+ * otherwise the data is copied to a new allocation and the old space is only reclaimed by the next reset
+ * @param ptr - allocation from the same arena, or NULL
+ * @param old_size - size ptr was allocated with
+ * @param new_size - size wanted
+ * @return - the grown allocation
+ */
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr != NULL && ptr == arena->last) {
+        ArenaBlock *block = arena->current;
+        size_t offset = (char*)ptr - block->data;
+        if (offset + align_up(new_size) <= block->size) {
+            block->used = offset + align_up(new_size);
+            return ptr;
+        }
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (ptr != NULL)
+        memcpy(grown, ptr, old_size < new_size ? old_size : new_size);
+    return grown;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * Gives back everything allocated from an arena while keeping its blocks for reuse
+ */
+void arena_reset(Arena *arena) {
+    if (arena->first != NULL)
+        arena->first->used = 0;
+    arena->current = arena->first;
+    arena->last = NULL;
+}
+
+/**
+ * Returns all of an arena's blocks to the heap
+ */
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->first;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = arena->current = NULL;
+    arena->last = NULL;
+}
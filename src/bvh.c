@@ -0,0 +1,215 @@
+/* bvh.c - bounding volume hierarchies. Items are binned by their centroids along each axis and split where the surface
+ * area heuristic says tracing will be cheapest. Meshes build one over their triangles, groups over their members and
+ * instances one over all of them. When the items move but stay the same items, bvh_refit() redoes the bounds in place
+ * and keeps the tree */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../include/bvh.h"
+
+/**
+ * Rounds a coordinate down to a float that is no bigger, so float bounds still contain it
+ */
+float bvh_round_down(double v) {
+    float f = (float)v;
+    return f > v ? nextafterf(f, -INFINITY) : f;
+}
+
+/**
+ * Rounds a coordinate up to a float that is no smaller
+ */
+float bvh_round_up(double v) {
+    float f = (float)v;
+    return f < v ? nextafterf(f, INFINITY) : f;
+}
+
+/* min and max that compile to single instructions, unlike fminf() and fmaxf() which have to handle NaN */
+static inline float min_f(float a, float b) {
+    return a < b ? a : b;
+}
+
+static inline float max_f(float a, float b) {
+    return a > b ? a : b;
+}
+
+static inline float half_area(const float lo[3], const float hi[3]) {
+    float d[3] = {hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]};
+    return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+static inline int centroid_bin(float c, float lo, float scale) {
+    int b = (int)((c - lo) * scale);
+    return b < 0 ? 0 : b >= BVH_BINS ? BVH_BINS - 1 : b;
+}
+
+/**
+ * Builds the BVH node for items[begin] to items[end - 1] and everything below it
+ * @return - index of the node
+ */
+static uint32_t build_node(BVHNode *nodes, int *nnodes, BVHItem *items, int begin, int end, int depth) {
+    uint32_t index = (*nnodes)++;
+    BVHNode *node = &nodes[index];
+    float clo[3] = {INFINITY, INFINITY, INFINITY};
+    float chi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int k = 0; k < 3; k++) {
+        node->lo[k] = INFINITY;
+        node->hi[k] = -INFINITY;
+    }
+    for (int i = begin; i < end; i++) {
+        BVHItem *it = &items[i];
+        for (int k = 0; k < 3; k++) {
+            node->lo[k] = min_f(node->lo[k], it->lo[k]);
+            node->hi[k] = max_f(node->hi[k], it->hi[k]);
+            clo[k] = min_f(clo[k], it->centroid[k]);
+            chi[k] = max_f(chi[k], it->centroid[k]);
+        }
+    }
+    int count = end - begin;
+    node->first = begin;
+    node->count = count;
+    if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+        return index;
+
+    // bin the centroids along each axis and keep the split with the lowest surface area cost
+    int best_axis = -1, best_bin = 0;
+    float best_cost = INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        if (chi[axis] <= clo[axis])
+            continue;
+        float scale = BVH_BINS / (chi[axis] - clo[axis]);
+        int bin_count[BVH_BINS] = {0};
+        float bin_lo[BVH_BINS][3], bin_hi[BVH_BINS][3];
+        for (int j = 0; j < BVH_BINS; j++)
+            for (int k = 0; k < 3; k++) {
+                bin_lo[j][k] = INFINITY;
+                bin_hi[j][k] = -INFINITY;
+            }
+        for (int i = begin; i < end; i++) {
+            BVHItem *it = &items[i];
+            int j = centroid_bin(it->centroid[axis], clo[axis], scale);
+            bin_count[j]++;
+            for (int k = 0; k < 3; k++) {
+                bin_lo[j][k] = min_f(bin_lo[j][k], it->lo[k]);
+                bin_hi[j][k] = max_f(bin_hi[j][k], it->hi[k]);
+            }
+        }
+        // right_cost[j] is the cost of the bins from j up, swept from the top down
+        float right_cost[BVH_BINS];
+        float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int n = 0;
+        for (int j = BVH_BINS - 1; j > 0; j--) {
+            n += bin_count[j];
+            for (int k = 0; k < 3; k++) {
+                lo[k] = min_f(lo[k], bin_lo[j][k]);
+                hi[k] = max_f(hi[k], bin_hi[j][k]);
+            }
+            right_cost[j] = n > 0 ? n * half_area(lo, hi) : INFINITY;
+        }
+        for (int k = 0; k < 3; k++) {
+            lo[k] = INFINITY;
+            hi[k] = -INFINITY;
+        }
+        n = 0;
+        for (int j = 1; j < BVH_BINS; j++) {
+            n += bin_count[j - 1];
+            for (int k = 0; k < 3; k++) {
+                lo[k] = min_f(lo[k], bin_lo[j - 1][k]);
+                hi[k] = max_f(hi[k], bin_hi[j - 1][k]);
+            }
+            if (n == 0 || n == count)
+                continue;
+            float cost = n * half_area(lo, hi) + right_cost[j];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = j;
+            }
+        }
+    }
+    if (best_axis < 0)      // every centroid is at the same spot, no split would separate them
+        return index;
+
+    // move the items left of the split to the front
+    float scale = BVH_BINS / (chi[best_axis] - clo[best_axis]);
+    int mid = begin;
+    for (int i = begin; i < end; i++) {
+        if (centroid_bin(items[i].centroid[best_axis], clo[best_axis], scale) < best_bin) {
+            BVHItem t = items[i];
+            items[i] = items[mid];
+            items[mid++] = t;
+        }
+    }
+    build_node(nodes, nnodes, items, begin, mid, depth + 1);   // lands right after this node
+    uint32_t second = build_node(nodes, nnodes, items, mid, end, depth + 1);
+    node = &nodes[index];
+    node->first = second;
+    node->count = 0;
+    return index;
+}
+
+/**
+ * Builds a BVH over a set of items
+ * @param items - bounds of each item, sorted into the order the leaves list them
+ * @param n - number of items, at least 1
+ * @param nnodes - set to the number of nodes
+ * @return - the nodes, root first, to be freed by the caller
+ */
+BVHNode *bvh_build(BVHItem *items, int n, int *nnodes) {
+    BVHNode *nodes = malloc(sizeof(BVHNode) * (2 * (size_t)n - 1));
+    if (nodes == NULL) {
+        fprintf(stderr, "Error: bvh_build: Out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++)
+            items[i].centroid[k] = 0.5f * (items[i].lo[k] + items[i].hi[k]);
+    *nnodes = 0;
+    build_node(nodes, nnodes, items, 0, n, 0);
+    BVHNode *shrunk = realloc(nodes, sizeof(BVHNode) * *nnodes);
+    return shrunk != NULL ? shrunk : nodes;
+}
+
+/**
+ * Updates a BVH's bounds in place after its items have moved, keeping its tree. Children come after their parent,
+ * so going through the nodes backwards finishes both children before the node over them. Much quicker than building
+ * it again, but the tree gets looser the further the items move from where it was built for, see bvh_cost()
+ * @param nodes - the BVH
+ * @param nnodes - number of nodes
+ * @param items - the new bounds of the items, in the order the leaves list them
+ */
+void bvh_refit(BVHNode *nodes, int nnodes, const BVHItem *items) {
+    for (int i = nnodes - 1; i >= 0; i--) {
+        BVHNode *node = &nodes[i];
+        for (int k = 0; k < 3; k++) {
+            if (node->count > 0) {
+                node->lo[k] = INFINITY;
+                node->hi[k] = -INFINITY;
+                for (uint32_t j = node->first; j < node->first + node->count; j++) {
+                    node->lo[k] = min_f(node->lo[k], items[j].lo[k]);
+                    node->hi[k] = max_f(node->hi[k], items[j].hi[k]);
+                }
+            }
+            else {
+                node->lo[k] = min_f(nodes[i + 1].lo[k], nodes[node->first].lo[k]);
+                node->hi[k] = max_f(nodes[i + 1].hi[k], nodes[node->first].hi[k]);
+            }
+        }
+    }
+}
+
+/**
+ * Estimates how many nodes a ray through a BVH visits, from the surface area of each node relative to the root's.
+ * Comparing it before and after a refit tells when the tree has got loose enough to be worth building again
+ * @param nodes - the BVH
+ * @param nnodes - number of nodes
+ * @return - the estimate, at least 1
+ */
+float bvh_cost(const BVHNode *nodes, int nnodes) {
+    float root = half_area(nodes[0].lo, nodes[0].hi);
+    if (!(root > 0))
+        return 1;
+    float cost = 0;
+    for (int i = 0; i < nnodes; i++)
+        cost += half_area(nodes[i].lo, nodes[i].hi);
+    return cost / root;
+}
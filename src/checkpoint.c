@@ -0,0 +1,276 @@
+/* checkpoint.c - saves the finished tiles of the view being rendered every so often, and once more when the render
+ * is stopped by SIGTERM or SIGINT, so a render that is killed partway through can be resumed with --resume instead
+ * of starting over. Each save writes a new file and renames it over the last one, so a render killed while saving
+ * still leaves the previous checkpoint whole. The file is tied to the scene, settings and binary by the same hash the
+ * tile cache names its tiles with, and a checkpoint that doesn't match is ignored */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "../include/checkpoint.h"
+
+/* fixed part of a checkpoint file, followed by a byte per tile saying whether it was finished, and then the pixels of
+ * each finished tile in turn, row by row */
+typedef struct checkpoint_header_t {
+    int32_t magic;
+    int32_t width, height;
+    int32_t ntiles;
+    int32_t complete;       // 1 once the view's image has been written, nothing follows the header then
+    int32_t unused;
+    CacheKey view;
+} CheckpointHeader;
+
+/* the signal that asked the render to stop, 0 until one does */
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_stop_signal(int sig) {
+    stop_signal = sig;
+}
+
+/**
+ * Sets up checkpointing and has SIGTERM and SIGINT stop the render at the next tile instead of killing it
+ * @param ck - set up for the run
+ * @param interval - seconds between saves
+ * @param resume - whether tiles already saved are read back instead of rendered
+ */
+void checkpoint_open(Checkpoint *ck, double interval, boolean resume) {
+    memset(ck, '\0', sizeof(Checkpoint));
+    ck->interval = interval;
+    ck->resume = resume;
+    ck->binary = hash_binary();
+    struct sigaction action;
+    memset(&action, '\0', sizeof(action));
+    action.sa_handler = on_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+}
+
+/**
+ * @return - true once the render has been asked to stop, tiles not yet started should be left alone
+ */
+boolean checkpoint_stopping() {
+    return stop_signal != 0;
+}
+
+static int tile_index(Checkpoint *ck, Tile *tile) {
+    return tile->y0 / TILE_SIZE * ck->cols + tile->x0 / TILE_SIZE;
+}
+
+/**
+ * Finds the rectangle of a tile from its index, the inverse of tile_index()
+ */
+static Tile tile_at(Checkpoint *ck, int k) {
+    Tile tile;
+    tile.x0 = k % ck->cols * TILE_SIZE;
+    tile.y0 = k / ck->cols * TILE_SIZE;
+    tile.x1 = tile.x0 + TILE_SIZE < ck->img->width ? tile.x0 + TILE_SIZE : ck->img->width;
+    tile.y1 = tile.y0 + TILE_SIZE < ck->img->height ? tile.y0 + TILE_SIZE : ck->img->height;
+    return tile;
+}
+
+/**
+ * Reads the header of the view's checkpoint
+ * @return - the open file, after the header, or NULL if there is no checkpoint for the view as it is now
+ */
+static FILE *open_checkpoint(Checkpoint *ck, int width, int height, CheckpointHeader *header) {
+    FILE *in = fopen(ck->path, "rb");
+    if (in == NULL)
+        return NULL;
+    int ntiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    if (fread(header, sizeof(CheckpointHeader), 1, in) != 1 || header->magic != CHECKPOINT_MAGIC ||
+        header->width != width || header->height != height || header->ntiles != ntiles ||
+        header->view.a != ck->view.a || header->view.b != ck->view.b) {
+        fclose(in);
+        return NULL;
+    }
+    return in;
+}
+
+/**
+ * Checks whether a view was already written by the run being resumed, in which case it needn't be rendered at all
+ * @param ck - the checkpoint, with path set to the view's file
+ * @param camera - camera the view is seen from
+ * @param width - image width
+ * @param height - image height
+ * @return - true if the view's image was written
+ */
+boolean checkpoint_finished(Checkpoint *ck, Camera *camera, int width, int height) {
+    if (!ck->resume)
+        return false;
+    ck->view = hash_view(ck->binary, camera);
+    CheckpointHeader header;
+    FILE *in = open_checkpoint(ck, width, height, &header);
+    if (in == NULL)
+        return false;
+    fclose(in);
+    if (header.complete)
+        ck->skipped++;
+    return header.complete;
+}
+
+/**
+ * Writes the view's checkpoint next to it and renames it into place
+ * @param complete - whether the view's image has been written, in which case no tiles are saved
+ * @return - false if it couldn't be written, the previous checkpoint is left as it was
+ */
+static boolean save(Checkpoint *ck, boolean complete) {
+    double start = wall_seconds();
+    char *temp = malloc(strlen(ck->path) + 32);
+    sprintf(temp, "%s.%ld.tmp", ck->path, (long)getpid());
+    FILE *out = fopen(temp, "wb");
+    if (out == NULL) {
+        free(temp);
+        return false;
+    }
+
+    // which tiles are finished is read once, so the pixels written are those of the tiles the file says are
+    unsigned char *done = calloc(ck->ntiles, 1);
+    if (!complete) {
+        for (int k = 0; k < ck->ntiles; k++)
+            done[k] = __atomic_load_n(&ck->done[k], __ATOMIC_ACQUIRE);
+    }
+    image *img = ck->img;
+    CheckpointHeader header = {CHECKPOINT_MAGIC, img->width, img->height, ck->ntiles, complete, 0, ck->view};
+    size_t bytes = sizeof(header);
+    boolean written = fwrite(&header, sizeof(header), 1, out) == 1;
+    if (!complete) {
+        written = written && fwrite(done, 1, ck->ntiles, out) == ck->ntiles;
+        bytes += ck->ntiles;
+        for (int k = 0; k < ck->ntiles && written; k++) {
+            if (!done[k])
+                continue;
+            Tile tile = tile_at(ck, k);
+            int w = tile.x1 - tile.x0;
+            for (int i = tile.y0; i < tile.y1 && written; i++)
+                written = fwrite(&img->hdr[(size_t)3 * (i * img->width + tile.x0)], sizeof(float[3]), w, out) == w;
+            bytes += sizeof(float[3]) * w * (tile.y1 - tile.y0);
+        }
+    }
+    free(done);
+    if (fclose(out) != 0 || !written || rename(temp, ck->path) != 0) {
+        unlink(temp);
+        free(temp);
+        return false;
+    }
+    free(temp);
+    ck->saves++;
+    ck->bytes_written += bytes;
+    ck->seconds += wall_seconds() - start;
+    return true;
+}
+
+/**
+ * Starts checkpointing a view. With --resume, the tiles its checkpoint has saved are read into the image and moved
+ * out of the tiles to render
+ * @param ck - the checkpoint, with path set to the view's file
+ * @param img - the image, pixels of tiles read back are filled in
+ * @param camera - camera the image is seen from
+ * @param tiles - tiles still to render, after the tile cache if there is one. Set to the tiles that weren't saved
+ * @param ntiles - number of tiles
+ * @return - number of tiles left to render, each handed to checkpoint_tile_done() once it is
+ */
+int checkpoint_resume(Checkpoint *ck, image *img, Camera *camera, Tile *tiles, int ntiles) {
+    double start = wall_seconds();
+    ck->view = hash_view(ck->binary, camera);
+    ck->img = img;
+    ck->cols = (img->width + TILE_SIZE - 1) / TILE_SIZE;
+    ck->ntiles = ck->cols * ((img->height + TILE_SIZE - 1) / TILE_SIZE);
+
+    // tiles that weren't handed in came from the tile cache and are as good as finished
+    ck->done = malloc(ck->ntiles);
+    memset(ck->done, 1, ck->ntiles);
+    for (int t = 0; t < ntiles; t++)
+        ck->done[tile_index(ck, &tiles[t])] = 0;
+
+    unsigned char *saved = calloc(ck->ntiles, 1);
+    CheckpointHeader header;
+    FILE *in = ck->resume ? open_checkpoint(ck, img->width, img->height, &header) : NULL;
+    if (in != NULL && !header.complete && fread(saved, 1, ck->ntiles, in) == ck->ntiles) {
+        // a file cut short keeps the tiles before the cut
+        float *buffer = malloc(sizeof(float[3]) * TILE_SIZE * TILE_SIZE);
+        boolean read = true;
+        for (int k = 0; k < ck->ntiles; k++) {
+            if (!saved[k])
+                continue;
+            Tile tile = tile_at(ck, k);
+            int w = tile.x1 - tile.x0, h = tile.y1 - tile.y0;
+            saved[k] = read = read && fread(buffer, sizeof(float[3]), w * h, in) == w * h;
+            if (!read || ck->done[k])
+                continue;
+            for (int i = 0; i < h; i++)
+                memcpy(&img->hdr[(size_t)3 * ((tile.y0 + i) * img->width + tile.x0)], &buffer[3 * i * w],
+                       sizeof(float[3]) * w);
+        }
+        free(buffer);
+    }
+    else {
+        memset(saved, 0, ck->ntiles);
+    }
+    if (in != NULL)
+        fclose(in);
+
+    int nleft = 0;
+    for (int t = 0; t < ntiles; t++) {
+        int k = tile_index(ck, &tiles[t]);
+        if (saved[k]) {
+            ck->done[k] = 1;
+            ck->resumed++;
+        }
+        else {
+            tiles[nleft++] = tiles[t];
+        }
+    }
+    free(saved);
+    ck->next_save = wall_seconds() + ck->interval;
+    ck->seconds += wall_seconds() - start;
+    return nleft;
+}
+
+/**
+ * Marks a tile finished and saves the checkpoint if it is time to. Called by whichever thread rendered the tile, and
+ * only one thread saves at a time while the rest carry on rendering
+ * @param ck - the checkpoint of the view being rendered
+ * @param tile - the tile, whose pixels are final
+ */
+void checkpoint_tile_done(Checkpoint *ck, Tile *tile) {
+    __atomic_store_n(&ck->done[tile_index(ck, tile)], 1, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&ck->saving, 1, __ATOMIC_ACQUIRE))
+        return;
+    if (wall_seconds() >= ck->next_save) {
+        save(ck, false);
+        ck->next_save = wall_seconds() + ck->interval;
+    }
+    __atomic_store_n(&ck->saving, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Finishes checkpointing a view once its tiles are rendered. If the render was asked to stop, the tiles finished
+ * so far are saved and the program exits as the signal would have had it
+ * @param ck - the checkpoint of the view
+ */
+void checkpoint_end(Checkpoint *ck) {
+    if (stop_signal != 0) {
+        if (!save(ck, false)) {
+            fprintf(stderr, "Error: checkpoint_end: Failed to write checkpoint file '%s'\n", ck->path);
+            exit(1);
+        }
+        int finished = 0;
+        for (int k = 0; k < ck->ntiles; k++)
+            finished += ck->done[k];
+        fprintf(stderr, "checkpoint: stopped by signal %d, %d of %d tiles saved to '%s'\n", (int)stop_signal,
+                finished, ck->ntiles, ck->path);
+        exit(128 + stop_signal);
+    }
+    free(ck->done);
+    ck->done = NULL;
+}
+
+/**
+ * Records that the view's image has been written, so resuming skips the view. The tiles aren't needed after that
+ * @param ck - the checkpoint of the view
+ */
+void checkpoint_complete(Checkpoint *ck) {
+    save(ck, true);
+}
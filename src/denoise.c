@@ -0,0 +1,203 @@
+/* denoise.c - an edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) run on the tile thread pool. Each pass
+ * is a 5x5 B3 spline kernel with its taps spread 2^pass pixels apart, so a handful of passes covers a wide area for
+ * the cost of 25 taps a pixel each. Every tap is weighted down by how much its luminance, albedo, depth and normal
+ * differ from the center's, which keeps the blur on the surface the center pixel sees. The luminance difference is
+ * measured against the noise around the center, as in SVGF (Schied et al. 2017), so noisy areas blend further */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../include/denoise.h"
+#include "../include/tiles.h"
+
+/* one pass of the filter */
+typedef struct denoise_pass_t {
+    const float *in;
+    float *luminance;       // luminance of each pixel of in, what the color term compares
+    float *deviation;       // estimated standard deviation of each pixel's luminance
+    float *out;
+    AuxBuffers *aux;
+    int step;               // pixels between taps
+    float sigma;            // luminance difference, in standard deviations, at which a tap's weight falls to 1/e
+} DenoisePass;
+
+static inline float sqrf(float v) {
+    return v * v;
+}
+
+/* B3 spline weights of the taps along each axis */
+static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+/**
+ * Sets up the auxiliary buffers for an image, filled in by raycast_aux()
+ * @param aux - the buffers
+ * @param width - image width in pixels
+ * @param height - image height in pixels
+ */
+void aux_buffers_init(AuxBuffers *aux, int width, int height) {
+    size_t n = (size_t)width * height;
+    aux->width = width;
+    aux->height = height;
+    aux->normal = malloc(sizeof(float[3]) * n);
+    aux->depth = malloc(sizeof(float) * n);
+    aux->albedo = malloc(sizeof(float[3]) * n);
+    if (aux->normal == NULL || aux->depth == NULL || aux->albedo == NULL) {
+        fprintf(stderr, "Error: aux_buffers_init: Out of memory for %dx%d auxiliary buffers\n", width, height);
+        exit(1);
+    }
+}
+
+void aux_buffers_free(AuxBuffers *aux) {
+    free(aux->normal);
+    free(aux->depth);
+    free(aux->albedo);
+}
+
+/**
+ * Finds the luminance of the pixels of a tile for one pass
+ */
+static void luminance_tile(Tile *tile, int thread, void *arg) {
+    DenoisePass *pass = arg;
+    int width = pass->aux->width;
+    for (int i = tile->y0; i < tile->y1; i++) {
+        for (int j = tile->x0; j < tile->x1; j++) {
+            size_t p = (size_t)i * width + j;
+            const float *c = &pass->in[3 * p];
+            pass->luminance[p] = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+        }
+    }
+}
+
+/**
+ * Estimates how noisy the pixels of a tile are for one pass, from the spread of the luminance of the 3x3 pixels
+ * around each one. There is only one sample per pixel to go on, so the spread of its neighbors stands in for it
+ */
+static void deviation_tile(Tile *tile, int thread, void *arg) {
+    DenoisePass *pass = arg;
+    int width = pass->aux->width, height = pass->aux->height;
+    for (int i = tile->y0; i < tile->y1; i++) {
+        for (int j = tile->x0; j < tile->x1; j++) {
+            float sum = 0, sum_sqr = 0;
+            int n = 0;
+            for (int y = i > 0 ? i - 1 : 0; y <= i + 1 && y < height; y++) {
+                for (int x = j > 0 ? j - 1 : 0; x <= j + 1 && x < width; x++) {
+                    float l = pass->luminance[(size_t)y * width + x];
+                    sum += l;
+                    sum_sqr += l * l;
+                    n++;
+                }
+            }
+            float variance = sum_sqr / n - sqrf(sum / n);
+            pass->deviation[(size_t)i * width + j] = sqrtf(variance > 0 ? variance : 0);
+        }
+    }
+}
+
+/**
+ * Filters the pixels of a tile for one pass
+ */
+static void denoise_tile(Tile *tile, int thread, void *arg) {
+    DenoisePass *pass = arg;
+    AuxBuffers *aux = pass->aux;
+    int width = aux->width, height = aux->height;
+    float albedo_scale = 1.0f / (float)(DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+    for (int i = tile->y0; i < tile->y1; i++) {
+        for (int j = tile->x0; j < tile->x1; j++) {
+            size_t p = (size_t)i * width + j;
+            float lp = pass->luminance[p];
+            // the luminance difference that counts as an edge grows with how noisy the pixel is
+            float color_scale = 1 / (sqrf(pass->sigma * pass->deviation[p]) + DENOISE_MIN_VARIANCE);
+            const float *np = &aux->normal[3 * p];
+            const float *ap = &aux->albedo[3 * p];
+            float zp = aux->depth[p];
+            boolean hit = zp != INFINITY;
+            // relative depth difference allowed per pixel of distance, background pixels only blend with each other
+            float depth_scale = hit ? 1.0f / (float)(DENOISE_SIGMA_DEPTH * pass->step) / zp : 0;
+            float sum[3] = {0, 0, 0};
+            float weights = 0;
+            for (int dy = -2; dy <= 2; dy++) {
+                int y = i + dy * pass->step;
+                if (y < 0 || y >= height)
+                    continue;
+                for (int dx = -2; dx <= 2; dx++) {
+                    int x = j + dx * pass->step;
+                    if (x < 0 || x >= width)
+                        continue;
+                    size_t q = (size_t)y * width + x;
+                    float zq = aux->depth[q];
+                    if ((zq != INFINITY) != hit)
+                        continue;
+                    // the normal term first, since it rules out most taps across edges without an exp
+                    float w = kernel[dy + 2] * kernel[dx + 2];
+                    if (hit) {
+                        const float *nq = &aux->normal[3 * q];
+                        float cosine = np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2];
+                        if (cosine < DENOISE_MIN_COSINE)
+                            continue;
+                        for (int k = 1; k < DENOISE_NORMAL_POWER; k *= 2)
+                            cosine *= cosine;
+                        w *= cosine;
+                    }
+                    const float *aq = &aux->albedo[3 * q];
+                    float dc = sqrf(pass->luminance[q] - lp);
+                    float da = sqrf(aq[0] - ap[0]) + sqrf(aq[1] - ap[1]) + sqrf(aq[2] - ap[2]);
+                    int apart = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+                    float dz = hit && apart > 0 ? fabsf(zq - zp) * depth_scale / apart : 0;
+                    // weights this small make no difference, and would be slow denormals before long
+                    float exponent = dc * color_scale + da * albedo_scale + dz;
+                    if (exponent > DENOISE_MAX_EXPONENT)
+                        continue;
+                    w *= expf(-exponent);
+                    const float *cq = &pass->in[3 * q];
+                    sum[0] += w * cq[0];
+                    sum[1] += w * cq[1];
+                    sum[2] += w * cq[2];
+                    weights += w;
+                }
+            }
+            // the center tap always has a weight of at least 9/64, so weights is never 0
+            float *out = &pass->out[3 * p];
+            out[0] = sum[0] / weights;
+            out[1] = sum[1] / weights;
+            out[2] = sum[2] / weights;
+        }
+    }
+}
+
+/**
+ * Filters the linear colors of an image, guided by its auxiliary buffers
+ * @param color - 3 floats per pixel to filter
+ * @param out - set to the filtered colors, must not be color
+ * @param aux - normal, depth and albedo of each pixel's first hit, from raycast_aux()
+ * @param passes - number of passes, the last one with taps 2^(passes - 1) pixels apart
+ * @param sigma_color - luminance difference, in standard deviations of the center pixel's noise, at which a
+ *                      neighbor's weight falls to 1/e in the first pass
+ */
+void denoise_image(float *color, float *out, AuxBuffers *aux, int passes, double sigma_color) {
+    size_t n = (size_t)3 * aux->width * aux->height;
+    float *scratch = passes > 1 ? malloc(sizeof(float) * n) : NULL;
+    float *luminance = malloc(sizeof(float) * n / 3);
+    float *deviation = malloc(sizeof(float) * n / 3);
+    Tile *tiles;
+    int ntiles = make_tiles(aux->width, aux->height, &tiles);
+    DenoisePass pass = {.in = color, .luminance = luminance, .deviation = deviation, .aux = aux};
+    double sigma = sigma_color;
+    for (int k = 0; k < passes; k++) {
+        // passes alternate between the two buffers so that the last one lands in out
+        pass.out = (passes - 1 - k) % 2 == 0 ? out : scratch;
+        pass.step = 1 << k;
+        pass.sigma = (float)sigma;
+        tile_pool_run(tiles, ntiles, aux->height, luminance_tile, &pass);
+        tile_pool_run(tiles, ntiles, aux->height, deviation_tile, &pass);
+        tile_pool_run(tiles, ntiles, aux->height, denoise_tile, &pass);
+        pass.in = pass.out;
+        sigma /= 2;
+    }
+    if (passes <= 0) {
+        for (size_t k = 0; k < n; k++)
+            out[k] = color[k];
+    }
+    free(tiles);
+    free(scratch);
+    free(luminance);
+    free(deviation);
+}
@@ -0,0 +1,129 @@
+/* gbuffer.c - G-buffers for relighting. raycast_scene() fills one in while it renders with one sample per pixel,
+ * gbuffer_write() saves it, and a later run with changed lights reads it back for relight_scene(), which only redoes
+ * the direct lighting of each first hit */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/gbuffer.h"
+#include "../include/json.h"
+
+/* fixed part of a G-buffer file, followed by the light positions and then each per pixel array in turn */
+typedef struct gbuffer_header_t {
+    int32_t magic;
+    int32_t real_size;      // sizeof(real) of the build that wrote it
+    int32_t width, height;
+    int32_t nobjects;
+    int32_t nlights;
+} GBufferHeader;
+
+/**
+ * Sets up an empty G-buffer for the scene as it is now, with every light's visibility unknown
+ * @param gb - the G-buffer
+ * @param width - image width in pixels
+ * @param height - image height in pixels
+ */
+void gbuffer_init(GBuffer *gb, int width, int height) {
+    size_t n = (size_t)width * height;
+    gb->width = width;
+    gb->height = height;
+    gb->nobjects = nobjects;
+    gb->nlights = nlights;
+    gb->words = (nlights + 15) / 16;
+    gb->obj = malloc(sizeof(int32_t) * n);
+    gb->triangle = malloc(sizeof(int32_t) * n);
+    gb->t = malloc(sizeof(real) * n);
+    gb->indirect = malloc(sizeof(real[3]) * n);
+    gb->visibility = calloc(n * gb->words + 1, sizeof(uint32_t));
+    gb->light_positions = malloc(sizeof(real[3]) * (nlights + 1));
+    if (gb->obj == NULL || gb->triangle == NULL || gb->t == NULL || gb->indirect == NULL || gb->visibility == NULL) {
+        fprintf(stderr, "Error: gbuffer_init: Out of memory for a %dx%d G-buffer\n", width, height);
+        exit(1);
+    }
+    for (int i = 0; i < nlights; i++)
+        v3_copy(lights[i].position, gb->light_positions[i]);
+}
+
+void gbuffer_free(GBuffer *gb) {
+    free(gb->obj);
+    free(gb->triangle);
+    free(gb->t);
+    free(gb->indirect);
+    free(gb->visibility);
+    free(gb->light_positions);
+    memset(gb, '\0', sizeof(GBuffer));
+}
+
+/**
+ * Saves a G-buffer to a file
+ * @param gb - the G-buffer
+ * @param path - file to write
+ */
+void gbuffer_write(GBuffer *gb, const char *path) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: gbuffer_write: Failed to create G-buffer file '%s'\n", path);
+        exit(1);
+    }
+    size_t n = (size_t)gb->width * gb->height;
+    GBufferHeader header = {GBUFFER_MAGIC, sizeof(real), gb->width, gb->height, gb->nobjects, gb->nlights};
+    boolean written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                      fwrite(gb->light_positions, sizeof(real[3]), gb->nlights, out) == gb->nlights &&
+                      fwrite(gb->obj, sizeof(int32_t), n, out) == n &&
+                      fwrite(gb->triangle, sizeof(int32_t), n, out) == n && fwrite(gb->t, sizeof(real), n, out) == n &&
+                      fwrite(gb->indirect, sizeof(real[3]), n, out) == n &&
+                      fwrite(gb->visibility, sizeof(uint32_t), n * gb->words, out) == n * gb->words;
+    if (fclose(out) != 0 || !written) {
+        fprintf(stderr, "Error: gbuffer_write: Failed to write G-buffer file '%s'\n", path);
+        exit(1);
+    }
+}
+
+/**
+ * Reads a G-buffer saved by gbuffer_write() for the scene as it is now. The scene must have the same objects and
+ * number of lights as the one it was captured from, though the lights can be different
+ * @param gb - set to the G-buffer
+ * @param path - file to read
+ * @param width - image width it must have
+ * @param height - image height it must have
+ */
+void gbuffer_read(GBuffer *gb, const char *path, int width, int height) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Error: gbuffer_read: Failed to open G-buffer file '%s'\n", path);
+        exit(1);
+    }
+    GBufferHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != GBUFFER_MAGIC ||
+        header.real_size != sizeof(real)) {
+        fprintf(stderr, "Error: gbuffer_read: '%s' isn't a G-buffer written by this build\n", path);
+        exit(1);
+    }
+    if (header.width != width || header.height != height) {
+        fprintf(stderr, "Error: gbuffer_read: '%s' is %dx%d, not %dx%d\n", path, header.width, header.height, width,
+                height);
+        exit(1);
+    }
+    if (header.nobjects != nobjects || header.nlights != nlights) {
+        fprintf(stderr, "Error: gbuffer_read: '%s' was captured from a scene with %d objects and %d lights, this one has "
+                        "%d and %d\n", path, header.nobjects, header.nlights, nobjects, nlights);
+        exit(1);
+    }
+    gbuffer_init(gb, width, height);
+    size_t n = (size_t)width * height;
+    boolean read = fread(gb->light_positions, sizeof(real[3]), nlights, in) == nlights &&
+                   fread(gb->obj, sizeof(int32_t), n, in) == n && fread(gb->triangle, sizeof(int32_t), n, in) == n &&
+                   fread(gb->t, sizeof(real), n, in) == n &&
+                   fread(gb->indirect, sizeof(real[3]), n, in) == n &&
+                   fread(gb->visibility, sizeof(uint32_t), n * gb->words, in) == n * gb->words;
+    fclose(in);
+    if (!read) {
+        fprintf(stderr, "Error: gbuffer_read: '%s' is cut short\n", path);
+        exit(1);
+    }
+    for (size_t p = 0; p < n; p++) {
+        if (gb->obj[p] < -1) {
+            fprintf(stderr, "Error: gbuffer_read: '%s' is damaged\n", path);
+            exit(1);
+        }
+    }
+}
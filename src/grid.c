@@ -0,0 +1,377 @@
+/* grid.c - a uniform grid over the spheres for scenes with lots of them spread evenly. Building it is two passes
+ * over the spheres, counting and then filling the cells each one's bounding box overlaps. A ray walks the cells it
+ * passes through in order (a 3D DDA) and stops as soon as the closest hit so far lies before the cell it is leaving,
+ * so it only tests the spheres near its path. Planes have no bounds and meshes have their own BVH, so both are tested
+ * for every ray */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../include/grid.h"
+#include "../include/mesh.h"
+#include "../include/tiles.h"
+
+/* fraction of a cell the sphere bounds are grown by when binning, so rounding in the walk can't miss a sphere */
+#define CELL_EPSILON ((real)0.001)
+
+UniformGrid grid = {0};
+
+/* a copy of the grid in each NUMA node's memory, made by grid_replicate(), NULL while every thread reads grid */
+static UniformGrid *grid_copies = NULL;
+static int ngrid_copies = 0;
+static boolean replicated = false;  // whether the copies are made again each time the grid is built or refit
+
+/* per-thread stamps of the last ray that tested each sphere, so spheres spanning several cells are tested once */
+static __thread unsigned int *mailbox = NULL;
+static __thread int mailbox_size = 0;
+static __thread unsigned int ray_stamp = 0;
+
+/**
+ * Finds the range of cells along one axis that a sphere's bounding box overlaps
+ */
+static void cell_range(int axis, real center, real radius, int *first, int *last) {
+    real a = (center - radius - grid.lo[axis]) * grid.inv_cell[axis] - CELL_EPSILON;
+    real b = (center + radius - grid.lo[axis]) * grid.inv_cell[axis] + CELL_EPSILON;
+    *first = a < 0 ? 0 : (int)a;
+    *last = b >= grid.res[axis] ? grid.res[axis] - 1 : (int)b;
+}
+
+/**
+ * Bins the spheres into the cells of the grid, whose bounds and resolution are already set
+ */
+static void grid_fill() {
+    int n = grid.nobjects;
+    int ncells = grid.res[0] * grid.res[1] * grid.res[2];
+
+    // count the spheres in each cell, turn the counts into offsets, then fill the cells
+    grid.cell_start = calloc(ncells + 1, sizeof(int));
+    int *range = malloc(sizeof(int) * 6 * (n + 1));     // per sphere: first/last cell along x, y and z
+    for (int i = 0; i < n; i++) {
+        if (objects[i].type != SPHERE)
+            continue;
+        int *r = &range[6 * i];
+        for (int k = 0; k < 3; k++)
+            cell_range(k, objects[i].sphere.position[k], objects[i].sphere.radius, &r[2 * k], &r[2 * k + 1]);
+        for (int z = r[4]; z <= r[5]; z++)
+            for (int y = r[2]; y <= r[3]; y++)
+                for (int x = r[0]; x <= r[1]; x++)
+                    grid.cell_start[(z * grid.res[1] + y) * grid.res[0] + x + 1]++;
+    }
+    for (int c = 0; c < ncells; c++)
+        grid.cell_start[c + 1] += grid.cell_start[c];
+    grid.cell_items = malloc(sizeof(int) * (grid.cell_start[ncells] + 1));
+    int *fill = malloc(sizeof(int) * (ncells + 1));
+    memcpy(fill, grid.cell_start, sizeof(int) * ncells);
+    for (int i = 0; i < n; i++) {
+        if (objects[i].type != SPHERE)
+            continue;
+        int *r = &range[6 * i];
+        for (int z = r[4]; z <= r[5]; z++)
+            for (int y = r[2]; y <= r[3]; y++)
+                for (int x = r[0]; x <= r[1]; x++)
+                    grid.cell_items[fill[(z * grid.res[1] + y) * grid.res[0] + x]++] = i;
+    }
+    free(fill);
+    free(range);
+
+    // the centers and radii of the spheres next to each other, so the walk doesn't chase each sphere's position
+    free(grid.spheres);
+    grid.spheres = calloc(n + 1, sizeof(real[4]));
+    for (int i = 0; i < n; i++) {
+        if (objects[i].type != SPHERE)
+            continue;
+        v3_copy(objects[i].sphere.position, grid.spheres[i]);
+        grid.spheres[i][3] = objects[i].sphere.radius;
+    }
+
+    grid.bytes = sizeof(int) * ((size_t)ncells + 1 + grid.cell_start[ncells] + n + 1) + sizeof(real[4]) * (n + 1);
+}
+
+/**
+ * Builds the grid over every sphere in objects. The resolution is picked so there are about GRID_DENSITY cells per
+ * sphere, with cells as close to cubes as the bounds allow
+ */
+void grid_build() {
+    double start = wall_seconds();
+    grid_free();
+
+    int n = 0;
+    while (objects[n].type != 0)
+        n++;
+    grid.nobjects = n;
+    grid.unbounded = malloc(sizeof(int) * (n + 1));
+    for (int k = 0; k < 3; k++) {
+        grid.lo[k] = INFINITY;
+        grid.hi[k] = -INFINITY;
+    }
+    for (int i = 0; i < n; i++) {
+        if (objects[i].type == SPHERE) {
+            for (int k = 0; k < 3; k++) {
+                grid.lo[k] = fmin(grid.lo[k], objects[i].sphere.position[k] - objects[i].sphere.radius);
+                grid.hi[k] = fmax(grid.hi[k], objects[i].sphere.position[k] + objects[i].sphere.radius);
+            }
+            grid.nspheres++;
+        }
+        else if (objects[i].type == PLANE || objects[i].type == MESH) {
+            grid.unbounded[grid.nunbounded++] = i;
+        }
+    }
+
+    // pick the resolution from the sphere count and the volume of their bounds
+    if (grid.nspheres > 0) {
+        real extent[3];
+        real volume = 1;
+        for (int k = 0; k < 3; k++) {
+            extent[k] = fmax(grid.hi[k] - grid.lo[k], (real)1e-6);
+            volume *= extent[k];
+        }
+        real cells_per_unit = cbrt(GRID_DENSITY * grid.nspheres / volume);
+        for (int k = 0; k < 3; k++) {
+            real res = ceil(extent[k] * cells_per_unit);
+            grid.res[k] = res < 1 ? 1 : res > GRID_MAX_RES ? GRID_MAX_RES : (int)res;
+            grid.cell[k] = extent[k] / grid.res[k];
+            grid.inv_cell[k] = 1 / grid.cell[k];
+        }
+    }
+    else {
+        grid.res[0] = grid.res[1] = grid.res[2] = 1;
+    }
+    grid_fill();
+    if (replicated)
+        grid_replicate();
+    grid.build_seconds = wall_seconds() - start;
+}
+
+/**
+ * Catches the grid up with spheres that have moved since it was built. While every sphere is still inside the grid's
+ * bounds the cells stay as they are and only the spheres are binned again, which skips picking a resolution and
+ * keeps the grid the same size from frame to frame. A sphere outside of them needs new bounds, so the grid is built
+ * again
+ */
+void grid_refit() {
+    double start = wall_seconds();
+    boolean inside = grid.nobjects == nobjects;
+    for (int i = 0; i < grid.nobjects && inside; i++) {
+        if (objects[i].type != SPHERE)
+            continue;
+        for (int k = 0; k < 3; k++) {
+            if (objects[i].sphere.position[k] - objects[i].sphere.radius < grid.lo[k] ||
+                objects[i].sphere.position[k] + objects[i].sphere.radius > grid.hi[k])
+                inside = false;
+        }
+    }
+    if (!inside || grid.nspheres == 0) {
+        grid_build();
+        return;
+    }
+    free(grid.cell_start);
+    free(grid.cell_items);
+    grid_fill();
+    if (replicated)
+        grid_replicate();
+    grid.build_seconds = wall_seconds() - start;
+}
+
+static void free_copies() {
+    for (int k = 0; k < ngrid_copies; k++) {
+        free(grid_copies[k].cell_start);
+        free(grid_copies[k].cell_items);
+        free(grid_copies[k].unbounded);
+        free(grid_copies[k].spheres);
+    }
+    free(grid_copies);
+    grid_copies = NULL;
+    ngrid_copies = 0;
+}
+
+void grid_free() {
+    free_copies();
+    free(grid.cell_start);
+    free(grid.cell_items);
+    free(grid.unbounded);
+    free(grid.spheres);
+    memset(&grid, 0, sizeof(grid));
+}
+
+static void *copy_array(const void *data, size_t bytes) {
+    void *copy = malloc(bytes);
+    memcpy(copy, data, bytes);
+    return copy;
+}
+
+/**
+ * Copies the grid's arrays into memory allocated and first written by one of a node's threads
+ */
+static void copy_grid(int node, void *arg) {
+    UniformGrid *copy = &grid_copies[node];
+    int ncells = grid.res[0] * grid.res[1] * grid.res[2];
+    *copy = grid;
+    copy->cell_start = copy_array(grid.cell_start, sizeof(int) * (ncells + 1));
+    copy->cell_items = copy_array(grid.cell_items, sizeof(int) * (grid.cell_start[ncells] + 1));
+    copy->unbounded = copy_array(grid.unbounded, sizeof(int) * (grid.nobjects + 1));
+    copy->spheres = copy_array(grid.spheres, sizeof(real[4]) * (grid.nobjects + 1));
+}
+
+/**
+ * Gives each NUMA node the threads are on a copy of the grid in its own memory, which grid_shoot() reads from on
+ * that node's threads. From then on the copies are made again whenever the grid is built or refit
+ */
+void grid_replicate() {
+    free_copies();
+    replicated = true;
+    ngrid_copies = tile_pool_nodes();
+    grid_copies = calloc(ngrid_copies, sizeof(UniformGrid));
+    tile_pool_run_nodes(copy_grid, NULL);
+}
+
+/**
+ * Frees the calling thread's mailboxes, called by each pool thread as it exits
+ */
+void grid_thread_free() {
+    free(mailbox);
+    mailbox = NULL;
+    mailbox_size = 0;
+    ray_stamp = 0;
+}
+
+/**
+ * Keeps the closer of two hits. Ties go to the lower object index, the same as shoot()'s linear scan
+ */
+static inline void closest(int obj, real t, boolean in_sphere, int triangle, real max_distance, int *best_o,
+                           real *best_t, boolean *best_in_sphere, int *best_triangle) {
+    if (max_distance != INFINITY && t > max_distance)
+        return;
+    if (t > 0 && (t < *best_t || (t == *best_t && obj < *best_o))) {
+        *best_t = t;
+        *best_o = obj;
+        *best_in_sphere = in_sphere;
+        *best_triangle = triangle;
+    }
+}
+
+/**
+ * Shoots a ray through the grid to find the closest object it hits. Gives the same answer as the linear scan in
+ * shoot(), which has the parameters described there
+ */
+void grid_shoot(Ray *ray, int self_index, real max_distance, int *ret_index, real *ret_best_t, boolean *ret_in_sphere,
+                int *ret_triangle) {
+    UniformGrid *g = grid_copies != NULL ? &grid_copies[tile_pool_node()] : &grid;
+    int best_o = -1;
+    boolean best_in_sphere = false;
+    real best_t = INFINITY;
+    int best_triangle = -1;
+    counters.rays++;
+
+    for (int k = 0; k < g->nunbounded; k++) {
+        int i = g->unbounded[k];
+        boolean in_sphere = false;
+        int triangle = -1;
+        real t;
+        if (objects[i].type == MESH)    // a mesh can shadow itself, see shoot()
+            t = mesh_intersect(ray, &objects[i].mesh, i == self_index ? ray_offset(ray->origin) : 0, max_distance,
+                               &in_sphere, &triangle);
+        else if (i == self_index)
+            continue;
+        else
+            t = plane_intersect(ray, objects[i].plane.position, objects[i].plane.normal);
+        counters.tests++;
+        closest(i, t, in_sphere, triangle, max_distance, &best_o, &best_t, &best_in_sphere, &best_triangle);
+    }
+
+    // clip the ray to the grid bounds
+    real t_enter = 0, t_leave = INFINITY;
+    for (int k = 0; k < 3 && g->nspheres > 0; k++) {
+        if (isnan(ray->direction[k])) {     // like a failed refraction, which can't hit anything
+            t_leave = -INFINITY;
+            break;
+        }
+        if (ray->direction[k] == 0) {
+            if (ray->origin[k] < g->lo[k] || ray->origin[k] > g->hi[k])
+                t_leave = -INFINITY;
+            continue;
+        }
+        real inv = 1 / ray->direction[k];
+        real t0 = (g->lo[k] - ray->origin[k]) * inv;
+        real t1 = (g->hi[k] - ray->origin[k]) * inv;
+        t_enter = fmax(t_enter, fmin(t0, t1));
+        t_leave = fmin(t_leave, fmax(t0, t1));
+    }
+    if (g->nspheres == 0 || t_enter > t_leave || t_enter > best_t || t_enter > max_distance) {
+        *ret_index = best_o;
+        *ret_best_t = best_t;
+        *ret_in_sphere = best_in_sphere;
+        *ret_triangle = best_triangle;
+        return;
+    }
+
+    // a new stamp for this ray, clearing the mailboxes when the stamps wrap around
+    if (mailbox_size < g->nobjects || ++ray_stamp == 0) {
+        if (mailbox_size < g->nobjects) {
+            free(mailbox);
+            mailbox = malloc(sizeof(unsigned int) * g->nobjects);
+            if (mailbox == NULL) {
+                fprintf(stderr, "Error: grid_shoot: Out of memory\n");
+                exit(1);
+            }
+            mailbox_size = g->nobjects;
+        }
+        memset(mailbox, 0, sizeof(unsigned int) * mailbox_size);
+        ray_stamp = 1;
+    }
+
+    // cell the ray enters in and how far along the ray each axis crosses into its next cell
+    int cell[3], step[3], stop[3];
+    real t_next[3], t_delta[3];
+    for (int k = 0; k < 3; k++) {
+        real p = (ray->origin[k] + ray->direction[k] * t_enter - g->lo[k]) * g->inv_cell[k];
+        cell[k] = p < 0 ? 0 : p >= g->res[k] ? g->res[k] - 1 : (int)p;
+        if (ray->direction[k] > 0) {
+            step[k] = 1;
+            stop[k] = g->res[k];
+            t_next[k] = (g->lo[k] + (cell[k] + 1) * g->cell[k] - ray->origin[k]) / ray->direction[k];
+            t_delta[k] = g->cell[k] / ray->direction[k];
+        }
+        else if (ray->direction[k] < 0) {
+            step[k] = -1;
+            stop[k] = -1;
+            t_next[k] = (g->lo[k] + cell[k] * g->cell[k] - ray->origin[k]) / ray->direction[k];
+            t_delta[k] = -g->cell[k] / ray->direction[k];
+        }
+        else {
+            step[k] = 0;
+            stop[k] = -1;
+            t_next[k] = INFINITY;
+            t_delta[k] = INFINITY;
+        }
+    }
+
+    while (true) {
+        int c = (cell[2] * g->res[1] + cell[1]) * g->res[0] + cell[0];
+        for (int k = g->cell_start[c]; k < g->cell_start[c + 1]; k++) {
+            int i = g->cell_items[k];
+            if (i == self_index || mailbox[i] == ray_stamp)
+                continue;
+            mailbox[i] = ray_stamp;
+            counters.tests++;
+            boolean in_sphere = false;
+            real t = sphere_intersect(ray, g->spheres[i], g->spheres[i][3], &in_sphere);
+            closest(i, t, in_sphere, -1, max_distance, &best_o, &best_t, &best_in_sphere, &best_triangle);
+        }
+
+        // every sphere not tested yet is hit, if at all, beyond the point where the ray leaves this cell
+        int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        real t_exit = t_next[axis];
+        if (best_t < t_exit || t_exit > max_distance)
+            break;
+        if (step[axis] == 0)     // a zero direction, which never leaves its cell
+            break;
+        cell[axis] += step[axis];
+        if (cell[axis] == stop[axis])
+            break;
+        t_next[axis] += t_delta[axis];
+    }
+    *ret_index = best_o;
+    *ret_best_t = best_t;
+    *ret_in_sphere = best_in_sphere;
+    *ret_triangle = best_triangle;
+}
@@ -1,17 +1,21 @@
 //
 // Created by mkg on 10/13/2016.
 //
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "../include/illumination.h"
 #include "../include/vector_math.h"
 #include "../include/json.h"
+#include "../include/stats.h"
+#include "../include/tiles.h"
 
 /**
  * Clamps colors -- makes sure they are within a certain range. We don't want values outside of 0-1
  * @param color_val
  * @return the clamped color value
  */
-double clamp(double color_val){
+real clamp(real color_val){
     if (color_val < 0)
         return 0;
     else if (color_val > 1)
@@ -19,7 +23,7 @@ double clamp(double color_val){
     else
         return color_val;
 }
-void scale_color(double* color, double scalar, double* out_color) {
+void scale_color(real* color, real scalar, real* out_color) {
     if (scalar < 0.0) {
         fprintf(stderr, "Error: scale_color: Can't apply negative scalar to a color value\n");
         exit(1);
@@ -29,7 +33,7 @@ void scale_color(double* color, double scalar, double* out_color) {
     out_color[2] = color[2] * scalar;
 }
 
-void copy_color(double* color, double* out_color) {
+void copy_color(real* color, real* out_color) {
     out_color[0] = color[0];
     out_color[1] = color[1];
     out_color[2] = color[2];
@@ -43,16 +47,13 @@ void copy_color(double* color, double* out_color) {
  * @param KD - The diffuse color of the object
  * @param out_color - the resulting RGB color when we're done
  */
-void calculate_diffuse(double *N, double *L, double *IL, double *KD, double *out_color) {
+void calculate_diffuse(real *N, real *L, real *IL, real *KD, real *out_color) {
     // K_a*I_a should be added to the beginning of this whole thing, which is a constant and ambient light
-    double n_dot_l = v3_dot(N, L);
+    real n_dot_l = v4_dot(v4_load(N), v4_load(L));
     if (n_dot_l > 0) {
-        double diffuse_product[3];
-        diffuse_product[0] = KD[0] * IL[0];
-        diffuse_product[1] = KD[1] * IL[1];
-        diffuse_product[2] = KD[2] * IL[2];
+        V4 diffuse_product = v4_mul(v4_load(KD), v4_load(IL));
         // multiply by n_dot_l and store in out_color
-        v3_scale(diffuse_product, n_dot_l, out_color);
+        v4_store(v4_scale(diffuse_product, n_dot_l), out_color);
     }
     else {
         // would normally return K_a*I_a here...
@@ -73,16 +74,13 @@ void calculate_diffuse(double *N, double *L, double *IL, double *KD, double *out
  * @param IL - Illumination level of the light. In essence the "color" of the light
  * @param out_color - where we store the resulting RGB color value
  */
-void calculate_specular(double ns, double *L, double *R, double *N, double *V, double *KS, double *IL, double *out_color) {
-    double v_dot_r = v3_dot(V, R);
-    double n_dot_l = v3_dot(N, L);
+void calculate_specular(real ns, real *L, real *R, real *N, real *V, real *KS, real *IL, real *out_color) {
+    real v_dot_r = v4_dot(v4_load(V), v4_load(R));
+    real n_dot_l = v4_dot(v4_load(N), v4_load(L));
     if (v_dot_r > 0 && n_dot_l > 0) {
-        double vr_to_the_ns = pow(v_dot_r, ns);
-        double spec_product[3];
-        spec_product[0] = KS[0] * IL[0];
-        spec_product[1] = KS[1] * IL[1];
-        spec_product[2] = KS[2] * IL[2];
-        v3_scale(spec_product, vr_to_the_ns, out_color);
+        real vr_to_the_ns = pow(v_dot_r, ns);
+        V4 spec_product = v4_mul(v4_load(KS), v4_load(IL));
+        v4_store(v4_scale(spec_product, vr_to_the_ns), out_color);
     }
     else {
         v3_zero(out_color);
@@ -95,18 +93,16 @@ void calculate_specular(double ns, double *L, double *R, double *N, double *V, d
  * @param direction_to_object - direction vector from the light to the object
  * @return - returns the attenuation value
  */
-double calculate_angular_att(Light *light, double direction_to_object[3]) {
+real calculate_angular_att(Light *light, real direction_to_object[3]) {
     if (light->type != SPOTLIGHT)
         return 1.0;
     if (light->direction == NULL) {
         fprintf(stderr, "Error: calculate_angular_att: Can't have spotlight with no direction\n");
         exit(1);
     }
-    normalize(light->direction);
-    double theta_rad = light->theta_deg * (M_PI / 180.0);
-    double cos_theta = cos(theta_rad);
-    double vo_dot_vl = v3_dot(light->direction, direction_to_object);
-    if (vo_dot_vl < cos_theta)
+    // light->direction was normalized and cos_theta set by prepare_scene()
+    real vo_dot_vl = v3_dot(light->direction, direction_to_object);
+    if (vo_dot_vl < light->cos_theta)
         return 0.0;
     return pow(vo_dot_vl, light->ang_att0);
 }
@@ -117,16 +113,326 @@ double calculate_angular_att(Light *light, double direction_to_object[3]) {
  * @param distance_to_light - distance from the object we're calculating this on to the light
  * @return - returns the attenuation value
  */
-double calculate_radial_att(Light *light, double distance_to_light) {
-    if (light->rad_att0 == 0 && light->rad_att1 == 0 && light->rad_att2 == 0) {
-        fprintf(stdout, "WARNING: calculate_radial_att: Found all 0s for attenuation. Assuming default values of radial attenuation\n");
-        light->rad_att2 = 1.0;
-    }
+real calculate_radial_att(Light *light, real distance_to_light) {
+    // all 0 attenuation was replaced with the default by prepare_scene()
     // if d_l == infinity, return 1
     if (distance_to_light > 99999999999999) return 1.0;
 
-    double dl_sqr = sqr(distance_to_light);
-    double denom = light->rad_att2 * dl_sqr + light->rad_att1 * distance_to_light + light->ang_att0;
-    return 1.0 / denom;
+    real dl_sqr = sqr(distance_to_light);
+    real denom = light->rad_att2 * dl_sqr + light->rad_att1 * distance_to_light + light->ang_att0;
+    return 1 / denom;
+}
+
+
+/**
+ * Finds how far away from a light an object can be and still get a contribution of at least threshold from it. An
+ * object's diffuse and specular colors add up to at most 2 and angular attenuation is at most 1, so the contribution
+ * is at most 2 * (brightest color channel) * radial attenuation
+ * @param light - light struct that we care about
+ * @param threshold - smallest contribution that matters, 0 or less means every light always matters
+ * @return - the influence radius, INFINITY if the light never drops below the threshold
+ */
+real calculate_influence_radius(Light *light, real threshold) {
+    if (threshold <= 0)
+        return INFINITY;
+    real brightest = light->color[0];
+    if (light->color[1] > brightest) brightest = light->color[1];
+    if (light->color[2] > brightest) brightest = light->color[2];
+
+    // solve a2*d^2 + a1*d + a0 = 2 * brightest / threshold, with the same constant term calculate_radial_att() uses
+    real a2 = light->rad_att2;
+    real a1 = light->rad_att1;
+    real a0 = light->ang_att0;
+    real k = 2.0 * brightest / threshold;
+    if (k <= a0)
+        return 0;
+    if (a2 > 0)
+        return (-a1 + sqrt(sqr(a1) + 4 * a2 * (k - a0))) / (2 * a2);
+    if (a1 > 0)
+        return (k - a0) / a1;
+    return INFINITY;
+}
+
+/**
+ * Checks if a light can light a point before any shadow ray is cast towards it. The point has to be within the
+ * light's influence radius and, for a spotlight, inside of its cone
+ * @param light - light struct that we care about
+ * @param to_light - normalized direction from the point to the light
+ * @param distance_to_light - distance from the point to the light
+ * @return - false if the light contributes nothing worth computing at the point
+ */
+boolean light_reaches(Light *light, real to_light[3], real distance_to_light) {
+    counters.lights_considered++;
+    if (distance_to_light > light->influence_radius) {
+        counters.lights_culled++;
+        return false;
+    }
+    if (light->type == SPOTLIGHT) {
+        // same vector math as direct_shade() and calculate_angular_att() so the cone edge agrees exactly
+        V4 L = v4_scale(v4_normalize(v4_load(to_light)), -1);
+        if (v4_dot(v4_load(light->direction), L) < light->cos_theta) {
+            counters.lights_culled++;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* the lights laid out for shade_light_batch(), rebuilt by light_soa_build() */
+LightSoA light_soa = {0};
+
+/* specular exponent, set by settings_apply() */
+int shininess = SHININESS;
+
+/* a copy of light_soa in each NUMA node's memory, made by light_soa_replicate(), NULL while every thread reads it */
+static LightSoA *soa_copies = NULL;
+static int nsoa_copies = 0;
+static boolean replicated = false;  // whether the copies are made again each time light_soa is built
+
+/* LIGHT_LANES reals operated on together, using the compiler's generic vector extension */
+#ifdef SINGLE_PRECISION
+typedef int32_t lane_int;
+#else
+typedef int64_t lane_int;
+#endif
+typedef real lanes __attribute__((vector_size(VECTOR_BYTES)));
+typedef lane_int lane_mask __attribute__((vector_size(VECTOR_BYTES)));
+
+/* keeps the lanes of a where mask is set and zeroes the others, clearing any inf or nan they might hold. A macro
+ * rather than a function, since passing vectors wider than the target's registers by value changes the ABI */
+#define LANES_SELECT(mask, a) ((lanes)((mask) & (lane_mask)(a)))
+
+/**
+ * Raises x to a power, by repeated squaring when the power is a small whole number
+ */
+static inline real pow_small(real x, real e) {
+    if (e >= 0 && e <= 64 && e == (int) e) {
+        real result = 1;
+        for (unsigned int n = (unsigned int) e; n; n >>= 1) {
+            if (n & 1)
+                result *= x;
+            x *= x;
+        }
+        return result;
+    }
+    return pow(x, e);
+}
+
+/**
+ * Copies the lights into light_soa. Must run after prepare_scene() has normalized the spotlight directions and
+ * filled in the cone angles
+ */
+void light_soa_build() {
+    free(light_soa.px);
+    int n = nlights;
+    light_soa.count = n;
+    light_soa.spots = 0;
+    // one block for every field, each padded out to a whole number of lanes
+    int stride = (n + LIGHT_LANES - 1) / LIGHT_LANES * LIGHT_LANES;
+    real *block = calloc((size_t) stride * 14 + 1, sizeof(real));
+    real **fields[14] = {&light_soa.px, &light_soa.py, &light_soa.pz, &light_soa.r, &light_soa.g, &light_soa.b,
+                           &light_soa.a0, &light_soa.a1, &light_soa.a2, &light_soa.dx, &light_soa.dy, &light_soa.dz,
+                           &light_soa.cos_theta, &light_soa.ang_exp};
+    for (int f = 0; f < 14; f++)
+        *fields[f] = block + f * stride;
+    for (int i = 0; i < n; i++) {
+        Light *light = &lights[i];
+        light_soa.px[i] = light->position[0];
+        light_soa.py[i] = light->position[1];
+        light_soa.pz[i] = light->position[2];
+        light_soa.r[i] = light->color[0];
+        light_soa.g[i] = light->color[1];
+        light_soa.b[i] = light->color[2];
+        light_soa.a0[i] = light->ang_att0;
+        light_soa.a1[i] = light->rad_att1;
+        light_soa.a2[i] = light->rad_att2;
+        if (light->type == SPOTLIGHT) {
+            light_soa.dx[i] = light->direction[0];
+            light_soa.dy[i] = light->direction[1];
+            light_soa.dz[i] = light->direction[2];
+            light_soa.cos_theta[i] = light->cos_theta;
+            light_soa.ang_exp[i] = light->ang_att0;
+        }
+        else {
+            light_soa.cos_theta[i] = -2;
+        }
+        if (light->type == SPOTLIGHT)
+            light_soa.spots++;
+    }
+    if (replicated)
+        light_soa_replicate();
+}
+
+/**
+ * Copies light_soa's block into memory allocated and first written by one of a node's threads
+ */
+static void copy_light_soa(int node, void *arg) {
+    LightSoA *copy = &soa_copies[node];
+    size_t stride = light_soa.py - light_soa.px;
+    real *block = malloc(sizeof(real) * (stride * 14 + 1));
+    memcpy(block, light_soa.px, sizeof(real) * (stride * 14 + 1));
+    *copy = light_soa;
+    real **fields[14] = {&copy->px, &copy->py, &copy->pz, &copy->r, &copy->g, &copy->b, &copy->a0, &copy->a1,
+                         &copy->a2, &copy->dx, &copy->dy, &copy->dz, &copy->cos_theta, &copy->ang_exp};
+    for (int f = 0; f < 14; f++)
+        *fields[f] = block + f * stride;
+}
+
+/**
+ * Gives each NUMA node the threads are on a copy of light_soa in its own memory, which shade_light_batch() reads
+ * from on that node's threads. From then on the copies are made again whenever light_soa is built
+ */
+void light_soa_replicate() {
+    for (int k = 0; k < nsoa_copies; k++)
+        free(soa_copies[k].px);
+    free(soa_copies);
+    replicated = true;
+    nsoa_copies = tile_pool_nodes();
+    soa_copies = calloc(nsoa_copies, sizeof(LightSoA));
+    tile_pool_run_nodes(copy_light_soa, NULL);
+}
+
+/**
+ * Adds a light to the batch of lights to shade at a point
+ * @param batch - batch to add to
+ * @param light - index of the light
+ * @param to_light - normalized direction from the point to the light
+ * @param distance - distance from the point to the light
+ * @param weight - what the light's contribution is scaled by, 0 if it is in shadow
+ */
+void light_batch_push(LightBatch *batch, int light, real to_light[3], real distance, real weight) {
+    if (batch->n == batch->cap) {
+        batch->cap = batch->cap ? batch->cap * 2 : 64;
+        batch->light = realloc(batch->light, sizeof(int) * batch->cap);
+        batch->lx = realloc(batch->lx, sizeof(real) * batch->cap);
+        batch->ly = realloc(batch->ly, sizeof(real) * batch->cap);
+        batch->lz = realloc(batch->lz, sizeof(real) * batch->cap);
+        batch->dist = realloc(batch->dist, sizeof(real) * batch->cap);
+        batch->mask = realloc(batch->mask, sizeof(real) * batch->cap);
+    }
+    int k = batch->n++;
+    batch->light[k] = light;
+    batch->lx[k] = to_light[0];
+    batch->ly[k] = to_light[1];
+    batch->lz[k] = to_light[2];
+    batch->dist[k] = distance;
+    batch->mask[k] = weight;
+}
+
+void light_batch_free(LightBatch *batch) {
+    free(batch->light);
+    free(batch->lx);
+    free(batch->ly);
+    free(batch->lz);
+    free(batch->dist);
+    free(batch->mask);
+    memset(batch, 0, sizeof(LightBatch));
 }
 
+/**
+ * Adds the diffuse and specular light from every light in a batch to a point's color, LIGHT_LANES lights at a time.
+ * Gives what calling direct_shade() on each unshadowed light does, apart from the rounding of the Phong and
+ * spotlight powers, which are taken by repeated squaring
+ * @param batch - lights with their directions, distances and shadow masks
+ * @param normal - normalized surface normal at the point
+ * @param view - direction of the ray that hit the point
+ * @param kd - diffuse color of the object
+ * @param ks - specular color of the object
+ * @param color - the light is added to this color
+ */
+void shade_light_batch(LightBatch *batch, real normal[3], real view[3], real kd[3], real ks[3],
+                       real color[3]) {
+    const LightSoA *soa = soa_copies != NULL ? &soa_copies[tile_pool_node()] : &light_soa;
+    lanes zero = {0};
+    // pad the last block with masked out lights, the capacity is always a whole number of blocks
+    for (int k = batch->n; k % LIGHT_LANES != 0; k++) {
+        batch->light[k] = batch->light[0];
+        batch->lx[k] = batch->ly[k] = 0;
+        batch->lz[k] = batch->dist[k] = 1;
+        batch->mask[k] = 0;
+    }
+
+    for (int base = 0; base < batch->n; base += LIGHT_LANES) {
+        // gather the lights' fields, then load everything into lanes
+        real gathered[6][LIGHT_LANES];
+        for (int k = 0; k < LIGHT_LANES; k++) {
+            int i = batch->light[base + k];
+            gathered[0][k] = soa->r[i];
+            gathered[1][k] = soa->g[i];
+            gathered[2][k] = soa->b[i];
+            gathered[3][k] = soa->a0[i];
+            gathered[4][k] = soa->a1[i];
+            gathered[5][k] = soa->a2[i];
+        }
+        lanes r, g, b, a0, a1, a2, lx, ly, lz, dist, mask;
+        memcpy(&r, gathered[0], sizeof(lanes));
+        memcpy(&g, gathered[1], sizeof(lanes));
+        memcpy(&b, gathered[2], sizeof(lanes));
+        memcpy(&a0, gathered[3], sizeof(lanes));
+        memcpy(&a1, gathered[4], sizeof(lanes));
+        memcpy(&a2, gathered[5], sizeof(lanes));
+        memcpy(&lx, &batch->lx[base], sizeof(lanes));
+        memcpy(&ly, &batch->ly[base], sizeof(lanes));
+        memcpy(&lz, &batch->lz[base], sizeof(lanes));
+        memcpy(&dist, &batch->dist[base], sizeof(lanes));
+        memcpy(&mask, &batch->mask[base], sizeof(lanes));
+
+        // diffuse and specular response, R being L reflected about the normal
+        lanes n_dot_l = normal[0] * lx + normal[1] * ly + normal[2] * lz;
+        lanes scale = (real)2 * n_dot_l;
+        lanes rx = lx - normal[0] * scale;
+        lanes ry = ly - normal[1] * scale;
+        lanes rz = lz - normal[2] * scale;
+        lanes v_dot_r = view[0] * rx + view[1] * ry + view[2] * rz;
+        lane_mask lit = n_dot_l > zero;
+        lanes diffuse = LANES_SELECT(lit, n_dot_l);
+        // (v.r)^shininess by repeated squaring
+        lanes phong = zero + (real)1;
+        lanes power = v_dot_r;
+        for (unsigned int e = shininess; e; e >>= 1) {
+            if (e & 1)
+                phong *= power;
+            power *= power;
+        }
+        lanes specular = LANES_SELECT(lit & (v_dot_r > zero), phong);
+
+        // radial attenuation
+        lanes frad = (real)1 / (a2 * (dist * dist) + a1 * dist + a0);
+        lane_mask is_far = dist > (real)99999999999999.0;
+        frad = (lanes)((is_far & (lane_mask)(zero + (real)1)) | (~is_far & (lane_mask)frad));
+
+        // angular attenuation, the angle being between the spotlight direction and the direction to the point
+        lanes att = frad * mask;
+        if (soa->spots > 0) {
+            real fang[LIGHT_LANES];
+            for (int k = 0; k < LIGHT_LANES; k++) {
+                int i = batch->light[base + k];
+                fang[k] = 1;
+                if (soa->cos_theta[i] > -2) {
+                    real vo_dot_vl = -(soa->dx[i] * lx[k] + soa->dy[i] * ly[k] +
+                                         soa->dz[i] * lz[k]);
+                    fang[k] = vo_dot_vl < soa->cos_theta[i] ? 0 : pow_small(vo_dot_vl, soa->ang_exp[i]);
+                }
+            }
+            lanes fang_lanes;
+            memcpy(&fang_lanes, fang, sizeof(lanes));
+            att = frad * fang_lanes * mask;
+        }
+
+        // masked out lanes are zeroed rather than multiplied so they can't leak inf or nan into the color
+        att = LANES_SELECT(mask != zero, att);
+        lanes out[3] = {
+                att * (ks[0] * r * specular + kd[0] * r * diffuse),
+                att * (ks[1] * g * specular + kd[1] * g * diffuse),
+                att * (ks[2] * b * specular + kd[2] * b * diffuse)
+        };
+        real sums[3][LIGHT_LANES];
+        memcpy(sums, out, sizeof(sums));
+        int m = batch->n - base < LIGHT_LANES ? batch->n - base : LIGHT_LANES;
+        for (int k = 0; k < m; k++) {
+            color[0] += sums[0][k];
+            color[1] += sums[1][k];
+            color[2] += sums[2][k];
+        }
+    }
+}
@@ -0,0 +1,487 @@
+/* instance.c - geometry instancing. Spheres and meshes given a "group" are kept out of the scene and gathered into
+ * groups, each with a BVH over its members. An instance places a whole group with a position, rotation and uniform
+ * scale, and a second BVH over the instances' bounds finds the ones a ray passes near. The ray is moved into the
+ * group's coordinates rather than moving the group into the scene, so every instance of a group shares one copy of it.
+ * A member hit through an instance gets its own hit index past the scene's objects, which the shading functions turn
+ * back into the member with hit_object() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "../include/instance.h"
+#include "../include/mesh.h"
+#include "../include/arena.h"
+
+InstanceTable instance_table = {0};
+
+/* closest hit while a ray walks the instances, see instances_shoot() */
+typedef struct instance_hit_t {
+    Ray *ray;               // the ray in the scene
+    int self_index;
+    real max_distance;
+    real t_max;             // min of the closest hit and max_distance, in the scene's distances
+    int *best_o;
+    real *best_t;
+    boolean *best_in_sphere;
+    int *best_triangle;
+} InstanceHit;
+
+/**
+ * Finds the group with a name, adding it if there isn't one yet
+ */
+static Group *find_group(const char *name, boolean add) {
+    for (int g = 0; g < instance_table.ngroups; g++)
+        if (strcmp(instance_table.groups[g].name, name) == 0)
+            return &instance_table.groups[g];
+    if (!add)
+        return NULL;
+    Group *groups = realloc(instance_table.groups, sizeof(Group) * (instance_table.ngroups + 1));
+    if (groups == NULL) {
+        fprintf(stderr, "Error: instances_build: Out of memory\n");
+        exit(1);
+    }
+    instance_table.groups = groups;
+    Group *group = &groups[instance_table.ngroups++];
+    memset(group, '\0', sizeof(Group));
+    group->name = (char *)name;
+    return group;
+}
+
+/**
+ * Finds the bounds of a group member in the group's coordinates
+ */
+static void member_bounds(object *member, BVHItem *item) {
+    for (int k = 0; k < 3; k++) {
+        if (member->type == SPHERE) {
+            item->lo[k] = bvh_round_down(member->sphere.position[k] - member->sphere.radius);
+            item->hi[k] = bvh_round_up(member->sphere.position[k] + member->sphere.radius);
+        }
+        else {
+            BVHNode *root = &member->mesh.data->nodes[0];
+            item->lo[k] = bvh_round_down(member->mesh.position[k] + root->lo[k] * member->mesh.scale);
+            item->hi[k] = bvh_round_up(member->mesh.position[k] + root->hi[k] * member->mesh.scale);
+        }
+    }
+}
+
+/**
+ * Gathers the grouped objects into their groups and builds a BVH over each group's members
+ */
+static void groups_build() {
+    for (int i = 0; i < ngrouped_objects; i++) {
+        prepare_object(&grouped_objects[i]);
+        find_group(grouped_objects[i].group, true)->nmembers++;
+    }
+    for (int g = 0; g < instance_table.ngroups; g++) {
+        Group *group = &instance_table.groups[g];
+        object *members = malloc(sizeof(object) * group->nmembers);
+        BVHItem *items = malloc(sizeof(BVHItem) * group->nmembers);
+        if (members == NULL || items == NULL) {
+            fprintf(stderr, "Error: instances_build: Out of memory\n");
+            exit(1);
+        }
+        int n = 0;
+        for (int i = 0; i < ngrouped_objects; i++) {
+            if (strcmp(grouped_objects[i].group, group->name) != 0)
+                continue;
+            member_bounds(&grouped_objects[i], &items[n]);
+            items[n].index = i;
+            n++;
+        }
+        group->nodes = bvh_build(items, n, &group->nnodes);
+        for (int m = 0; m < n; m++)
+            members[m] = grouped_objects[items[m].index];
+        group->members = members;
+        free(items);
+        instance_table.bytes += sizeof(object) * group->nmembers + sizeof(BVHNode) * group->nnodes;
+    }
+}
+
+/**
+ * Sets an instance's transform from its position, rotation and scale. The rotation turns about x, then y, then z
+ */
+static void set_transform(InstanceEntry *entry, Instance *instance) {
+    real c[3] = {1, 1, 1}, s[3] = {0, 0, 0};
+    for (int k = 0; k < 3 && instance->rotation != NULL; k++) {
+        c[k] = cos(instance->rotation[k] * (M_PI / 180.0));
+        s[k] = sin(instance->rotation[k] * (M_PI / 180.0));
+    }
+    // Rz * Ry * Rx
+    real r[3][3] = {
+            {c[2] * c[1], c[2] * s[1] * s[0] - s[2] * c[0], c[2] * s[1] * c[0] + s[2] * s[0]},
+            {s[2] * c[1], s[2] * s[1] * s[0] + c[2] * c[0], s[2] * s[1] * c[0] - c[2] * s[0]},
+            {-s[1],       c[1] * s[0],                      c[1] * c[0]}
+    };
+    memcpy(entry->rotation, r, sizeof(r));
+    v3_copy(instance->position, entry->position);
+    entry->scale = instance->scale;
+    entry->inv_scale = 1 / instance->scale;
+}
+
+/**
+ * Finds the bounds of an instance in the scene from the 8 corners of its group's bounds
+ */
+static void instance_bounds(InstanceEntry *entry, BVHItem *item) {
+    BVHNode *root = &entry->group->nodes[0];
+    for (int k = 0; k < 3; k++) {
+        item->lo[k] = INFINITY;
+        item->hi[k] = -INFINITY;
+    }
+    for (int corner = 0; corner < 8; corner++) {
+        real p[3] = {corner & 1 ? root->hi[0] : root->lo[0],
+                     corner & 2 ? root->hi[1] : root->lo[1],
+                     corner & 4 ? root->hi[2] : root->lo[2]};
+        real x[3];
+        for (int k = 0; k < 3; k++)
+            x[k] = entry->position[k] + entry->scale * (entry->rotation[k][0] * p[0] + entry->rotation[k][1] * p[1] +
+                                                        entry->rotation[k][2] * p[2]);
+        real slack = ray_offset(x) + ray_offset(p) * entry->scale;     // for the rounding in the transform
+        for (int k = 0; k < 3; k++) {
+            item->lo[k] = fmin(item->lo[k], bvh_round_down(x[k] - slack));
+            item->hi[k] = fmax(item->hi[k], bvh_round_up(x[k] + slack));
+        }
+    }
+}
+
+/**
+ * Fills the instance table from the instances in objects and builds the BVH over their bounds
+ */
+static void instance_bvh_build() {
+    int n = 0;
+    for (int i = 0; i < nobjects; i++)
+        n += objects[i].type == INSTANCE;
+    if (n == 0)
+        return;
+    InstanceEntry *entries = malloc(sizeof(InstanceEntry) * n);
+    instance_table.entries = malloc(sizeof(InstanceEntry) * n);
+    BVHItem *items = malloc(sizeof(BVHItem) * n);
+    if (entries == NULL || instance_table.entries == NULL || items == NULL) {
+        fprintf(stderr, "Error: instances_build: Out of memory\n");
+        exit(1);
+    }
+    n = 0;
+    for (int i = 0; i < nobjects; i++) {
+        if (objects[i].type != INSTANCE)
+            continue;
+        Instance *instance = &objects[i].instance;
+        InstanceEntry *entry = &entries[n];
+        entry->object = i;
+        entry->group = find_group(instance->group, false);
+        if (entry->group == NULL) {
+            fprintf(stderr, "Error: instances_build: instance of a group that has no members: '%s'\n", instance->group);
+            exit(1);
+        }
+        if (instance->position == NULL)
+            instance->position = arena_calloc(&scene_arena, 3, sizeof(real));
+        set_transform(entry, instance);
+        instance_bounds(entry, &items[n]);
+        items[n].index = n;
+        n++;
+    }
+    instance_table.nodes = bvh_build(items, n, &instance_table.nnodes);
+    instance_table.built_cost = bvh_cost(instance_table.nodes, instance_table.nnodes);
+
+    // hit indices are handed out in leaf order, so one is found again by a binary search over first_hit
+    long long hits = nobjects;
+    for (int e = 0; e < n; e++) {
+        InstanceEntry *entry = &instance_table.entries[e];
+        *entry = entries[items[e].index];
+        entry->first_hit = (int)hits;
+        hits += entry->group->nmembers;
+        if (hits > INT_MAX) {
+            fprintf(stderr, "Error: instances_build: Instances have more than %d objects between them\n", INT_MAX);
+            exit(1);
+        }
+    }
+    instance_table.nentries = n;
+    instance_table.nhits = (int)hits;
+    instance_table.bytes += sizeof(InstanceEntry) * n + sizeof(BVHNode) * instance_table.nnodes;
+    free(entries);
+    free(items);
+}
+
+/**
+ * Builds the groups and the instance table with its BVH. Called by prepare_scene() once the objects are ready
+ */
+void instances_build() {
+    double start = wall_seconds();
+    instances_free();
+    groups_build();
+    instance_bvh_build();
+    instance_table.build_seconds = wall_seconds() - start;
+}
+
+/**
+ * Catches the instance table up with instances that have moved, turned or been scaled since it was built. The BVH
+ * over the instances is refit rather than built again, unless refitting has made it more than INSTANCE_REFIT_SLACK
+ * times as costly to trace as a fresh one was. The groups are in their own coordinates and don't change
+ */
+void instances_refit() {
+    int n = instance_table.nentries;
+    if (n == 0)
+        return;
+    BVHItem *items = malloc(sizeof(BVHItem) * n);
+    if (items == NULL) {
+        fprintf(stderr, "Error: instances_refit: Out of memory\n");
+        exit(1);
+    }
+    for (int e = 0; e < n; e++) {
+        InstanceEntry *entry = &instance_table.entries[e];
+        set_transform(entry, &objects[entry->object].instance);
+        instance_bounds(entry, &items[e]);
+    }
+    bvh_refit(instance_table.nodes, instance_table.nnodes, items);
+    free(items);
+    instance_table.refits++;
+    if (bvh_cost(instance_table.nodes, instance_table.nnodes) > INSTANCE_REFIT_SLACK * instance_table.built_cost) {
+        instance_table.bytes -= sizeof(InstanceEntry) * n + sizeof(BVHNode) * instance_table.nnodes;
+        free(instance_table.entries);
+        free(instance_table.nodes);
+        instance_bvh_build();
+        instance_table.rebuilds++;
+    }
+}
+
+/**
+ * Frees the instance table and the groups
+ */
+void instances_free() {
+    for (int g = 0; g < instance_table.ngroups; g++) {
+        free(instance_table.groups[g].members);
+        free(instance_table.groups[g].nodes);
+    }
+    free(instance_table.groups);
+    free(instance_table.entries);
+    free(instance_table.nodes);
+    memset(&instance_table, '\0', sizeof(InstanceTable));
+}
+
+/**
+ * Finds the instance a member's hit index was handed out by
+ */
+static InstanceEntry *find_entry(int hit) {
+    int lo = 0, hi = instance_table.nentries - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (instance_table.entries[mid].first_hit <= hit)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &instance_table.entries[lo];
+}
+
+/**
+ * Finds the group member a hit index past the scene's objects refers to, see hit_object()
+ */
+object *instance_member(int hit) {
+    InstanceEntry *entry = find_entry(hit);
+    return &entry->group->members[hit - entry->first_hit];
+}
+
+/**
+ * Finds the instance a member was hit through
+ * @param hit - hit index of the member
+ * @return - index of the instance in objects
+ */
+int instance_owner(int hit) {
+    return find_entry(hit)->object;
+}
+
+/**
+ * Finds the bounds in the scene of an instance
+ * @param object - index of the instance in objects
+ * @param lo - set to the low corner
+ * @param hi - set to the high corner
+ */
+void instance_object_bounds(int object, real lo[3], real hi[3]) {
+    for (int e = 0; e < instance_table.nentries; e++) {
+        if (instance_table.entries[e].object != object)
+            continue;
+        BVHItem item;
+        instance_bounds(&instance_table.entries[e], &item);
+        for (int k = 0; k < 3; k++) {
+            lo[k] = item.lo[k];
+            hi[k] = item.hi[k];
+        }
+        return;
+    }
+    for (int k = 0; k < 3; k++) {
+        lo[k] = INFINITY;
+        hi[k] = -INFINITY;
+    }
+}
+
+/**
+ * Finds the normal of a group member hit through an instance
+ * @param hit - hit index of the member
+ * @param triangle - triangle that was hit if the member is a mesh, see mesh_intersect()
+ * @param point - point on the member, in the scene
+ * @param normal - set to the normal in the scene, not normalized
+ */
+void instance_normal(int hit, int triangle, real point[3], real normal[3]) {
+    InstanceEntry *entry = find_entry(hit);
+    object *member = &entry->group->members[hit - entry->first_hit];
+    real d[3], local[3], n[3];
+    v3_sub(point, entry->position, d);
+    for (int k = 0; k < 3; k++)
+        local[k] = (entry->rotation[0][k] * d[0] + entry->rotation[1][k] * d[1] + entry->rotation[2][k] * d[2]) *
+                   entry->inv_scale;
+    if (member->type == SPHERE)
+        v3_sub(local, member->sphere.position, n);
+    else
+        mesh_normal(&member->mesh, triangle, n);
+    for (int k = 0; k < 3; k++)
+        normal[k] = entry->rotation[k][0] * n[0] + entry->rotation[k][1] * n[1] + entry->rotation[k][2] * n[2];
+}
+
+/**
+ * Walks a BVH nearest child first, handing each leaf that could hold something closer than *t_max to a function
+ * @param nodes - the BVH
+ * @param org - ray origin in the BVH's coordinates
+ * @param inv_dir - 1 / ray direction, per axis
+ * @param t_max - furthest distance that matters, lowered by the leaf function as it finds hits
+ * @param leaf - tests what a leaf holds
+ * @param context - handed to the leaf function
+ */
+static inline void bvh_walk(const BVHNode *nodes, const real org[3], const real inv_dir[3], real *t_max,
+                            void (*leaf)(const BVHNode *, void *), void *context) {
+    struct { uint32_t node; real t; } stack[BVH_MAX_DEPTH + 2];
+    int sp = 0;
+    uint32_t node = 0;
+    if (bvh_box_entry(&nodes[0], org, inv_dir, *t_max) == INFINITY)
+        return;
+    while (true) {
+        const BVHNode *n = &nodes[node];
+        if (n->count > 0) {
+            leaf(n, context);
+        }
+        else {
+            uint32_t near = node + 1, far = n->first;
+            real t_near = bvh_box_entry(&nodes[near], org, inv_dir, *t_max);
+            real t_far = bvh_box_entry(&nodes[far], org, inv_dir, *t_max);
+            if (t_far < t_near) {
+                uint32_t t = near;
+                near = far;
+                far = t;
+                real s = t_near;
+                t_near = t_far;
+                t_far = s;
+            }
+            if (t_near != INFINITY) {
+                if (t_far != INFINITY) {
+                    stack[sp].node = far;
+                    stack[sp++].t = t_far;
+                }
+                node = near;
+                continue;
+            }
+        }
+        // the next node put aside that could still have something closer
+        while (sp > 0 && stack[sp - 1].t > *t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        node = stack[--sp].node;
+    }
+}
+
+/* one instance being walked, see group_leaf() */
+typedef struct group_walk_t {
+    InstanceHit *hit;
+    InstanceEntry *entry;
+    Ray local;              // the ray in the group's coordinates
+    real t_max;             // hit->t_max in the group's distances
+} GroupWalk;
+
+/**
+ * Tests the members in a leaf of a group's BVH
+ */
+static void group_leaf(const BVHNode *leaf, void *context) {
+    GroupWalk *walk = context;
+    InstanceHit *hit = walk->hit;
+    for (uint32_t m = leaf->first; m < leaf->first + leaf->count; m++) {
+        object *member = &walk->entry->group->members[m];
+        int id = walk->entry->first_hit + (int)m;
+        boolean in_sphere = false;
+        int triangle = -1;
+        real t;
+        counters.tests++;
+        if (member->type == MESH)   // a mesh can shadow itself, see shoot()
+            t = mesh_intersect(&walk->local, &member->mesh,
+                               id == hit->self_index ? ray_offset(walk->local.origin) : 0, walk->t_max, &in_sphere,
+                               &triangle);
+        else if (id == hit->self_index)
+            continue;
+        else
+            t = sphere_intersect(&walk->local, member->sphere.position, member->sphere.radius, &in_sphere);
+        if (t <= 0)
+            continue;
+        real t_scene = t * walk->entry->scale;
+        if (hit->max_distance != INFINITY && t_scene > hit->max_distance)
+            continue;
+        if (t_scene < *hit->best_t || (t_scene == *hit->best_t && id < *hit->best_o)) {
+            *hit->best_t = t_scene;
+            *hit->best_o = id;
+            *hit->best_in_sphere = in_sphere;
+            *hit->best_triangle = triangle;
+            hit->t_max = fmin(hit->t_max, t_scene);
+            walk->t_max = fmin(walk->t_max, t);
+        }
+    }
+}
+
+/**
+ * Moves the ray into the group's coordinates for each instance in a leaf of the instance BVH and walks its group
+ */
+static void instance_leaf(const BVHNode *leaf, void *context) {
+    InstanceHit *hit = context;
+    for (uint32_t e = leaf->first; e < leaf->first + leaf->count; e++) {
+        InstanceEntry *entry = &instance_table.entries[e];
+        GroupWalk walk = {.hit = hit, .entry = entry, .t_max = hit->t_max * entry->inv_scale};
+        real d[3], inv_dir[3];
+        v3_sub(hit->ray->origin, entry->position, d);
+        for (int k = 0; k < 3; k++) {
+            // the transpose of the rotation undoes it, and the direction stays a unit vector
+            walk.local.origin[k] = (entry->rotation[0][k] * d[0] + entry->rotation[1][k] * d[1] +
+                                    entry->rotation[2][k] * d[2]) * entry->inv_scale;
+            walk.local.direction[k] = entry->rotation[0][k] * hit->ray->direction[0] +
+                                      entry->rotation[1][k] * hit->ray->direction[1] +
+                                      entry->rotation[2][k] * hit->ray->direction[2];
+            inv_dir[k] = 1 / walk.local.direction[k];
+        }
+        bvh_walk(entry->group->nodes, walk.local.origin, inv_dir, &walk.t_max, group_leaf, &walk);
+    }
+}
+
+/**
+ * Tests a ray against every instance, keeping the closest hit. Called by shoot() and primary_shoot() after testing
+ * the scene's own objects, which have the lower hit indices
+ * @param ray - ray in the scene
+ * @param self_index - hit index of the object the ray leaves from, or -1
+ * @param max_distance - hits past this don't count
+ * @param best_o - closest hit index so far, updated
+ * @param best_t - its distance, updated
+ * @param best_in_sphere - whether it was from inside, updated
+ * @param best_triangle - triangle that was hit if it is a mesh, -1 otherwise, updated
+ */
+void instances_shoot(Ray *ray, int self_index, real max_distance, int *best_o, real *best_t, boolean *best_in_sphere,
+                     int *best_triangle) {
+    if (instance_table.nentries == 0 || isnan(ray->direction[0] + ray->direction[1] + ray->direction[2]))
+        return;     // a failed refraction would pass every bounds test and can't hit anything
+    InstanceHit hit = {
+            .ray = ray,
+            .self_index = self_index,
+            .max_distance = max_distance,
+            .t_max = fmin(*best_t, max_distance),
+            .best_o = best_o,
+            .best_t = best_t,
+            .best_in_sphere = best_in_sphere,
+            .best_triangle = best_triangle
+    };
+    real inv_dir[3];
+    for (int k = 0; k < 3; k++)
+        inv_dir[k] = 1 / ray->direction[k];
+    bvh_walk(instance_table.nodes, ray->origin, inv_dir, &hit.t_max, instance_leaf, &hit);
+}
@@ -8,13 +8,20 @@
 #include <strings.h>
 #include <ctype.h>
 #include "../include/json.h"
+#include "../include/arena.h"
+#include "../include/settings.h"
 
 /* global variables */
 int line = 1;                   // global var for line numbers as we parse
-object objects[MAX_OBJECTS];    // allocate space for all objects in json file
-Light lights[MAX_OBJECTS];      // allocate space for lights
+object *objects = NULL;         // grows as objects are found, see grow_objects()
+int objects_capacity = 0;
+Light *lights = NULL;           // grows as lights are found, see grow_lights()
+int lights_capacity = 0;
 int nlights;
 int nobjects;
+object *grouped_objects = NULL; // grows as grouped objects are found, see group_object()
+int grouped_objects_capacity = 0;
+int ngrouped_objects = 0;
 
 /* helper functions */
 
@@ -65,23 +72,43 @@ double next_number(FILE* json) {
     return val;
 }
 
+/* gets the next value from a file - This is *expected* to be true or false */
+boolean next_boolean(FILE *json) {
+    char word[6];
+    int n = 0;
+    int c = next_c(json);
+    while (isalpha(c) && n < (int)sizeof(word) - 1) {
+        word[n++] = (char)c;
+        c = next_c(json);
+    }
+    word[n] = 0;
+    if (c == '\n')
+        line--;
+    ungetc(c, json);
+    if (strcmp(word, "true") != 0 && strcmp(word, "false") != 0) {
+        fprintf(stderr, "Error: Expected true or false but found '%s': %d\n", word, line);
+        exit(1);
+    }
+    return word[0] == 't';
+}
+
 /* since we could use 0-255 or 0-1 or whatever, this function checks bounds */
-int check_color_val(double v) {
+int check_color_val(real v) {
     if (v < 0.0 || v > 1.0)
         return 0;
     return 1;
 }
 
 /* check bounds for colors in json light objects. These can be anything >= 0 */
-int check_light_color_val(double v) {
+int check_light_color_val(real v) {
     if (v < 0.0)
         return 0;
     return 1;
 }
 
 /* gets the next 3 values from FILE as vector coordinates */
-double* next_vector(FILE* json) {
-    double* v = malloc(sizeof(double)*3);
+real* next_vector(FILE* json) {
+    real* v = arena_alloc(&scene_arena, sizeof(real)*3);
     skip_ws(json);
     expect_c(json, '[');
     skip_ws(json);
@@ -100,8 +127,8 @@ double* next_vector(FILE* json) {
 }
 
 /* Checks that the next 3 values in the FILE are valid rgb numbers */
-double* next_color(FILE* json, boolean is_rgb) {
-    double* v = malloc(sizeof(double)*3);
+real* next_color(FILE* json, boolean is_rgb) {
+    real* v = arena_alloc(&scene_arena, sizeof(real)*3);
     skip_ws(json);
     expect_c(json, '[');
     skip_ws(json);
@@ -152,12 +179,133 @@ char* parse_string(FILE *json) {
         if (isspace(c)) {
             continue;
         }
+        if (i == sizeof(buffer) - 1) {
+            fprintf(stderr, "Error: parse_string: Strings can't be longer than %d characters: %d\n", i, line);
+            exit(1);
+        }
         buffer[i] = c;
         i++;
         c = next_c(json);
     }
     buffer[i] = 0;
-    return strdup(buffer); // returns a malloc'd version of buffer
+    return arena_strdup(&scene_arena, buffer); // lives as long as the rest of the scene
+}
+
+/**
+ * Reads a list of position keys, each an object with a "frame" and a "position", for example
+ * [{"frame": 0, "position": [0, 0, 5]}, {"frame": 24, "position": [2, 0, 5]}]
+ * @param json - file positioned at the list
+ * @param nkeys - set to the number of keys
+ * @return - the keys, which must be given in increasing frame order
+ */
+PositionKey *next_keys(FILE *json, int *nkeys) {
+    PositionKey *keys = NULL;
+    int n = 0, capacity = 0;
+    skip_ws(json);
+    expect_c(json, '[');
+    skip_ws(json);
+    int c = next_c(json);
+    while (c != ']') {
+        if (c != '{') {
+            fprintf(stderr, "Error: next_keys: Expected a key object but found '%c': %d\n", c, line);
+            exit(1);
+        }
+        if (n == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 8;
+            keys = realloc(keys, sizeof(PositionKey) * capacity);
+            if (keys == NULL) {
+                fprintf(stderr, "Error: next_keys: Failed to allocate %d keys\n", capacity);
+                exit(1);
+            }
+        }
+        PositionKey *key = &keys[n++];
+        boolean has_frame = false, has_position = false;
+        do {
+            char *name = parse_string(json);
+            skip_ws(json);
+            expect_c(json, ':');
+            skip_ws(json);
+            if (strcmp(name, "frame") == 0) {
+                key->frame = next_number(json);
+                has_frame = true;
+            }
+            else if (strcmp(name, "position") == 0) {
+                real *v = next_vector(json);
+                memcpy(key->position, v, sizeof(key->position));
+                has_position = true;
+            }
+            else {
+                fprintf(stderr, "Error: next_keys: '%s' not a valid key field: %d\n", name, line);
+                exit(1);
+            }
+            skip_ws(json);
+            c = next_c(json);
+        } while (c == ',');
+        if (c != '}') {
+            fprintf(stderr, "Error: next_keys: Expected '}' but found '%c': %d\n", c, line);
+            exit(1);
+        }
+        if (!has_frame || !has_position) {
+            fprintf(stderr, "Error: next_keys: key must have a frame and a position: %d\n", line);
+            exit(1);
+        }
+        if (n > 1 && key->frame <= keys[n - 2].frame) {
+            fprintf(stderr, "Error: next_keys: keys must be in increasing frame order: %d\n", line);
+            exit(1);
+        }
+        skip_ws(json);
+        c = next_c(json);
+        if (c == ',') {
+            skip_ws(json);
+            c = next_c(json);
+        }
+        else if (c != ']') {
+            fprintf(stderr, "Error: next_keys: Expecting comma or ]: %d\n", line);
+            exit(1);
+        }
+    }
+    *nkeys = n;
+    PositionKey *result = NULL;
+    if (n > 0)
+        result = memcpy(arena_alloc(&scene_arena, sizeof(PositionKey) * n), keys, sizeof(PositionKey) * n);
+    free(keys);
+    return result;
+}
+
+/**
+ * Moves an object out of the scene and into the grouped objects, which only show up through instances of its group
+ * @param obj - object to move, zeroed afterwards so its slot can be reused
+ */
+void group_object(object *obj) {
+    if (ngrouped_objects == grouped_objects_capacity) {
+        int capacity = grouped_objects_capacity > 0 ? 2 * grouped_objects_capacity : MAX_OBJECTS;
+        grouped_objects = realloc(grouped_objects, sizeof(object) * capacity);
+        if (grouped_objects == NULL) {
+            fprintf(stderr, "Error: group_object: Failed to allocate %d grouped objects\n", capacity);
+            exit(1);
+        }
+        grouped_objects_capacity = capacity;
+    }
+    grouped_objects[ngrouped_objects++] = *obj;
+    memset(obj, '\0', sizeof(object));
+}
+
+/**
+ * Finds a file named in a scene relative to the directory the scene file is in, so a scene can be rendered from
+ * anywhere. Absolute names are kept as they are
+ * @param scene_path - path of the scene file
+ * @param name - file name as written in the scene
+ * @return - the path to open, allocated with the rest of the scene
+ */
+static char *scene_relative(const char *scene_path, char *name) {
+    const char *slash = strrchr(scene_path, '/');
+    if (name[0] == '/' || slash == NULL)
+        return name;
+    size_t dir_len = slash - scene_path + 1;
+    char *path = arena_alloc(&scene_arena, dir_len + strlen(name) + 1);
+    memcpy(path, scene_path, dir_len);
+    strcpy(path + dir_len, name);
+    return path;
 }
 
 /**
@@ -166,8 +314,9 @@ char* parse_string(FILE *json) {
  * the file and places the values into the appropriate portion of the current
  * object.
  * @param json file handler with ASCII json data
+ * @param path - name of the json file, files the scene names are found relative to its directory
  */
-void read_json(FILE *json) {
+void read_json(FILE *json, const char *path) {
     //read in data from file
     // expecting square bracket but we need to get rid of whitespace
     skip_ws(json);
@@ -190,7 +339,7 @@ void read_json(FILE *json) {
 
     int obj_counter = 0;
     int light_counter = 0;
-    int obj_type;
+    int obj_type = 0;
     boolean not_done = true;
     // flags for testing whether or not objects have these elements
     boolean has_ior = false;
@@ -200,10 +349,6 @@ void read_json(FILE *json) {
     // find the objects
     while (not_done) {
         //c  = next_c(json);
-        if (obj_counter > MAX_OBJECTS) {
-            fprintf(stderr, "Error: read_json: Number of objects is too large: %d\n", line);
-            exit(1);
-        }
         if (c == ']') {
             fprintf(stderr, "Error: read_json: Unexpected ']': %d\n", line);
             fclose(json);
@@ -222,6 +367,7 @@ void read_json(FILE *json) {
             skip_ws(json);
 
             char *type = parse_string(json);
+            grow_objects(obj_counter + 1);
             if (strcmp(type, "camera") == 0) {
                 obj_type = CAMERA;
                 objects[obj_counter].type = CAMERA;
@@ -234,8 +380,20 @@ void read_json(FILE *json) {
                 obj_type = PLANE;
                 objects[obj_counter].type = PLANE;
             }
+            else if (strcmp(type, "mesh") == 0) {
+                obj_type = MESH;
+                objects[obj_counter].type = MESH;
+            }
+            else if (strcmp(type, "instance") == 0) {
+                obj_type = INSTANCE;
+                objects[obj_counter].type = INSTANCE;
+            }
             else if (strcmp(type, "light") == 0) {
                 obj_type = LIGHT;
+                grow_lights(light_counter + 1);
+            }
+            else if (strcmp(type, "render") == 0) {
+                obj_type = RENDER;
             }
             else {
                 exit(1);
@@ -262,7 +420,7 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: Width cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double temp = next_number(json);
+                        real temp = next_number(json);
                         if (temp <= 0) {
                             fprintf(stderr, "Error: read_json: width must be positive: %d\n", line);
                             exit(1);
@@ -276,31 +434,96 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: Height cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double temp = next_number(json);
+                        real temp = next_number(json);
                         if (temp <= 0) {
                             fprintf(stderr, "Error: read_json: height must be positive: %d\n", line);
                             exit(1);
                         }
                         objects[obj_counter].camera.height = temp;
                     }
+                    else if (strcmp(key, "fov") == 0) {
+                        if (obj_type != CAMERA) {
+                            fprintf(stderr, "Error: read_json: Fov cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        real temp = next_number(json);
+                        if (temp <= 0 || temp >= 180) {
+                            fprintf(stderr, "Error: read_json: fov must be between 0 and 180 degrees: %d\n", line);
+                            exit(1);
+                        }
+                        objects[obj_counter].camera.fov = temp;
+                    }
+                    else if (strcmp(key, "look_at") == 0) {
+                        if (obj_type != CAMERA) {
+                            fprintf(stderr, "Error: read_json: Look_at cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        objects[obj_counter].camera.look_at = next_vector(json);
+                    }
+                    else if (strcmp(key, "up") == 0) {
+                        if (obj_type != CAMERA) {
+                            fprintf(stderr, "Error: read_json: Up cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        objects[obj_counter].camera.up = next_vector(json);
+                    }
                     else if (strcmp(key, "radius") == 0) {
                         if (obj_type != SPHERE) {
                             fprintf(stderr, "Error: read_json: Radius cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double temp = next_number(json);
+                        real temp = next_number(json);
                         if (temp <= 0) {
                             fprintf(stderr, "Error: read_json: radius must be positive: %d\n", line);
                             exit(1);
                         }
                         objects[obj_counter].sphere.radius = temp;
                     }
+                    else if (strcmp(key, "file") == 0) {
+                        if (obj_type != MESH) {
+                            fprintf(stderr, "Error: read_json: File cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        objects[obj_counter].mesh.file = scene_relative(path, parse_string(json));
+                    }
+                    else if (strcmp(key, "scale") == 0) {
+                        if (obj_type != MESH && obj_type != INSTANCE) {
+                            fprintf(stderr, "Error: read_json: Scale cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        real temp = next_number(json);
+                        if (temp <= 0) {
+                            fprintf(stderr, "Error: read_json: scale must be positive: %d\n", line);
+                            exit(1);
+                        }
+                        if (obj_type == MESH)
+                            objects[obj_counter].mesh.scale = temp;
+                        else
+                            objects[obj_counter].instance.scale = temp;
+                    }
+                    else if (strcmp(key, "group") == 0) {
+                        if (obj_type == SPHERE || obj_type == MESH)
+                            objects[obj_counter].group = parse_string(json);
+                        else if (obj_type == INSTANCE)
+                            objects[obj_counter].instance.group = parse_string(json);
+                        else {
+                            fprintf(stderr, "Error: read_json: Group cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                    }
+                    else if (strcmp(key, "rotation") == 0) {
+                        if (obj_type != INSTANCE) {
+                            fprintf(stderr, "Error: read_json: Rotation cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        objects[obj_counter].instance.rotation = next_vector(json);
+                    }
                     else if (strcmp(key, "theta") == 0) {
                         if (obj_type != LIGHT) {
                             fprintf(stderr, "Error: read_json: Theta cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double theta = next_number(json);
+                        real theta = next_number(json);
                         if (theta > 0.0) {
                             lights[light_counter].type = SPOTLIGHT;
                         }
@@ -315,7 +538,7 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: Radial-a0 cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double rad_a = next_number(json);
+                        real rad_a = next_number(json);
                         if (rad_a < 0) {
                             fprintf(stderr, "Error: read_json: radial-a0 must be positive: %d\n", line);
                             exit(1);
@@ -327,7 +550,7 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: Radial-a1 cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double rad_a = next_number(json);
+                        real rad_a = next_number(json);
                         if (rad_a < 0) {
                             fprintf(stderr, "Error: read_json: radial-a1 must be positive: %d\n", line);
                             exit(1);
@@ -339,7 +562,7 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: Radial-a2 cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double rad_a = next_number(json);
+                        real rad_a = next_number(json);
                         if (rad_a < 0) {
                             fprintf(stderr, "Error: read_json: radial-a2 must be positive: %d\n", line);
                             exit(1);
@@ -351,7 +574,7 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: Angular-a0 cannot be set on this type: %d\n", line);
                             exit(1);
                         }
-                        double ang_a = next_number(json);
+                        real ang_a = next_number(json);
                         if (ang_a < 0) {
                             fprintf(stderr, "Error: read_json: angular-a0 must be positive: %d\n", line);
                             exit(1);
@@ -378,6 +601,8 @@ void read_json(FILE *json) {
                             objects[obj_counter].sphere.spec_color = next_color(json, true);
                         else if (obj_type == PLANE)
                             objects[obj_counter].plane.spec_color = next_color(json, true);
+                        else if (obj_type == MESH)
+                            objects[obj_counter].mesh.spec_color = next_color(json, true);
                         else {
                             fprintf(stderr, "Error: read_json: speculaor_color vector can't be applied here: %d\n", line);
                             exit(1);
@@ -388,6 +613,8 @@ void read_json(FILE *json) {
                             objects[obj_counter].sphere.diff_color = next_color(json, true);
                         else if (obj_type == PLANE)
                             objects[obj_counter].plane.diff_color = next_color(json, true);
+                        else if (obj_type == MESH)
+                            objects[obj_counter].mesh.diff_color = next_color(json, true);
                         else {
                             fprintf(stderr, "Error: read_json: diffuse_color vector can't be applied here: %d\n", line);
                             exit(1);
@@ -398,6 +625,12 @@ void read_json(FILE *json) {
                             objects[obj_counter].sphere.position = next_vector(json);
                         else if (obj_type == PLANE)
                             objects[obj_counter].plane.position = next_vector(json);
+                        else if (obj_type == MESH)
+                            objects[obj_counter].mesh.position = next_vector(json);
+                        else if (obj_type == INSTANCE)
+                            objects[obj_counter].instance.position = next_vector(json);
+                        else if (obj_type == CAMERA)
+                            objects[obj_counter].camera.position = next_vector(json);
                         else if (obj_type == LIGHT)
                             lights[light_counter].position = next_vector(json);
                         else {
@@ -405,12 +638,26 @@ void read_json(FILE *json) {
                             exit(1);
                         }
                     }
+                    else if (strcmp(key, "keys") == 0) {
+                        // only what animate_scene() moves can have keys
+                        if (obj_type != SPHERE && obj_type != PLANE && obj_type != MESH && obj_type != INSTANCE &&
+                            obj_type != CAMERA && obj_type != LIGHT) {
+                            fprintf(stderr, "Error: read_json: Keys cannot be set on this type: %d\n", line);
+                            exit(1);
+                        }
+                        if (obj_type == LIGHT)
+                            lights[light_counter].keys = next_keys(json, &lights[light_counter].nkeys);
+                        else
+                            objects[obj_counter].keys = next_keys(json, &objects[obj_counter].nkeys);
+                    }
                     else if (strcmp(key, "reflectivity") == 0) {
                         has_reflect = true;
                         if (obj_type == SPHERE)
                             objects[obj_counter].sphere.reflect = next_number(json);
                         else if (obj_type == PLANE)
                             objects[obj_counter].plane.reflect = next_number(json);
+                        else if (obj_type == MESH)
+                            objects[obj_counter].mesh.reflect = next_number(json);
                         else {
                             fprintf(stderr, "Error: read_json: Reflectivity can't be applied here: %d\n", line);
                             exit(1);
@@ -422,6 +669,8 @@ void read_json(FILE *json) {
                             objects[obj_counter].sphere.refract = next_number(json);
                         else if (obj_type == PLANE)
                             objects[obj_counter].plane.refract = next_number(json);
+                        else if (obj_type == MESH)
+                            objects[obj_counter].mesh.refract = next_number(json);
                         else {
                             fprintf(stderr, "Error: read_json: Refractivity can't be applied here: %d\n", line);
                             exit(1);
@@ -433,11 +682,89 @@ void read_json(FILE *json) {
                             objects[obj_counter].sphere.ior = next_number(json);
                         else if (obj_type == PLANE)
                             objects[obj_counter].plane.ior = next_number(json);
+                        else if (obj_type == MESH)
+                            objects[obj_counter].mesh.ior = next_number(json);
                         else {
                             fprintf(stderr, "Error: read_json: ior can't be applied here: %d\n", line);
                             exit(1);
                         }
                     }
+                    else if (strcmp(key, "preset") == 0 || strcmp(key, "depth") == 0 ||
+                             strcmp(key, "samples") == 0 || strcmp(key, "min_weight") == 0 ||
+                             strcmp(key, "shadows") == 0 || strcmp(key, "shininess") == 0 ||
+                             strcmp(key, "ray_epsilon") == 0 || strcmp(key, "background_color") == 0) {
+                        if (obj_type != RENDER) {
+                            fprintf(stderr, "Error: read_json: '%s' can only be set on a render object: %d\n", key,
+                                    line);
+                            exit(1);
+                        }
+                        RenderSettings *settings = &scene_settings;
+                        if (strcmp(key, "preset") == 0) {
+                            char *name = parse_string(json);
+                            RenderSettings scratch = {0};
+                            if (!settings_preset(&scratch, name)) {
+                                fprintf(stderr, "Error: read_json: preset must be preview, draft or final: %d\n",
+                                        line);
+                                exit(1);
+                            }
+                            settings->preset = scratch.preset;
+                        }
+                        else if (strcmp(key, "shadows") == 0) {
+                            settings->shadows = next_boolean(json);
+                            settings->given |= SETTING_SHADOWS;
+                        }
+                        else if (strcmp(key, "background_color") == 0) {
+                            memcpy(settings->background, next_color(json, false), sizeof(settings->background));
+                            settings->given |= SETTING_BACKGROUND;
+                        }
+                        else {
+                            double temp = next_number(json);
+                            if (strcmp(key, "depth") == 0) {
+                                if (temp < 0 || temp != (int)temp) {
+                                    fprintf(stderr, "Error: read_json: depth must be a whole number >= 0: %d\n",
+                                            line);
+                                    exit(1);
+                                }
+                                settings->max_depth = (int)temp;
+                                settings->given |= SETTING_DEPTH;
+                            }
+                            else if (strcmp(key, "samples") == 0) {
+                                if (temp < 1 || temp != (int)temp) {
+                                    fprintf(stderr, "Error: read_json: samples must be a whole number > 0: %d\n",
+                                            line);
+                                    exit(1);
+                                }
+                                settings->samples = (int)temp;
+                                settings->given |= SETTING_SAMPLES;
+                            }
+                            else if (strcmp(key, "min_weight") == 0) {
+                                if (temp < 0 || temp >= 1) {
+                                    fprintf(stderr, "Error: read_json: min_weight must be from 0 up to 1: %d\n",
+                                            line);
+                                    exit(1);
+                                }
+                                settings->min_weight = temp;
+                                settings->given |= SETTING_MIN_WEIGHT;
+                            }
+                            else if (strcmp(key, "shininess") == 0) {
+                                if (temp < 1 || temp != (int)temp) {
+                                    fprintf(stderr, "Error: read_json: shininess must be a whole number > 0: %d\n",
+                                            line);
+                                    exit(1);
+                                }
+                                settings->shininess = (int)temp;
+                                settings->given |= SETTING_SHININESS;
+                            }
+                            else {
+                                if (temp <= 0) {
+                                    fprintf(stderr, "Error: read_json: ray_epsilon must be positive: %d\n", line);
+                                    exit(1);
+                                }
+                                settings->ray_epsilon = temp;
+                                settings->given |= SETTING_RAY_EPSILON;
+                            }
+                        }
+                    }
                     else if (strcmp(key, "normal") == 0) {
                         if (obj_type != PLANE) {
                             fprintf(stderr, "Error: read_json: Normal vector can't be applied here: %d\n", line);
@@ -471,7 +798,10 @@ void read_json(FILE *json) {
                 exit(1);
             }
         }
-        if (obj_type == LIGHT) {
+        if (obj_type == RENDER) {
+            // nothing to check, every field of it was checked as it was read
+        }
+        else if (obj_type == LIGHT) {
             if (lights[light_counter].type == SPOTLIGHT) {
                 if (lights[light_counter].direction == NULL) {
                     fprintf(stderr, "Error: read_json: 'spotlight' light type must have a direction: %d\n", line);
@@ -485,7 +815,7 @@ void read_json(FILE *json) {
             light_counter++;
         }
         else {
-            if (obj_type == SPHERE || obj_type == PLANE) {
+            if (obj_type == SPHERE || obj_type == PLANE || obj_type == MESH) {
                 if (objects[obj_counter].sphere.spec_color == NULL) {
                     fprintf(stderr, "Error: read_json: object must have a specular color: %d\n", line);
                     exit(1);
@@ -526,18 +856,64 @@ void read_json(FILE *json) {
                         exit(1);
                     }
                 }
+                else if (obj_type == MESH) {
+                    Mesh *mesh = &objects[obj_counter].mesh;
+                    if (mesh->file == NULL) {
+                        fprintf(stderr, "Error: read_json: mesh must have a file: %d\n", line);
+                        exit(1);
+                    }
+                    if (!has_refract) {
+                        mesh->refract = 0.0;
+                    }
+                    if (!has_reflect) {
+                        mesh->reflect = 0.0;
+                    }
+                    if (!has_ior) {
+                        mesh->ior = 1.0;
+                    }
+                    if (mesh->scale == 0) {
+                        mesh->scale = 1.0;
+                    }
+                    if (mesh->refract + mesh->reflect > 1.0) {
+                        fprintf(stderr, "Error: read_json: The sum of reflectivity and refractivity cannot be greater than 1: %d\n", line);
+                        exit(1);
+                    }
+                }
+            }
+            if (obj_type == INSTANCE) {
+                Instance *instance = &objects[obj_counter].instance;
+                if (instance->group == NULL) {
+                    fprintf(stderr, "Error: read_json: instance must have a group: %d\n", line);
+                    exit(1);
+                }
+                if (instance->scale == 0) {
+                    instance->scale = 1.0;
+                }
             }
             if (obj_type == CAMERA) {
-                if (objects[obj_counter].camera.width == 0) {
+                Camera *camera = &objects[obj_counter].camera;
+                if (camera->fov != 0 && (camera->width != 0 || camera->height != 0)) {
+                    fprintf(stderr, "Error: read_json: camera can't have both a fov and a width or height: %d\n", line);
+                    exit(1);
+                }
+                if (camera->fov == 0 && camera->width == 0) {
                     fprintf(stderr, "Error: read_json: camera must have a width: %d\n", line);
                     exit(1);
                 }
-                if (objects[obj_counter].camera.height == 0) {
+                if (camera->fov == 0 && camera->height == 0) {
                     fprintf(stderr, "Error: read_json: camera must have a height: %d\n", line);
                     exit(1);
                 }
             }
-            obj_counter++;
+            if (objects[obj_counter].group != NULL && objects[obj_counter].keys != NULL) {
+                fprintf(stderr, "Error: read_json: grouped objects can't have keys, key an instance of the group: %d\n",
+                        line);
+                exit(1);
+            }
+            if (objects[obj_counter].group != NULL)
+                group_object(&objects[obj_counter]);
+            else
+                obj_counter++;
         }
         if (not_done)
             c = next_c(json);
@@ -551,24 +927,103 @@ void read_json(FILE *json) {
  * initializes list of objects to be empty for each element
  */
 void init_objects() {
-    memset(objects, '\0', sizeof(objects));
+    grow_objects(MAX_OBJECTS);
+    memset(objects, '\0', sizeof(object) * objects_capacity);
+    memset(&scene_settings, '\0', sizeof(RenderSettings));
+}
+
+/**
+ * Makes sure there is room for at least n objects and the zeroed one that ends the list. New objects are zeroed like
+ * the ones from init_objects()
+ * @param n - number of objects needed
+ */
+void grow_objects(int n) {
+    if (n < objects_capacity)
+        return;
+    int capacity = objects_capacity > 0 ? objects_capacity : MAX_OBJECTS;
+    while (capacity <= n)
+        capacity *= 2;
+    objects = realloc(objects, sizeof(object) * capacity);
+    if (objects == NULL) {
+        fprintf(stderr, "Error: grow_objects: Failed to allocate %d objects\n", capacity);
+        exit(1);
+    }
+    memset(&objects[objects_capacity], '\0', sizeof(object) * (capacity - objects_capacity));
+    objects_capacity = capacity;
 }
 
 /**
  * initializes list of lights to be empty for each element
  */
 void init_lights() {
-    memset(lights, '\0', sizeof(lights));
+    grow_lights(MAX_OBJECTS);
+    memset(lights, '\0', sizeof(Light) * lights_capacity);
+}
+
+/**
+ * Makes sure there is room for at least n lights. New lights are zeroed like the ones from init_lights()
+ * @param n - number of lights needed
+ */
+void grow_lights(int n) {
+    if (n <= lights_capacity)
+        return;
+    int capacity = lights_capacity > 0 ? lights_capacity : MAX_OBJECTS;
+    while (capacity < n)
+        capacity *= 2;
+    lights = realloc(lights, sizeof(Light) * capacity);
+    if (lights == NULL) {
+        fprintf(stderr, "Error: grow_lights: Failed to allocate %d lights\n", capacity);
+        exit(1);
+    }
+    memset(&lights[lights_capacity], '\0', sizeof(Light) * (capacity - lights_capacity));
+    lights_capacity = capacity;
+}
+
+/**
+ * Takes the scene that was read away from the globals, leaving them empty for read_json() to fill again
+ * @param copy - set to the scene, to be freed with scene_copy_free()
+ */
+void scene_detach(SceneCopy *copy) {
+    copy->objects = objects;
+    copy->nobjects = nobjects;
+    copy->lights = lights;
+    copy->nlights = nlights;
+    copy->grouped_objects = grouped_objects;
+    copy->ngrouped_objects = ngrouped_objects;
+    copy->arena = scene_arena;
+    objects = NULL;
+    objects_capacity = 0;
+    nobjects = 0;
+    lights = NULL;
+    lights_capacity = 0;
+    nlights = 0;
+    grouped_objects = NULL;
+    grouped_objects_capacity = 0;
+    ngrouped_objects = 0;
+    memset(&scene_arena, '\0', sizeof(Arena));
+    line = 1;
+}
+
+/**
+ * Frees a scene set aside by scene_detach()
+ */
+void scene_copy_free(SceneCopy *copy) {
+    free(copy->objects);
+    free(copy->lights);
+    free(copy->grouped_objects);
+    arena_free(&copy->arena);
+    memset(copy, '\0', sizeof(SceneCopy));
 }
 
 /* testing/debug functions */
 void print_objects(object *obj) {
     int i = 0;
-    while (i < MAX_OBJECTS && obj[i].type > 0) {
+    while (obj[i].type > 0) {
         printf("object type: %d\n", obj[i].type);
         if (obj[i].type == CAMERA) {
             printf("height: %lf\n", obj[i].camera.height);
             printf("width: %lf\n", obj[i].camera.width);
+            printf("fov: %lf\n", obj[i].camera.fov);
         }
             // TODO: add printing of diffuse colors as well
         else if (obj[i].type == SPHERE) {
@@ -591,6 +1046,14 @@ void print_objects(object *obj) {
                    obj[i].plane.normal[1],
                    obj[i].plane.normal[2]);
         }
+        else if (obj[i].type == MESH) {
+            printf("file: %s\n", obj[i].mesh.file);
+            printf("scale: %lf\n", obj[i].mesh.scale);
+        }
+        else if (obj[i].type == INSTANCE) {
+            printf("group: %s\n", obj[i].instance.group);
+            printf("scale: %lf\n", obj[i].instance.scale);
+        }
         else {
             printf("unsupported value\n");
         }
@@ -0,0 +1,336 @@
+/* lighttree.c - a bounding volume hierarchy over the lights, with a bounding box and a cone of emission directions
+ * for every node. Shading points use it either to skip whole groups of lights that are too far away or point the
+ * wrong way, or to importance sample a fixed number of lights, which keeps the cost per shading point roughly
+ * constant no matter how many lights there are */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../include/lighttree.h"
+#include "../include/raytracer.h"
+#include "../include/illumination.h"
+
+/* the tree and the light indices in the order its leaves cover them */
+static LightNode *nodes = NULL;
+static int nnodes = 0;
+static int *light_order = NULL;
+
+/* per-thread random state and scratch space for select_lights() */
+static __thread uint64_t rng_state = 1;
+static __thread LightChoice *choices_buf = NULL;
+static __thread int choices_cap = 0;
+
+/**
+ * Sets the random state used for sampling lights. Seeding per pixel keeps renders repeatable across thread counts
+ */
+void light_tree_seed(uint64_t seed) {
+    rng_state = seed * 0x9E3779B97F4A7C15ull + 0x632BE59BD9B4E019ull;
+    if (rng_state == 0)
+        rng_state = 1;
+}
+
+static real light_random() {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (real)((rng_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static real brightest_channel(Light *light) {
+    real b = light->color[0];
+    if (light->color[1] > b) b = light->color[1];
+    if (light->color[2] > b) b = light->color[2];
+    return b;
+}
+
+/**
+ * Grows cone a (axis, half angle) to also cover cone b
+ */
+static void cone_union(real axis_a[3], real *theta_a, real axis_b[3], real theta_b) {
+    if (*theta_a >= M_PI)
+        return;
+    if (theta_b >= M_PI) {
+        *theta_a = M_PI;
+        return;
+    }
+    real between = acos(fmax(-1.0, fmin(1.0, v3_dot(axis_a, axis_b))));
+    if (fmin(between + theta_b, M_PI) <= *theta_a)
+        return;     // b is already inside of a
+    if (fmin(between + *theta_a, M_PI) <= theta_b) {
+        v3_copy(axis_b, axis_a);
+        *theta_a = theta_b;
+        return;
+    }
+    real theta = (*theta_a + between + theta_b) / 2;
+    if (theta >= M_PI) {
+        *theta_a = M_PI;
+        return;
+    }
+    // rotate axis a towards axis b by (theta - theta_a)
+    real rot = theta - *theta_a;
+    real perp[3];
+    v3_scale(axis_a, v3_dot(axis_a, axis_b), perp);
+    v3_sub(axis_b, perp, perp);
+    real len = v3_len(perp);
+    if (len < 1e-12) {
+        *theta_a = M_PI;
+        return;
+    }
+    v3_scale(perp, 1.0 / len, perp);
+    for (int k = 0; k < 3; k++)
+        axis_a[k] = axis_a[k] * cos(rot) + perp[k] * sin(rot);
+    normalize(axis_a);
+    *theta_a = theta;
+}
+
+/**
+ * Fills in the bounds of a node from the lights it covers
+ */
+static void node_bounds(LightNode *node) {
+    for (int k = 0; k < 3; k++) {
+        node->lo[k] = INFINITY;
+        node->hi[k] = -INFINITY;
+    }
+    node->power = 0;
+    node->max_power = 0;
+    node->theta_o = -1;     // empty cone until the first light
+    node->theta_e = 0;
+    node->min_a0 = node->min_a1 = node->min_a2 = INFINITY;
+    for (int i = node->first; i < node->first + node->count; i++) {
+        Light *light = &lights[light_order[i]];
+        for (int k = 0; k < 3; k++) {
+            node->lo[k] = fmin(node->lo[k], light->position[k]);
+            node->hi[k] = fmax(node->hi[k], light->position[k]);
+        }
+        node->power += brightest_channel(light);
+        node->max_power = fmax(node->max_power, brightest_channel(light));
+        node->min_a0 = fmin(node->min_a0, light->ang_att0);   // constant term calculate_radial_att() uses
+        node->min_a1 = fmin(node->min_a1, light->rad_att1);
+        node->min_a2 = fmin(node->min_a2, light->rad_att2);
+
+        real axis[3] = {0, 0, 1};
+        real theta = M_PI;
+        if (light->type == SPOTLIGHT) {
+            v3_copy(light->direction, axis);
+            theta = 0;
+            node->theta_e = fmax(node->theta_e, acos(light->cos_theta));
+        }
+        if (node->theta_o < 0) {
+            v3_copy(axis, node->axis);
+            node->theta_o = theta;
+        }
+        else {
+            cone_union(node->axis, &node->theta_o, axis, theta);
+        }
+    }
+}
+
+/* axis used by the sort comparator, qsort has no context argument */
+static int sort_axis;
+
+static int compare_lights(const void *a, const void *b) {
+    real pa = lights[*(const int*)a].position[sort_axis];
+    real pb = lights[*(const int*)b].position[sort_axis];
+    return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Builds the subtree over light_order[first .. first+count) by splitting at the median of the longest axis
+ * @return - index of the subtree's root node
+ */
+static int build_node(int first, int count) {
+    int index = nnodes++;
+    LightNode *node = &nodes[index];
+    node->first = first;
+    node->count = count;
+    node->left = node->right = -1;
+    node_bounds(node);
+    if (count == 1)
+        return index;
+
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (node->hi[k] - node->lo[k] > node->hi[axis] - node->lo[axis])
+            axis = k;
+    }
+    sort_axis = axis;
+    qsort(&light_order[first], count, sizeof(int), compare_lights);
+    int half = count / 2;
+    int left = build_node(first, half);
+    int right = build_node(first + half, count - half);
+    nodes[index].left = left;   // nodes may have moved, don't hold on to node
+    nodes[index].right = right;
+    return index;
+}
+
+/**
+ * Builds the light tree over every light in the scene. Must run after prepare_scene() has normalized the spotlight
+ * directions and filled in the cone angles
+ */
+void light_tree_build() {
+    light_tree_free();
+    if (nlights == 0)
+        return;
+    nodes = malloc(sizeof(LightNode) * (2 * nlights - 1));
+    light_order = malloc(sizeof(int) * nlights);
+    for (int i = 0; i < nlights; i++)
+        light_order[i] = i;
+    build_node(0, nlights);
+}
+
+void light_tree_free() {
+    free(nodes);
+    free(light_order);
+    nodes = NULL;
+    light_order = NULL;
+    nnodes = 0;
+}
+
+/**
+ * Upper bound on the radial attenuation of any light in a node for a point at a given distance from its box
+ */
+static real node_attenuation(LightNode *node, real dist) {
+    real denom = node->min_a2 * sqr(dist) + node->min_a1 * dist + node->min_a0;
+    return denom > 0 ? 1.0 / denom : INFINITY;
+}
+
+/**
+ * Finds the smallest angle between the node's cone axis and the direction from any of its lights to a point, minus
+ * the cone's half angle. Zero means the point may be right in front of a light
+ * @param dist_center - distance from the box center to the point
+ * @param radius - radius of the sphere around the box
+ * @param to_point - direction from the box center to the point, normalized
+ */
+static real node_cone_angle(LightNode *node, real dist_center, real radius, real to_point[3]) {
+    if (node->theta_o >= M_PI || dist_center <= radius)
+        return 0;
+    real theta = acos(fmax(-1.0, fmin(1.0, v3_dot(node->axis, to_point))));
+    real theta_u = asin(radius / dist_center);
+    return fmax(0.0, theta - node->theta_o - theta_u);
+}
+
+/**
+ * Estimates how much a node's lights can contribute at a point
+ * @param node - tree node
+ * @param position - shading point
+ * @param bound - if true an upper bound on what any single light of the node adds is returned, since culling is
+ * decided light by light. Otherwise a smoother estimate of the whole node's contribution is returned for sampling
+ */
+static real node_importance(LightNode *node, real position[3], boolean bound) {
+    real center[3], half[3], to_point[3];
+    real dist_box_sqr = 0;
+    for (int k = 0; k < 3; k++) {
+        center[k] = (node->lo[k] + node->hi[k]) / 2;
+        half[k] = (node->hi[k] - node->lo[k]) / 2;
+        real d = fabs(position[k] - center[k]) - half[k];
+        if (d > 0)
+            dist_box_sqr += sqr(d);
+    }
+    v3_sub(position, center, to_point);
+    real dist_center = v3_len(to_point);
+    real radius = v3_len(half);
+    if (dist_center > 0)
+        v3_scale(to_point, 1.0 / dist_center, to_point);
+
+    real angle = node_cone_angle(node, dist_center, radius, to_point);
+    if (angle >= node->theta_e && node->theta_o < M_PI)
+        return 0;   // the point is outside of every spotlight's cone
+
+    if (bound)
+        return 2.0 * node->max_power * node_attenuation(node, sqrt(dist_box_sqr));
+    // for sampling use the distance to the center, but never closer than the node's own size
+    real cone = node->theta_o < M_PI ? cos(angle) : 1.0;
+    return node->power * cone * node_attenuation(node, fmax(dist_center, radius));
+}
+
+static LightChoice *push_choice(int *n) {
+    if (*n == choices_cap) {
+        choices_cap = choices_cap ? choices_cap * 2 : 64;
+        choices_buf = realloc(choices_buf, sizeof(LightChoice) * choices_cap);
+    }
+    return &choices_buf[(*n)++];
+}
+
+/**
+ * Walks the tree and keeps every light whose subtree might contribute at least the light threshold at the point
+ */
+static void collect_significant(int index, real position[3], int *n) {
+    LightNode *node = &nodes[index];
+    real bound = node_importance(node, position, true);
+    if (bound == 0 || bound < render_options.light_threshold) {
+        counters.lights_considered += node->count;
+        counters.lights_culled += node->count;
+        return;
+    }
+    if (node->left < 0) {
+        LightChoice *choice = push_choice(n);
+        choice->light = light_order[node->first];
+        choice->weight = 1;
+        return;
+    }
+    collect_significant(node->left, position, n);
+    collect_significant(node->right, position, n);
+}
+
+/**
+ * Picks one light by walking down the tree, choosing each child in proportion to its importance
+ * @param position - shading point
+ * @param pdf - probability the returned light was picked with
+ * @return - index of the light, -1 if no light can reach the point
+ */
+static int sample_light(real position[3], real *pdf) {
+    int index = 0;
+    *pdf = 1;
+    if (node_importance(&nodes[0], position, false) <= 0)
+        return -1;
+    while (nodes[index].left >= 0) {
+        real il = node_importance(&nodes[nodes[index].left], position, false);
+        real ir = node_importance(&nodes[nodes[index].right], position, false);
+        if (il + ir <= 0 || isnan(il + ir))
+            return -1;
+        real pl = isinf(il) ? (isinf(ir) ? 0.5 : 1.0) : (isinf(ir) ? 0.0 : il / (il + ir));
+        if (light_random() < pl) {
+            *pdf *= pl;
+            index = nodes[index].left;
+        }
+        else {
+            *pdf *= 1 - pl;
+            index = nodes[index].right;
+        }
+    }
+    return light_order[nodes[index].first];
+}
+
+/**
+ * Chooses the lights to evaluate at a shading point according to render_options.light_mode. Every light is still
+ * checked with light_reaches() before a shadow ray is cast towards it
+ * @param position - shading point
+ * @param choices - set to a per-thread array of lights and weights, valid until the next call, or to NULL when every
+ * light is evaluated with weight 1, in which case choice c is simply light c
+ * @return - number of choices
+ */
+int select_lights(real position[3], LightChoice **choices) {
+    if (render_options.light_mode == LIGHTS_ALL || nodes == NULL) {
+        *choices = NULL;
+        return nlights;
+    }
+    int n = 0;
+    if (render_options.light_mode == LIGHTS_SIGNIFICANT) {
+        collect_significant(0, position, &n);
+    }
+    else {
+        int samples = render_options.light_samples;
+        for (int s = 0; s < samples; s++) {
+            real pdf;
+            int light = sample_light(position, &pdf);
+            if (light < 0)
+                break;
+            LightChoice *choice = push_choice(&n);
+            choice->light = light;
+            choice->weight = 1.0 / (samples * pdf);
+        }
+    }
+    *choices = choices_buf;
+    return n;
+}
@@ -12,24 +12,653 @@
 #include "../include/raytracer.h"
 #include "../include/ppmrw.h"
 #include "../include/base.h"
+#include "../include/tiles.h"
+#include "../include/lighttree.h"
+#include "../include/arena.h"
+#include "../include/grid.h"
+#include "../include/mesh.h"
+#include "../include/instance.h"
+#include "../include/animation.h"
+#include "../include/watch.h"
+#include "../include/tilecache.h"
+#include "../include/gbuffer.h"
+#include "../include/denoise.h"
+#include "../include/checkpoint.h"
+#include "../include/settings.h"
+#include "../include/illumination.h"
+
+/**
+ * Prints how to run the program along with the supported options
+ */
+void usage() {
+    fprintf(stderr, "Usage: raytrace [options] width height input.json output.ppm\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --cost-map FILE      write a false color per-pixel cost map to FILE and raw costs to FILE.raw\n");
+    fprintf(stderr, "  --preset NAME        start from the preview, draft or final settings, in place of the scene's\n");
+    fprintf(stderr, "  --depth N            follow reflections and refractions N bounces deep (default %d)\n",
+            MAX_REC_LEVEL);
+    fprintf(stderr, "  --samples N          adaptive anti-aliasing with at most N samples per pixel\n");
+    fprintf(stderr, "  --min-weight W       don't trace reflections and refractions adding less than W to a pixel\n"
+                    "                       (default 0, trace them all)\n");
+    fprintf(stderr, "  --shadows on|off     whether shadow rays are cast (default on)\n");
+    fprintf(stderr, "  --shininess N        specular exponent of every surface (default %d)\n", SHININESS);
+    fprintf(stderr, "  --ray-epsilon E      distance secondary rays start away from their surface (default %g)\n",
+            (double)RAY_EPSILON);
+    fprintf(stderr, "  --background R,G,B   color of rays that hit nothing (default 0,0,0)\n");
+    fprintf(stderr, "  --min-samples N      stratified samples per pixel before adapting (default 4)\n");
+    fprintf(stderr, "  --variance T         keep sampling a pixel while its color variance is above T (default 0.0001)\n");
+    fprintf(stderr, "  --threads N          render with N threads (default: one per processor)\n");
+    fprintf(stderr, "  --pin-threads        keep each thread on one processor and each band of the image on one NUMA\n"
+                    "                       node's threads, with its memory first written by them\n");
+    fprintf(stderr, "  --replicate-scene    with --pin-threads, give each NUMA node its own copy of the grid and lights\n");
+    fprintf(stderr, "  --time-budget MS     render progressively and write the best image available after MS milliseconds\n");
+    fprintf(stderr, "  --batch-rays         shade a tile at a time breadth first, batching secondary and shadow rays\n");
+    fprintf(stderr, "  --sort-rays          like --batch-rays, sorting the batched rays for coherence\n");
+    fprintf(stderr, "  --light-threshold T  skip lights contributing less than T at a point (default 1/512, 0 keeps all)\n");
+    fprintf(stderr, "  --light-tree         skip whole groups of lights too dim to matter using a light hierarchy\n");
+    fprintf(stderr, "  --light-samples N    shade each point with N lights importance sampled from the light hierarchy\n");
+    fprintf(stderr, "  --accel NAME         how rays find what they hit: linear (test every object, the default) or grid\n");
+    fprintf(stderr, "  --view N             only render the Nth camera, counting from 0 (default: every camera, each to\n"
+                    "                       its own file with _N added to the output name)\n");
+    fprintf(stderr, "  --frames A..B        render frames A to B of the scene's position keys, each to its own file with\n"
+                    "                       _NNNN added to the output name, or as raw RGB frames to stdout if the output\n"
+                    "                       is -\n");
+    fprintf(stderr, "  --watch              keep running and render again each time the scene file is saved, tracing\n"
+                    "                       only the tiles the edit can have changed\n");
+    fprintf(stderr, "  --cache DIR          keep rendered tiles in DIR and reuse them in later runs of the same scene\n");
+    fprintf(stderr, "  --cache-size MB      remove the least recently used tiles once DIR is over MB megabytes (default\n"
+                    "                       %d)\n", TILE_CACHE_MB);
+    fprintf(stderr, "  --exposure EV        scale the image's colors by 2^EV before they are quantized (default 0)\n");
+    fprintf(stderr, "  --tonemap NAME       how colors are fit into the image: clamp (cut off at 1, the default) or\n"
+                    "                       reinhard (roll off bright colors)\n");
+    fprintf(stderr, "  --pfm FILE           also write the image's linear colors to FILE as a PFM, before exposure and\n"
+                    "                       tone mapping\n");
+    fprintf(stderr, "  --denoise            smooth out sampling noise with an edge-avoiding filter guided by each pixel's\n"
+                    "                       normal, depth and albedo\n");
+    fprintf(stderr, "  --denoise-passes N   denoise with N filter passes, each reaching twice as far (default %d)\n",
+            DENOISE_PASSES);
+    fprintf(stderr, "  --denoise-sigma S    luminance difference, in multiples of the local noise, the denoiser starts\n"
+                    "                       treating as an edge (default %g)\n", DENOISE_SIGMA_COLOR);
+    fprintf(stderr, "  --reference FILE     print the PSNR and max difference of each image against the ppm FILE\n");
+    fprintf(stderr, "  --gbuffer FILE       also save each pixel's first hit and shadow rays to FILE, for --relight\n");
+    fprintf(stderr, "  --relight FILE       render the scene again from a G-buffer saved by --gbuffer, only shading the\n"
+                    "                       direct light again and only casting shadow rays to lights that have moved\n");
+    fprintf(stderr, "  --checkpoint FILE    save the finished tiles of each view to FILE as it renders, and when stopped\n"
+                    "                       by SIGTERM or SIGINT\n");
+    fprintf(stderr, "  --checkpoint-every S save a checkpoint every S seconds (default %d)\n", CHECKPOINT_SECONDS);
+    fprintf(stderr, "  --resume             pick up from the --checkpoint files of a render that was stopped\n");
+    fprintf(stderr, "  --stats              print render statistics to stderr\n");
+}
+
+/**
+ * Gets the value that follows an option on the command line
+ * @param argc - number of arguments
+ * @param argv - the arguments
+ * @param i - index of the option, moved onto its value
+ * @return - the option's value
+ */
+char *option_value(int argc, char *argv[], int *i) {
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: main: %s requires a value\n", argv[*i]);
+        exit(1);
+    }
+    (*i)++;
+    return argv[*i];
+}
+
+/**
+ * Gets the positive integer value that follows an option on the command line
+ */
+int option_int(int argc, char *argv[], int *i) {
+    char *opt = argv[*i];
+    int val = atoi(option_value(argc, argv, i));
+    if (val <= 0) {
+        fprintf(stderr, "Error: main: %s must be > 0\n", opt);
+        exit(1);
+    }
+    return val;
+}
+
+/**
+ * Finds the file a view of a frame is written to. With several views the view number goes before the extension, and
+ * with frames the frame number goes after it, so out.ppm becomes out_0.ppm or out_0012.ppm or out_0_0012.ppm
+ * @param path - file name given on the command line
+ * @param view - number of the view
+ * @param several - whether more than one view is being written
+ * @param frame - number of the frame, or -1 if there are no frames
+ * @return - the file name, to be freed by the caller
+ */
+char *output_path(const char *path, int view, boolean several, int frame) {
+    char *result = malloc(strlen(path) + 32);
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    int stem = dot != NULL && (slash == NULL || dot > slash) ? (int)(dot - path) : (int)strlen(path);
+    int n = sprintf(result, "%.*s", stem, path);
+    if (several)
+        n += sprintf(result + n, "_%d", view);
+    if (frame >= 0)
+        n += sprintf(result + n, "_%04d", frame);
+    strcpy(result + n, path + stem);
+    return result;
+}
+
+/**
+ * Finds the cameras of the scene, each of which is a view
+ * @param cameras - set to the index of each camera in objects, room for nobjects
+ * @return - number of cameras
+ */
+int find_cameras(int *cameras) {
+    int ncameras = 0;
+    for (int i = 0; i < nobjects; i++) {
+        if (objects[i].type == CAMERA)
+            cameras[ncameras++] = i;
+    }
+    return ncameras;
+}
+
+/* what is done to each view once it is rendered, set from the command line */
+static int denoise_passes = 0;                      // 0 leaves the image as it was rendered
+static double denoise_sigma = DENOISE_SIGMA_COLOR;
+static image reference = {NULL};                    // image to compare each view with, pixmap NULL for none
+
+/* images passed through resolve_image() and the seconds it and the denoiser took, for --stats */
+static int resolved_images = 0;
+static double resolve_seconds = 0;
+static double denoise_seconds = 0;
+
+/**
+ * Finds how close an image is to the reference image
+ * @param img - the resolved image
+ * @param max_diff - set to the largest difference of any 8 bit color channel
+ * @return - peak signal to noise ratio of its 8 bit colors in dB, INFINITY if they are the same
+ */
+double reference_psnr(image *img, int *max_diff) {
+    size_t n = (size_t)3 * img->width * img->height;
+    unsigned char *a = (unsigned char *)img->pixmap, *b = (unsigned char *)reference.pixmap;
+    double sum = 0;
+    *max_diff = 0;
+    for (size_t k = 0; k < n; k++) {
+        int d = abs(a[k] - b[k]);
+        if (d > *max_diff)
+            *max_diff = d;
+        sum += d * d;
+    }
+    return sum > 0 ? 10 * log10(255.0 * 255.0 * n / sum) : INFINITY;
+}
+
+/**
+ * Resolves an image and writes it out, along with its linear colors if they were asked for
+ * @param img - the rendered image
+ * @param path - file to write it to, or NULL to write the bare pixels to stdout
+ * @param pfm_path - file to write the linear colors to as a PFM, or NULL
+ */
+void write_image(image *img, char *path, char *pfm_path) {
+    double start_time = wall_seconds();
+    resolve_image(img);
+    resolve_seconds += wall_seconds() - start_time;
+    resolved_images++;
+
+    if (pfm_path != NULL) {
+        FILE *pfm = fopen(pfm_path, "wb");
+        if (pfm == NULL || write_pfm(pfm, img) < 0 || fclose(pfm) != 0) {
+            fprintf(stderr, "Error: main: Failed to write PFM file '%s'\n", pfm_path);
+            exit(1);
+        }
+    }
+
+    /* create output file and write image data, or hand the bare pixels to whatever reads stdout */
+    if (path == NULL) {
+        write_p6_data(stdout, img);
+        fflush(stdout);
+        return;
+    }
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", path);
+        exit(1);
+    }
+    create_ppm(out, 6, img);
+    fclose(out);
+}
+
+/**
+ * Denoises the image of one view if that was asked for, resolves it and writes it out, along with its linear colors
+ * if they were asked for. The denoised colors go into a copy, so img keeps the colors that were rendered
+ * @param img - the rendered image
+ * @param camera - camera the view is seen from
+ * @param path - file to write it to, or NULL to write the bare pixels to stdout
+ * @param pfm_path - file to write the linear colors to as a PFM, or NULL
+ */
+void write_view(image *img, Camera *camera, char *path, char *pfm_path) {
+    image denoised = *img;
+    if (denoise_passes > 0) {
+        double start_time = wall_seconds();
+        AuxBuffers aux;
+        aux_buffers_init(&aux, img->width, img->height);
+        raycast_aux(img, camera, &aux);
+        denoised.hdr = malloc(sizeof(float[3]) * img->width * img->height);
+        denoise_image(img->hdr, denoised.hdr, &aux, denoise_passes, denoise_sigma);
+        aux_buffers_free(&aux);
+        denoise_seconds += wall_seconds() - start_time;
+    }
+    write_image(&denoised, path, pfm_path);
+    if (denoised.hdr != img->hdr)
+        free(denoised.hdr);
+    if (reference.pixmap != NULL) {
+        int max_diff;
+        double psnr = reference_psnr(img, &max_diff);
+        fprintf(stderr, "psnr: %.2f dB against the reference, max difference %d\n", psnr, max_diff);
+    }
+}
+
+/**
+ * Renders one view, writing out its cost map if one was requested
+ * @param img - image to render into
+ * @param camera - camera the view is seen from
+ * @param cost_map_path - file to write the cost map to, or NULL for no cost map
+ * @param tiles - tiles to render, or NULL to render the whole image
+ * @param ntiles - number of tiles
+ * @param deps - if not NULL, one per tile, set to what the tile's rays touched, see watch.h
+ * @return - seconds spent rendering
+ */
+double render_view(image *img, Camera *camera, char *cost_map_path, Tile *tiles, int ntiles, TileDeps *deps) {
+    /* set up the per-pixel cost map if one was requested */
+    CostMap cost_map;
+    if (cost_map_path != NULL) {
+        cost_map_init(&cost_map, img->width, img->height);
+        render_options.cost_map = &cost_map;
+    }
+
+    /* fill the img->hdr with colors by raycasting the objects */
+    double start_time = wall_seconds();
+    if (render_options.time_budget > 0) {
+        double quality = raycast_progressive(img, camera, render_options.time_budget);
+        fprintf(stderr, "time budget: %.0f ms, %.1f%% of pixels fully traced\n", render_options.time_budget,
+                100.0 * quality);
+    }
+    else if (tiles != NULL) {
+        raycast_tiles(img, camera, tiles, ntiles, deps);
+    }
+    else {
+        raycast_scene(img, camera);
+    }
+    double seconds = wall_seconds() - start_time;
+
+    if (cost_map_path != NULL) {
+        cost_map_write(&cost_map, cost_map_path);
+        cost_map_free(&cost_map);
+        render_options.cost_map = NULL;
+    }
+    return seconds;
+}
+
+/**
+ * Renders one view again from the G-buffer saved for it by --gbuffer
+ * @param img - image to render into
+ * @param camera - camera the view is seen from
+ * @param gbuffer_path - G-buffer file to read
+ * @return - seconds spent relighting, not counting reading the G-buffer
+ */
+double relight_view(image *img, Camera *camera, char *gbuffer_path) {
+    GBuffer gbuffer;
+    gbuffer_read(&gbuffer, gbuffer_path, img->width, img->height);
+    double start_time = wall_seconds();
+    relight_scene(img, camera, &gbuffer);
+    double seconds = wall_seconds() - start_time;
+    gbuffer_free(&gbuffer);
+    return seconds;
+}
+
+/**
+ * Renders again, recording what their rays touch, the tiles of the watched views that were last rendered without
+ * recording. Run once the views are written, so that their images come out as fast as without --watch and the next
+ * small edit can still keep most tiles
+ * @param views - the watched views' images
+ * @param cameras - object index of each view's camera
+ * @param nviews - number of views
+ * @param only_view - the one view rendered, or -1 for all of them
+ * @param tiles - the tiles of an image
+ * @param ntiles - number of tiles
+ * @param deps - per view, the dependencies of each tile
+ * @return - number of tiles rendered again
+ */
+int record_views(image *views, int *cameras, int nviews, int only_view, Tile *tiles, int ntiles, TileDeps **deps) {
+    Tile *unknown = malloc(sizeof(Tile) * ntiles);
+    TileDeps *unknown_deps = malloc(sizeof(TileDeps) * ntiles);
+    int *unknown_index = malloc(sizeof(int) * ntiles);
+    int recorded = 0;
+    for (int v = 0; v < nviews; v++) {
+        if (only_view >= 0 && v != only_view)
+            continue;
+        int n = 0;
+        for (int t = 0; t < ntiles; t++) {
+            if (!tile_deps_known(&deps[v][t])) {
+                unknown[n] = tiles[t];
+                unknown_deps[n] = deps[v][t];
+                unknown_index[n++] = t;
+            }
+        }
+        // the pixels come out the same as the ones already written
+        if (n > 0)
+            render_view(&views[v], &objects[cameras[v]].camera, NULL, unknown, n, unknown_deps);
+        for (int k = 0; k < n; k++)
+            deps[v][unknown_index[k]] = unknown_deps[k];
+        recorded += n;
+    }
+    free(unknown);
+    free(unknown_deps);
+    free(unknown_index);
+    return recorded;
+}
 
 /* example usage: raytrace width height input.json out.ppm */
 int main(int argc, char *argv[]) {
-    /* testing that we can read json objects */
-    if (argc != 5) {
+    char *positional[4];    // width, height, input json and output file
+    int npositional = 0;
+    char *cost_map_file = NULL;
+    boolean show_stats = false;
+    int only_view = -1;
+    int first_frame = 0, last_frame = 0;
+    boolean animated = false;
+    boolean watching = false;
+    char *cache_dir = NULL;
+    int cache_mb = TILE_CACHE_MB;
+    char *gbuffer_file = NULL;
+    char *relight_file = NULL;
+    char *pfm_file = NULL;
+    char *checkpoint_file = NULL;
+    double checkpoint_interval = CHECKPOINT_SECONDS;
+    boolean resume = false;
+    int nthreads = default_thread_count();
+    boolean pin_threads = false;
+    boolean replicate = false;
+    RenderSettings options = {0};   // quality settings given on the command line, see settings.h
+
+    /* separate the options from the positional arguments */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cost-map") == 0) {
+            cost_map_file = option_value(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--preset") == 0) {
+            // only the name is kept, settings_resolve() applies the preset under the scene and the other options
+            char *name = option_value(argc, argv, &i);
+            RenderSettings scratch = {0};
+            if (!settings_preset(&scratch, name)) {
+                fprintf(stderr, "Error: main: Unknown preset '%s', expected preview, draft or final\n", name);
+                exit(1);
+            }
+            options.preset = scratch.preset;
+        }
+        else if (strcmp(argv[i], "--depth") == 0) {
+            options.max_depth = atoi(option_value(argc, argv, &i));
+            options.given |= SETTING_DEPTH;
+            if (options.max_depth < 0) {
+                fprintf(stderr, "Error: main: --depth must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--samples") == 0) {
+            options.samples = option_int(argc, argv, &i);
+            options.given |= SETTING_SAMPLES;
+        }
+        else if (strcmp(argv[i], "--min-weight") == 0) {
+            options.min_weight = atof(option_value(argc, argv, &i));
+            options.given |= SETTING_MIN_WEIGHT;
+            if (options.min_weight < 0 || options.min_weight >= 1) {
+                fprintf(stderr, "Error: main: --min-weight must be >= 0 and < 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--shadows") == 0) {
+            char *value = option_value(argc, argv, &i);
+            if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+                fprintf(stderr, "Error: main: --shadows must be on or off\n");
+                exit(1);
+            }
+            options.shadows = strcmp(value, "on") == 0;
+            options.given |= SETTING_SHADOWS;
+        }
+        else if (strcmp(argv[i], "--shininess") == 0) {
+            options.shininess = option_int(argc, argv, &i);
+            options.given |= SETTING_SHININESS;
+        }
+        else if (strcmp(argv[i], "--ray-epsilon") == 0) {
+            options.ray_epsilon = atof(option_value(argc, argv, &i));
+            options.given |= SETTING_RAY_EPSILON;
+            if (options.ray_epsilon <= 0) {
+                fprintf(stderr, "Error: main: --ray-epsilon must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--background") == 0) {
+            double r, g, b;
+            if (sscanf(option_value(argc, argv, &i), "%lf,%lf,%lf", &r, &g, &b) != 3 || r < 0 || g < 0 || b < 0) {
+                fprintf(stderr, "Error: main: --background must be R,G,B with each >= 0\n");
+                exit(1);
+            }
+            options.background[0] = (real)r;
+            options.background[1] = (real)g;
+            options.background[2] = (real)b;
+            options.given |= SETTING_BACKGROUND;
+        }
+        else if (strcmp(argv[i], "--min-samples") == 0) {
+            render_options.min_samples = option_int(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--variance") == 0) {
+            render_options.variance_threshold = atof(option_value(argc, argv, &i));
+            if (render_options.variance_threshold < 0) {
+                fprintf(stderr, "Error: main: --variance must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0) {
+            nthreads = option_int(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--pin-threads") == 0) {
+            pin_threads = true;
+        }
+        else if (strcmp(argv[i], "--replicate-scene") == 0) {
+            replicate = true;
+        }
+        else if (strcmp(argv[i], "--time-budget") == 0) {
+            render_options.time_budget = option_int(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--batch-rays") == 0) {
+            render_options.ray_order = RAYS_BATCHED;
+        }
+        else if (strcmp(argv[i], "--sort-rays") == 0) {
+            render_options.ray_order = RAYS_SORTED;
+        }
+        else if (strcmp(argv[i], "--light-threshold") == 0) {
+            render_options.light_threshold = atof(option_value(argc, argv, &i));
+            if (render_options.light_threshold < 0) {
+                fprintf(stderr, "Error: main: --light-threshold must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--light-tree") == 0) {
+            render_options.light_mode = LIGHTS_SIGNIFICANT;
+        }
+        else if (strcmp(argv[i], "--light-samples") == 0) {
+            render_options.light_mode = LIGHTS_SAMPLED;
+            render_options.light_samples = option_int(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--accel") == 0 || strncmp(argv[i], "--accel=", 8) == 0) {
+            char *name = argv[i][7] == '=' ? &argv[i][8] : option_value(argc, argv, &i);
+            if (strcmp(name, "linear") == 0)
+                render_options.accel = ACCEL_LINEAR;
+            else if (strcmp(name, "grid") == 0)
+                render_options.accel = ACCEL_GRID;
+            else {
+                fprintf(stderr, "Error: main: Unknown acceleration structure '%s'\n", name);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--view") == 0) {
+            only_view = atoi(option_value(argc, argv, &i));
+            if (only_view < 0) {
+                fprintf(stderr, "Error: main: --view must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--frames") == 0) {
+            char *range = option_value(argc, argv, &i);
+            char *dots = strstr(range, "..");
+            first_frame = atoi(range);
+            last_frame = dots != NULL ? atoi(dots + 2) : first_frame;
+            if (first_frame < 0 || last_frame < first_frame) {
+                fprintf(stderr, "Error: main: --frames must be A..B with 0 <= A <= B\n");
+                exit(1);
+            }
+            animated = true;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            watching = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0) {
+            cache_dir = option_value(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0) {
+            cache_mb = option_int(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--exposure") == 0) {
+            render_options.exposure = atof(option_value(argc, argv, &i));
+        }
+        else if (strcmp(argv[i], "--tonemap") == 0) {
+            char *name = option_value(argc, argv, &i);
+            if (strcmp(name, "clamp") == 0)
+                render_options.tonemap = TONEMAP_CLAMP;
+            else if (strcmp(name, "reinhard") == 0)
+                render_options.tonemap = TONEMAP_REINHARD;
+            else {
+                fprintf(stderr, "Error: main: Unknown tone mapping '%s'\n", name);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--pfm") == 0) {
+            pfm_file = option_value(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--denoise") == 0) {
+            denoise_passes = DENOISE_PASSES;
+        }
+        else if (strcmp(argv[i], "--denoise-passes") == 0) {
+            denoise_passes = option_int(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--denoise-sigma") == 0) {
+            denoise_sigma = atof(option_value(argc, argv, &i));
+            if (denoise_sigma <= 0) {
+                fprintf(stderr, "Error: main: --denoise-sigma must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--reference") == 0) {
+            char *reference_file = option_value(argc, argv, &i);
+            FILE *in = fopen(reference_file, "rb");
+            if (in == NULL || read_ppm(in, &reference) < 0) {
+                fprintf(stderr, "Error: main: Failed to read reference image '%s'\n", reference_file);
+                exit(1);
+            }
+            fclose(in);
+        }
+        else if (strcmp(argv[i], "--gbuffer") == 0) {
+            gbuffer_file = option_value(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--relight") == 0) {
+            relight_file = option_value(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0) {
+            checkpoint_file = option_value(argc, argv, &i);
+        }
+        else if (strcmp(argv[i], "--checkpoint-every") == 0) {
+            checkpoint_interval = atof(option_value(argc, argv, &i));
+            if (checkpoint_interval <= 0) {
+                fprintf(stderr, "Error: main: --checkpoint-every must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            resume = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = true;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: main: Unknown option '%s'\n", argv[i]);
+            usage();
+            exit(1);
+        }
+        else {
+            if (npositional == 4) {
+                fprintf(stderr, "Error: main: You must have 4 arguments\n");
+                usage();
+                exit(1);
+            }
+            positional[npositional++] = argv[i];
+        }
+    }
+    if (npositional != 4) {
         fprintf(stderr, "Error: main: You must have 4 arguments\n");
+        usage();
         exit(1);
     }
     /* test dimensions */
-    if (atoi(argv[1]) <= 0 || atoi(argv[2]) <= 0) {
+    if (atoi(positional[0]) <= 0 || atoi(positional[1]) <= 0) {
         fprintf(stderr, "Error: main: width and height parameters must be > 0\n");
         exit(1);
     }
 
+    if (replicate && !pin_threads) {
+        fprintf(stderr, "Error: main: --replicate-scene needs --pin-threads to know which node each thread is on\n");
+        exit(1);
+    }
+
+    if (watching && (animated || strcmp(positional[3], "-") == 0)) {
+        fprintf(stderr, "Error: main: --watch writes one image per view, it can't be used with --frames or output -\n");
+        exit(1);
+    }
+
+    if (cache_dir != NULL && (watching || render_options.time_budget > 0 || cost_map_file != NULL)) {
+        fprintf(stderr, "Error: main: --cache can't be used with --watch, --time-budget or --cost-map\n");
+        exit(1);
+    }
+
+    /* a G-buffer holds a single ray through each pixel center, shaded depth first with every light that reaches it */
+    if (gbuffer_file != NULL || relight_file != NULL) {
+        if (gbuffer_file != NULL && relight_file != NULL) {
+            fprintf(stderr, "Error: main: --gbuffer and --relight can't be used together\n");
+            exit(1);
+        }
+        if (render_options.ray_order != RAYS_RECURSIVE ||
+            render_options.light_mode == LIGHTS_SAMPLED || render_options.time_budget > 0 || animated || watching ||
+            cache_dir != NULL || cost_map_file != NULL) {
+            fprintf(stderr, "Error: main: --gbuffer and --relight can't be used with --batch-rays, --sort-rays, "
+                            "--light-samples, --time-budget, --frames, --watch, --cache or --cost-map\n");
+            exit(1);
+        }
+    }
+
+    /* a checkpoint holds whole tiles of a view rendered in one go, and resuming skips views that were written */
+    if (resume && checkpoint_file == NULL) {
+        fprintf(stderr, "Error: main: --resume needs the --checkpoint the render was started with\n");
+        exit(1);
+    }
+    if (checkpoint_file != NULL && (render_options.time_budget > 0 || watching || gbuffer_file != NULL ||
+                                    relight_file != NULL || cost_map_file != NULL || strcmp(positional[3], "-") == 0)) {
+        fprintf(stderr, "Error: main: --checkpoint can't be used with --time-budget, --watch, --gbuffer, --relight, "
+                        "--cost-map or output -\n");
+        exit(1);
+    }
+
+    if (reference.pixmap != NULL && (reference.width != atoi(positional[0]) || reference.height != atoi(positional[1]))) {
+        fprintf(stderr, "Error: main: The reference image is %dx%d, not %sx%s\n", reference.width, reference.height,
+                positional[0], positional[1]);
+        exit(1);
+    }
+
     /* open the input json file */
-    FILE *json = fopen(argv[3], "rb");
+    FILE *json = fopen(positional[2], "rb");
     if (json == NULL) {
-        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", argv[3]);
+        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", positional[2]);
         exit(1);
     }
 
@@ -38,32 +667,335 @@ int main(int argc, char *argv[]) {
     init_objects();
 
     /* fill object and light arrays with scene info */
-    read_json(json);
+    read_json(json, positional[2]);
+
+    /* the preset, then the scene's render object, then the command line decide how the scene is rendered */
+    RenderSettings settings;
+    settings_resolve(&options, &settings);
+    settings_apply(&settings);
+    if ((gbuffer_file != NULL || relight_file != NULL) && render_options.max_samples > 1) {
+        fprintf(stderr, "Error: main: --gbuffer and --relight need 1 sample per pixel, the settings ask for %d\n",
+                render_options.max_samples);
+        exit(1);
+    }
 
     /* create image */
     image img;
-    img.width = atoi(argv[1]);
-    img.height = atoi(argv[2]);
+    img.width = atoi(positional[0]);
+    img.height = atoi(positional[1]);
     img.pixmap = (RGBPixel*) malloc(sizeof(RGBPixel)*img.width*img.height);
+    img.hdr = malloc(sizeof(float[3]) * img.width * img.height);
     //print_pixels(img.pixmap, img.width, img.height);
-    int pos = get_camera(objects);
-    if (pos == -1) {
+
+    /* every camera in the scene is a view, rendered one after another from the same prepared scene */
+    int *cameras = malloc(sizeof(int) * (nobjects + 1));
+    int ncameras = find_cameras(cameras);
+    if (ncameras == 0) {
         fprintf(stderr, "Error: main: No camera object found in data\n");
         exit(1);
     }
+    if (only_view >= ncameras) {
+        fprintf(stderr, "Error: main: --view %d but the scene only has %d cameras\n", only_view, ncameras);
+        exit(1);
+    }
 
-    /* fill the img->pixmap with colors by raycasting the objects */
-    raycast_scene(&img, objects[pos].camera.width, objects[pos].camera.height);
+    /* keyed objects start where they are on the first frame, without --frames that is frame 0 */
+    animate_scene(first_frame);
+    prepare_scene();
+    if (show_stats)
+        cache_counter_start();
+    tile_pool_init(nthreads, pin_threads);
+    if (pin_threads)
+        first_touch_image(&img);
+    if (replicate)
+        replicate_scene();
+    TileCache tile_cache;
+    if (cache_dir != NULL) {
+        tile_cache_open(&tile_cache, cache_dir, (size_t)cache_mb << 20);
+        render_options.tile_cache = &tile_cache;
+    }
+    Checkpoint checkpoint;
+    if (checkpoint_file != NULL) {
+        checkpoint_open(&checkpoint, checkpoint_interval, resume);
+        render_options.checkpoint = &checkpoint;
+    }
+    boolean to_stdout = strcmp(positional[3], "-") == 0;
+    boolean several = only_view < 0 && ncameras > 1;
+    double render_time = 0, refit_time = 0;
 
-    /* create output file and write image data */
-    FILE *out = fopen(argv[4], "wb");
-    if (out == NULL) {
-        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[4]);
-        exit(1);
+    /* with --watch every view keeps its image and what each of its tiles' rays touched, for the next save. The first
+     * render doesn't record that, record_views() does once it is written. A time budget or a cost map means every tile
+     * is rendered on every save */
+    boolean incremental = watching && render_options.time_budget == 0 && cost_map_file == NULL;
+    Tile *tiles = NULL;
+    int ntiles = 0;
+    image *views = NULL;
+    TileDeps **deps = NULL;
+    if (watching) {
+        watch_cells_build();
+        ntiles = make_tiles(img.width, img.height, &tiles);
+        views = malloc(sizeof(image) * ncameras);
+        deps = malloc(sizeof(TileDeps *) * ncameras);
+        for (int v = 0; v < ncameras; v++) {
+            views[v] = img;
+            views[v].pixmap = malloc(sizeof(RGBPixel) * img.width * img.height);
+            views[v].hdr = malloc(sizeof(float[3]) * img.width * img.height);
+            if (pin_threads)
+                first_touch_image(&views[v]);
+            deps[v] = calloc(ntiles, sizeof(TileDeps));
+        }
+    }
+    for (int frame = first_frame; frame <= last_frame; frame++) {
+        if (frame > first_frame) {
+            /* the scene and the threads carry over from the last frame, only what moved is updated */
+            double start_time = wall_seconds();
+            refit_scene(animate_scene(frame));
+            refit_time += wall_seconds() - start_time;
+        }
+        for (int v = 0; v < ncameras; v++) {
+            if (only_view >= 0 && v != only_view)
+                continue;
+            Camera *camera = &objects[cameras[v]].camera;
+            if (checkpoint_file != NULL) {
+                checkpoint.path = output_path(checkpoint_file, v, several, animated ? frame : -1);
+                if (checkpoint_finished(&checkpoint, camera, img.width, img.height)) {
+                    free(checkpoint.path);
+                    continue;
+                }
+            }
+            char *path = to_stdout ? NULL : output_path(positional[3], v, several, animated ? frame : -1);
+            char *cost_map_path = cost_map_file == NULL ? NULL :
+                                  output_path(cost_map_file, v, several, animated ? frame : -1);
+            char *pfm_path = pfm_file == NULL ? NULL : output_path(pfm_file, v, several, animated ? frame : -1);
+            char *gbuffer_path = gbuffer_file != NULL || relight_file != NULL ?
+                                 output_path(gbuffer_file != NULL ? gbuffer_file : relight_file, v, several, -1) : NULL;
+            GBuffer gbuffer;
+            if (gbuffer_file != NULL) {
+                gbuffer_init(&gbuffer, img.width, img.height);
+                render_options.gbuffer = &gbuffer;
+            }
+            image *view_img = watching ? &views[v] : &img;
+            if (watching)
+                render_time += render_view(view_img, camera, cost_map_path, tiles, ntiles, NULL);
+            else if (relight_file != NULL)
+                render_time += relight_view(view_img, camera, gbuffer_path);
+            else
+                render_time += render_view(view_img, camera, cost_map_path, NULL, 0, NULL);
+            write_view(view_img, camera, path, pfm_path);
+            if (checkpoint_file != NULL) {
+                checkpoint_complete(&checkpoint);
+                free(checkpoint.path);
+            }
+            if (gbuffer_file != NULL) {
+                gbuffer_write(&gbuffer, gbuffer_path);
+                gbuffer_free(&gbuffer);
+                render_options.gbuffer = NULL;
+            }
+            free(gbuffer_path);
+            free(pfm_path);
+            free(path);
+            free(cost_map_path);
+        }
+    }
+
+    /* with --watch each save reads the scene again, and only tiles whose rays touched what changed are traced */
+    if (watching) {
+        int fd = watch_open(positional[2]);
+        int nviews = only_view >= 0 ? 1 : ncameras;
+        fprintf(stderr, "watch: traced %d of %d tiles in %.1f ms\n", nviews * ntiles, nviews * ntiles, 1000 * render_time);
+        if (incremental) {
+            double start_time = wall_seconds();
+            int recorded = record_views(views, cameras, ncameras, only_view, tiles, ntiles, deps);
+            fprintf(stderr, "watch: recorded %d tiles in %.1f ms\n", recorded, 1000 * (wall_seconds() - start_time));
+        }
+        Tile *dirty = malloc(sizeof(Tile) * ntiles);
+        TileDeps *dirty_deps = malloc(sizeof(TileDeps) * ntiles);
+        int *dirty_index = malloc(sizeof(int) * ntiles);
+        fprintf(stderr, "watch: waiting for '%s' to be saved\n", positional[2]);
+        for (;;) {
+            watch_wait(fd, positional[2]);
+            if (!scene_file_valid(positional[2])) {
+                fprintf(stderr, "watch: '%s' has errors, keeping the last image\n", positional[2]);
+                continue;
+            }
+            double start_time = wall_seconds();
+            SceneCopy old;
+            scene_detach(&old);
+            json = fopen(positional[2], "rb");
+            if (json == NULL) {
+                fprintf(stderr, "Error: main: Failed to open input file '%s'\n", positional[2]);
+                exit(1);
+            }
+            init_lights();
+            init_objects();
+            read_json(json, positional[2]);
+            animate_scene(0);
+            prepare_scene();
+            SceneDiff diff;
+            scene_diff(&old, &diff);
+
+            /* new settings can change any pixel */
+            RenderSettings edited;
+            settings_resolve(&options, &edited);
+            if (!settings_equal(&edited, &settings)) {
+                settings_apply(&edited);
+                diff.everything = true;
+            }
+            settings = edited;
+
+            /* cameras can only have been added or removed if objects were, and then every tile is traced anyway */
+            cameras = realloc(cameras, sizeof(int) * (nobjects + 1));
+            int found = find_cameras(cameras);
+            if (found == 0 || only_view >= found) {
+                fprintf(stderr, "Error: main: The scene has %d cameras, not enough to render\n", found);
+                exit(1);
+            }
+            if (found != ncameras) {
+                for (int v = 0; v < ncameras; v++) {
+                    free(views[v].pixmap);
+                    free(views[v].hdr);
+                    tile_deps_free(deps[v], ntiles);
+                }
+                ncameras = found;
+                views = realloc(views, sizeof(image) * ncameras);
+                deps = realloc(deps, sizeof(TileDeps *) * ncameras);
+                for (int v = 0; v < ncameras; v++) {
+                    views[v] = img;
+                    views[v].pixmap = malloc(sizeof(RGBPixel) * img.width * img.height);
+                    views[v].hdr = malloc(sizeof(float[3]) * img.width * img.height);
+                    if (pin_threads)
+                        first_touch_image(&views[v]);
+                    deps[v] = calloc(ntiles, sizeof(TileDeps));
+                }
+                several = only_view < 0 && ncameras > 1;
+            }
+
+            int traced = 0, total = 0;
+            for (int v = 0; v < ncameras; v++) {
+                if (only_view >= 0 && v != only_view)
+                    continue;
+                Camera *camera = &objects[cameras[v]].camera;
+                int ndirty = 0;
+                for (int t = 0; t < ntiles; t++) {
+                    if (!incremental || tile_dirty(&diff, &deps[v][t])) {
+                        dirty[ndirty] = tiles[t];
+                        dirty_deps[ndirty] = deps[v][t];
+                        dirty_index[ndirty++] = t;
+                    }
+                }
+                char *path = output_path(positional[3], v, several, -1);
+                char *cost_map_path = cost_map_file == NULL ? NULL : output_path(cost_map_file, v, several, -1);
+                char *pfm_path = pfm_file == NULL ? NULL : output_path(pfm_file, v, several, -1);
+                // recording only pays off when most tiles are kept, past that they are traced as fast as they can be
+                // and recorded after the image is written
+                boolean record = incremental && ndirty * WATCH_PLAIN_TILES <= ntiles;
+                render_view(&views[v], camera, cost_map_path, dirty, ndirty, record ? dirty_deps : NULL);
+                write_view(&views[v], camera, path, pfm_path);
+                for (int k = 0; k < ndirty; k++) {
+                    if (!record)
+                        tile_deps_forget(&dirty_deps[k]);
+                    deps[v][dirty_index[k]] = dirty_deps[k];
+                }
+                free(path);
+                free(cost_map_path);
+                free(pfm_path);
+                traced += ndirty;
+                total += ntiles;
+            }
+            fprintf(stderr, "watch: traced %d of %d tiles in %.1f ms\n", traced, total,
+                    1000 * (wall_seconds() - start_time));
+            if (incremental) {
+                start_time = wall_seconds();
+                int recorded = record_views(views, cameras, ncameras, only_view, tiles, ntiles, deps);
+                if (recorded > 0)
+                    fprintf(stderr, "watch: recorded %d tiles in %.1f ms\n", recorded,
+                            1000 * (wall_seconds() - start_time));
+            }
+            scene_diff_free(&diff);
+            scene_copy_free(&old);
+        }
+    }
+    int nnodes = tile_pool_nodes();
+    tile_pool_shutdown();
+    light_tree_free();
+    if (cache_dir != NULL)
+        tile_cache_close(&tile_cache);
+
+    /* every view was written, so their checkpoints are no longer needed */
+    if (checkpoint_file != NULL) {
+        for (int frame = first_frame; frame <= last_frame; frame++) {
+            for (int v = 0; v < ncameras; v++) {
+                if (only_view >= 0 && v != only_view)
+                    continue;
+                char *checkpoint_path = output_path(checkpoint_file, v, several, animated ? frame : -1);
+                remove(checkpoint_path);
+                free(checkpoint_path);
+            }
+        }
+    }
+
+    if (show_stats) {
+        print_stats(stderr, render_time);
+        fprintf(stderr, "resolve:            %.2f ms per image, %.0f Mpixels/sec\n",
+                1000 * resolve_seconds / resolved_images,
+                (double)resolved_images * img.width * img.height / (resolve_seconds > 0 ? resolve_seconds : 1) / 1e6);
+        if (denoise_passes > 0)
+            fprintf(stderr, "denoise:            %d passes, %.1f ms per image\n", denoise_passes,
+                    1000 * denoise_seconds / resolved_images);
+        settings_print(stderr, &settings);
+        if (pin_threads)
+            fprintf(stderr, "threads:            %d pinned to processors on %d NUMA nodes%s\n", nthreads, nnodes,
+                    replicate ? ", grid and lights copied to each node" : "");
+        long long misses = cache_counter_stop();
+        if (misses >= 0)
+            fprintf(stderr, "cache misses:       %lld\n", misses);
+        else
+            fprintf(stderr, "cache misses:       not available\n");
+        if (render_options.accel == ACCEL_GRID)
+            fprintf(stderr, "grid:               %dx%dx%d cells, %.1f MB, built in %.1f ms\n", grid.res[0], grid.res[1],
+                    grid.res[2], grid.bytes / 1048576.0, 1000 * grid.build_seconds);
+        for (MeshData *mesh = loaded_meshes; mesh != NULL; mesh = mesh->next)
+            fprintf(stderr, "mesh:               %s, %d triangles, %d BVH nodes, %.1f MB, read in %.1f ms, BVH built in "
+                            "%.1f ms\n", mesh->path, mesh->ntriangles, mesh->nnodes, mesh->bytes / 1048576.0,
+                    1000 * mesh->load_seconds, 1000 * mesh->build_seconds);
+        int nframes = last_frame - first_frame + 1;
+        if (several)
+            fprintf(stderr, "views:              %d cameras, %.1f ms each\n", ncameras,
+                    1000 * render_time / (ncameras * nframes));
+        if (animated)
+            fprintf(stderr, "frames:             %d frames, %.1f ms rendering and %.3f ms refitting each\n", nframes,
+                    1000 * render_time / nframes, nframes > 1 ? 1000 * refit_time / (nframes - 1) : 0.0);
+        if (instance_table.ngroups > 0)
+            fprintf(stderr, "instances:          %d instances of %d groups, %d objects between them, %.1f MB, built in "
+                            "%.1f ms\n", instance_table.nentries, instance_table.ngroups,
+                    instance_table.nhits > 0 ? instance_table.nhits - nobjects : 0, instance_table.bytes / 1048576.0,
+                    1000 * instance_table.build_seconds);
+        if (instance_table.refits > 0)
+            fprintf(stderr, "instance refits:    %d, %d of them built again\n", instance_table.refits,
+                    instance_table.rebuilds);
+        if (checkpoint_file != NULL)
+            fprintf(stderr, "checkpoint:         %d saves, %.1f MB written, %.1f ms, %d tiles and %d views resumed\n",
+                    checkpoint.saves, checkpoint.bytes_written / 1048576.0, 1000 * checkpoint.seconds,
+                    checkpoint.resumed, checkpoint.skipped);
+        if (cache_dir != NULL) {
+            fprintf(stderr, "tile cache:         %d hits, %d misses, %.1f MB read, %.1f MB written, %.1f ms\n",
+                    tile_cache.hits, tile_cache.misses, tile_cache.bytes_read / 1048576.0,
+                    tile_cache.bytes_written / 1048576.0, 1000 * tile_cache.seconds);
+            if (tile_cache.misses > 0)
+                fprintf(stderr, "tile cache size:    %.1f MB of %d MB, %d tiles evicted\n",
+                        tile_cache.bytes_held / 1048576.0, cache_mb, tile_cache.evicted);
+        }
     }
-    create_ppm(out, 6, &img);
+
     /* cleanup */
-    fclose(out);
+    free(cameras);
+    free(img.pixmap);
+    free(img.hdr);
+    free(reference.pixmap);
+    grid_free();
+    instances_free();
+    mesh_free_all();
+    arena_free(&scene_arena);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,343 @@
+/* mesh.c - triangle meshes. An OBJ file is read into one vertex buffer and one buffer of 32-bit vertex indices, and a
+ * BVH is built over its triangles (see bvh.c). Rays are moved into the file's own space rather than moving its
+ * vertices into the scene, so every mesh object made from the same file shares one copy. Triangles are tested with the
+ * watertight test of Woop, Benthin and Wald, which can't let a ray slip between two triangles through the edge they
+ * share. mesh_intersect() hands back the triangle it hit, and shading takes the normal from that triangle */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "../include/mesh.h"
+
+MeshData *loaded_meshes = NULL;
+
+/**
+ * Makes room for at least needed items in an array that doubles its capacity as it fills
+ */
+static void *grow_array(void *array, size_t *capacity, size_t needed, size_t size) {
+    if (needed <= *capacity)
+        return array;
+    size_t c = *capacity > 0 ? *capacity : 1024;
+    while (c < needed)
+        c *= 2;
+    array = realloc(array, size * c);
+    if (array == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        exit(1);
+    }
+    *capacity = c;
+    return array;
+}
+
+/**
+ * Reads the next vertex reference of a face, like "7", "7/2", "7//3" or "-1", as a 0 based vertex index
+ * @param s - where to read from, moved past the reference
+ * @param nvertices - vertices read so far, negative references count back from here
+ * @param index - set to the vertex index
+ * @return - false if there are no more references on the line
+ */
+static boolean face_index(char **s, int nvertices, const char *path, int line, long *index) {
+    char *end;
+    long i = strtol(*s, &end, 10);
+    if (end == *s)
+        return false;
+    while (*end != 0 && !isspace((unsigned char)*end))
+        end++;      // texture coordinate and normal indices aren't used
+    *s = end;
+    i = i < 0 ? nvertices + i : i - 1;
+    if (i < 0 || i >= nvertices) {
+        fprintf(stderr, "Error: mesh_load: Face uses a vertex that isn't defined in '%s': %d\n", path, line);
+        exit(1);
+    }
+    *index = i;
+    return true;
+}
+
+/**
+ * Builds the BVH over a mesh's triangles and puts its index buffer in leaf order
+ */
+static void mesh_build_bvh(MeshData *mesh) {
+    double start = wall_seconds();
+    int n = mesh->ntriangles;
+    BVHItem *items = malloc(sizeof(BVHItem) * n);
+    uint32_t *indices = malloc(sizeof(uint32_t) * 3 * (size_t)n);
+    if (items == NULL || indices == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 3; k++) {
+            vertex_real lo = INFINITY, hi = -INFINITY;
+            for (int v = 0; v < 3; v++) {
+                vertex_real x = mesh->vertices[3 * mesh->indices[3 * i + v] + k];
+                lo = x < lo ? x : lo;
+                hi = x > hi ? x : hi;
+            }
+            items[i].lo[k] = bvh_round_down(lo);
+            items[i].hi[k] = bvh_round_up(hi);
+        }
+        items[i].index = i;
+    }
+    mesh->nodes = bvh_build(items, n, &mesh->nnodes);
+
+    // reorder the triangles so each leaf's are next to each other
+    for (int i = 0; i < n; i++)
+        memcpy(&indices[3 * i], &mesh->indices[3 * items[i].index], sizeof(uint32_t) * 3);
+    free(mesh->indices);
+    mesh->indices = indices;
+    free(items);
+    mesh->build_seconds = wall_seconds() - start;
+}
+
+/**
+ * Loads an OBJ file and builds its BVH, or finds it among the files already loaded. Only vertex positions and faces
+ * are read, faces with more than three corners are split into a fan of triangles, and triangles with no area are
+ * dropped. Everything else in the file (normals, texture coordinates, groups, materials) is skipped
+ * @param path - OBJ file to read
+ * @return - the mesh, shared with every other caller asking for the same file
+ */
+MeshData *mesh_load(const char *path) {
+    for (MeshData *m = loaded_meshes; m != NULL; m = m->next)
+        if (strcmp(m->path, path) == 0)
+            return m;
+
+    double start = wall_seconds();
+    FILE *obj = fopen(path, "rb");
+    if (obj == NULL) {
+        fprintf(stderr, "Error: mesh_load: Failed to open OBJ file '%s'\n", path);
+        exit(1);
+    }
+    MeshData *mesh = calloc(1, sizeof(MeshData));
+    mesh->path = strdup(path);
+    size_t vertex_capacity = 0, index_capacity = 0;
+    size_t ntriangles = 0;
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    int line = 0;
+    while (getline(&buffer, &buffer_size, obj) != -1) {
+        line++;
+        char *s = buffer;
+        while (isspace((unsigned char)*s))
+            s++;
+        if (s[0] == 'v' && isspace((unsigned char)s[1])) {
+            mesh->vertices = grow_array(mesh->vertices, &vertex_capacity, 3 * ((size_t)mesh->nvertices + 1),
+                                        sizeof(vertex_real));
+            s++;
+            for (int k = 0; k < 3; k++) {
+                char *end;
+                mesh->vertices[3 * mesh->nvertices + k] = strtod(s, &end);
+                if (end == s) {
+                    fprintf(stderr, "Error: mesh_load: Vertex must have 3 coordinates in '%s': %d\n", path, line);
+                    exit(1);
+                }
+                s = end;
+            }
+            mesh->nvertices++;
+        }
+        else if (s[0] == 'f' && isspace((unsigned char)s[1])) {
+            s++;
+            long first, prev, next;
+            if (!face_index(&s, mesh->nvertices, path, line, &first) ||
+                !face_index(&s, mesh->nvertices, path, line, &prev)) {
+                fprintf(stderr, "Error: mesh_load: Face must have at least 3 vertices in '%s': %d\n", path, line);
+                exit(1);
+            }
+            while (face_index(&s, mesh->nvertices, path, line, &next)) {
+                vertex_real *a = &mesh->vertices[3 * first], *b = &mesh->vertices[3 * prev];
+                vertex_real *c = &mesh->vertices[3 * next];
+                real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+                real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+                real n[3];
+                v3_cross(e1, e2, n);
+                if (n[0] != 0 || n[1] != 0 || n[2] != 0) {
+                    mesh->indices = grow_array(mesh->indices, &index_capacity, 3 * (ntriangles + 1), sizeof(uint32_t));
+                    mesh->indices[3 * ntriangles] = first;
+                    mesh->indices[3 * ntriangles + 1] = prev;
+                    mesh->indices[3 * ntriangles + 2] = next;
+                    ntriangles++;
+                }
+                prev = next;
+            }
+        }
+    }
+    free(buffer);
+    fclose(obj);
+    if (ntriangles == 0) {
+        fprintf(stderr, "Error: mesh_load: No triangles found in '%s'\n", path);
+        exit(1);
+    }
+    if (ntriangles > INT32_MAX / 2) {
+        fprintf(stderr, "Error: mesh_load: Too many triangles in '%s'\n", path);
+        exit(1);
+    }
+    mesh->ntriangles = (int)ntriangles;
+    mesh->vertices = realloc(mesh->vertices, sizeof(vertex_real) * 3 * mesh->nvertices);
+    mesh->indices = realloc(mesh->indices, sizeof(uint32_t) * 3 * ntriangles);
+    mesh->load_seconds = wall_seconds() - start;
+
+    mesh_build_bvh(mesh);
+    mesh->bytes = sizeof(vertex_real) * 3 * mesh->nvertices + sizeof(uint32_t) * 3 * ntriangles +
+                  sizeof(BVHNode) * mesh->nnodes;
+    mesh->next = loaded_meshes;
+    loaded_meshes = mesh;
+    return mesh;
+}
+
+void mesh_free_all() {
+    while (loaded_meshes != NULL) {
+        MeshData *mesh = loaded_meshes;
+        loaded_meshes = mesh->next;
+        free(mesh->path);
+        free(mesh->vertices);
+        free(mesh->indices);
+        free(mesh->nodes);
+        free(mesh);
+    }
+}
+
+/**
+ * Watertight ray/triangle test. The ray is sheared so it runs along +z through the origin, and the signs of the 2D
+ * edge functions say whether it passes inside. Every edge is worked out from its own two vertices alone, so the two
+ * triangles sharing an edge always agree which side of it a ray passes
+ * @return - distance along the ray in mesh space, -1 if it misses
+ */
+static inline real triangle_intersect(const vertex_real *v0, const vertex_real *v1, const vertex_real *v2,
+                                      const real org[3], const int k[3], const real shear[3]) {
+    real az = v0[k[2]] - org[k[2]], bz = v1[k[2]] - org[k[2]], cz = v2[k[2]] - org[k[2]];
+    real ax = v0[k[0]] - org[k[0]] - shear[0] * az, ay = v0[k[1]] - org[k[1]] - shear[1] * az;
+    real bx = v1[k[0]] - org[k[0]] - shear[0] * bz, by = v1[k[1]] - org[k[1]] - shear[1] * bz;
+    real cx = v2[k[0]] - org[k[0]] - shear[0] * cz, cy = v2[k[1]] - org[k[1]] - shear[1] * cz;
+    real u = cx * by - cy * bx;
+    real v = ax * cy - ay * cx;
+    real w = bx * ay - by * ax;
+#ifdef SINGLE_PRECISION
+    // a ray exactly on an edge in float can still be decided in double
+    if (u == 0 || v == 0 || w == 0) {
+        u = (real)((double)cx * by - (double)cy * bx);
+        v = (real)((double)ax * cy - (double)ay * cx);
+        w = (real)((double)bx * ay - (double)by * ax);
+    }
+#endif
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return -1;
+    real det = u + v + w;
+    if (det == 0)
+        return -1;
+    return shear[2] * (u * az + v * bz + w * cz) / det;
+}
+
+/**
+ * Tests a ray against a mesh, walking its BVH nearest child first
+ * @param ray - ray in the scene
+ * @param mesh - mesh object, its data loaded by prepare_scene()
+ * @param t_min - hits this close to the ray's origin are ignored, so a ray leaving the mesh doesn't hit where it left
+ * @param t_max - furthest hit that matters
+ * @param back_face - set to whether the closest hit was on the back of its triangle, like leaving a sphere
+ * @param triangle - set to the index of the triangle hit, for mesh_normal()
+ * @return - distance to the closest hit, -1 if there isn't one
+ */
+real mesh_intersect(Ray *ray, Mesh *mesh, real t_min, real t_max, boolean *back_face, int *triangle) {
+    MeshData *data = mesh->data;
+    real inv_scale = 1 / mesh->scale;
+    real org[3], inv_dir[3];
+    real *dir = ray->direction;
+    for (int k = 0; k < 3; k++) {
+        org[k] = (ray->origin[k] - mesh->position[k]) * inv_scale;
+        inv_dir[k] = 1 / dir[k];
+    }
+    // the ray keeps its direction in mesh space, so distances there are the scene's divided by the scale
+    t_min *= inv_scale;
+    real best_t = t_max * inv_scale;
+    int best_tri = -1;
+
+    // shear for the triangle test, z is the axis the ray runs along the most
+    int k[3];
+    k[2] = fabs(dir[0]) > fabs(dir[1]) ? (fabs(dir[0]) > fabs(dir[2]) ? 0 : 2) : (fabs(dir[1]) > fabs(dir[2]) ? 1 : 2);
+    k[0] = (k[2] + 1) % 3;
+    k[1] = (k[0] + 1) % 3;
+    if (isnan(dir[0] + dir[1] + dir[2]) || dir[k[2]] == 0)
+        return -1;      // like a failed refraction, which would pass every bounds test and can't hit anything
+    if (dir[k[2]] < 0) {    // keep the winding so the edge function signs still mean the same thing
+        int t = k[0];
+        k[0] = k[1];
+        k[1] = t;
+    }
+    real shear[3] = {dir[k[0]] / dir[k[2]], dir[k[1]] / dir[k[2]], 1 / dir[k[2]]};
+
+    struct { uint32_t node; real t; } stack[BVH_MAX_DEPTH + 2];
+    int sp = 0;
+    uint32_t node = 0;
+    if (bvh_box_entry(&data->nodes[0], org, inv_dir, best_t) == INFINITY)
+        return -1;
+    while (true) {
+        BVHNode *n = &data->nodes[node];
+        if (n->count > 0) {
+            for (uint32_t i = n->first; i < n->first + n->count; i++) {
+                uint32_t *tri = &data->indices[3 * i];
+                real t = triangle_intersect(&data->vertices[3 * tri[0]], &data->vertices[3 * tri[1]],
+                                            &data->vertices[3 * tri[2]], org, k, shear);
+                if (t > t_min && t < best_t) {
+                    best_t = t;
+                    best_tri = i;
+                }
+            }
+        }
+        else {
+            uint32_t near = node + 1, far = n->first;
+            real t_near = bvh_box_entry(&data->nodes[near], org, inv_dir, best_t);
+            real t_far = bvh_box_entry(&data->nodes[far], org, inv_dir, best_t);
+            if (t_far < t_near) {
+                uint32_t t = near;
+                near = far;
+                far = t;
+                real s = t_near;
+                t_near = t_far;
+                t_far = s;
+            }
+            if (t_near != INFINITY) {
+                if (t_far != INFINITY) {
+                    stack[sp].node = far;
+                    stack[sp++].t = t_far;
+                }
+                node = near;
+                continue;
+            }
+        }
+        // the next node put aside that could still have something closer
+        while (sp > 0 && stack[sp - 1].t > best_t)
+            sp--;
+        if (sp == 0)
+            break;
+        node = stack[--sp].node;
+    }
+    if (best_tri < 0)
+        return -1;
+
+    uint32_t *tri = &data->indices[3 * best_tri];
+    vertex_real *a = &data->vertices[3 * tri[0]], *b = &data->vertices[3 * tri[1]], *c = &data->vertices[3 * tri[2]];
+    real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    real normal[3];
+    v3_cross(e1, e2, normal);
+    *back_face = v3_dot(normal, dir) > 0;
+    *triangle = best_tri;
+    return best_t * mesh->scale;
+}
+
+/**
+ * Finds the normal of a mesh on one of its triangles, the face normal. Meshes are only moved and uniformly scaled, so
+ * it is the same in the scene as in the file
+ * @param mesh - mesh object
+ * @param triangle - index of the triangle, as mesh_intersect() gave it
+ * @param normal - set to the normalized normal, facing the way the triangle's corners wind counter-clockwise
+ */
+void mesh_normal(Mesh *mesh, int triangle, real normal[3]) {
+    MeshData *data = mesh->data;
+    uint32_t *t = &data->indices[3 * triangle];
+    vertex_real *a = &data->vertices[3 * t[0]], *b = &data->vertices[3 * t[1]], *c = &data->vertices[3 * t[2]];
+    real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    v3_cross(e1, e2, normal);
+    normalize(normal);
+}
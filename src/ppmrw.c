@@ -16,6 +16,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <stdint.h>
 
 /*******************************************************//**
  * Utility functions
@@ -200,13 +201,70 @@ int read_header(FILE *fh, header *hdr) {
  * @return 0 on success, -1 on error
  */
 int write_p6_data(FILE *fh, image *img) {
-    int i,j;
-    for (i=0; i<(img->height); i++) {
-        for (j=0; j<(img->width); j++) {
-            fwrite(&(img->pixmap[i * img->width + j].r), 1, 1, fh);
-            fwrite(&(img->pixmap[i * img->width + j].g), 1, 1, fh);
-            fwrite(&(img->pixmap[i * img->width + j].b), 1, 1, fh);
+    // the pixels are packed r, g, b bytes, so each row goes out in one write
+    for (int i=0; i<(img->height); i++) {
+        if (fwrite(&img->pixmap[i * img->width], sizeof(RGBPixel), img->width, fh) != (size_t)img->width)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the linear color of an image to a file stream as a PFM (portable float map): a "PF" header, then 3 little
+ * endian floats per pixel with the rows from the bottom of the image to the top
+ * @param fh file handler
+ * @param img image struct holding the linear colors in img->hdr
+ * @return 0 on success, -1 on error
+ */
+int write_pfm(FILE *fh, image *img) {
+    // a negative scale marks the floats as little endian
+    fprintf(fh, "PF\n%d %d\n-1.0\n", img->width, img->height);
+    uint32_t probe = 1;
+    boolean little_endian = *(unsigned char *)&probe == 1;
+    float *row = malloc(sizeof(float) * 3 * img->width);
+    for (int i = img->height - 1; i >= 0; i--) {
+        memcpy(row, &img->hdr[(size_t)3 * i * img->width], sizeof(float) * 3 * img->width);
+        if (!little_endian) {
+            for (int k = 0; k < 3 * img->width; k++) {
+                uint32_t bits;
+                memcpy(&bits, &row[k], sizeof(bits));
+                bits = bits >> 24 | (bits >> 8 & 0xff00) | (bits << 8 & 0xff0000) | bits << 24;
+                memcpy(&row[k], &bits, sizeof(bits));
+            }
         }
+        if (fwrite(row, sizeof(float), 3 * img->width, fh) != (size_t)3 * img->width) {
+            free(row);
+            return -1;
+        }
+    }
+    free(row);
+    return 0;
+}
+
+/**
+ * Reads a whole P6 ppm file without comments, like the ones create_ppm() writes, into an image. The pixels are read
+ * in one go rather than through read_header(), which would skip a first pixel byte that looks like white space
+ * @param fh input file pointer
+ * @param img set to the image, with its pixmap allocated and no linear colors
+ * @return 0 on success, -1 on error
+ */
+int read_ppm(FILE *fh, image *img) {
+    int width, height, max_color_val;
+    if (fscanf(fh, "P6 %d %d %d", &width, &height, &max_color_val) != 3 || !isspace(fgetc(fh)) || width <= 0 ||
+        height <= 0 || max_color_val != 255) {
+        fprintf(stderr, "Error: read_ppm: Not a P6 ppm file with 8 bit colors\n");
+        return -1;
+    }
+    img->width = width;
+    img->height = height;
+    img->max_color_val = max_color_val;
+    img->hdr = NULL;
+    img->pixmap = malloc(sizeof(RGBPixel) * width * height);
+    if (fread(img->pixmap, sizeof(RGBPixel), (size_t)width * height, fh) != (size_t)width * height) {
+        fprintf(stderr, "Error: read_ppm: Image data is missing\n");
+        free(img->pixmap);
+        img->pixmap = NULL;
+        return -1;
     }
     return 0;
 }
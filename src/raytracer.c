@@ -6,6 +6,19 @@
 #include "../include/vector_math.h"
 #include "../include/json.h"
 #include "../include/illumination.h"
+#include "../include/tiles.h"
+#include "../include/visibility.h"
+#include "../include/wavefront.h"
+#include "../include/lighttree.h"
+#include "../include/arena.h"
+#include "../include/grid.h"
+#include "../include/mesh.h"
+#include "../include/instance.h"
+#include "../include/watch.h"
+#include "../include/tilecache.h"
+#include "../include/checkpoint.h"
+#include "../include/gbuffer.h"
+#include "../include/denoise.h"
 
 /* raycast.c - provides raycasting functionality */
 #include <stdio.h>
@@ -13,12 +26,32 @@
 #include <string.h>
 #include <math.h>
 
-#define SHININESS 20        // constant for shininess
-#define MAX_REC_LEVEL 7     // maximum recursion level for raytracing
-
 /* overall background color for the image */
 V3 background_color = {0, 0, 0};
 
+/* command line controlled render options */
+RenderOptions render_options = {
+        .cost_map = NULL,
+        .max_samples = 1,
+        .max_depth = MAX_REC_LEVEL,
+        .min_weight = 0,
+        .shadows = true,
+        .ray_epsilon = RAY_EPSILON,
+        .min_samples = 4,
+        .variance_threshold = 0.0001,
+        .time_budget = 0,
+        .ray_order = RAYS_RECURSIVE,
+        .light_threshold = 1.0 / 512.0,
+        .light_mode = LIGHTS_ALL,
+        .light_samples = 1,
+        .accel = ACCEL_LINEAR,
+        .tile_cache = NULL,
+        .gbuffer = NULL,
+        .checkpoint = NULL,
+        .exposure = 0,
+        .tonemap = TONEMAP_CLAMP
+};
+
 /**
  * Finds and gets the index in objects that has the camera width and height
  * @param objects - array of object types that represent the scene
@@ -26,7 +59,7 @@ V3 background_color = {0, 0, 0};
  */
 int get_camera(object *objects) {
     int i = 0;
-    while (i < MAX_OBJECTS && objects[i].type != 0) {
+    while (objects[i].type != 0) {
         if (objects[i].type == CAMERA) {
             return i;
         }
@@ -37,18 +70,158 @@ int get_camera(object *objects) {
 }
 
 /**
- * colors the values of a pixel based on the color array that is passed in
+ * Checks an object and fills in what it needs for tracing, see prepare_scene()
+ * @param obj - object in the scene or in a group
+ */
+void prepare_object(object *obj) {
+    if (obj->type == PLANE) {
+        if (obj->plane.normal == NULL || obj->plane.position == NULL) {
+            fprintf(stderr, "Error: prepare_scene: plane must have a position and a normal\n");
+            exit(1);
+        }
+        normalize(obj->plane.normal);
+    }
+    else if (obj->type == SPHERE && obj->sphere.position == NULL) {
+        fprintf(stderr, "Error: prepare_scene: sphere must have a position\n");
+        exit(1);
+    }
+    else if (obj->type == MESH) {
+        if (obj->mesh.position == NULL)
+            obj->mesh.position = arena_calloc(&scene_arena, 3, sizeof(real));
+        obj->mesh.data = mesh_load(obj->mesh.file);
+    }
+}
+
+/**
+ * Gets the scene ready to be read by several render threads at once. Anything that used to be fixed up lazily while
+ * tracing (normalizing plane normals and spotlight directions, defaulting radial attenuation) is done here, so the
+ * objects and lights are read-only during the render
+ */
+void prepare_scene() {
+    for (int i = 0; objects[i].type != 0; i++)
+        prepare_object(&objects[i]);
+    instances_build();
+    for (int i = 0; i < nlights; i++) {
+        if (lights[i].position == NULL || lights[i].color == NULL) {
+            fprintf(stderr, "Error: prepare_scene: light must have a position and a color\n");
+            exit(1);
+        }
+        if (lights[i].type == SPOTLIGHT) {
+            normalize(lights[i].direction);
+            lights[i].cos_theta = cos(lights[i].theta_deg * (M_PI / 180.0));
+        }
+        if (lights[i].rad_att0 == 0 && lights[i].rad_att1 == 0 && lights[i].rad_att2 == 0) {
+            fprintf(stderr, "WARNING: prepare_scene: Found all 0s for attenuation. Assuming default values of radial attenuation\n");
+            lights[i].rad_att2 = 1.0;
+        }
+        lights[i].influence_radius = calculate_influence_radius(&lights[i], render_options.light_threshold);
+    }
+    light_soa_build();
+    if (render_options.light_mode != LIGHTS_ALL)
+        light_tree_build();
+    if (render_options.accel == ACCEL_GRID)
+        grid_build();
+}
+
+/**
+ * Gives each NUMA node the tile pool's threads are on its own copy of the grid and the light arrays, the read-only
+ * scene data every ray goes through. The copies follow the scene from then on
+ */
+void replicate_scene() {
+    light_soa_replicate();
+    if (render_options.accel == ACCEL_GRID)
+        grid_replicate();
+}
+
+/**
+ * colors the values of a pixel based on the color array that is passed in. The color is kept as it is in the
+ * image's linear color buffer, resolve_image() turns it into the pixel's 8 bit color
  * @param color - array of 3 color values for r,g,b
  * @param row - which row the pixel is on
  * @param col - which column the pixel is on
  * @param img - image struct that allows for indexing the appropriate spot
  */
-void set_pixel_color(double *color, int row, int col, image *img) {
-    // fill in pixel color values
-    // the color vals are stored as values between 0 and 1, so we need to adjust
-    img->pixmap[row * img->width + col].r = (unsigned char)(MAX_COLOR_VAL * clamp(color[0]));
-    img->pixmap[row * img->width + col].g = (unsigned char)(MAX_COLOR_VAL * clamp(color[1]));
-    img->pixmap[row * img->width + col].b = (unsigned char)(MAX_COLOR_VAL * clamp(color[2]));
+void set_pixel_color(real *color, int row, int col, image *img) {
+    float *hdr = &img->hdr[(size_t)3 * (row * img->width + col)];
+    hdr[0] = (float)color[0];
+    hdr[1] = (float)color[1];
+    hdr[2] = (float)color[2];
+}
+
+/* channels resolved together by resolve_image(), as many floats as the target's registers hold */
+#define RESOLVE_LANES (VECTOR_BYTES / (int)sizeof(float))
+typedef float channel_lanes __attribute__((vector_size(VECTOR_BYTES)));
+typedef int32_t channel_mask __attribute__((vector_size(VECTOR_BYTES)));
+typedef unsigned char channel_bytes __attribute__((vector_size(RESOLVE_LANES)));
+
+/**
+ * Maps one linear color channel into 0 to 1, the same way resolve_image() does a whole vector of them
+ */
+static inline float tonemap_channel(float c) {
+    c = c > 0 ? c : 0;
+    if (render_options.tonemap == TONEMAP_REINHARD)
+        return c / (1 + c);
+    return c < 1 ? c : 1;
+}
+
+/**
+ * Turns the linear colors of an image into its 8 bit pixels in one sweep, scaling them by the exposure, mapping them
+ * into 0 to 1 with the tone mapping operator and quantizing them. The colors and the pixels are both walked as flat
+ * arrays of channels, RESOLVE_LANES at a time with the compiler's generic vector extension, since the scalar loop's
+ * comparisons keep it from being turned into SIMD on its own
+ * @param img - image with its linear colors filled in
+ */
+void resolve_image(image *img) {
+    size_t n = (size_t)3 * img->width * img->height;
+    const float *in = img->hdr;
+    unsigned char *out = (unsigned char *)img->pixmap;
+    float scale = (float)exp2(render_options.exposure);
+    boolean reinhard = render_options.tonemap == TONEMAP_REINHARD;
+    channel_lanes one = (channel_lanes){0} + 1;
+    size_t k = 0;
+    for (; k + RESOLVE_LANES <= n; k += RESOLVE_LANES) {
+        channel_lanes c;
+        memcpy(&c, &in[k], sizeof(c));
+        c = c * scale;
+        // negative and nan channels go to 0
+        c = (channel_lanes)((c > 0) & (channel_mask)c);
+        if (reinhard) {
+            c = c / (1 + c);
+        }
+        else {
+            channel_mask over = c > 1;
+            c = (channel_lanes)((over & (channel_mask)one) | (~over & (channel_mask)c));
+        }
+        channel_bytes q = __builtin_convertvector(__builtin_convertvector(c * MAX_COLOR_VAL, channel_mask),
+                                                  channel_bytes);
+        memcpy(&out[k], &q, sizeof(q));
+    }
+    for (; k < n; k++)
+        out[k] = (unsigned char)(MAX_COLOR_VAL * tonemap_channel(in[k] * scale));
+}
+
+/**
+ * Zeroes the rows of a tile's linear colors and pixels, from the thread that will render the tile
+ */
+static void first_touch_tile(Tile *tile, int thread, void *arg) {
+    image *img = arg;
+    for (int i = tile->y0; i < tile->y1; i++) {
+        memset(&img->hdr[(size_t)3 * (i * img->width + tile->x0)], 0, sizeof(float[3]) * (tile->x1 - tile->x0));
+        memset(&img->pixmap[(size_t)i * img->width + tile->x0], 0, sizeof(RGBPixel) * (tile->x1 - tile->x0));
+    }
+}
+
+/**
+ * Writes every pixel of a newly allocated image for the first time from the tile pool, before anything else does.
+ * With pinned threads each band of tiles goes to the same NUMA node in every batch, so this places each band's
+ * memory on the node whose threads render it
+ * @param img - image whose hdr and pixmap haven't been written yet
+ */
+void first_touch_image(image *img) {
+    Tile *tiles;
+    int ntiles = make_tiles(img->width, img->height, &tiles);
+    tile_pool_run(tiles, ntiles, img->height, first_touch_tile, img);
+    free(tiles);
 }
 
 /** Tests for an intersection between a ray and a plane
@@ -58,19 +231,19 @@ void set_pixel_color(double *color, int row, int col, image *img) {
  * @param Norm - 3d vector of the normal to the plane
  * @return - distance to the object if intersects, otherwise, -1
  */
-double plane_intersect(Ray *ray, double *Pos, double *Norm) {
-    normalize(Norm);
+real plane_intersect(Ray *ray, real *Pos, real *Norm) {
+    // Norm was normalized by prepare_scene()
     // determine if plane is parallel to the ray
-    double vd = v3_dot(Norm, ray->direction);
+    real vd = v3_dot(Norm, ray->direction);
 
-    if (fabs(vd) < 0.0001) return -1;
+    if (fabs(vd) < PARALLEL_EPSILON) return -1;
 
-    double vector[3];
+    real vector[3];
     v3_sub(Pos, ray->origin, vector);
-    double t = v3_dot(vector, Norm) / vd;
+    real t = v3_dot(vector, Norm) / vd;
 
     // no intersection
-    if (t < 0.0)
+    if (t < 0)
         return -1;
 
     return t;
@@ -84,8 +257,8 @@ double plane_intersect(Ray *ray, double *Pos, double *Norm) {
  * @param r - radius of the sphere
  * @return - distance to the object if intersects, otherwise, -1
  */
-double sphere_intersect(Ray *ray, double *C, double r, boolean *in_sphere) {
-    double b, c;
+real sphere_intersect(Ray *ray, real *C, real r, boolean *in_sphere) {
+    real b, c;
     V3 vector_diff;
     v3_sub(ray->origin, C, vector_diff);
 
@@ -94,42 +267,53 @@ double sphere_intersect(Ray *ray, double *C, double r, boolean *in_sphere) {
     c = sqr(vector_diff[0]) + sqr(vector_diff[1]) + sqr(vector_diff[2]) - sqr(r);
 
     // check that discriminant is <, =, or > 0
-    double disc = sqr(b) - 4*c;
-    double t;  // solutions
+    real disc = sqr(b) - 4*c;
+    real t;    // solutions
     if (disc < 0) {
         return -1; // no solution
     }
     disc = sqrt(disc);
 
-    t = (-b - disc) / 2.0;
+    t = (-b - disc) / 2;
     *(in_sphere) = false;
-    if (t < 0.0) {
+    if (t < 0) {
         *(in_sphere) = true;
-        t = (-b + disc) / 2.0;
+        t = (-b + disc) / 2;
     }
-    if (t < 0.0)
+    if (t < 0)
         return -1;
     return t;
 }
 
-void normal_vector(int obj_index, V3 position, V3 normal) {
-    if (objects[obj_index].type == PLANE) {
+void normal_vector(int obj_index, int triangle, V3 position, V3 normal) {
+    if (obj_index >= nobjects) {
+        instance_normal(obj_index, triangle, position, normal);
+    }
+    else if (objects[obj_index].type == PLANE) {
         v3_copy(objects[obj_index].plane.normal, normal);
     }
     else if (objects[obj_index].type == SPHERE) {
         v3_sub(position, objects[obj_index].sphere.position, normal);
     }
+    else if (objects[obj_index].type == MESH) {
+        mesh_normal(&objects[obj_index].mesh, triangle, normal);
+    }
     else {
         fprintf(stderr, "Error: normal_vector: This object type does not have a normal vector\n");
+        v3_zero(normal);
     }
 }
 
-double get_reflectivity(int obj_index) {
-    if (objects[obj_index].type == PLANE) {
-        return objects[obj_index].plane.reflect;
+real get_reflectivity(int obj_index) {
+    object *obj = hit_object(obj_index);
+    if (obj->type == PLANE) {
+        return obj->plane.reflect;
     }
-    else if (objects[obj_index].type == SPHERE) {
-        return objects[obj_index].sphere.reflect;
+    else if (obj->type == SPHERE) {
+        return obj->sphere.reflect;
+    }
+    else if (obj->type == MESH) {
+        return obj->mesh.reflect;
     }
     else {
         fprintf(stderr, "Error: get_reflectivity: Specified object does not have a reflect property\n");
@@ -137,12 +321,16 @@ double get_reflectivity(int obj_index) {
     }
 }
 
-double get_refractivity(int obj_index) {
-    if (objects[obj_index].type == PLANE) {
-        return objects[obj_index].plane.refract;
+real get_refractivity(int obj_index) {
+    object *obj = hit_object(obj_index);
+    if (obj->type == PLANE) {
+        return obj->plane.refract;
     }
-    else if (objects[obj_index].type == SPHERE) {
-        return objects[obj_index].sphere.refract;
+    else if (obj->type == SPHERE) {
+        return obj->sphere.refract;
+    }
+    else if (obj->type == MESH) {
+        return obj->mesh.refract;
     }
     else {
         fprintf(stderr, "Error: get_refractivity: Specified object does not have a refract property\n");
@@ -150,13 +338,17 @@ double get_refractivity(int obj_index) {
     }
 }
 
-double get_ior(int obj_index) {
-    double ior;
-    if (objects[obj_index].type == PLANE) {
-        ior = objects[obj_index].plane.ior;
+real get_ior(int obj_index) {
+    object *obj = hit_object(obj_index);
+    real ior;
+    if (obj->type == PLANE) {
+        ior = obj->plane.ior;
     }
-    else if (objects[obj_index].type == SPHERE) {
-        ior = objects[obj_index].sphere.ior;
+    else if (obj->type == SPHERE) {
+        ior = obj->sphere.ior;
+    }
+    else if (obj->type == MESH) {
+        ior = obj->mesh.ior;
     }
     else {
         fprintf(stderr, "Error: get_ior: Specified object does not have an ior property\n");
@@ -174,13 +366,13 @@ double get_ior(int obj_index) {
  * @param direction - direction vector that we are reflecting
  * @param position  - position where the direction vector is hitting the object (so we can determine the normal vector)
  * @param obj_index - index into objects array. i.e. the current object we are reflecting off of
+ * @param triangle - triangle that was hit if the object is a mesh, see mesh_intersect()
  * @param reflection - the resulting reflection vector
  */
-void reflection_vector(V3 direction, V3 position, int obj_index, V3 reflection) {
+void reflection_vector(V3 direction, V3 position, int obj_index, int triangle, V3 reflection) {
     V3 normal;
-    normal_vector(obj_index, position, normal);
-    normalize(normal);
-    v3_reflect(direction, normal, reflection);
+    normal_vector(obj_index, triangle, position, normal);
+    v4_store(v4_reflect(v4_load(direction), v4_normalize(v4_load(normal))), reflection);
 }
 
 /**
@@ -189,18 +381,18 @@ void reflection_vector(V3 direction, V3 position, int obj_index, V3 reflection)
  * @param direction - V3 direction of ray
  * @param position - V3 current position
  * @param obj_index - index into the objects array that we want to calculate the refraction of
+ * @param triangle - triangle that was hit if the object is a mesh, see mesh_intersect()
  * @param ext_ior - The index of refraction of the space that we are currently in
  * @param refracted_vector - V3 output vector. This is the resulting refraction vector
  * @param in_sphere - boolean representing whether or not our current position is inside of a sphere
  */
-void refraction_vector(V3 direction, V3 position, int obj_index, double ext_ior, V3 refracted_vector, boolean *in_sphere) {
+void refraction_vector(V3 direction, V3 position, int obj_index, int triangle, real ext_ior, V3 refracted_vector,
+                       boolean *in_sphere) {
     // initializations and variables setup
-    V3 dir, pos, normal, a, b;
-    v3_copy(direction, dir);
-    v3_copy(position, pos);
-    normalize(dir);
-    normalize(pos);
-    double int_ior = get_ior(obj_index);
+    V3 pos, n;
+    V4 dir = v4_normalize(v4_load(direction));
+    v4_store(v4_normalize(v4_load(position)), pos);
+    real int_ior = get_ior(obj_index);
 
     // This only works for this project...Assume that there are no objects intersecting other objects. Check if we are
     // already inside of a sphere. If we are, then the next ior will be 1 (air)
@@ -208,26 +400,24 @@ void refraction_vector(V3 direction, V3 position, int obj_index, double ext_ior,
         int_ior = 1;
 
     // find normal vector of current object
-    normal_vector(obj_index, pos, normal);
+    normal_vector(obj_index, triangle, pos, n);
+    V4 normal = v4_load(n);
 
     // reverse the normal if we are inside of a sphere, heading outward
     if ((*in_sphere) == true)
-        v3_scale(normal, -1, normal);
+        normal = v4_scale(normal, -1);
 
-    normalize(normal);
+    normal = v4_normalize(normal);
 
     // create coordinate frame with a and b, where b is tangent to the object intersection
-    v3_cross(normal, dir, a);
-    normalize(a);
-    v3_cross(a, normal, b);
+    V4 a = v4_normalize(v4_cross(normal, dir));
+    V4 b = v4_cross(a, normal);
 
     // find transmission vector angle and direction
-    double sin_theta = v3_dot(dir, b);
-    double sin_phi = (ext_ior / int_ior) * sin_theta;
-    double cos_phi = sqrt(1 - sqr(sin_phi));
-    v3_scale(normal, -1*cos_phi, normal);
-    v3_scale(b, sin_phi, b);
-    v3_add(normal , b, refracted_vector);
+    real sin_theta = v4_dot(dir, b);
+    real sin_phi = (ext_ior / int_ior) * sin_theta;
+    real cos_phi = sqrt(1 - sqr(sin_phi));
+    v4_store(v4_add(v4_scale(normal, -1*cos_phi), v4_scale(b, sin_phi)), refracted_vector);
 }
 
 /**
@@ -235,36 +425,71 @@ void refraction_vector(V3 direction, V3 position, int obj_index, double ext_ior,
  * @param ray - the ray we are shooting out to find an intersection with
  * @param self_index - if < 0, ignore this. If >= 0, it is the index of the object we are getting distance FROM
  * @param max_distance - This is the maximum distance we care to check. e.g. distance to a light source
- * @param ret_index - the index in objects array of the closest object we intersected
+ * @param ret_index - the index in objects array of the closest object we intersected, or past its end for a group member
+ * hit through an instance, see hit_object()
  * @param ret_best_t - the distance of the closest object
  * @param ret_in_sphere - boolean representing whether or not our current position is inside of a sphere
+ * @param ret_triangle - the triangle hit if the closest object is a mesh, -1 otherwise
  */
-void shoot(Ray *ray, int self_index, double max_distance, int *ret_index, double *ret_best_t, boolean *ret_in_sphere) {
+void shoot(Ray *ray, int self_index, real max_distance, int *ret_index, real *ret_best_t, boolean *ret_in_sphere,
+           int *ret_triangle) {
+    if (render_options.accel == ACCEL_GRID) {
+        grid_shoot(ray, self_index, max_distance, ret_index, ret_best_t, ret_in_sphere, ret_triangle);
+        instances_shoot(ray, self_index, max_distance, ret_index, ret_best_t, ret_in_sphere, ret_triangle);
+        watch_record(ray, max_distance, *ret_index, *ret_best_t);
+        return;
+    }
     int best_o = -1;
     boolean best_in_sphere = false; // tells us if we are inside the sphere
-    double best_t = INFINITY;
+    real best_t = INFINITY;
+    int best_triangle = -1;
+    counters.rays++;
     for (int i=0; objects[i].type != 0; i++) {
         // if self_index was passed in as > 0, we must ignore object i because we are checking distance to another
-        // object from the one at self_index.
-        if (self_index == i) continue;
+        // object from the one at self_index. A mesh can shadow itself, so it is only kept from hitting the spot the
+        // ray leaves from
+        if (self_index == i) {
+            if (objects[i].type == MESH) {
+                counters.tests++;
+                boolean back_face = false;
+                int triangle;
+                real t = mesh_intersect(ray, &objects[i].mesh, ray_offset(ray->origin), max_distance, &back_face,
+                                        &triangle);
+                if (t > 0 && t < best_t) {
+                    best_t = t;
+                    best_o = i;
+                    best_in_sphere = back_face;
+                    best_triangle = triangle;
+                }
+            }
+            continue;
+        }
 
         // we need to run intersection test on each object
-        double t = 0;
+        real t = 0;
         boolean in_sphere = false;
+        int triangle = -1;
         switch(objects[i].type) {
             case 0:
                 printf("no object found\n");
                 break;
             case CAMERA:
+            case INSTANCE:  // tested below, through the instance BVH
                 break;
             case SPHERE:
+                counters.tests++;
                 t = sphere_intersect(ray, objects[i].sphere.position,
                                      objects[i].sphere.radius, &in_sphere);
                 break;
             case PLANE:
+                counters.tests++;
                 t = plane_intersect(ray, objects[i].plane.position,
                                     objects[i].plane.normal);
                 break;
+            case MESH:
+                counters.tests++;
+                t = mesh_intersect(ray, &objects[i].mesh, 0, max_distance, &in_sphere, &triangle);
+                break;
             default:
                 // Error
                 exit(1);
@@ -275,11 +500,52 @@ void shoot(Ray *ray, int self_index, double max_distance, int *ret_index, double
             best_t = t;
             best_o = i;
             best_in_sphere = in_sphere;
+            best_triangle = triangle;
         }
     }
+    instances_shoot(ray, self_index, max_distance, &best_o, &best_t, &best_in_sphere, &best_triangle);
+    watch_record(ray, max_distance, best_o, best_t);
     (*ret_index) = best_o;
     (*ret_best_t) = best_t;
     (*ret_in_sphere) = best_in_sphere;
+    (*ret_triangle) = best_triangle;
+}
+
+/**
+ * Finds the normal and the colors of an object at a point on its surface
+ * @param obj_index - index of the object
+ * @param triangle - triangle that was hit if the object is a mesh, see mesh_intersect()
+ * @param point - point on the object
+ * @param normal - set to the normalized surface normal
+ * @param diff_color - set to the object's diffuse color
+ * @param spec_color - set to the object's specular color
+ */
+void surface_shading(int obj_index, int triangle, real point[3], real normal[3], real diff_color[3],
+                     real spec_color[3]) {
+    object *obj = hit_object(obj_index);
+    if (obj_index >= nobjects) {
+        instance_normal(obj_index, triangle, point, normal);
+        v3_copy(obj->sphere.diff_color, diff_color);
+        v3_copy(obj->sphere.spec_color, spec_color);
+    } else if (obj->type == PLANE) {
+        v3_copy(obj->plane.normal, normal);
+        v3_copy(obj->plane.diff_color, diff_color);
+        v3_copy(obj->plane.spec_color, spec_color);
+    } else if (obj->type == SPHERE) {
+        // find normal of our current intersection on the sphere
+        v3_sub(point, obj->sphere.position, normal);
+        // copy the colors into temp variables
+        v3_copy(obj->sphere.diff_color, diff_color);
+        v3_copy(obj->sphere.spec_color, spec_color);
+    } else if (obj->type == MESH) {
+        mesh_normal(&obj->mesh, triangle, normal);
+        v3_copy(obj->mesh.diff_color, diff_color);
+        v3_copy(obj->mesh.spec_color, spec_color);
+    } else {
+        fprintf(stderr, "Error: shade: Trying to shade unsupported type of object\n");
+        exit(1);
+    }
+    v4_store(v4_normalize_fast(v4_load(normal)), normal);
 }
 
 /**
@@ -287,55 +553,44 @@ void shoot(Ray *ray, int self_index, double max_distance, int *ret_index, double
  * and specular colors of the object.
  * @param ray - the ray coming into the object at objects[obj_index]
  * @param obj_index - index into the objects array. i.e. the current object we are determining the color of
+ * @param triangle - triangle that was hit if the object is a mesh, see mesh_intersect()
  * @param position - The current vector position that the ray has intersected with the object
  * @param light - The specific light object in the scene that we are using to determine the shade of this object
  * @param max_dist - The furthest distance from the object we should be allowing. This is the distance from the current
  * object to the light object position
  * @param color - This is the final color value when the function is complete
  */
-void direct_shade(Ray *ray, int obj_index, double position[3], Light *light, double max_dist, double color[3]) {
-    double normal[3];
-    double obj_diff_color[3];
-    double obj_spec_color[3];
+void direct_shade(Ray *ray, int obj_index, int triangle, real position[3], Light *light, real max_dist,
+                  real color[3]) {
+    real normal[3];
+    real obj_diff_color[3];
+    real obj_spec_color[3];
 
     // find normal and color
-    if (objects[obj_index].type == PLANE) {
-        v3_copy(objects[obj_index].plane.normal, normal);
-        v3_copy(objects[obj_index].plane.diff_color, obj_diff_color);
-        v3_copy(objects[obj_index].plane.spec_color, obj_spec_color);
-    } else if (objects[obj_index].type == SPHERE) {
-        // find normal of our current intersection on the sphere
-        v3_sub(ray->origin, objects[obj_index].sphere.position, normal);
-        // copy the colors into temp variables
-        v3_copy(objects[obj_index].sphere.diff_color, obj_diff_color);
-        v3_copy(objects[obj_index].sphere.spec_color, obj_spec_color);
-    } else {
-        fprintf(stderr, "Error: shade: Trying to shade unsupported type of object\n");
-        exit(1);
-    }
-    normalize(normal);
+    surface_shading(obj_index, triangle, ray->origin, normal, obj_diff_color, obj_spec_color);
     // find light, reflection and camera vectors
-    double L[3];
-    double R[3];
-    double V[3];
-    v3_copy(ray->direction, L);
-    normalize(L);
-    v3_reflect(L, normal, R);
+    real L[3];
+    real R[3];
+    real V[3];
+    V4 l = v4_normalize(v4_load(ray->direction));
+    V4 n = v4_normalize(v4_load(normal));
+    v4_store(l, L);
+    v4_store(v4_reflect(l, n), R);
+    v4_store(n, normal);
     v3_copy(position, V);
-    double diffuse[3];
-    double specular[3];
+    real diffuse[3];
+    real specular[3];
     scale_color(diffuse, 0, diffuse);
     scale_color(specular, 0, specular);
     calculate_diffuse(normal, L, light->color, obj_diff_color, diffuse);
-    calculate_specular(SHININESS, L, R, normal, V, obj_spec_color, light->color, specular);
+    calculate_specular(shininess, L, R, normal, V, obj_spec_color, light->color, specular);
 
     // calculate the angular and radial attenuation
-    double fang;
-    double frad;
+    real fang;
+    real frad;
     // get the vector from the object to the light
-    double light_to_obj_dir[3];
-    v3_copy(L, light_to_obj_dir);
-    v3_scale(light_to_obj_dir, -1, light_to_obj_dir);
+    real light_to_obj_dir[3];
+    v4_store(v4_scale(l, -1), light_to_obj_dir);
 
     if (light->type == OBJECT) { // the light source is a reflection off of another object, so don't calculate attenuation
         fang = 1;
@@ -350,19 +605,94 @@ void direct_shade(Ray *ray, int obj_index, double position[3], Light *light, dou
     color[2] += frad * fang * (specular[2] + diffuse[2]);
 }
 
+/* lights shaded at the current point, reused across calls to shade() */
+static __thread LightBatch shadow_batch;
+
+/* pixel whose first hit shade() is capturing into render_options.gbuffer, -1 when not capturing */
+static __thread int capture_pixel = -1;
+
+static inline GBuffer *capture_target() {
+    return capture_pixel >= 0 ? render_options.gbuffer : NULL;
+}
+
+/**
+ * Adds the light reaching a point straight from the light sources, casting a shadow ray towards every light that can
+ * reach it and shading them all at once. With a G-buffer the color so far is kept as the pixel's indirect color, and
+ * each light that hasn't moved since the G-buffer was captured uses the shadow ray result it holds, or records one
+ * @param ray - ray that hit the point, normalized
+ * @param obj_index - index of the object that was hit
+ * @param triangle - triangle that was hit if the object is a mesh, see mesh_intersect()
+ * @param point - where it was hit
+ * @param gb - G-buffer of the pixel's first hit, or NULL
+ * @param pixel - index of the pixel in gb
+ * @param color - the direct light is added to this
+ * @param in_sphere - Boolean that represents whether or not our current position is inside of a sphere
+ */
+static void shade_direct(Ray *ray, int obj_index, int triangle, real point[3], GBuffer *gb, int pixel,
+                         real color[3], boolean *in_sphere) {
+    if (gb != NULL)
+        copy_color(color, gb->indirect[pixel]);
+    Ray shadow_ray;
+    v3_copy(point, shadow_ray.origin);
+    LightChoice *choices;
+    int nchoices = select_lights(point, &choices);
+    shadow_batch.n = 0;
+    for (int c=0; c<nchoices; c++) {
+        // without a choice array every light is taken, at full weight
+        int l = choices != NULL ? choices[c].light : c;
+        real weight = choices != NULL ? choices[c].weight : 1;
+        Light *light = &lights[l];
+        // find new ray direction
+        V4 to_light = v4_sub(v4_load(light->position), v4_load(point));
+        real distance_to_light = v4_len(to_light);
+        v4_store(v4_div(to_light, distance_to_light), shadow_ray.direction);
+
+        // don't bother with a shadow ray if the light can't reach this spot anyway
+        if (!light_reaches(light, shadow_ray.direction, distance_to_light))
+            continue;
+
+        // without shadows every light that faces the point reaches it
+        boolean known = gb != NULL && render_options.shadows && light->position[0] == gb->light_positions[l][0] &&
+                        light->position[1] == gb->light_positions[l][1] &&
+                        light->position[2] == gb->light_positions[l][2];
+        int visibility = !render_options.shadows ? VISIBILITY_LIT :
+                         known ? gbuffer_visibility(gb, pixel, l) : VISIBILITY_UNKNOWN;
+        if (visibility == VISIBILITY_UNKNOWN) {
+            // new check new ray for intersections with other objects, if there was one in the way it's shadow
+            int best_o, best_triangle;
+            real best_t;
+            shoot(&shadow_ray, obj_index, distance_to_light, &best_o, &best_t, in_sphere, &best_triangle);
+            visibility = best_o == -1 ? VISIBILITY_LIT : VISIBILITY_SHADOWED;
+            if (known)
+                gbuffer_set_visibility(gb, pixel, l, visibility);
+        }
+        light_batch_push(&shadow_batch, l, shadow_ray.direction, distance_to_light,
+                         visibility == VISIBILITY_LIT ? weight : 0);
+    }
+    if (shadow_batch.n > 0) {
+        real normal[3], obj_diff_color[3], obj_spec_color[3];
+        surface_shading(obj_index, triangle, point, normal, obj_diff_color, obj_spec_color);
+        shade_light_batch(&shadow_batch, normal, ray->direction, obj_diff_color, obj_spec_color, color);
+    }
+}
+
 /**
  * shade - This function does the recursive raytracing, taking into account the reflection and refraction vectors of
  * each intersection and recursively shading
  * @param ray - original ray -- starting point for testing shade
  * @param obj_index  - index of the current object we are running shade on
+ * @param triangle - triangle that was hit if the object is a mesh, see mesh_intersect()
  * @param t - distance to the object
  * @param color - this will be the output color after shade calculations are done
  * @param rec_level - This is the current level of recursion we are on
+ * @param weight - the most this ray's color can add to the pixel, rays reflected or refracted with less than
+ * render_options.min_weight left aren't traced
  * @param in_sphere - Boolean that represents whether or not our current position is inside of a sphere
  */
-void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, double color[3], boolean *in_sphere) {
+void shade(Ray *ray, int obj_index, int triangle, real t, real curr_ior, int rec_level, real weight, real color[3],
+           boolean *in_sphere) {
     // check that we haven't done too many recursions
-    if (rec_level > MAX_REC_LEVEL) { // base case, reached max number of recursions
+    if (rec_level > render_options.max_depth) { // base case, reached max number of recursions
         // return black for color
         scale_color(color, 0, color);
         return;
@@ -376,8 +706,8 @@ void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, do
         exit(1);
     }
 
-    double new_origin[3] = {0, 0, 0};
-    double new_dir[3] = {0, 0, 0};
+    real new_origin[3] = {0, 0, 0};
+    real new_dir[3] = {0, 0, 0};
 
     // find new ray origin
     v3_scale(ray->direction, t, new_origin);
@@ -392,14 +722,16 @@ void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, do
     V3 reflection = {0, 0, 0};
     V3 refraction = {0, 0, 0};
     normalize(ray->direction);
-    reflection_vector(ray->direction, ray_new.origin, obj_index, reflection);
-    refraction_vector(ray->direction, ray_new.origin, obj_index, curr_ior, refraction, in_sphere);
+    reflection_vector(ray->direction, ray_new.origin, obj_index, triangle, reflection);
+    refraction_vector(ray->direction, ray_new.origin, obj_index, triangle, curr_ior, refraction, in_sphere);
 
     // create temp variables to use for recursively shading
     int best_refl_o;     // index of closest reflected object
-    double best_refl_t;  // distance of closest reflected object
+    real best_refl_t;    // distance of closest reflected object
     int best_refr_o;     // index of closest refracted object
-    double best_refr_t;  // distance of closest refracted object
+    real best_refr_t;    // distance of closest refracted object
+    int best_refl_tri;   // triangle of closest reflected object, if it is a mesh
+    int best_refr_tri;   // triangle of closest refracted object, if it is a mesh
 
 
     Ray ray_reflected = {
@@ -413,49 +745,59 @@ void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, do
 
     // offset the new origin of each ray by just a little in the direction of the ray, so we can avoid running into the same object again
     V3 offset = {0, 0, 0};
-    v3_scale(ray_reflected.direction, 0.001, offset);
+    v3_scale(ray_reflected.direction, ray_offset(new_origin), offset);
     v3_add(ray_reflected.origin, offset, ray_reflected.origin);
     v3_zero(offset);
-    v3_scale(ray_refracted.direction, 0.001, offset);
+    v3_scale(ray_refracted.direction, ray_offset(new_origin), offset);
     v3_add(ray_refracted.origin, offset, ray_refracted.origin);
 
     normalize(ray_reflected.direction);
     normalize(ray_refracted.direction);
 
-    // shoot new reflection vector out as a new ray, to check if there is an intersection with another object
-    shoot(&ray_reflected, -1, INFINITY, &best_refl_o, &best_refl_t, in_sphere);
+    // shoot new reflection vector out as a new ray, to check if there is an intersection with another object. Each
+    // child ray keeps its own inside-of-a-sphere flag, so shading one doesn't change what the other refracts into
+    boolean refl_in_sphere = false;
+    boolean refr_in_sphere = false;
+    shoot(&ray_reflected, -1, INFINITY, &best_refl_o, &best_refl_t, &refl_in_sphere, &best_refl_tri);
 
     // we only want to shoot and possibly hit the same object we are currently on if it is a sphere, not a plane
-    if (objects[obj_index].type == PLANE)
-        shoot(&ray_refracted, -1, INFINITY, &best_refr_o, &best_refr_t, in_sphere);
+    if (hit_object(obj_index)->type == PLANE)
+        shoot(&ray_refracted, -1, INFINITY, &best_refr_o, &best_refr_t, &refr_in_sphere, &best_refr_tri);
     else
-        shoot(&ray_refracted, -1, INFINITY, &best_refr_o, &best_refr_t, in_sphere);
+        shoot(&ray_refracted, -1, INFINITY, &best_refr_o, &best_refr_t, &refr_in_sphere, &best_refr_tri);
 
     if (best_refl_o == -1 && best_refr_o == -1) { // there were no objects that we intersected with
         scale_color(color, 0, color);
     }
     else {  // we had an intersection, so we need to recursively shade...
-        double reflection_color[3] = {0, 0, 0};
-        double refraction_color[3] = {0, 0, 0};
-        double reflect_constant = get_reflectivity(obj_index);
-        double refract_constant = get_refractivity(obj_index);
-        double refr_ior = 1;     // ior of closest object based on refraction vector
-        double refl_ior = 1;     // ior of closest object based on reflection vector
+        real reflection_color[3] = {0, 0, 0};
+        real refraction_color[3] = {0, 0, 0};
+        real reflect_constant = get_reflectivity(obj_index);
+        real refract_constant = get_refractivity(obj_index);
+        real refr_ior = 1;       // ior of closest object based on refraction vector
+        real refl_ior = 1;       // ior of closest object based on reflection vector
 
         // create temp lights to hold the reflection and refraction colors and directions
+        V3 refl_direction, refl_color, refr_direction, refr_color;
         Light refl_light;
         refl_light.type = OBJECT;
-        refl_light.direction = malloc(sizeof(V3));
-        refl_light.color = malloc(sizeof(double) * 3);
+        refl_light.direction = refl_direction;
+        refl_light.color = refl_color;
         Light refr_light;
         refr_light.type = OBJECT;
-        refr_light.direction = malloc(sizeof(V3));
-        refr_light.color = malloc(sizeof(double) * 3);
+        refr_light.direction = refr_direction;
+        refr_light.color = refr_color;
 
+        // a child whose color would add too little to the pixel is left black instead of traced
+        real refl_weight = weight * reflect_constant;
+        real refr_weight = weight * refract_constant;
+        boolean cut = render_options.min_weight > 0;
         if (best_refl_o >= 0) {
             // recursively shade based on reflection
             refl_ior = get_ior(best_refl_o);
-            shade(&ray_reflected, best_refl_o, best_refl_t, refl_ior, rec_level+1, reflection_color, in_sphere);
+            if (!cut || refl_weight >= render_options.min_weight)
+                shade(&ray_reflected, best_refl_o, best_refl_tri, best_refl_t, refl_ior, rec_level+1, refl_weight,
+                      reflection_color, &refl_in_sphere);
             v3_scale(reflection_color, reflect_constant, reflection_color);
 
             v3_scale(reflection, -1, refl_light.direction);
@@ -469,12 +811,14 @@ void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, do
             v3_sub(ray_reflected.direction, ray_new.origin, ray_new.direction);
             normalize(ray_new.direction);
 
-            direct_shade(&ray_new, obj_index, ray->direction, &refl_light, INFINITY, color);
+            direct_shade(&ray_new, obj_index, triangle, ray->direction, &refl_light, INFINITY, color);
         }
         if (best_refr_o >= 0) {
             refr_ior = get_ior(best_refr_o);
             // recursively shade based on refraction
-            shade(&ray_refracted, best_refr_o, best_refr_t, refr_ior, rec_level+1, refraction_color, in_sphere);
+            if (!cut || refr_weight >= render_options.min_weight)
+                shade(&ray_refracted, best_refr_o, best_refr_tri, best_refr_t, refr_ior, rec_level+1, refr_weight,
+                      refraction_color, &refr_in_sphere);
             v3_scale(refraction_color, refract_constant, refraction_color);
 
             v3_scale(refraction, -1, refr_light.direction);
@@ -488,7 +832,7 @@ void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, do
             normalize(ray_new.direction);
 
             v3_add(color, refraction_color, color);   // doing this instead of direct_shade gets me transparent objects, but doesn't work when there are multiple reflective surfaces
-            //direct_shade(&ray_new, obj_index, ray->direction, &refr_light, INFINITY, color); // this version allows reflections to work
+            //direct_shade(&ray_new, obj_index, triangle, ray->direction, &refr_light, INFINITY, color); // this version allows reflections to work
         }
         // now add what is left of the original color of the object to the current intersection point
         if (reflect_constant == -1)
@@ -500,88 +844,697 @@ void shade(Ray *ray, int obj_index, double t, double curr_ior, int rec_level, do
             copy_color(background_color, color);
         }
         else {
-            double color_diff = 1.0 - reflect_constant - refract_constant;
+            real color_diff = 1.0 - reflect_constant - refract_constant;
             if (fabs(color_diff) < 0.0001) // account for numbers that are really close to 0, but still negative
                 color_diff = 0;
-            double obj_color[3] = {0, 0, 0};
-            copy_color(objects[obj_index].plane.diff_color, obj_color);
+            real obj_color[3] = {0, 0, 0};
+            copy_color(hit_object(obj_index)->plane.diff_color, obj_color);
             scale_color(obj_color, color_diff, obj_color);
             color[0] += obj_color[0];
             color[1] += obj_color[1];
             color[2] += obj_color[2];
         }
-        //cleanup
-        free(refl_light.direction);
-        free(refl_light.color);
-        free(refr_light.direction);
-        free(refr_light.color);
     }
 
-    for (int i=0; i<nlights; i++) {
-        // find new ray direction
-        int best_o;
-        double best_t;
-        v3_zero(ray_new.direction);
-        v3_sub(lights[i].position, ray_new.origin, ray_new.direction);
-        double distance_to_light = v3_len(ray_new.direction);
-        normalize(ray_new.direction);
+    shade_direct(ray, obj_index, triangle, ray_new.origin, rec_level == 0 ? capture_target() : NULL, capture_pixel,
+                 color, in_sphere);
+}
+
+/**
+ * Small per-pixel random number generator used to jitter samples. Seeding it from the pixel coordinates keeps the
+ * output deterministic no matter what order the pixels are traced in
+ * @param state - generator state, must be non-zero
+ * @return - uniformly distributed number in [0, 1)
+ */
+static double next_random(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (double)((*state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Sets up the camera frame and the viewplane for an image. A camera with a field of view gets a viewplane with the
+ * image's aspect ratio
+ * @param view - view to fill in
+ * @param camera - camera object from the scene
+ * @param img_width - image width in pixels
+ * @param img_height - image height in pixels
+ */
+void view_init(View *view, Camera *camera, int img_width, int img_height) {
+    view->height = camera->fov > 0 ? 2 * tan(camera->fov * (M_PI / 360.0)) : camera->height;
+    view->width = camera->fov > 0 ? view->height * img_width / img_height : camera->width;
+    view->pixwidth = view->width / (real)img_width;
+    view->pixheight = view->height / (real)img_height;
+
+    V3 up = {0, 1, 0};
+    v3_zero(view->origin);
+    view->forward[0] = 0;
+    view->forward[1] = 0;
+    view->forward[2] = 1;
+    if (camera->position != NULL)
+        v3_copy(camera->position, view->origin);
+    if (camera->look_at != NULL) {
+        v3_sub(camera->look_at, view->origin, view->forward);
+        if (v3_len(view->forward) == 0) {
+            fprintf(stderr, "Error: view_init: camera can't look at its own position\n");
+            exit(1);
+        }
+        normalize(view->forward);
+    }
+    if (camera->up != NULL)
+        v3_copy(camera->up, up);
+    v3_cross(up, view->forward, view->right);
+    if (v3_len(view->right) < PARALLEL_EPSILON) {
+        fprintf(stderr, "Error: view_init: camera up can't be along the direction it looks\n");
+        exit(1);
+    }
+    normalize(view->right);
+    v3_cross(view->forward, view->right, view->up);
+}
+
+/**
+ * Finds where the primary ray through a point inside of a pixel crosses the viewplane, in units of the camera's
+ * right and up vectors from the viewplane center
+ * @param view - camera and viewplane
+ * @param row - which row the pixel is on
+ * @param col - which column the pixel is on
+ * @param sx - horizontal offset inside of the pixel, 0 to 1 (0.5 is the center)
+ * @param sy - vertical offset inside of the pixel, 0 to 1 (0.5 is the center)
+ * @param spot - the resulting x and y on the viewplane
+ */
+static void viewplane_spot(View *view, int row, int col, real sx, real sy, real spot[2]) {
+    spot[0] = -view->width/2 + view->pixwidth*(col + sx);
+    spot[1] = -(-view->height/2 + view->pixheight*(row + sy));
+}
+
+/**
+ * Builds the primary ray going through a point inside of a pixel on the viewplane
+ * @param view - camera and viewplane
+ * @param row - which row the pixel is on
+ * @param col - which column the pixel is on
+ * @param sx - horizontal offset inside of the pixel, 0 to 1 (0.5 is the center)
+ * @param sy - vertical offset inside of the pixel, 0 to 1 (0.5 is the center)
+ * @param ray - the resulting ray from the camera
+ * @param spot - where the ray crosses the viewplane, see viewplane_spot()
+ */
+static void primary_ray(View *view, int row, int col, real sx, real sy, Ray *ray, real spot[2]) {
+    viewplane_spot(view, row, col, sx, sy, spot);
+    v3_copy(view->origin, ray->origin);
+    for (int k = 0; k < 3; k++)
+        ray->direction[k] = view->forward[k] + spot[0] * view->right[k] + spot[1] * view->up[k];
+    normalize(ray->direction);
+}
+
+/**
+ * Builds the primary rays through the centers of a run of pixels in one row. The point where the row starts on the
+ * viewplane is found once and each pixel steps along the row from it, in batches of PRIMARY_BATCH kept as separate x,
+ * y and z arrays so the compiler turns the loops into SIMD. The directions are summed in a different order than
+ * primary_ray() sums them, so they can differ from its rays in the last bits
+ * @param view - camera and viewplane
+ * @param row - which row the pixels are on
+ * @param col0 - column of the first pixel
+ * @param n - number of pixels
+ * @param rays - the resulting n rays
+ * @param spots - if not NULL, where each of the n rays crosses the viewplane, see viewplane_spot()
+ */
+static void primary_ray_row(View *view, int row, int col0, int n, Ray *rays, real (*spots)[2]) {
+    real x0 = -view->width/2;
+    real y = -(-view->height/2 + view->pixheight*(row + (real)0.5));
+    real base[3], step[3];
+    for (int k = 0; k < 3; k++) {
+        base[k] = view->forward[k] + x0 * view->right[k] + y * view->up[k];
+        step[k] = view->pixwidth * view->right[k];
+    }
+    for (int first = 0; first < n; first += PRIMARY_BATCH) {
+        int count = n - first < PRIMARY_BATCH ? n - first : PRIMARY_BATCH;
+        real dx[PRIMARY_BATCH], dy[PRIMARY_BATCH], dz[PRIMARY_BATCH];
+        for (int i = 0; i < PRIMARY_BATCH; i++) {
+            real c = col0 + first + i + (real)0.5;
+            dx[i] = base[0] + c * step[0];
+            dy[i] = base[1] + c * step[1];
+            dz[i] = base[2] + c * step[2];
+        }
+        for (int i = 0; i < PRIMARY_BATCH; i++) {
+            real len = sqrt(sqr(dx[i]) + sqr(dy[i]) + sqr(dz[i]));
+            dx[i] /= len;
+            dy[i] /= len;
+            dz[i] /= len;
+        }
+        for (int i = 0; i < count; i++) {
+            Ray *ray = &rays[first + i];
+            v3_copy(view->origin, ray->origin);
+            ray->direction[0] = dx[i];
+            ray->direction[1] = dy[i];
+            ray->direction[2] = dz[i];
+        }
+    }
+    if (spots != NULL) {
+        for (int i = 0; i < n; i++) {
+            spots[i][0] = x0 + view->pixwidth * (col0 + i + (real)0.5);
+            spots[i][1] = y;
+        }
+    }
+}
+
+/* everything a tile needs to render its part of the image */
+typedef struct render_job_t {
+    image *img;
+    View *view;
+    PrimaryVisibility vis;  // binned spheres for primary rays
+    FirstHit *hits;         // first hit through each pixel center, filled by the visibility pass of each tile
+    unsigned char *traced;  // progressive only: per pixel, 0 not traced, 1 traced at its center, 2 traced with the
+                            // full sample budget, by the refinement pass or by a lattice pass when that budget is 1
+    int step;               // progressive only: lattice spacing of the current pass, 0 for the refinement pass
+    double deadline;        // progressive only: wall clock time to stop at
+    int expired;            // progressive only: set once the deadline has passed
+    Tile *tiles;            // the tiles being rendered
+    TileDeps *deps;         // if not NULL, what each tile's rays touch is recorded here, see watch.h
+    GBuffer *gbuffer;       // relight only: the first hits being relit
+    AuxBuffers *aux;        // raycast_aux() only: the buffers being filled in
+    Checkpoint *checkpoint; // if not NULL, each tile is marked finished in it once rendered
+} RenderJob;
+
+/**
+ * Finds the color seen along a primary ray once its first hit is known
+ * @param ray - ray leaving the camera
+ * @param hit - closest object along the ray
+ * @param color - resulting color, background color if nothing was hit
+ */
+static void shade_first_hit(Ray *ray, FirstHit *hit, real color[3]) {
+    boolean in_sphere = hit->in_sphere;
+    v3_zero(color);
+    counters.samples++;
+    if (hit->t > 0 && hit->t != INFINITY && hit->obj != -1) {// there was an intersection
+        shade(ray, hit->obj, hit->triangle, hit->t, 1, 0, 1, color, &in_sphere);
+    }
+    else {
+        copy_color(background_color, color);
+    }
+}
+
+/**
+ * Records the first hit of a pixel in a G-buffer once shade_first_hit() has found its color. A pixel that hit
+ * nothing has no direct light, so all of its color is indirect
+ * @param gb - the G-buffer
+ * @param pixel - index of the pixel in gb
+ * @param hit - closest object through the pixel center
+ * @param color - color shade_first_hit() found for it
+ */
+static void capture_first_hit(GBuffer *gb, int pixel, FirstHit *hit, real color[3]) {
+    if (hit->t > 0 && hit->t != INFINITY && hit->obj != -1) {
+        gb->obj[pixel] = hit->obj;
+        gb->triangle[pixel] = hit->triangle;
+        gb->t[pixel] = hit->t;
+    }
+    else {
+        gb->obj[pixel] = -1;
+        gb->triangle[pixel] = -1;
+        gb->t[pixel] = INFINITY;
+        copy_color(color, gb->indirect[pixel]);
+    }
+}
+
+/**
+ * Finds the color seen along a single primary ray
+ * @param job - render job with the visibility structure
+ * @param ray - ray leaving the camera
+ * @param spot - where the ray crosses the viewplane, from primary_ray()
+ * @param row - pixel row the ray goes through
+ * @param col - pixel column the ray goes through
+ * @param color - resulting color, background color if nothing was hit
+ */
+static void trace_sample(RenderJob *job, Ray *ray, real spot[2], int row, int col, real color[3]) {
+    FirstHit hit;
+    primary_shoot(&job->vis, ray, spot, row, col, &hit);
+    shade_first_hit(ray, &hit, color);
+}
 
-        // new check new ray for intersections with other objects
-        shoot(&ray_new, obj_index, distance_to_light, &best_o, &best_t, in_sphere);
+/**
+ * Adds one sample to the running color sums of a pixel. The sums are over clamped colors since that is what ends
+ * up in the image
+ */
+static void accumulate_sample(real color[3], real sum[3], real sum_sqr[3]) {
+    for (int k = 0; k < 3; k++) {
+        real c = clamp(color[k]);
+        sum[k] += c;
+        sum_sqr[k] += c * c;
+    }
+}
 
-        if (best_o == -1) { // this means there was no object in the way between the current one and the light
-            direct_shade(&ray_new, obj_index, ray->direction, &lights[i], distance_to_light, color);
+/**
+ * Finds the color of one pixel. With one sample per pixel this is a single ray through the pixel center. Otherwise
+ * a stratified grid of jittered samples is taken first, then more jittered samples are added while the estimated
+ * variance of the pixel color is above the threshold and the pixel's sample budget is not used up
+ * @param job - render job with the viewplane and visibility structure
+ * @param row - which row the pixel is on
+ * @param col - which column the pixel is on
+ * @param max_samples - sample budget for the pixel
+ * @param color - the resulting pixel color
+ */
+static void render_pixel(RenderJob *job, int row, int col, int max_samples, real color[3]) {
+    View *view = job->view;
+    Ray ray;
+    real spot[2];
+    if (max_samples <= 1) {
+        primary_ray(view, row, col, 0.5, 0.5, &ray, spot);
+        trace_sample(job, &ray, spot, row, col, color);
+        return;
+    }
+
+    uint64_t rng = ((uint64_t)row << 32 | (uint64_t)col) * 0x9E3779B97F4A7C15ull + 1;
+    light_tree_seed((uint64_t)row << 32 | (uint64_t)col);
+    real sum[3] = {0, 0, 0};
+    real sum_sqr[3] = {0, 0, 0};
+    real sample[3];
+    int n = 0;
+
+    // stratified first pass: an m x m grid with one jittered sample in each cell
+    int m = (int)sqrt((real)render_options.min_samples);
+    if (m < 1)
+        m = 1;
+    if (m * m > max_samples)
+        m = (int)sqrt((real)max_samples);
+    for (int sy = 0; sy < m; sy++) {
+        for (int sx = 0; sx < m; sx++) {
+            primary_ray(view, row, col, (sx + next_random(&rng)) / m, (sy + next_random(&rng)) / m, &ray, spot);
+            trace_sample(job, &ray, spot, row, col, sample);
+            accumulate_sample(sample, sum, sum_sqr);
+            n++;
+        }
+    }
+
+    // refine while the variance of the mean is too large
+    while (n < max_samples) {
+        real max_var = 0;
+        for (int k = 0; k < 3; k++) {
+            real mean = sum[k] / n;
+            real var = (sum_sqr[k] / n - mean * mean) * n / (n - 1 > 0 ? n - 1 : 1);
+            if (var / n > max_var)
+                max_var = var / n;
         }
-        // there was an object in the way, so we don't do anything. It's shadow
+        if (max_var <= render_options.variance_threshold)
+            break;
+        primary_ray(view, row, col, next_random(&rng), next_random(&rng), &ray, spot);
+        trace_sample(job, &ray, spot, row, col, sample);
+        accumulate_sample(sample, sum, sum_sqr);
+        n++;
     }
+    v3_scale(sum, 1.0 / n, color);
+}
+
+/**
+ * Traces one pixel and writes it into the image, recording its cost if there is a cost map
+ */
+static void trace_pixel(RenderJob *job, int row, int col, int max_samples, real color[3]) {
+    // snapshot the counters so the cost of this pixel can be recorded
+    RenderCounters start = counters;
+    uint64_t start_cycles = read_cycles();
+
+    render_pixel(job, row, col, max_samples, color);
+    set_pixel_color(color, row, col, job->img);
+
+    if (render_options.cost_map != NULL)
+        cost_map_record(render_options.cost_map, row, col, &start, read_cycles() - start_cycles);
+}
+
+/**
+ * Shades a tile whose first-hit buffer is filled in, given its primary rays, with the breadth-first shader in
+ * wavefront.c. The cost of the batch can't be split between pixels, so it is spread evenly over the tile in the cost
+ * map
+ */
+static void shade_tile_batched(RenderJob *job, Tile *tile, Ray *rays) {
+    image *img = job->img;
+    int tile_w = tile->x1 - tile->x0;
+    int n = tile_w * (tile->y1 - tile->y0);
+    FirstHit *hits = arena_alloc(&frame_arena, sizeof(FirstHit) * n);
+    real (*colors)[3] = arena_alloc(&frame_arena, sizeof(real[3]) * n);
+    RenderCounters start = counters;
+    uint64_t start_cycles = read_cycles();
+    light_tree_seed((uint64_t)tile->y0 << 32 | (uint64_t)tile->x0);
+
+    for (int i = tile->y0; i < tile->y1; i++) {
+        for (int j = tile->x0; j < tile->x1; j++) {
+            hits[(i - tile->y0) * tile_w + (j - tile->x0)] = job->hits[i * img->width + j];
+        }
+    }
+    shade_batch(rays, hits, n, colors, render_options.ray_order == RAYS_SORTED);
+    for (int i = tile->y0; i < tile->y1; i++) {
+        for (int j = tile->x0; j < tile->x1; j++) {
+            set_pixel_color(colors[(i - tile->y0) * tile_w + (j - tile->x0)], i, j, img);
+            counters.pixels++;
+        }
+    }
+    if (render_options.cost_map != NULL)
+        cost_map_spread(render_options.cost_map, tile->y0, tile->x0, tile->y1, tile->x1, &start,
+                        read_cycles() - start_cycles);
+}
+
+/**
+ * Renders every pixel of a tile. With one sample per pixel the tile is done in two passes: a visibility pass that
+ * fills the first-hit buffer for the tile, then a shading pass that reads it
+ */
+static void render_tile_pixels(RenderJob *job, Tile *tile) {
+    image *img = job->img;
+    if (render_options.max_samples <= 1) {
+        // the primary rays are built a row at a time and kept for the shading pass, along with where they cross
+        // the viewplane so the visibility pass doesn't have to work it out from the ray again
+        int tile_w = tile->x1 - tile->x0;
+        Ray *rays = arena_alloc(&frame_arena, sizeof(Ray) * tile_w * (tile->y1 - tile->y0));
+        real (*spots)[2] = arena_alloc(&frame_arena, sizeof(real[2]) * tile_w);
+        for (int i = tile->y0; i < tile->y1; i++) {
+            Ray *row = &rays[(i - tile->y0) * tile_w];
+            primary_ray_row(job->view, i, tile->x0, tile_w, row, spots);
+            for (int j = tile->x0; j < tile->x1; j++) {
+                RenderCounters start = counters;
+                uint64_t start_cycles = read_cycles();
+                int c = j - tile->x0;
+                primary_shoot(&job->vis, &row[c], spots[c], i, j, &job->hits[i * img->width + j]);
+                if (render_options.cost_map != NULL)
+                    cost_map_record(render_options.cost_map, i, j, &start, read_cycles() - start_cycles);
+            }
+        }
+        if (render_options.ray_order != RAYS_RECURSIVE) {
+            shade_tile_batched(job, tile, rays);
+            return;
+        }
+        for (int i = tile->y0; i < tile->y1; i++) {
+            for (int j = tile->x0; j < tile->x1; j++) {
+                RenderCounters start = counters;
+                uint64_t start_cycles = read_cycles();
+                real color[3];
+                FirstHit *hit = &job->hits[i * img->width + j];
+                light_tree_seed((uint64_t)i << 32 | (uint64_t)j);
+                if (render_options.gbuffer != NULL)
+                    capture_pixel = i * img->width + j;
+                shade_first_hit(&rays[(i - tile->y0) * tile_w + (j - tile->x0)], hit, color);
+                if (capture_pixel >= 0) {
+                    capture_first_hit(render_options.gbuffer, capture_pixel, hit, color);
+                    capture_pixel = -1;
+                }
+                set_pixel_color(color, i, j, img);
+                counters.pixels++;
+                if (render_options.cost_map != NULL)
+                    cost_map_record(render_options.cost_map, i, j, &start, read_cycles() - start_cycles);
+            }
+        }
+        return;
+    }
+    for (int i = tile->y0; i < tile->y1; i++) {
+        for (int j = tile->x0; j < tile->x1; j++) {
+            real color[3] = {0, 0, 0};
+            trace_pixel(job, i, j, render_options.max_samples, color);
+            counters.pixels++;
+        }
+    }
+}
+
+/**
+ * Renders a tile on the tile thread pool, recording what its rays touch if the job asks for it
+ */
+static void render_tile(Tile *tile, int thread, void *arg) {
+    RenderJob *job = arg;
+    if (job->checkpoint != NULL && checkpoint_stopping())
+        return;     // the render was asked to stop, the tiles left are saved unfinished
+    arena_reset(&frame_arena);  // the previous tile's temporaries are done with
+    if (job->deps != NULL)
+        tile_deps_begin(&job->deps[tile - job->tiles]);
+    render_tile_pixels(job, tile);
+    tile_deps_end();
+    if (job->checkpoint != NULL)
+        checkpoint_tile_done(job->checkpoint, tile);
 }
 
 /**
  * Shoots out rays over a viewplane of dimensions stored in img and looks through
- * the array of objects for an intersection for each pixel.
+ * the array of objects for an intersection for each pixel. The image is split into tiles that are rendered on the
+ * tile thread pool.
+ * @param img - image data (width, height, pixmap...)
+ * @param camera - camera the image is seen from
+ */
+void raycast_scene(image *img, Camera *camera) {
+    Tile *tiles;
+    int ntiles = make_tiles(img->width, img->height, &tiles);
+    if (render_options.tile_cache != NULL)
+        ntiles = tile_cache_fetch(render_options.tile_cache, img, camera, tiles, ntiles);
+    if (render_options.checkpoint != NULL)
+        ntiles = checkpoint_resume(render_options.checkpoint, img, camera, tiles, ntiles);
+    raycast_tiles(img, camera, tiles, ntiles, NULL);
+    if (render_options.checkpoint != NULL)
+        checkpoint_end(render_options.checkpoint);
+    if (render_options.tile_cache != NULL)
+        tile_cache_store(render_options.tile_cache, img, tiles, ntiles);
+    free(tiles);
+}
+
+/**
+ * Renders some of the tiles of an image, leaving the pixels outside of them as they are
  * @param img - image data (width, height, pixmap...)
- * @param cam_width - camera width
- * @param cam_height - camera height
- * @param objects - array of objects in the scene
- */
-void raycast_scene(image *img, double cam_width, double cam_height) {
-    // loop over all pixels and test for intesections with objects.
-    // store results in pixmap
-    double vp_pos[3] = {0, 0, 1};   // view plane position
-    double point[3] = {0, 0, 0};    // point on viewplane where intersection happens
-
-    double pixheight = (double)cam_height / (double)img->height;
-    double pixwidth = (double)cam_width / (double)img->width;
-
-    Ray ray = {
-            .origin = {0, 0, 0},
-            .direction = {0, 0, 0}
+ * @param camera - camera the image is seen from
+ * @param tiles - tiles to render, from make_tiles()
+ * @param ntiles - number of tiles
+ * @param deps - if not NULL, one per tile, set to what the tile's rays touched, see watch.h
+ */
+void raycast_tiles(image *img, Camera *camera, Tile *tiles, int ntiles, TileDeps *deps) {
+    View view;
+    view_init(&view, camera, img->width, img->height);
+    RenderJob job = {
+            .img = img,
+            .view = &view,
+            .hits = NULL,
+            .tiles = tiles,
+            .deps = deps,
+            .checkpoint = render_options.checkpoint
     };
+    visibility_init(&job.vis, &view, img->width, img->height);
+    if (render_options.max_samples <= 1)
+        job.hits = malloc(sizeof(FirstHit) * img->width * img->height);
+    tile_pool_run(tiles, ntiles, img->height, render_tile, &job);
+    free(job.hits);
+    visibility_free(&job.vis);
+}
 
-    for (int i = 0; i < img->height; i++) {
-        for (int j = 0; j < img->width; j++) {
-            v3_zero(ray.origin);
-            v3_zero(ray.direction);
-            point[0] = vp_pos[0] - cam_width/2.0 + pixwidth*(j + 0.5);
-            point[1] = -(vp_pos[1] - cam_height/2.0 + pixheight*(i + 0.5));
-            point[2] = vp_pos[2];    // set intersecting point Z to viewplane Z
-            normalize(point);   // normalize the point
-            // store normalized point as our ray direction
-            v3_copy(point, ray.direction);
-            double color[3] = {0, 0, 0};
-
-            int best_o;     // index of 'best' or closest object
-            double best_t;  // closest distance
-            boolean in_sphere = false;
-            shoot(&ray, -1, INFINITY, &best_o, &best_t, &in_sphere);
-
-            if (best_t > 0 && best_t != INFINITY && best_o != -1) {// there was an intersection
-                shade(&ray, best_o, best_t, 1, 0, color, &in_sphere);
-                set_pixel_color(color, i, j, img);
+/**
+ * Relights a tile from the G-buffer of the job. Each pixel starts from its captured indirect color and only the
+ * direct light at its first hit is shaded again, so only shadow rays towards lights that have moved are cast
+ */
+static void relight_tile(Tile *tile, int thread, void *arg) {
+    RenderJob *job = arg;
+    GBuffer *gb = job->gbuffer;
+    int tile_w = tile->x1 - tile->x0;
+    arena_reset(&frame_arena);
+    Ray *rays = arena_alloc(&frame_arena, sizeof(Ray) * tile_w);
+    for (int i = tile->y0; i < tile->y1; i++) {
+        primary_ray_row(job->view, i, tile->x0, tile_w, rays, NULL);
+        for (int j = tile->x0; j < tile->x1; j++) {
+            int p = i * gb->width + j;
+            real color[3];
+            copy_color(gb->indirect[p], color);
+            if (gb->obj[p] != -1) {
+                // the hit point is found the same way shade() finds it
+                Ray *ray = &rays[j - tile->x0];
+                real point[3];
+                boolean in_sphere = false;
+                v3_scale(ray->direction, gb->t[p], point);
+                v3_add(point, ray->origin, point);
+                normalize(ray->direction);
+                shade_direct(ray, gb->obj[p], gb->triangle[p], point, gb, p, color, &in_sphere);
+            }
+            set_pixel_color(color, i, j, job->img);
+            counters.pixels++;
+        }
+    }
+}
+
+/**
+ * Renders an image again from a G-buffer captured by raycast_scene() after its lights have changed. Everything but
+ * the direct light at each pixel's first hit is taken from the G-buffer, so changes to the lights' colors,
+ * attenuation and positions show up directly while light reaching the pixel through reflections and refractions
+ * keeps its captured color
+ * @param img - image data (width, height, pixmap...), the size the G-buffer was captured at
+ * @param camera - camera the G-buffer was captured from
+ * @param gb - the G-buffer
+ */
+void relight_scene(image *img, Camera *camera, GBuffer *gb) {
+    View view;
+    view_init(&view, camera, img->width, img->height);
+    RenderJob job = {
+            .img = img,
+            .view = &view,
+            .gbuffer = gb
+    };
+    Tile *tiles;
+    int ntiles = make_tiles(img->width, img->height, &tiles);
+    tile_pool_run(tiles, ntiles, img->height, relight_tile, &job);
+    free(tiles);
+}
+
+/**
+ * Fills in the auxiliary buffers for the pixels of a tile from the first hit through each pixel center
+ */
+static void aux_tile(Tile *tile, int thread, void *arg) {
+    RenderJob *job = arg;
+    AuxBuffers *aux = job->aux;
+    int tile_w = tile->x1 - tile->x0;
+    arena_reset(&frame_arena);
+    Ray *rays = arena_alloc(&frame_arena, sizeof(Ray) * tile_w);
+    real (*spots)[2] = arena_alloc(&frame_arena, sizeof(real[2]) * tile_w);
+    for (int i = tile->y0; i < tile->y1; i++) {
+        primary_ray_row(job->view, i, tile->x0, tile_w, rays, spots);
+        for (int j = tile->x0; j < tile->x1; j++) {
+            size_t p = (size_t)i * aux->width + j;
+            Ray *ray = &rays[j - tile->x0];
+            FirstHit hit;
+            primary_shoot(&job->vis, ray, spots[j - tile->x0], i, j, &hit);
+            if (hit.t > 0 && hit.t != INFINITY && hit.obj != -1) {
+                real point[3], normal[3], diff_color[3], spec_color[3];
+                v3_scale(ray->direction, hit.t, point);
+                v3_add(point, ray->origin, point);
+                surface_shading(hit.obj, hit.triangle, point, normal, diff_color, spec_color);
+                for (int k = 0; k < 3; k++) {
+                    aux->normal[3 * p + k] = (float)normal[k];
+                    aux->albedo[3 * p + k] = (float)diff_color[k];
+                }
+                aux->depth[p] = (float)hit.t;
             }
             else {
-                set_pixel_color(background_color, i, j, img);
+                for (int k = 0; k < 3; k++) {
+                    aux->normal[3 * p + k] = 0;
+                    aux->albedo[3 * p + k] = 0;
+                }
+                aux->depth[p] = INFINITY;
+            }
+        }
+    }
+}
+
+/**
+ * Fills in the auxiliary buffers the denoiser is guided by: the normal, depth and albedo of the first hit through
+ * each pixel center. It only casts primary rays, so it is cheap next to rendering the image
+ * @param img - image data (width, height, pixmap...)
+ * @param camera - camera the image is seen from
+ * @param aux - the buffers, the size of the image
+ */
+void raycast_aux(image *img, Camera *camera, AuxBuffers *aux) {
+    View view;
+    view_init(&view, camera, img->width, img->height);
+    RenderJob job = {
+            .img = img,
+            .view = &view,
+            .aux = aux
+    };
+    visibility_init(&job.vis, &view, img->width, img->height);
+    Tile *tiles;
+    int ntiles = make_tiles(img->width, img->height, &tiles);
+    tile_pool_run(tiles, ntiles, img->height, aux_tile, &job);
+    free(tiles);
+    visibility_free(&job.vis);
+}
+
+/**
+ * Checks the progressive render deadline. Once it has passed every thread sees it without reading the clock again
+ * @return - true if the render should stop
+ */
+static boolean deadline_passed(RenderJob *job) {
+    if (__atomic_load_n(&job->expired, __ATOMIC_RELAXED))
+        return true;
+    if (wall_seconds() < job->deadline)
+        return false;
+    __atomic_store_n(&job->expired, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Runs one progressive pass over a tile. A pass with step s traces the pixels on an s x s lattice that earlier
+ * passes have not traced yet, and fills the rest of each s x s block with that color until a finer pass gets to it.
+ * The refinement pass (step 0) re-renders traced pixels with the full adaptive sample budget
+ */
+static void progressive_tile(Tile *tile, int thread, void *arg) {
+    RenderJob *job = arg;
+    image *img = job->img;
+    arena_reset(&frame_arena);
+    int s = job->step;
+    real color[3];
+
+    if (s == 0) {
+        for (int i = tile->y0; i < tile->y1; i++) {
+            for (int j = tile->x0; j < tile->x1; j++) {
+                if (deadline_passed(job))
+                    return;
+                trace_pixel(job, i, j, render_options.max_samples, color);
+                job->traced[i * img->width + j] = 2;
+                counters.pixels++;
             }
         }
+        return;
+    }
+
+    // tiles start on a multiple of TILE_SIZE, so the lattice and its blocks line up with the tile
+    for (int i = tile->y0; i < tile->y1; i += s) {
+        for (int j = tile->x0; j < tile->x1; j += s) {
+            if (job->traced[i * img->width + j])
+                continue;
+            if (deadline_passed(job))
+                return;
+            trace_pixel(job, i, j, 1, color);
+            // with a budget of 1 sample there is nothing left for the refinement pass to add
+            job->traced[i * img->width + j] = render_options.max_samples > 1 ? 1 : 2;
+            counters.pixels++;
+
+            // upsample into the pixels of the block that have not been traced
+            for (int bi = i; bi < i + s && bi < tile->y1; bi++) {
+                for (int bj = j; bj < j + s && bj < tile->x1; bj++) {
+                    if (!job->traced[bi * img->width + bj])
+                        set_pixel_color(color, bi, bj, img);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Renders the scene progressively within a time budget. A coarse pass traces every 8th pixel in each direction and
+ * fills the gaps, then interleaved passes on 4, 2 and 1 pixel lattices refine the image down to full resolution,
+ * and finally pixels get extra adaptive samples if --samples is above 1. Whatever is done when the budget runs out
+ * is left in img.
+ * @param img - image data (width, height, pixmap...)
+ * @param camera - camera the image is seen from
+ * @param budget_ms - time budget in milliseconds
+ * @return - fraction of the pixels that got their full sample budget, a pixel with only its coarse sample counts
+ * for nothing while the refinement pass has yet to reach it
+ */
+double raycast_progressive(image *img, Camera *camera, double budget_ms) {
+    View view;
+    view_init(&view, camera, img->width, img->height);
+    int npixels = img->width * img->height;
+    RenderJob job = {
+            .img = img,
+            .view = &view,
+            .traced = calloc((size_t)npixels, 1),
+            .deadline = wall_seconds() + budget_ms / 1000.0,
+            .expired = 0
+    };
+    visibility_init(&job.vis, &view, img->width, img->height);
+    memset(img->hdr, 0, sizeof(float[3]) * npixels);
+
+    Tile *tiles;
+    int ntiles = make_tiles(img->width, img->height, &tiles);
+    for (job.step = 8; job.step >= 1 && !job.expired; job.step /= 2) {
+        tile_pool_run(tiles, ntiles, img->height, progressive_tile, &job);
+    }
+    if (render_options.max_samples > 1 && !job.expired) {
+        job.step = 0;
+        tile_pool_run(tiles, ntiles, img->height, progressive_tile, &job);
+    }
+    free(tiles);
+    visibility_free(&job.vis);
+
+    int traced = 0;
+    for (int i = 0; i < npixels; i++) {
+        if (job.traced[i] == 2)
+            traced++;
     }
+    free(job.traced);
+    return (double)traced / npixels;
 }
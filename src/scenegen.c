@@ -0,0 +1,325 @@
+/** scenegen main program entry point
+ *
+ *  writes a random scene as json that read_json() accepts. The same options and seed always give the same file, so
+ *  large scenes for benchmarks don't need to be checked in */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "../include/base.h"
+
+/* how the spheres are spread through the scene's box */
+#define SPREAD_UNIFORM 0    // independently and evenly
+#define SPREAD_CLUSTERED 1  // in gaussian clumps around random centers
+#define SPREAD_LATTICE 2    // on a regular lattice, jittered slightly
+
+/* what to generate, set from the command line */
+typedef struct scene_options_t {
+    uint64_t seed;
+    long spheres;
+    int planes;
+    int lights;
+    int spotlights;
+    double reflective;      // fraction of spheres that are mirror-like
+    double refractive;      // fraction of spheres that are glass
+    int spread;             // SPREAD_UNIFORM, SPREAD_CLUSTERED or SPREAD_LATTICE
+    int clusters;           // clumps for SPREAD_CLUSTERED
+    int nesting;            // spheres come in groups of this many concentric glass shells, 1 for no nesting
+    double radius;          // radius of the spheres, the outer shell for nested ones
+    double size;            // half the width of the box the spheres fill, 0 for one sphere per unit cube
+    long instances;         // 0 to put the spheres in the scene, else copies of them placed as instances of a group
+} SceneOptions;
+
+static uint64_t rng_state;
+
+/**
+ * Uniform random number in [0, 1), xorshift64* like the light sampling in lighttree.c
+ */
+static double rnd() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rnd_range(double lo, double hi) {
+    return lo + (hi - lo) * rnd();
+}
+
+/**
+ * Normally distributed random number with mean 0 and standard deviation 1, by the Box-Muller transform
+ */
+static double rnd_normal() {
+    double u = rnd();
+    double v = rnd();
+    return sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+}
+
+/**
+ * Prints how to run the program along with the supported options
+ */
+void usage() {
+    fprintf(stderr, "Usage: scenegen [options] output.json\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --seed N             random seed, the same seed and options give the same scene (default 1)\n");
+    fprintf(stderr, "  --spheres N          number of spheres (default 1000)\n");
+    fprintf(stderr, "  --planes N           number of planes, walls around the spheres (default 1)\n");
+    fprintf(stderr, "  --lights N           number of point lights (default 1)\n");
+    fprintf(stderr, "  --spotlights N       number of spotlights (default 0)\n");
+    fprintf(stderr, "  --reflective F       fraction of spheres that are mirror-like (default 0.2)\n");
+    fprintf(stderr, "  --refractive F       fraction of spheres that are glass (default 0.1)\n");
+    fprintf(stderr, "  --spread NAME        uniform, clustered or lattice (default uniform)\n");
+    fprintf(stderr, "  --clusters N         number of clumps for --spread clustered (default 16)\n");
+    fprintf(stderr, "  --nesting N          put spheres in groups of N concentric glass shells (default 1)\n");
+    fprintf(stderr, "  --radius R           sphere radius (default 0.2)\n");
+    fprintf(stderr, "  --size S             half width of the box the spheres fill (default: one sphere per unit cube)\n");
+    fprintf(stderr, "  --instances N        make the spheres a group and place N rotated copies of it (default 0)\n");
+}
+
+/**
+ * Gets the value that follows an option on the command line
+ */
+char *option_value(int argc, char *argv[], int *i) {
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: scenegen: %s requires a value\n", argv[*i]);
+        exit(1);
+    }
+    (*i)++;
+    return argv[*i];
+}
+
+/**
+ * Gets the non-negative number that follows an option on the command line
+ */
+double option_number(int argc, char *argv[], int *i) {
+    char *opt = argv[*i];
+    double val = atof(option_value(argc, argv, i));
+    if (val < 0) {
+        fprintf(stderr, "Error: scenegen: %s must be >= 0\n", opt);
+        exit(1);
+    }
+    return val;
+}
+
+/**
+ * Writes one sphere. Materials are picked from the reflective and refractive fractions; the rest are matte with a
+ * little reflectivity, since shade() only keeps an object's own color when it reflects or refracts something
+ */
+static void write_sphere(FILE *out, SceneOptions *opt, double x, double y, double z, double radius, boolean glass,
+                         const char *group) {
+    double reflect, refract, ior = 1;
+    double pick = rnd();
+    if (glass || pick < opt->refractive) {
+        refract = rnd_range(0.5, 0.9);
+        reflect = rnd_range(0, 1 - refract);
+        ior = rnd_range(1.3, 1.8);
+    }
+    else if (pick < opt->refractive + opt->reflective) {
+        reflect = rnd_range(0.3, 0.8);
+        refract = 0;
+    }
+    else {
+        reflect = 0.1;
+        refract = 0;
+    }
+    fprintf(out, ",\n  {\"type\": \"sphere\", ");
+    if (group != NULL)
+        fprintf(out, "\"group\": \"%s\", ", group);
+    fprintf(out, "\"radius\": %.6g, \"position\": [%.6g, %.6g, %.6g], "
+                 "\"diffuse_color\": [%.3f, %.3f, %.3f], \"specular_color\": [0.3, 0.3, 0.3], "
+                 "\"reflectivity\": %.3f, \"refractivity\": %.3f, \"ior\": %.3f}",
+            radius, x, y, z, rnd(), rnd(), rnd(), reflect, refract, ior);
+}
+
+/* example usage: scenegen --spheres 1000000 --seed 7 million.json */
+int main(int argc, char *argv[]) {
+    SceneOptions opt = {
+            .seed = 1,
+            .spheres = 1000,
+            .planes = 1,
+            .lights = 1,
+            .spotlights = 0,
+            .reflective = 0.2,
+            .refractive = 0.1,
+            .spread = SPREAD_UNIFORM,
+            .clusters = 16,
+            .nesting = 1,
+            .radius = 0.2,
+            .size = 0,
+            .instances = 0
+    };
+    char *output = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0)
+            opt.seed = strtoull(option_value(argc, argv, &i), NULL, 10);
+        else if (strcmp(argv[i], "--spheres") == 0)
+            opt.spheres = (long)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--planes") == 0)
+            opt.planes = (int)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--lights") == 0)
+            opt.lights = (int)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--spotlights") == 0)
+            opt.spotlights = (int)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--reflective") == 0)
+            opt.reflective = option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--refractive") == 0)
+            opt.refractive = option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--clusters") == 0)
+            opt.clusters = (int)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--nesting") == 0)
+            opt.nesting = (int)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--radius") == 0)
+            opt.radius = option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--size") == 0)
+            opt.size = option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--instances") == 0)
+            opt.instances = (long)option_number(argc, argv, &i);
+        else if (strcmp(argv[i], "--spread") == 0) {
+            char *name = option_value(argc, argv, &i);
+            if (strcmp(name, "uniform") == 0)
+                opt.spread = SPREAD_UNIFORM;
+            else if (strcmp(name, "clustered") == 0)
+                opt.spread = SPREAD_CLUSTERED;
+            else if (strcmp(name, "lattice") == 0)
+                opt.spread = SPREAD_LATTICE;
+            else {
+                fprintf(stderr, "Error: scenegen: Unknown spread '%s'\n", name);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: scenegen: Unknown option '%s'\n", argv[i]);
+            usage();
+            exit(1);
+        }
+        else if (output == NULL)
+            output = argv[i];
+        else {
+            fprintf(stderr, "Error: scenegen: Only one output file can be given\n");
+            usage();
+            exit(1);
+        }
+    }
+    if (output == NULL) {
+        fprintf(stderr, "Error: scenegen: No output file given\n");
+        usage();
+        exit(1);
+    }
+    if (opt.reflective + opt.refractive > 1) {
+        fprintf(stderr, "Error: scenegen: --reflective and --refractive can't add up to more than 1\n");
+        exit(1);
+    }
+    if (opt.nesting < 1 || opt.clusters < 1 || opt.radius <= 0) {
+        fprintf(stderr, "Error: scenegen: --nesting, --clusters and --radius must be > 0\n");
+        exit(1);
+    }
+    FILE *out = fopen(output, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: scenegen: Failed to create output file '%s'\n", output);
+        exit(1);
+    }
+    rng_state = opt.seed * 0x9E3779B97F4A7C15ull + 0x632BE59BD9B4E019ull;
+    if (rng_state == 0)
+        rng_state = 1;
+
+    // the spheres fill a box centered on the view axis, far enough down +z that the camera sees all of its front
+    long groups = (opt.spheres + opt.nesting - 1) / opt.nesting;
+    double group_size = opt.size > 0 ? opt.size : fmax(cbrt((double)groups) / 2, 2 * opt.radius);
+
+    // instances sit on a lattice far enough apart that their boxes can't touch however they are turned
+    long instances_per_side = (long)ceil(cbrt((double)opt.instances));
+    double instance_spacing = 2 * sqrt(3) * (group_size + opt.radius);
+    double size = opt.instances > 0 ? instances_per_side * instance_spacing / 2 : group_size;
+    double center[3] = {0, 0, 5 * size};
+    fprintf(out, "[\n  {\"type\": \"camera\", \"width\": 0.5, \"height\": 0.5}");
+
+    // point lights spread through a box a bit bigger than the spheres', together about as bright as one light
+    for (int i = 0; i < opt.lights; i++) {
+        double brightness = 8 * size * size / opt.lights;
+        fprintf(out, ",\n  {\"type\": \"light\", \"color\": [%.6g, %.6g, %.6g], \"position\": [%.6g, %.6g, %.6g], "
+                     "\"radial-a2\": 1, \"radial-a1\": 1, \"radial-a0\": 1}",
+                brightness, brightness, brightness, center[0] + rnd_range(-1.5, 1.5) * size,
+                center[1] + rnd_range(1.1, 1.5) * size, center[2] + rnd_range(-1.5, 1.5) * size);
+    }
+    // spotlights above the spheres, each aimed at a random point among them
+    for (int i = 0; i < opt.spotlights; i++) {
+        double brightness = 8 * size * size / opt.spotlights;
+        double from[3] = {center[0] + rnd_range(-1, 1) * size, center[1] + 1.5 * size,
+                          center[2] + rnd_range(-1, 1) * size};
+        double to[3] = {center[0] + rnd_range(-1, 1) * size, center[1] + rnd_range(-1, 1) * size,
+                        center[2] + rnd_range(-1, 1) * size};
+        fprintf(out, ",\n  {\"type\": \"light\", \"color\": [%.6g, %.6g, %.6g], \"position\": [%.6g, %.6g, %.6g], "
+                     "\"direction\": [%.6g, %.6g, %.6g], \"theta\": %.3g, \"angular-a0\": %.3g, "
+                     "\"radial-a2\": 1, \"radial-a1\": 1, \"radial-a0\": 1}",
+                brightness, brightness, brightness, from[0], from[1], from[2],
+                to[0] - from[0], to[1] - from[1], to[2] - from[2], rnd_range(20, 45), rnd_range(2, 10));
+    }
+
+    // planes are the walls of a box around the spheres, floor and back wall first, pushed further out every lap
+    static const double walls[6][3] = {{0, 1, 0}, {0, 0, -1}, {1, 0, 0}, {-1, 0, 0}, {0, -1, 0}, {0, 0, 1}};
+    for (int i = 0; i < opt.planes; i++) {
+        const double *n = walls[i % 6];
+        double d = size + opt.radius + 1 + i / 6;
+        fprintf(out, ",\n  {\"type\": \"plane\", \"normal\": [%g, %g, %g], \"position\": [%.6g, %.6g, %.6g], "
+                     "\"diffuse_color\": [%.3f, %.3f, %.3f], \"specular_color\": [0.1, 0.1, 0.1], "
+                     "\"reflectivity\": 0.1, \"refractivity\": 0}",
+                n[0], n[1], n[2], center[0] - n[0] * d, center[1] - n[1] * d, center[2] - n[2] * d,
+                rnd_range(0.3, 0.9), rnd_range(0.3, 0.9), rnd_range(0.3, 0.9));
+    }
+
+    // a group is built around the origin and its instances put it in place
+    const char *group = opt.instances > 0 ? "spheres" : NULL;
+    double origin[3] = {0, 0, 0};
+    double *group_center = opt.instances > 0 ? origin : center;
+
+    // cluster centers, and the lattice spacing that fits every group of spheres in the box
+    double (*clumps)[3] = malloc(sizeof(double[3]) * opt.clusters);
+    for (int c = 0; c < opt.clusters; c++)
+        for (int k = 0; k < 3; k++)
+            clumps[c][k] = group_center[k] + rnd_range(-0.8, 0.8) * group_size;
+    long per_side = (long)ceil(cbrt((double)groups));
+    double spacing = 2 * group_size / per_side;
+
+    long written = 0;
+    for (long g = 0; g < groups; g++) {
+        double p[3];
+        if (opt.spread == SPREAD_CLUSTERED) {
+            double *clump = clumps[(int)(rnd() * opt.clusters)];
+            for (int k = 0; k < 3; k++)
+                p[k] = clump[k] + rnd_normal() * group_size / 8;
+        }
+        else if (opt.spread == SPREAD_LATTICE) {
+            long cell[3] = {g % per_side, (g / per_side) % per_side, g / (per_side * per_side)};
+            for (int k = 0; k < 3; k++)
+                p[k] = group_center[k] - group_size + (cell[k] + 0.5 + rnd_range(-0.1, 0.1)) * spacing;
+        }
+        else {
+            for (int k = 0; k < 3; k++)
+                p[k] = group_center[k] + rnd_range(-1, 1) * group_size;
+        }
+        // nested groups are concentric glass shells, each a bit smaller than the one around it
+        for (int s = 0; s < opt.nesting && written < opt.spheres; s++, written++)
+            write_sphere(out, &opt, p[0], p[1], p[2], opt.radius * (opt.nesting - s) / opt.nesting, opt.nesting > 1,
+                         group);
+    }
+    for (long i = 0; i < opt.instances; i++) {
+        long cell[3] = {i % instances_per_side, (i / instances_per_side) % instances_per_side,
+                        i / (instances_per_side * instances_per_side)};
+        double p[3];
+        for (int k = 0; k < 3; k++)
+            p[k] = center[k] - size + (cell[k] + 0.5) * instance_spacing;
+        fprintf(out, ",\n  {\"type\": \"instance\", \"group\": \"%s\", \"position\": [%.6g, %.6g, %.6g], "
+                     "\"rotation\": [%.1f, %.1f, %.1f]}",
+                group, p[0], p[1], p[2], rnd_range(0, 360), rnd_range(0, 360), rnd_range(0, 360));
+    }
+    fprintf(out, "\n]\n");
+    free(clumps);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: scenegen: Failed to write '%s'\n", output);
+        exit(1);
+    }
+    return 0;
+}
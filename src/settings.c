@@ -0,0 +1,123 @@
+/* settings.c - named presets and the merging of the quality settings a render is given. A preset picks the recursion
+ * depth, samples, contribution cutoff and shadows, the scene's render object can change any of those and the look
+ * of the scene (shininess, ray offset and background), and the command line has the last word on all of them */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/settings.h"
+#include "../include/raytracer.h"
+#include "../include/illumination.h"
+
+/* the scene's render object, reset by init_objects() and filled in by read_json() */
+RenderSettings scene_settings = {0};
+
+/* presets, from quickest to best looking */
+static const RenderSettings presets[] = {
+        // a quick look at the layout: one bounce, no shadows, only strong reflections
+        {SETTING_DEPTH | SETTING_SAMPLES | SETTING_MIN_WEIGHT | SETTING_SHADOWS, "preview", 1, 1, 0.1, false},
+        // what the lighting will look like, without the deep bounces or anti-aliasing
+        {SETTING_DEPTH | SETTING_SAMPLES | SETTING_MIN_WEIGHT | SETTING_SHADOWS, "draft", 3, 1, 0.02, true},
+        // every bounce that can still change an 8 bit color, with adaptive anti-aliasing
+        {SETTING_DEPTH | SETTING_SAMPLES | SETTING_MIN_WEIGHT | SETTING_SHADOWS, "final", MAX_REC_LEVEL, 16,
+         1.0 / 1024.0, true}
+};
+
+/**
+ * Copies the fields that were given in from into settings
+ */
+static void merge(RenderSettings *settings, const RenderSettings *from) {
+    if (from->given & SETTING_DEPTH)
+        settings->max_depth = from->max_depth;
+    if (from->given & SETTING_SAMPLES)
+        settings->samples = from->samples;
+    if (from->given & SETTING_MIN_WEIGHT)
+        settings->min_weight = from->min_weight;
+    if (from->given & SETTING_SHADOWS)
+        settings->shadows = from->shadows;
+    if (from->given & SETTING_SHININESS)
+        settings->shininess = from->shininess;
+    if (from->given & SETTING_RAY_EPSILON)
+        settings->ray_epsilon = from->ray_epsilon;
+    if (from->given & SETTING_BACKGROUND)
+        memcpy(settings->background, from->background, sizeof(settings->background));
+    settings->given |= from->given;
+}
+
+/**
+ * Applies a named preset on top of some settings
+ * @param settings - the fields the preset sets are overwritten, and its name recorded
+ * @param name - preview, draft or final
+ * @return - false if there is no preset of that name, settings are left as they were
+ */
+boolean settings_preset(RenderSettings *settings, const char *name) {
+    for (int k = 0; k < (int)(sizeof(presets) / sizeof(presets[0])); k++) {
+        if (strcmp(presets[k].preset, name) == 0) {
+            merge(settings, &presets[k]);
+            settings->preset = presets[k].preset;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Works out the settings to render with: the built in defaults, then the preset, then the scene's render object and
+ * then the command line. A preset named on the command line replaces the scene's
+ * @param options - settings given on the command line
+ * @param settings - set to the settings to render with, every field given
+ */
+void settings_resolve(RenderSettings *options, RenderSettings *settings) {
+    RenderSettings defaults = {
+            .given = ~0,
+            .preset = NULL,
+            .max_depth = MAX_REC_LEVEL,
+            .samples = 1,
+            .min_weight = 0,
+            .shadows = true,
+            .shininess = SHININESS,
+            .ray_epsilon = RAY_EPSILON,
+            .background = {0, 0, 0}
+    };
+    *settings = defaults;
+    const char *preset = options->preset != NULL ? options->preset : scene_settings.preset;
+    if (preset != NULL && !settings_preset(settings, preset)) {
+        fprintf(stderr, "Error: settings_resolve: Unknown preset '%s', expected preview, draft or final\n", preset);
+        exit(1);
+    }
+    merge(settings, &scene_settings);
+    merge(settings, options);
+}
+
+/**
+ * @return - whether two resolved settings render the same image
+ */
+boolean settings_equal(RenderSettings *a, RenderSettings *b) {
+    return a->max_depth == b->max_depth && a->samples == b->samples && a->min_weight == b->min_weight &&
+           a->shadows == b->shadows && a->shininess == b->shininess && a->ray_epsilon == b->ray_epsilon &&
+           memcmp(a->background, b->background, sizeof(a->background)) == 0;
+}
+
+/**
+ * Makes resolved settings the ones the renderer uses
+ * @param settings - from settings_resolve()
+ */
+void settings_apply(RenderSettings *settings) {
+    render_options.max_depth = settings->max_depth;
+    render_options.max_samples = settings->samples;
+    render_options.min_weight = settings->min_weight;
+    render_options.shadows = settings->shadows;
+    render_options.ray_epsilon = (real)settings->ray_epsilon;
+    shininess = settings->shininess;
+    v3_copy(settings->background, background_color);
+}
+
+/**
+ * Prints resolved settings on one line, for --stats
+ */
+void settings_print(FILE *out, RenderSettings *settings) {
+    fprintf(out, "settings:           %s, depth %d, %d samples, min weight %g, shadows %s, shininess %d, "
+                 "ray epsilon %g, background %g %g %g\n", settings->preset != NULL ? settings->preset : "no preset",
+            settings->max_depth, settings->samples, settings->min_weight, settings->shadows ? "on" : "off",
+            settings->shininess, settings->ray_epsilon, (double)settings->background[0],
+            (double)settings->background[1], (double)settings->background[2]);
+}
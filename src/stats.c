@@ -0,0 +1,261 @@
+/* stats.c - counters and per-pixel cost accounting for the renderer */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "../include/stats.h"
+
+/* global variables */
+__thread RenderCounters counters;
+RenderCounters render_totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_counter_fd = -1;
+
+/**
+ * Reads a cycle counter for timing small pieces of work. Uses the time stamp counter on x86 and falls back to a
+ * nanosecond clock everywhere else
+ * @return - current counter value
+ */
+uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @return - seconds on a monotonic wall clock, for timing whole passes
+ */
+double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Adds the calling thread's counters to render_totals and resets them. Every thread that renders calls this when it
+ * finishes a batch of work
+ */
+void flush_counters() {
+    pthread_mutex_lock(&totals_lock);
+    render_totals.rays += counters.rays;
+    render_totals.tests += counters.tests;
+    render_totals.samples += counters.samples;
+    render_totals.pixels += counters.pixels;
+    render_totals.lights_considered += counters.lights_considered;
+    render_totals.lights_culled += counters.lights_culled;
+    render_totals.arena_allocs += counters.arena_allocs;
+    render_totals.heap_allocs += counters.heap_allocs;
+    pthread_mutex_unlock(&totals_lock);
+    memset(&counters, 0, sizeof(counters));
+}
+
+/**
+ * Starts counting hardware cache misses for this process, including threads created afterwards. Does nothing if the
+ * kernel won't give us a counter (not Linux, no PMU, or perf_event_paranoid forbids it)
+ */
+void cache_counter_start() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cache_counter_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (cache_counter_fd >= 0) {
+        ioctl(cache_counter_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cache_counter_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/**
+ * Stops the cache miss counter. Threads created after cache_counter_start() are only included once they have exited
+ * @return - cache misses since cache_counter_start(), -1 if they could not be counted
+ */
+long long cache_counter_stop() {
+    long long count = -1;
+#ifdef __linux__
+    if (cache_counter_fd < 0)
+        return -1;
+    ioctl(cache_counter_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(cache_counter_fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    close(cache_counter_fd);
+    cache_counter_fd = -1;
+#endif
+    return count;
+}
+
+/**
+ * Prints a summary of the work done during the render
+ * @param out - stream to print to
+ * @param seconds - wall clock time spent rendering
+ */
+void print_stats(FILE *out, double seconds) {
+    fprintf(out, "render time:        %.3f s\n", seconds);
+    fprintf(out, "pixels traced:      %llu\n", (unsigned long long)render_totals.pixels);
+    fprintf(out, "primary samples:    %llu\n", (unsigned long long)render_totals.samples);
+    if (render_totals.pixels > 0)
+        fprintf(out, "average spp:        %.3f\n", (double)render_totals.samples / render_totals.pixels);
+    fprintf(out, "rays cast:          %llu\n", (unsigned long long)render_totals.rays);
+    fprintf(out, "intersection tests: %llu\n", (unsigned long long)render_totals.tests);
+    if (seconds > 0)
+        fprintf(out, "rays/sec:           %.0f\n", render_totals.rays / seconds);
+    if (render_totals.lights_considered > 0)
+        fprintf(out, "lights culled:      %llu of %llu (%.1f%%)\n", (unsigned long long)render_totals.lights_culled,
+                (unsigned long long)render_totals.lights_considered,
+                100.0 * render_totals.lights_culled / render_totals.lights_considered);
+    fprintf(out, "allocations:        %llu from arenas, %llu arena blocks from the heap\n",
+            (unsigned long long)render_totals.arena_allocs, (unsigned long long)render_totals.heap_allocs);
+}
+
+/**
+ * Allocates an empty cost map the size of the image
+ * @param map - cost map to fill in
+ * @param width - image width in pixels
+ * @param height - image height in pixels
+ */
+void cost_map_init(CostMap *map, int width, int height) {
+    map->width = width;
+    map->height = height;
+    map->rays = calloc((size_t)width * height, sizeof(float));
+    map->tests = calloc((size_t)width * height, sizeof(float));
+    map->cycles = calloc((size_t)width * height, sizeof(float));
+    if (map->rays == NULL || map->tests == NULL || map->cycles == NULL) {
+        fprintf(stderr, "Error: cost_map_init: Failed to allocate cost map\n");
+        exit(1);
+    }
+}
+
+/**
+ * Adds to the cost of one pixel the difference between the thread's counters now and a snapshot taken before some
+ * work on the pixel. Work done on a pixel in several passes is added up
+ * @param map - cost map to record into
+ * @param row - which row the pixel is on
+ * @param col - which column the pixel is on
+ * @param start - snapshot of the counters taken before tracing the pixel
+ * @param cycles - elapsed cycles spent on the pixel
+ */
+void cost_map_record(CostMap *map, int row, int col, RenderCounters *start, uint64_t cycles) {
+    int i = row * map->width + col;
+    map->rays[i] += (float)(counters.rays - start->rays);
+    map->tests[i] += (float)(counters.tests - start->tests);
+    map->cycles[i] += (float)cycles;
+}
+
+/**
+ * Maps a value between 0 and 1 onto a black-blue-red-yellow-white heat ramp
+ * @param v - normalized cost
+ * @param pixel - output color
+ */
+static void heat_color(double v, RGBPixel *pixel) {
+    static const double stops[5][3] = {
+            {0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}
+    };
+    if (v < 0) v = 0;
+    if (v > 1) v = 1;
+    double pos = v * 4;
+    int k = (int)pos;
+    if (k > 3) k = 3;
+    double f = pos - k;
+    pixel->r = (unsigned char)(255 * (stops[k][0] + f * (stops[k+1][0] - stops[k][0])));
+    pixel->g = (unsigned char)(255 * (stops[k][1] + f * (stops[k+1][1] - stops[k][1])));
+    pixel->b = (unsigned char)(255 * (stops[k][2] + f * (stops[k+1][2] - stops[k][2])));
+}
+
+/**
+ * Writes the cost map as a false color PPM of the elapsed cycles to filename, and the raw buffers to filename.raw as
+ * native floats, three per pixel in row major order: rays, intersection tests, cycles
+ * @param map - cost map to write out
+ * @param filename - name of the PPM file to create
+ */
+void cost_map_write(CostMap *map, char *filename) {
+    int npixels = map->width * map->height;
+    float max_cycles = 0;
+    for (int i = 0; i < npixels; i++) {
+        if (map->cycles[i] > max_cycles)
+            max_cycles = map->cycles[i];
+    }
+
+    image img;
+    img.width = map->width;
+    img.height = map->height;
+    img.max_color_val = 255;
+    img.pixmap = malloc(sizeof(RGBPixel) * npixels);
+    img.hdr = NULL;
+    for (int i = 0; i < npixels; i++) {
+        heat_color(max_cycles > 0 ? map->cycles[i] / max_cycles : 0, &img.pixmap[i]);
+    }
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: cost_map_write: Failed to create cost map file '%s'\n", filename);
+        exit(1);
+    }
+    create_ppm(out, 6, &img);
+    fclose(out);
+    free(img.pixmap);
+
+    // raw buffer goes next to the image
+    char *raw_name = malloc(strlen(filename) + 5);
+    sprintf(raw_name, "%s.raw", filename);
+    out = fopen(raw_name, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: cost_map_write: Failed to create raw cost file '%s'\n", raw_name);
+        exit(1);
+    }
+    for (int i = 0; i < npixels; i++) {
+        float cost[3] = {map->rays[i], map->tests[i], map->cycles[i]};
+        fwrite(cost, sizeof(float), 3, out);
+    }
+    fclose(out);
+    free(raw_name);
+}
+
+/**
+ * Spreads the cost of work done on a whole block of pixels evenly over the block, for work that can't be split up
+ * by pixel
+ * @param map - cost map to record into
+ * @param row0 - first row of the block
+ * @param col0 - first column of the block
+ * @param row1 - row after the last row of the block
+ * @param col1 - column after the last column of the block
+ * @param start - snapshot of the counters taken before the work started
+ * @param cycles - elapsed cycles spent on the block
+ */
+void cost_map_spread(CostMap *map, int row0, int col0, int row1, int col1, RenderCounters *start, uint64_t cycles) {
+    float n = (float)((row1 - row0) * (col1 - col0));
+    float rays = (float)(counters.rays - start->rays) / n;
+    float tests = (float)(counters.tests - start->tests) / n;
+    for (int row = row0; row < row1; row++) {
+        for (int col = col0; col < col1; col++) {
+            int i = row * map->width + col;
+            map->rays[i] += rays;
+            map->tests[i] += tests;
+            map->cycles[i] += (float)cycles / n;
+        }
+    }
+}
+
+void cost_map_free(CostMap *map) {
+    free(map->rays);
+    free(map->tests);
+    free(map->cycles);
+}
@@ -0,0 +1,413 @@
+/* tilecache.c - a directory of rendered tiles shared between runs. Each tile is a file named by a 128 bit hash of
+ * the prepared scene, the render settings, the camera, the image size, the tile's rectangle and the renderer binary,
+ * so a file can only ever hold the linear colors that rendering the tile again would give. Reading a tile touches its
+ * modification time, and after a run that wrote tiles the least recently touched files are removed until the
+ * directory is back under its size limit */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../include/tilecache.h"
+#include "../include/json.h"
+#include "../include/mesh.h"
+#include "../include/illumination.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+/**
+ * Adds bytes to a hash. Whole words go through both lanes, FNV-1a style in the first and multiply-rotate in the
+ * second, so the lanes don't collide together
+ */
+static void hash_bytes(CacheKey *key, const void *data, size_t n) {
+    const unsigned char *p = data;
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        key->a = (key->a ^ w) * 0x100000001b3ull;
+        key->b = key->b ^ w * 0x9E3779B97F4A7C15ull;
+        key->b = (key->b << 31 | key->b >> 33) * 0xBF58476D1CE4E5B9ull;
+        p += 8;
+        n -= 8;
+    }
+    while (n-- > 0) {
+        key->a = (key->a ^ *p) * 0x100000001b3ull;
+        key->b = (key->b ^ *p++) * 0x94D049BB133111EBull;
+    }
+}
+
+/**
+ * Mixes the lanes of a finished hash so every bit of the name depends on every byte hashed
+ */
+static void hash_finish(CacheKey *key) {
+    uint64_t lanes[2] = {key->a, key->b + key->a};
+    for (int i = 0; i < 2; i++) {
+        uint64_t x = lanes[i];
+        x = (x ^ x >> 33) * 0xFF51AFD7ED558CCDull;
+        x = (x ^ x >> 33) * 0xC4CEB9FE1A85EC53ull;
+        lanes[i] = x ^ x >> 33;
+    }
+    key->a = lanes[0];
+    key->b = lanes[1];
+}
+
+static void hash_int(CacheKey *key, int value) {
+    hash_bytes(key, &value, sizeof(value));
+}
+
+static void hash_real(CacheKey *key, real value) {
+    hash_bytes(key, &value, sizeof(value));
+}
+
+/**
+ * Adds a vector that may be missing to a hash
+ */
+static void hash_vector(CacheKey *key, real *v) {
+    hash_int(key, v != NULL);
+    if (v != NULL)
+        hash_bytes(key, v, sizeof(real) * 3);
+}
+
+static void hash_string(CacheKey *key, char *s) {
+    hash_int(key, s != NULL);
+    if (s != NULL)
+        hash_bytes(key, s, strlen(s) + 1);
+}
+
+static void hash_camera(CacheKey *key, Camera *camera) {
+    hash_real(key, camera->width);
+    hash_real(key, camera->height);
+    hash_real(key, camera->fov);
+    hash_vector(key, camera->position);
+    hash_vector(key, camera->look_at);
+    hash_vector(key, camera->up);
+}
+
+/**
+ * Adds an object to a hash, as prepare_scene() left it. Meshes add their triangles rather than the file they were
+ * read from, so editing the OBJ file changes the hash too
+ */
+static void hash_object(CacheKey *key, object *obj) {
+    hash_int(key, obj->type);
+    hash_string(key, obj->group);
+    switch (obj->type) {
+        case CAMERA:
+            hash_camera(key, &obj->camera);
+            break;
+        case SPHERE:
+            hash_vector(key, obj->sphere.diff_color);
+            hash_vector(key, obj->sphere.spec_color);
+            hash_vector(key, obj->sphere.position);
+            hash_real(key, obj->sphere.reflect);
+            hash_real(key, obj->sphere.refract);
+            hash_real(key, obj->sphere.radius);
+            hash_real(key, obj->sphere.ior);
+            break;
+        case PLANE:
+            hash_vector(key, obj->plane.diff_color);
+            hash_vector(key, obj->plane.spec_color);
+            hash_vector(key, obj->plane.position);
+            hash_vector(key, obj->plane.normal);
+            hash_real(key, obj->plane.reflect);
+            hash_real(key, obj->plane.refract);
+            hash_real(key, obj->plane.ior);
+            break;
+        case MESH:
+            hash_vector(key, obj->mesh.diff_color);
+            hash_vector(key, obj->mesh.spec_color);
+            hash_vector(key, obj->mesh.position);
+            hash_real(key, obj->mesh.reflect);
+            hash_real(key, obj->mesh.refract);
+            hash_real(key, obj->mesh.ior);
+            hash_real(key, obj->mesh.scale);
+            hash_int(key, obj->mesh.data->nvertices);
+            hash_int(key, obj->mesh.data->ntriangles);
+            hash_bytes(key, obj->mesh.data->vertices, sizeof(vertex_real) * 3 * obj->mesh.data->nvertices);
+            hash_bytes(key, obj->mesh.data->indices, sizeof(uint32_t) * 3 * obj->mesh.data->ntriangles);
+            break;
+        case INSTANCE:
+            hash_vector(key, obj->instance.position);
+            hash_vector(key, obj->instance.rotation);
+            hash_real(key, obj->instance.scale);
+            hash_string(key, obj->instance.group);
+            break;
+    }
+}
+
+static void hash_light(CacheKey *key, Light *light) {
+    hash_int(key, light->type);
+    hash_vector(key, light->color);
+    hash_vector(key, light->position);
+    hash_vector(key, light->direction);
+    hash_real(key, light->theta_deg);
+    hash_real(key, light->rad_att0);
+    hash_real(key, light->rad_att1);
+    hash_real(key, light->rad_att2);
+    hash_real(key, light->ang_att0);
+    hash_real(key, light->cos_theta);
+    hash_real(key, light->influence_radius);
+}
+
+/**
+ * Hashes the running executable, falling back on the build time if it can't be read
+ */
+CacheKey hash_binary() {
+    CacheKey key = {0xcbf29ce484222325ull, 0x84222325cbf29ce4ull};
+    FILE *exe = fopen("/proc/self/exe", "rb");
+    if (exe == NULL) {
+        hash_string(&key, __DATE__ " " __TIME__);
+        return key;
+    }
+    unsigned char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), exe)) > 0)
+        hash_bytes(&key, buffer, n);
+    fclose(exe);
+    return key;
+}
+
+/**
+ * Hashes everything that decides the linear colors of a view, apart from the tile rectangles hashed by tile_path().
+ * The exposure and tone mapping are left out since tiles are kept before resolve_image()
+ * @param binary - hash of the renderer, from hash_binary()
+ * @param camera - camera the view is seen from
+ * @return - the hash, not yet finished
+ */
+CacheKey hash_view(CacheKey binary, Camera *camera) {
+    CacheKey key = binary;
+    hash_int(&key, TILE_CACHE_MAGIC);
+    hash_int(&key, sizeof(real));
+    hash_int(&key, render_options.max_samples);
+    hash_int(&key, render_options.max_depth);
+    hash_bytes(&key, &render_options.min_weight, sizeof(double));
+    hash_int(&key, render_options.shadows);
+    hash_int(&key, shininess);
+    hash_bytes(&key, &render_options.ray_epsilon, sizeof(real));
+    hash_int(&key, render_options.min_samples);
+    hash_bytes(&key, &render_options.variance_threshold, sizeof(double));
+    hash_int(&key, render_options.ray_order);
+    hash_bytes(&key, &render_options.light_threshold, sizeof(double));
+    hash_int(&key, render_options.light_mode);
+    hash_int(&key, render_options.light_samples);
+    hash_int(&key, render_options.accel);
+    hash_vector(&key, background_color);
+    hash_camera(&key, camera);
+    hash_int(&key, nobjects);
+    for (int i = 0; i < nobjects; i++)
+        hash_object(&key, &objects[i]);
+    hash_int(&key, ngrouped_objects);
+    for (int i = 0; i < ngrouped_objects; i++)
+        hash_object(&key, &grouped_objects[i]);
+    hash_int(&key, nlights);
+    for (int i = 0; i < nlights; i++)
+        hash_light(&key, &lights[i]);
+    return key;
+}
+
+/**
+ * Opens a cache directory, making it if it isn't there
+ * @param cache - set up for the directory
+ * @param dir - the directory
+ * @param max_bytes - size the directory is kept under
+ */
+void tile_cache_open(TileCache *cache, const char *dir, size_t max_bytes) {
+    double start = wall_seconds();
+    memset(cache, '\0', sizeof(TileCache));
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: tile_cache_open: Failed to make cache directory '%s'\n", dir);
+        exit(1);
+    }
+    cache->dir = strdup(dir);
+    cache->max_bytes = max_bytes;
+    cache->binary = hash_binary();
+    cache->seconds = wall_seconds() - start;
+}
+
+/**
+ * Finds the file a tile of the view being rendered is kept in, dir/ab/cdef... with the first byte of the hash
+ * naming a subdirectory so no one directory gets too large
+ */
+static void tile_path(TileCache *cache, Tile *tile, int width, int height, char *path) {
+    CacheKey key = cache->view;
+    int rect[6] = {width, height, tile->x0, tile->y0, tile->x1, tile->y1};
+    hash_bytes(&key, rect, sizeof(rect));
+    hash_finish(&key);
+    sprintf(path, "%s/%02x/%014llx%016llx.tile", cache->dir, (unsigned int)(key.a >> 56),
+            (unsigned long long)(key.a & 0xFFFFFFFFFFFFFFull), (unsigned long long)key.b);
+}
+
+/**
+ * Reads the tiles of an image that are in the cache into it, and moves the rest to the front of tiles
+ * @param cache - the cache
+ * @param img - the image, pixels of tiles found are filled in
+ * @param camera - camera the image is seen from
+ * @param tiles - tiles of the image, from make_tiles(). Set to the tiles that weren't found
+ * @param ntiles - number of tiles
+ * @return - number of tiles that weren't found, to be rendered and then handed to tile_cache_store()
+ */
+int tile_cache_fetch(TileCache *cache, image *img, Camera *camera, Tile *tiles, int ntiles) {
+    double start = wall_seconds();
+    cache->view = hash_view(cache->binary, camera);
+
+    char *path = malloc(strlen(cache->dir) + 64);
+    float *buffer = malloc(sizeof(float[3]) * TILE_SIZE * TILE_SIZE);
+    int nmissed = 0;
+    for (int t = 0; t < ntiles; t++) {
+        Tile *tile = &tiles[t];
+        int w = tile->x1 - tile->x0, h = tile->y1 - tile->y0;
+        int header[3] = {0, 0, 0};
+        tile_path(cache, tile, img->width, img->height, path);
+        FILE *in = fopen(path, "rb");
+        boolean found = in != NULL && fread(header, sizeof(int), 3, in) == 3 && header[0] == TILE_CACHE_MAGIC &&
+                        header[1] == w && header[2] == h && fread(buffer, sizeof(float[3]), w * h, in) == w * h;
+        if (in != NULL)
+            fclose(in);
+        if (!found) {
+            tiles[nmissed++] = *tile;
+            continue;
+        }
+        for (int i = 0; i < h; i++)
+            memcpy(&img->hdr[(size_t)3 * ((tile->y0 + i) * img->width + tile->x0)], &buffer[3 * i * w],
+                   sizeof(float[3]) * w);
+        utimensat(AT_FDCWD, path, NULL, 0);     // now, for the least recently used eviction
+        cache->hits++;
+        cache->bytes_read += sizeof(header) + sizeof(float[3]) * w * h;
+    }
+    free(buffer);
+    free(path);
+    cache->seconds += wall_seconds() - start;
+    return nmissed;
+}
+
+/**
+ * Writes rendered tiles to the cache. Each is written to a file of its own and renamed into place, so runs sharing
+ * the directory never read half a tile
+ * @param cache - the cache, after tile_cache_fetch() for the same image
+ * @param img - the rendered image
+ * @param tiles - the tiles to write
+ * @param ntiles - number of tiles
+ */
+void tile_cache_store(TileCache *cache, image *img, Tile *tiles, int ntiles) {
+    double start = wall_seconds();
+    char *path = malloc(strlen(cache->dir) + 64);
+    char *temp = malloc(strlen(cache->dir) + 96);
+    for (int t = 0; t < ntiles; t++) {
+        Tile *tile = &tiles[t];
+        int w = tile->x1 - tile->x0, h = tile->y1 - tile->y0;
+        int header[3] = {TILE_CACHE_MAGIC, w, h};
+        tile_path(cache, tile, img->width, img->height, path);
+        *strrchr(path, '/') = '\0';
+        mkdir(path, 0777);
+        path[strlen(path)] = '/';
+        sprintf(temp, "%s.%ld.tmp", path, (long)getpid());
+        FILE *out = fopen(temp, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error: tile_cache_store: Failed to create cache file '%s'\n", temp);
+            exit(1);
+        }
+        boolean written = fwrite(header, sizeof(int), 3, out) == 3;
+        for (int i = 0; i < h && written; i++)
+            written = fwrite(&img->hdr[(size_t)3 * ((tile->y0 + i) * img->width + tile->x0)], sizeof(float[3]), w,
+                             out) == w;
+        if (fclose(out) != 0 || !written || rename(temp, path) != 0) {
+            // a full disk shouldn't fail the render, the tile just isn't kept
+            unlink(temp);
+            continue;
+        }
+        cache->misses++;
+        cache->bytes_written += sizeof(header) + sizeof(float[3]) * w * h;
+    }
+    free(temp);
+    free(path);
+    cache->seconds += wall_seconds() - start;
+}
+
+/* a file in the cache, for eviction */
+typedef struct cache_file_t {
+    char *path;
+    off_t size;
+    struct timespec touched;
+} CacheFile;
+
+static int compare_touched(const void *a, const void *b) {
+    const CacheFile *fa = a, *fb = b;
+    if (fa->touched.tv_sec != fb->touched.tv_sec)
+        return fa->touched.tv_sec < fb->touched.tv_sec ? -1 : 1;
+    if (fa->touched.tv_nsec != fb->touched.tv_nsec)
+        return fa->touched.tv_nsec < fb->touched.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Removes the least recently used tiles until the cache is under its size limit. Only a run that wrote tiles can
+ * have taken it over, so a run that found every tile doesn't look
+ */
+static void evict(TileCache *cache) {
+    CacheFile *files = NULL;
+    int nfiles = 0, capacity = 0;
+    size_t total = 0;
+    DIR *top = opendir(cache->dir);
+    if (top == NULL)
+        return;
+    for (struct dirent *sub; (sub = readdir(top)) != NULL;) {
+        if (sub->d_name[0] == '.')
+            continue;
+        char *sub_path = malloc(strlen(cache->dir) + strlen(sub->d_name) + 2);
+        sprintf(sub_path, "%s/%s", cache->dir, sub->d_name);
+        DIR *dir = opendir(sub_path);
+        for (struct dirent *entry; dir != NULL && (entry = readdir(dir)) != NULL;) {
+            if (entry->d_name[0] == '.')
+                continue;
+            char *path = malloc(strlen(sub_path) + strlen(entry->d_name) + 2);
+            sprintf(path, "%s/%s", sub_path, entry->d_name);
+            struct stat st;
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                free(path);
+                continue;
+            }
+            if (nfiles == capacity) {
+                capacity = capacity > 0 ? 2 * capacity : 1024;
+                files = realloc(files, sizeof(CacheFile) * capacity);
+            }
+            files[nfiles].path = path;
+            files[nfiles].size = st.st_size;
+            files[nfiles++].touched = st.st_mtim;
+            total += st.st_size;
+        }
+        if (dir != NULL)
+            closedir(dir);
+        free(sub_path);
+    }
+    closedir(top);
+
+    if (total > cache->max_bytes) {
+        qsort(files, nfiles, sizeof(CacheFile), compare_touched);
+        for (int i = 0; i < nfiles && total > cache->max_bytes; i++) {
+            if (unlink(files[i].path) == 0) {
+                total -= files[i].size;
+                cache->evicted++;
+            }
+        }
+    }
+    cache->bytes_held = total;
+    for (int i = 0; i < nfiles; i++)
+        free(files[i].path);
+    free(files);
+}
+
+/**
+ * Evicts what this run took the cache over its size limit with and closes it
+ */
+void tile_cache_close(TileCache *cache) {
+    double start = wall_seconds();
+    if (cache->misses > 0)
+        evict(cache);
+    free(cache->dir);
+    cache->dir = NULL;
+    cache->seconds += wall_seconds() - start;
+}
@@ -0,0 +1,432 @@
+/* tiles.c - a small persistent thread pool that hands out image tiles to workers. With pinned threads each thread
+ * stays on one processor, and the tiles of a batch are split into horizontal bands, one per NUMA node, that the
+ * node's threads work through before helping the other nodes. A band keeps going to the same node from batch to
+ * batch, so the rows of the image that a node's threads touched first stay in that node's memory */
+#ifdef __linux__
+#define _GNU_SOURCE     // for sched_getaffinity() and pthread_setaffinity_np()
+#include <sched.h>
+#include <dirent.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../include/tiles.h"
+#include "../include/stats.h"
+#include "../include/arena.h"
+#include "../include/grid.h"
+#include "../include/watch.h"
+
+/* state shared between the calling thread and the workers */
+typedef struct tile_pool_t {
+    pthread_t *threads;
+    int nthreads;               // total threads including the calling thread
+    int *cpus;                  // processor each thread is pinned to, NULL if they aren't
+    int *thread_node;           // node of each thread's processor, 0 for every thread unless they are pinned
+    int nnodes;                 // nodes with at least one thread on them
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;  // signaled when a new batch of tiles is posted
+    pthread_cond_t work_done;   // signaled when a worker finishes its part of the batch
+    int generation;             // bumped for every batch so workers can tell new work apart
+    int busy;                   // workers still running the current batch
+    boolean shutdown;
+
+    // the current batch
+    Tile *tiles;
+    int ntiles;
+    int *order;                 // indices into tiles, grouped by node, node k's from node_start[k] to node_start[k + 1]
+    int order_size;
+    int *node_start;
+    int *node_next;             // next tile of each node's band to hand out
+    boolean steal;              // whether threads take other nodes' tiles once their own node's are done
+    tile_func func;
+    void *arg;
+} TilePool;
+
+static int one_node[1] = {0};
+
+static TilePool pool = {
+        .threads = NULL,
+        .nthreads = 1,
+        .thread_node = one_node,
+        .nnodes = 1
+};
+
+/* node of the calling thread's processor, see tile_pool_node() */
+static __thread int current_node = 0;
+
+/**
+ * @return - number of processors online, used when no thread count is given
+ */
+int default_thread_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/**
+ * Grabs tiles off of the current batch until there are none left, starting with those of the thread's own node
+ * @param thread - index of the thread doing the work
+ */
+static void run_batch(int thread) {
+    int home = pool.thread_node[thread];
+    while (true) {
+        int t = -1;
+        pthread_mutex_lock(&pool.lock);
+        for (int k = 0; k < pool.nnodes && t < 0; k++) {
+            int node = (home + k) % pool.nnodes;
+            if (pool.node_next[node] < pool.node_start[node + 1])
+                t = pool.order[pool.node_next[node]++];
+            if (!pool.steal)
+                break;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (t < 0)
+            break;
+        pool.func(&pool.tiles[t], thread, pool.arg);
+    }
+    // fold this thread's counters into the totals before the batch is reported done
+    flush_counters();
+}
+
+#ifdef __linux__
+/**
+ * Finds the NUMA node of every processor from /sys/devices/system/node
+ * @param node_of_cpu - CPU_SETSIZE entries, set to the node of each processor, 0 where /sys doesn't say
+ */
+static void read_cpu_nodes(int *node_of_cpu) {
+    memset(node_of_cpu, 0, sizeof(int) * CPU_SETSIZE);
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL)
+        return;
+    for (struct dirent *entry; (entry = readdir(dir)) != NULL;) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) != 1)
+            continue;
+        char path[300];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *in = fopen(path, "r");
+        if (in == NULL)
+            continue;
+        // a list of ranges like 0-3,8-11
+        int first, last;
+        while (fscanf(in, "%d", &first) == 1) {
+            last = first;
+            int c = fgetc(in);
+            if (c == '-') {
+                if (fscanf(in, "%d", &last) != 1)
+                    break;
+                c = fgetc(in);
+            }
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                if (cpu >= 0)
+                    node_of_cpu[cpu] = node;
+            }
+            if (c != ',')
+                break;
+        }
+        fclose(in);
+    }
+    closedir(dir);
+}
+
+/**
+ * Picks a processor for each thread out of those the process may run on. They are taken in node order and spread
+ * evenly, so threads fewer than the processors are shared out between the nodes rather than filling the first one
+ */
+static void pick_cpus(int nthreads) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Error: tile_pool_init: Failed to find which processors the threads can be pinned to\n");
+        exit(1);
+    }
+    int *node_of_cpu = malloc(sizeof(int) * CPU_SETSIZE);
+    read_cpu_nodes(node_of_cpu);
+    int *cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    int ncpus = 0, max_node = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (node_of_cpu[cpu] > max_node)
+            max_node = node_of_cpu[cpu];
+    }
+    for (int node = 0; node <= max_node; node++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && node_of_cpu[cpu] == node)
+                cpus[ncpus++] = cpu;
+        }
+    }
+
+    // nodes are numbered from 0 in the order they are first used, skipping those no thread is on
+    int *node_index = malloc(sizeof(int) * (max_node + 1));
+    for (int node = 0; node <= max_node; node++)
+        node_index[node] = -1;
+    pool.cpus = malloc(sizeof(int) * nthreads);
+    pool.thread_node = malloc(sizeof(int) * nthreads);
+    pool.nnodes = 0;
+    for (int i = 0; i < nthreads; i++) {
+        int cpu = nthreads <= ncpus ? cpus[(long)i * ncpus / nthreads] : cpus[i % ncpus];
+        int node = node_of_cpu[cpu];
+        if (node_index[node] < 0)
+            node_index[node] = pool.nnodes++;
+        pool.cpus[i] = cpu;
+        pool.thread_node[i] = node_index[node];
+    }
+    free(node_index);
+    free(cpus);
+    free(node_of_cpu);
+}
+
+/**
+ * Pins the calling thread to its processor, if the threads are pinned
+ * @param thread - index of the calling thread
+ */
+static void pin_thread(int thread) {
+    current_node = pool.thread_node[thread];
+    if (pool.cpus == NULL)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pool.cpus[thread], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Error: tile_pool_init: Failed to pin thread %d to processor %d\n", thread, pool.cpus[thread]);
+        exit(1);
+    }
+}
+#else
+static void pick_cpus(int nthreads) {
+    fprintf(stderr, "Error: tile_pool_init: Pinning threads to processors is only supported on Linux\n");
+    exit(1);
+}
+
+static void pin_thread(int thread) {
+}
+#endif
+
+static void *worker_main(void *arg) {
+    int thread = (int)(long)arg;
+    int seen = 0;
+    pin_thread(thread);
+    pthread_mutex_lock(&pool.lock);
+    while (true) {
+        while (pool.generation == seen && !pool.shutdown)
+            pthread_cond_wait(&pool.work_ready, &pool.lock);
+        if (pool.shutdown)
+            break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_batch(thread);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.busy--;
+        if (pool.busy == 0)
+            pthread_cond_signal(&pool.work_done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    arena_free(&frame_arena);
+    grid_thread_free();
+    tile_deps_thread_free();
+    return NULL;
+}
+
+/**
+ * Starts the worker threads. The calling thread counts as one of them, so nthreads - 1 threads are created
+ * @param nthreads - total number of threads to render with
+ * @param pin - whether each thread, the calling one included, is kept on a processor of its own
+ */
+void tile_pool_init(int nthreads, boolean pin) {
+    if (nthreads < 1)
+        nthreads = 1;
+    pool.nthreads = nthreads;
+    pool.cpus = NULL;
+    pool.thread_node = calloc(nthreads, sizeof(int));
+    pool.nnodes = 1;
+    if (pin) {
+        free(pool.thread_node);
+        pick_cpus(nthreads);
+    }
+    pool.node_start = calloc(pool.nnodes + 1, sizeof(int));
+    pool.node_next = calloc(pool.nnodes, sizeof(int));
+    pool.order = NULL;
+    pool.order_size = 0;
+    pin_thread(0);
+    pool.generation = 0;
+    pool.busy = 0;
+    pool.shutdown = false;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.work_done, NULL);
+    pool.threads = malloc(sizeof(pthread_t) * nthreads);
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&pool.threads[i], NULL, worker_main, (void*)(long)i) != 0) {
+            fprintf(stderr, "Error: tile_pool_init: Failed to create worker thread\n");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Stops and joins all of the worker threads
+ */
+void tile_pool_shutdown() {
+    arena_free(&frame_arena);   // the calling thread's, the workers free their own
+    grid_thread_free();
+    tile_deps_thread_free();
+    if (pool.threads == NULL)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    free(pool.cpus);
+    free(pool.thread_node);
+    free(pool.node_start);
+    free(pool.node_next);
+    free(pool.order);
+    pool.threads = NULL;
+    pool.nthreads = 1;
+    pool.cpus = NULL;
+    pool.thread_node = one_node;
+    pool.nnodes = 1;
+    current_node = 0;
+}
+
+int tile_pool_threads() {
+    return pool.nthreads;
+}
+
+/**
+ * @return - number of NUMA nodes the threads are on, 1 unless they are pinned
+ */
+int tile_pool_nodes() {
+    return pool.nnodes;
+}
+
+/**
+ * @return - NUMA node of the calling thread, from 0 to tile_pool_nodes() - 1
+ */
+int tile_pool_node() {
+    return current_node;
+}
+
+/**
+ * Splits an image into TILE_SIZE x TILE_SIZE tiles in row major order
+ * @param width - image width
+ * @param height - image height
+ * @param tiles - set to a malloc'd array of tiles
+ * @return - number of tiles
+ */
+int make_tiles(int width, int height, Tile **tiles) {
+    int cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+    *tiles = malloc(sizeof(Tile) * cols * rows);
+    int n = 0;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            Tile *t = &(*tiles)[n++];
+            t->x0 = c * TILE_SIZE;
+            t->y0 = r * TILE_SIZE;
+            t->x1 = t->x0 + TILE_SIZE < width ? t->x0 + TILE_SIZE : width;
+            t->y1 = t->y0 + TILE_SIZE < height ? t->y0 + TILE_SIZE : height;
+        }
+    }
+    return n;
+}
+
+/**
+ * Splits the tiles of a batch into one band of rows per node, posts them to the pool and works on them until the
+ * batch is done
+ * @param height - height of the whole image the tiles are from, which the bands divide
+ * @param steal - whether threads go on to other nodes' tiles once their own are done
+ */
+static void run_tiles(Tile *tiles, int ntiles, int height, tile_func func, void *arg, boolean steal) {
+    if (pool.threads == NULL) {     // no pool was started, do everything on this thread
+        for (int t = 0; t < ntiles; t++)
+            func(&tiles[t], 0, arg);
+        flush_counters();
+        return;
+    }
+    if (ntiles > pool.order_size) {
+        free(pool.order);
+        pool.order = malloc(sizeof(int) * ntiles);
+        pool.order_size = ntiles;
+    }
+    // a tile's band only depends on where it is in the image, not on which other tiles are in the batch, so the same
+    // rows go to the same node in every batch, the same as when first_touch_image() placed them
+    memset(pool.node_start, 0, sizeof(int) * (pool.nnodes + 1));
+    for (int t = 0; t < ntiles; t++)
+        pool.node_start[(long)tiles[t].y0 * pool.nnodes / height + 1]++;
+    for (int k = 0; k < pool.nnodes; k++) {
+        pool.node_start[k + 1] += pool.node_start[k];
+        pool.node_next[k] = pool.node_start[k];
+    }
+    for (int t = 0; t < ntiles; t++)
+        pool.order[pool.node_next[(long)tiles[t].y0 * pool.nnodes / height]++] = t;
+    for (int k = 0; k < pool.nnodes; k++)
+        pool.node_next[k] = pool.node_start[k];
+
+    pthread_mutex_lock(&pool.lock);
+    pool.tiles = tiles;
+    pool.ntiles = ntiles;
+    pool.steal = steal;
+    pool.func = func;
+    pool.arg = arg;
+    pool.busy = pool.nthreads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_batch(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.work_done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Runs func on every tile using all threads in the pool and waits for the whole batch to finish. Tiles are handed out
+ * in order, so neighboring tiles tend to be rendered at the same time
+ * @param tiles - tiles to work on
+ * @param ntiles - number of tiles
+ * @param height - height of the whole image the tiles are from, even if only some of its tiles are in the batch
+ * @param func - work to do on each tile
+ * @param arg - passed through to func
+ */
+void tile_pool_run(Tile *tiles, int ntiles, int height, tile_func func, void *arg) {
+    run_tiles(tiles, ntiles, height, func, arg, true);
+}
+
+/* a function run once on each node, see tile_pool_run_nodes() */
+typedef struct node_job_t {
+    node_func func;
+    void *arg;
+} NodeJob;
+
+static void run_node(Tile *tile, int thread, void *arg) {
+    NodeJob *job = arg;
+    job->func(tile->y0, job->arg);
+}
+
+/**
+ * Runs func once for every NUMA node, each time on one of the node's threads, and waits for them all to finish.
+ * Memory func allocates and writes first is placed on its node
+ * @param func - work to do for each node
+ * @param arg - passed through to func
+ */
+void tile_pool_run_nodes(node_func func, void *arg) {
+    // tile k is the only one in the band of node k
+    Tile *tiles = malloc(sizeof(Tile) * pool.nnodes);
+    for (int k = 0; k < pool.nnodes; k++) {
+        tiles[k].x0 = 0;
+        tiles[k].x1 = 1;
+        tiles[k].y0 = k;
+        tiles[k].y1 = k + 1;
+    }
+    NodeJob job = {func, arg};
+    run_tiles(tiles, pool.nnodes, pool.nnodes, run_node, &job, false);
+    free(tiles);
+}
@@ -0,0 +1,120 @@
+/** vecbench main program entry point
+ *
+ *  times the vector kernels in vector_math.h, the V3 versions against the V4 ones, in nanoseconds per call. Each
+ *  kernel runs in a loop over a few thousand random vectors, so the numbers are throughput with the data in cache */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/vector_math.h"
+
+#define VECTORS 4096    // vectors each kernel loops over, 96 kB of double input
+#define ROUNDS 2000     // times each kernel goes over all of them
+
+static V3 in_a[VECTORS], in_b[VECTORS], out[VECTORS];
+
+/**
+ * Reads a monotonic clock
+ * @return - seconds since some fixed point
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Adds up the outputs so the compiler can't drop the work that produced them
+ */
+static real checksum() {
+    real sum = 0;
+    for (int i = 0; i < VECTORS; i++)
+        sum += out[i][0] + out[i][1] + out[i][2];
+    return sum;
+}
+
+/**
+ * Prints the time a kernel took per call
+ * @param name - name of the kernel
+ * @param seconds - time it took for all rounds
+ */
+static void report(const char *name, double seconds) {
+    printf("  %-18s %6.2f ns   (checksum %g)\n", name, seconds * 1e9 / ((double)ROUNDS * VECTORS),
+           (double)checksum());
+}
+
+/* keeps the compiler from merging the rounds of a kernel, which all write the same outputs */
+#define END_ROUND() __asm__ __volatile__("" : : : "memory")
+
+static void bench_normalize() {
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < VECTORS; i++) {
+            v3_copy(in_a[i], out[i]);
+            normalize(out[i]);
+        }
+        END_ROUND();
+    }
+}
+
+static void bench_v4_normalize() {
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < VECTORS; i++)
+            v4_store(v4_normalize(v4_load(in_a[i])), out[i]);
+        END_ROUND();
+    }
+}
+
+static void bench_v4_normalize_fast() {
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < VECTORS; i++)
+            v4_store(v4_normalize_fast(v4_load(in_a[i])), out[i]);
+        END_ROUND();
+    }
+}
+
+static void bench_cross() {
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < VECTORS; i++)
+            v3_cross(in_a[i], in_b[i], out[i]);
+        END_ROUND();
+    }
+}
+
+static void bench_v4_cross() {
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < VECTORS; i++)
+            v4_store(v4_cross(v4_load(in_a[i]), v4_load(in_b[i])), out[i]);
+        END_ROUND();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    srand(1);
+    for (int i = 0; i < VECTORS; i++) {
+        for (int k = 0; k < 3; k++) {
+            in_a[i][k] = (real)rand() / RAND_MAX * 2 - 1;
+            in_b[i][k] = (real)rand() / RAND_MAX * 2 - 1;
+        }
+    }
+
+    struct {
+        const char *name;
+        void (*run)();
+    } kernels[] = {
+            {"normalize", bench_normalize},
+            {"v4_normalize", bench_v4_normalize},
+            {"v4_normalize_fast", bench_v4_normalize_fast},
+            {"v3_cross", bench_cross},
+            {"v4_cross", bench_v4_cross}
+    };
+    printf("%s precision, %d vectors, %d rounds\n", sizeof(real) == sizeof(float) ? "single" : "double", VECTORS,
+           ROUNDS);
+    for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+        memset(out, 0, sizeof(out));
+        double start = now();
+        kernels[k].run();
+        report(kernels[k].name, now() - start);
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+/* visibility.c - finds what primary rays hit first without testing every object. Seen from the camera's own frame,
+ * where it sits at the origin looking down +z at the viewplane z = 1, each sphere covers a rectangle of the viewplane
+ * that can be worked out ahead of time. Spheres are binned by the tiles their rectangles cover and a primary ray only
+ * tests the spheres in its tile's bin whose rectangle contains it. Planes are intersected directly with the origin
+ * term precomputed, and meshes through their own BVH */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../include/visibility.h"
+#include "../include/tiles.h"
+#include "../include/mesh.h"
+#include "../include/instance.h"
+#include "../include/watch.h"
+
+/* grows the projected rectangles so rounding can't drop a grazing hit */
+#ifdef SINGLE_PRECISION
+#define RECT_EPSILON 1e-5f
+#else
+#define RECT_EPSILON 1e-9
+#endif
+
+/**
+ * Finds the range of slopes (x/z) of lines through the origin that touch a circle in the xz plane. This is the exact
+ * extent of the sphere's projection along one viewplane axis
+ * @param c - center of the circle along the axis
+ * @param cz - center of the circle along z, must be > r
+ * @param r - radius
+ * @param lo - smallest slope
+ * @param hi - largest slope
+ */
+static void tangent_slopes(real c, real cz, real r, real *lo, real *hi) {
+    real denom = sqr(cz) - sqr(r);
+    real root = r * sqrt(sqr(c) + sqr(cz) - sqr(r));
+    *lo = (c * cz - root) / denom - RECT_EPSILON;
+    *hi = (c * cz + root) / denom + RECT_EPSILON;
+}
+
+/**
+ * Projects every sphere onto the viewplane and bins it into the tiles it covers, and precomputes the plane terms
+ * @param vis - visibility structure to fill in
+ * @param view - viewplane the primary rays go through
+ * @param img_width - image width in pixels
+ * @param img_height - image height in pixels
+ */
+void visibility_init(PrimaryVisibility *vis, View *view, int img_width, int img_height) {
+    int n = 0;
+    while (objects[n].type != 0)
+        n++;
+    vis->view = view;
+    vis->img_width = img_width;
+    vis->img_height = img_height;
+    vis->tiles_x = (img_width + TILE_SIZE - 1) / TILE_SIZE;
+    vis->tiles_y = (img_height + TILE_SIZE - 1) / TILE_SIZE;
+    vis->rect = malloc(sizeof(*vis->rect) * (n + 1));
+    vis->always = malloc(sizeof(int) * (n + 1));
+    vis->planes = malloc(sizeof(int) * (n + 1));
+    vis->plane_num = malloc(sizeof(real) * (n + 1));
+    vis->meshes = malloc(sizeof(int) * (n + 1));
+    vis->nalways = 0;
+    vis->nplanes = 0;
+    vis->nmeshes = 0;
+
+    int ntiles = vis->tiles_x * vis->tiles_y;
+    int *tile_range = malloc(sizeof(int) * 4 * (n + 1));   // per sphere: first/last tile column, first/last tile row
+    vis->bin_start = calloc(ntiles + 1, sizeof(int));
+
+    for (int i = 0; i < n; i++) {
+        tile_range[4*i] = 1;    // empty until proven otherwise
+        tile_range[4*i + 1] = 0;
+        if (objects[i].type == PLANE) {
+            vis->planes[vis->nplanes] = i;
+            real d[3];
+            v3_sub(objects[i].plane.position, view->origin, d);
+            vis->plane_num[vis->nplanes] = v3_dot(d, objects[i].plane.normal);
+            vis->nplanes++;
+            continue;
+        }
+        if (objects[i].type == MESH) {
+            vis->meshes[vis->nmeshes++] = i;
+            continue;
+        }
+        if (objects[i].type != SPHERE)
+            continue;
+
+        // the center in the camera's frame
+        real d[3], c[3];
+        v3_sub(objects[i].sphere.position, view->origin, d);
+        c[0] = v3_dot(d, view->right);
+        c[1] = v3_dot(d, view->up);
+        c[2] = v3_dot(d, view->forward);
+        real r = objects[i].sphere.radius;
+        if (c[2] <= -r)     // entirely behind the camera
+            continue;
+        if (c[2] <= r) {    // surrounds or straddles the camera, projection is unbounded
+            vis->always[vis->nalways++] = i;
+            continue;
+        }
+        real *rect = vis->rect[i];
+        tangent_slopes(c[0], c[2], r, &rect[0], &rect[1]);
+        tangent_slopes(c[1], c[2], r, &rect[2], &rect[3]);
+
+        // pixels whose area on the viewplane overlaps the rectangle, see primary_ray() for the mapping
+        int col0 = (int)floor((rect[0] + view->width/2.0) / view->pixwidth);
+        int col1 = (int)floor((rect[1] + view->width/2.0) / view->pixwidth);
+        int row0 = (int)floor((view->height/2.0 - rect[3]) / view->pixheight);
+        int row1 = (int)floor((view->height/2.0 - rect[2]) / view->pixheight);
+        if (col1 < 0 || row1 < 0 || col0 >= img_width || row0 >= img_height)
+            continue;       // off screen
+        if (col0 < 0) col0 = 0;
+        if (row0 < 0) row0 = 0;
+        if (col1 >= img_width) col1 = img_width - 1;
+        if (row1 >= img_height) row1 = img_height - 1;
+        int *range = &tile_range[4*i];
+        range[0] = col0 / TILE_SIZE;
+        range[1] = col1 / TILE_SIZE;
+        range[2] = row0 / TILE_SIZE;
+        range[3] = row1 / TILE_SIZE;
+        for (int ty = range[2]; ty <= range[3]; ty++)
+            for (int tx = range[0]; tx <= range[1]; tx++)
+                vis->bin_start[ty * vis->tiles_x + tx + 1]++;
+    }
+
+    // turn the counts into offsets and fill the bins in object order
+    for (int t = 0; t < ntiles; t++)
+        vis->bin_start[t + 1] += vis->bin_start[t];
+    vis->bin_items = malloc(sizeof(int) * (vis->bin_start[ntiles] + 1));
+    int *fill = malloc(sizeof(int) * (ntiles + 1));
+    for (int t = 0; t < ntiles; t++)
+        fill[t] = vis->bin_start[t];
+    for (int i = 0; i < n; i++) {
+        int *range = &tile_range[4*i];
+        if (objects[i].type != SPHERE || range[0] > range[1])
+            continue;
+        for (int ty = range[2]; ty <= range[3]; ty++)
+            for (int tx = range[0]; tx <= range[1]; tx++)
+                vis->bin_items[fill[ty * vis->tiles_x + tx]++] = i;
+    }
+    free(fill);
+    free(tile_range);
+}
+
+void visibility_free(PrimaryVisibility *vis) {
+    free(vis->rect);
+    free(vis->always);
+    free(vis->planes);
+    free(vis->plane_num);
+    free(vis->meshes);
+    free(vis->bin_start);
+    free(vis->bin_items);
+}
+
+/**
+ * Keeps the closer of two hits. Ties go to the lower object index, the same as a linear scan over objects
+ */
+static inline void closest_hit(FirstHit *hit, int obj, real t, boolean in_sphere, int triangle) {
+    if (t > 0 && (t < hit->t || (t == hit->t && obj < hit->obj))) {
+        hit->obj = obj;
+        hit->t = t;
+        hit->in_sphere = in_sphere;
+        hit->triangle = triangle;
+    }
+}
+
+/**
+ * Finds the closest object along a primary ray. Gives the same answer as shoot() with no object to skip and no
+ * maximum distance, but only tests spheres that can cover the ray's spot on the viewplane
+ * @param vis - prepared visibility structure
+ * @param ray - primary ray leaving the camera
+ * @param spot - where the ray crosses the viewplane one unit in front of the camera, as the ray was built from it
+ * @param row - pixel row the ray goes through, picks the tile bin
+ * @param col - pixel column the ray goes through, picks the tile bin
+ * @param hit - the closest hit, obj is -1 if nothing was hit
+ */
+void primary_shoot(PrimaryVisibility *vis, Ray *ray, real spot[2], int row, int col, FirstHit *hit) {
+    hit->obj = -1;
+    hit->t = INFINITY;
+    hit->in_sphere = false;
+    hit->triangle = -1;
+    counters.rays++;
+    real x = spot[0];
+    real y = spot[1];
+
+    int bin = (row / TILE_SIZE) * vis->tiles_x + col / TILE_SIZE;
+    for (int k = vis->bin_start[bin]; k < vis->bin_start[bin + 1]; k++) {
+        int i = vis->bin_items[k];
+        real *rect = vis->rect[i];
+        if (x < rect[0] || x > rect[1] || y < rect[2] || y > rect[3])
+            continue;
+        boolean in_sphere = false;
+        counters.tests++;
+        real t = sphere_intersect(ray, objects[i].sphere.position, objects[i].sphere.radius, &in_sphere);
+        closest_hit(hit, i, t, in_sphere, -1);
+    }
+    for (int k = 0; k < vis->nalways; k++) {
+        int i = vis->always[k];
+        boolean in_sphere = false;
+        counters.tests++;
+        real t = sphere_intersect(ray, objects[i].sphere.position, objects[i].sphere.radius, &in_sphere);
+        closest_hit(hit, i, t, in_sphere, -1);
+    }
+    for (int k = 0; k < vis->nplanes; k++) {
+        int i = vis->planes[k];
+        counters.tests++;
+        real vd = v3_dot(objects[i].plane.normal, ray->direction);
+        if (fabs(vd) < PARALLEL_EPSILON)
+            continue;
+        closest_hit(hit, i, vis->plane_num[k] / vd, false, -1);
+    }
+    for (int k = 0; k < vis->nmeshes; k++) {
+        int i = vis->meshes[k];
+        boolean in_sphere = false;
+        int triangle;
+        counters.tests++;
+        real t = mesh_intersect(ray, &objects[i].mesh, 0, INFINITY, &in_sphere, &triangle);
+        closest_hit(hit, i, t, in_sphere, triangle);
+    }
+    instances_shoot(ray, -1, INFINITY, &hit->obj, &hit->t, &hit->in_sphere, &hit->triangle);
+    watch_record(ray, INFINITY, hit->obj, hit->t);
+}
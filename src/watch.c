@@ -0,0 +1,610 @@
+/* watch.c - incremental re-rendering for --watch. While a tile renders, every ray it traces adds what it touched to
+ * the tile's dependencies: the object it hit, the cells of a coarse grid over the scene that it crossed before
+ * stopping, and the cell of the point it hit. When the scene file is saved it is read again and compared with the last
+ * read object by object and light by light. A ray whose result can change either hit an object that changed, or now
+ * crosses the new bounds of one that moved, or ends at a point a changed light reached before or reaches now. Tiles
+ * with none of those rays keep their pixels from the last render and only the rest are traced again, recording their
+ * dependencies afresh */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#endif
+#include "../include/watch.h"
+#include "../include/instance.h"
+#include "../include/mesh.h"
+#include "../include/lighttree.h"
+#include "../include/animation.h"
+
+__thread TileDeps *tile_deps = NULL;
+
+/* the coarse grid rays are recorded on, over the bounded objects and a margin around them, see watch_cells_build() */
+static real cells_lo[3], cells_hi[3], cells_size[3], cells_inv_size[3];
+static int cells_res[3];
+static int cells_stride[3]; // index step from a cell to the next one along each axis
+static int cells_words;     // 64 bit words in a bit set with one bit per cell
+
+/* per-thread stamps of the last tile that listed each object, so each is listed once per tile */
+static __thread unsigned int *listed = NULL;
+static __thread int listed_size = 0;
+static __thread unsigned int tile_stamp = 0;
+
+static void object_bounds(int i, real lo[3], real hi[3]);
+
+/**
+ * Lays the coarse grid over the scene as it is now. Tiles recorded on an earlier grid have to be rendered again, so
+ * this is only done when every tile is
+ */
+void watch_cells_build() {
+    for (int k = 0; k < 3; k++) {
+        cells_lo[k] = INFINITY;
+        cells_hi[k] = -INFINITY;
+    }
+    for (int i = 0; i < nobjects; i++) {
+        if (objects[i].type != SPHERE && objects[i].type != MESH && objects[i].type != INSTANCE)
+            continue;
+        real lo[3], hi[3];
+        object_bounds(i, lo, hi);
+        for (int k = 0; k < 3; k++) {
+            cells_lo[k] = fmin(cells_lo[k], lo[k]);
+            cells_hi[k] = fmax(cells_hi[k], hi[k]);
+        }
+    }
+    if (cells_lo[0] > cells_hi[0]) {
+        for (int k = 0; k < 3; k++) {
+            cells_lo[k] = -1;   // nothing bounded to go around, anything that moves will need every tile anyway
+            cells_hi[k] = 1;
+        }
+    }
+
+    // cells as close to cubes as the bounds allow, like the grid in grid.c
+    real extent[3];
+    real largest = 0;
+    for (int k = 0; k < 3; k++)
+        largest = fmax(largest, cells_hi[k] - cells_lo[k]);
+    real volume = 1;
+    for (int k = 0; k < 3; k++) {
+        real margin = WATCH_MARGIN * fmax(cells_hi[k] - cells_lo[k], (real)0.01 * largest);
+        cells_lo[k] -= margin;
+        cells_hi[k] += margin;
+        extent[k] = cells_hi[k] - cells_lo[k];
+        volume *= extent[k];
+    }
+    real cells_per_unit = cbrt(WATCH_CELLS / volume);
+    int ncells = 1;
+    for (int k = 0; k < 3; k++) {
+        real res = ceil(extent[k] * cells_per_unit);
+        cells_res[k] = res < 1 ? 1 : res > WATCH_MAX_RES ? WATCH_MAX_RES : (int)res;
+        cells_size[k] = extent[k] / cells_res[k];
+        cells_inv_size[k] = 1 / cells_size[k];
+        cells_stride[k] = ncells;
+        ncells *= cells_res[k];
+    }
+    cells_words = (ncells + 63) / 64;
+}
+
+/**
+ * Finds the cell along one axis holding a coordinate, the nearest one if it is outside the grid
+ */
+static inline int cell_of(real v, int k) {
+    real c = (v - cells_lo[k]) * cells_inv_size[k];
+    return c < 0 ? 0 : c >= cells_res[k] ? cells_res[k] - 1 : (int)c;
+}
+
+static inline void mark_cell(uint64_t *bits, int i) {
+    bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+/**
+ * Marks the cells a ray crosses between two distances along it, walking them in order
+ */
+static void mark_segment(uint64_t *bits, Ray *ray, real t0, real t1) {
+    // clip to the grid, nothing outside of it can move without every tile being rendered again
+    real inv[3];
+    for (int k = 0; k < 3; k++) {
+        if (ray->direction[k] == 0) {
+            if (ray->origin[k] < cells_lo[k] || ray->origin[k] > cells_hi[k])
+                return;
+            inv[k] = INFINITY;
+            continue;
+        }
+        inv[k] = 1 / ray->direction[k];
+        real ta = (cells_lo[k] - ray->origin[k]) * inv[k];
+        real tb = (cells_hi[k] - ray->origin[k]) * inv[k];
+        if (ta > tb) {
+            real swap = ta;
+            ta = tb;
+            tb = swap;
+        }
+        t0 = ta > t0 ? ta : t0;
+        t1 = tb < t1 ? tb : t1;
+    }
+    if (t0 > t1)
+        return;
+
+    int i = 0, left[3], step[3];
+    real t_next[3], t_delta[3];
+    for (int k = 0; k < 3; k++) {
+        int c = cell_of(ray->origin[k] + t0 * ray->direction[k], k);
+        int last = cell_of(ray->origin[k] + t1 * ray->direction[k], k);
+        i += c * cells_stride[k];
+        left[k] = abs(last - c);
+        t_next[k] = INFINITY;
+        if (left[k] == 0)
+            continue;
+        step[k] = last > c ? cells_stride[k] : -cells_stride[k];
+        real boundary = cells_lo[k] + (c + (last > c)) * cells_size[k];
+        t_next[k] = (boundary - ray->origin[k]) * inv[k];
+        t_delta[k] = cells_size[k] * fabs(inv[k]);
+    }
+    mark_cell(bits, i);
+    for (int n = left[0] + left[1] + left[2]; n > 0; n--) {
+        int k = t_next[0] <= t_next[1] ? (t_next[0] <= t_next[2] ? 0 : 2) : (t_next[1] <= t_next[2] ? 1 : 2);
+        i += step[k];
+        mark_cell(bits, i);
+        t_next[k] = --left[k] == 0 ? INFINITY : t_next[k] + t_delta[k];
+    }
+}
+
+/**
+ * Starts recording the dependencies of a tile on the calling thread, forgetting what it recorded last time
+ * @param deps - the tile's dependencies
+ */
+void tile_deps_begin(TileDeps *deps) {
+    if (deps->words != cells_words) {
+        free(deps->crossed);
+        deps->crossed = malloc(sizeof(uint64_t) * 2 * cells_words);
+        deps->lit = deps->crossed + cells_words;
+        deps->words = cells_words;
+    }
+    memset(deps->crossed, 0, sizeof(uint64_t) * 2 * cells_words);
+    deps->nobjects = 0;
+    if (listed_size < nobjects || ++tile_stamp == 0) {
+        if (listed_size < nobjects) {
+            free(listed);
+            listed = malloc(sizeof(unsigned int) * nobjects);
+            if (listed == NULL) {
+                fprintf(stderr, "Error: tile_deps_begin: Out of memory\n");
+                exit(1);
+            }
+            listed_size = nobjects;
+        }
+        memset(listed, 0, sizeof(unsigned int) * listed_size);
+        tile_stamp = 1;
+    }
+    tile_deps = deps;
+}
+
+/**
+ * Forgets what a tile's rays touched, for a tile that was rendered without recording. tile_dirty() counts it as
+ * dirty until it is recorded again
+ */
+void tile_deps_forget(TileDeps *deps) {
+    deps->words = 0;
+    deps->nobjects = 0;
+}
+
+/**
+ * @return - whether a tile's dependencies were recorded on the coarse grid as it is now
+ */
+boolean tile_deps_known(TileDeps *deps) {
+    return deps->words == cells_words;
+}
+
+/**
+ * Frees the calling thread's object stamps, called by each pool thread as it exits
+ */
+void tile_deps_thread_free() {
+    free(listed);
+    listed = NULL;
+    listed_size = 0;
+    tile_stamp = 0;
+}
+
+/**
+ * Stops recording on the calling thread
+ */
+void tile_deps_end() {
+    tile_deps = NULL;
+}
+
+/**
+ * Adds a ray to the dependencies of the tile being recorded, see watch_record()
+ */
+void tile_deps_record(Ray *ray, real max_distance, int hit, real t) {
+    TileDeps *deps = tile_deps;
+    if (isnan(ray->direction[0] + ray->direction[1] + ray->direction[2]))
+        return;     // a failed refraction, which can't hit anything before or after an edit
+    mark_segment(deps->crossed, ray, 0, hit >= 0 ? t : max_distance);
+    if (hit < 0)
+        return;
+    int i = 0;
+    for (int k = 0; k < 3; k++)
+        i += cell_of(ray->origin[k] + t * ray->direction[k], k) * cells_stride[k];
+    mark_cell(deps->lit, i);
+
+    int obj = hit < nobjects ? hit : instance_owner(hit);
+    if (listed[obj] == tile_stamp)
+        return;
+    listed[obj] = tile_stamp;
+    if (deps->nobjects == deps->capacity) {
+        deps->capacity = deps->capacity > 0 ? 2 * deps->capacity : 16;
+        deps->objects = realloc(deps->objects, sizeof(int) * deps->capacity);
+        if (deps->objects == NULL) {
+            fprintf(stderr, "Error: tile_deps_record: Out of memory\n");
+            exit(1);
+        }
+    }
+    deps->objects[deps->nobjects++] = obj;
+}
+
+/**
+ * Frees the dependencies of n tiles
+ */
+void tile_deps_free(TileDeps *deps, int n) {
+    for (int i = 0; i < n; i++) {
+        free(deps[i].crossed);
+        free(deps[i].objects);
+    }
+    free(deps);
+}
+
+/**
+ * Compares two vectors that may be missing
+ */
+static boolean same_vector(real *a, real *b) {
+    if (a == NULL || b == NULL)
+        return a == b;
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+/**
+ * Compares the colors and surface properties of two spheres, planes or meshes of the same type
+ */
+static boolean same_material(object *a, object *b) {
+    if (!same_vector(a->plane.diff_color, b->plane.diff_color) ||
+        !same_vector(a->plane.spec_color, b->plane.spec_color))
+        return false;   // first in each of them, see json.h
+    if (a->type == SPHERE)
+        return a->sphere.reflect == b->sphere.reflect && a->sphere.refract == b->sphere.refract &&
+               a->sphere.ior == b->sphere.ior;
+    if (a->type == PLANE)
+        return a->plane.reflect == b->plane.reflect && a->plane.refract == b->plane.refract &&
+               a->plane.ior == b->plane.ior;
+    return a->mesh.reflect == b->mesh.reflect && a->mesh.refract == b->mesh.refract && a->mesh.ior == b->mesh.ior;
+}
+
+/**
+ * Finds how an object differs from the same object in the last read of the scene
+ * @param a - the object before
+ * @param b - the object now
+ * @return - 0, CHANGE_MATERIAL or CHANGE_GEOMETRY, or -1 if no tile can be kept
+ */
+static int object_change(object *a, object *b) {
+    if (a->type != b->type)
+        return -1;
+    boolean same_shape = true;
+    switch (a->type) {
+        case CAMERA:
+            if (a->camera.width != b->camera.width || a->camera.height != b->camera.height ||
+                a->camera.fov != b->camera.fov || !same_vector(a->camera.position, b->camera.position) ||
+                !same_vector(a->camera.look_at, b->camera.look_at) || !same_vector(a->camera.up, b->camera.up))
+                return -1;
+            return 0;
+        case INSTANCE:
+            if (strcmp(a->instance.group, b->instance.group) != 0 ||
+                !same_vector(a->instance.position, b->instance.position) ||
+                !same_vector(a->instance.rotation, b->instance.rotation) || a->instance.scale != b->instance.scale)
+                return CHANGE_GEOMETRY;
+            return 0;
+        case SPHERE:
+            same_shape = same_vector(a->sphere.position, b->sphere.position) && a->sphere.radius == b->sphere.radius;
+            break;
+        case PLANE:
+            same_shape = same_vector(a->plane.position, b->plane.position) &&
+                         same_vector(a->plane.normal, b->plane.normal);
+            break;
+        case MESH:
+            same_shape = strcmp(a->mesh.file, b->mesh.file) == 0 && same_vector(a->mesh.position, b->mesh.position) &&
+                         a->mesh.scale == b->mesh.scale;
+            break;
+    }
+    if (!same_shape)
+        return CHANGE_GEOMETRY;
+    return same_material(a, b) ? 0 : CHANGE_MATERIAL;
+}
+
+/**
+ * Compares two lights
+ */
+static boolean same_light(Light *a, Light *b) {
+    return a->type == b->type && same_vector(a->color, b->color) && same_vector(a->position, b->position) &&
+           same_vector(a->direction, b->direction) && a->theta_deg == b->theta_deg && a->rad_att0 == b->rad_att0 &&
+           a->rad_att1 == b->rad_att1 && a->rad_att2 == b->rad_att2 && a->ang_att0 == b->ang_att0;
+}
+
+/**
+ * Finds the bounds of an object in the scene, padded for the rounding in its intersection tests
+ */
+static void object_bounds(int i, real lo[3], real hi[3]) {
+    object *obj = &objects[i];
+    for (int k = 0; k < 3; k++) {
+        if (obj->type == SPHERE) {
+            lo[k] = obj->sphere.position[k] - obj->sphere.radius;
+            hi[k] = obj->sphere.position[k] + obj->sphere.radius;
+        }
+        else if (obj->type == MESH) {
+            BVHNode *root = &obj->mesh.data->nodes[0];
+            lo[k] = obj->mesh.position[k] + root->lo[k] * obj->mesh.scale;
+            hi[k] = obj->mesh.position[k] + root->hi[k] * obj->mesh.scale;
+        }
+        else {
+            lo[k] = -INFINITY;  // planes go on for ever
+            hi[k] = INFINITY;
+        }
+    }
+    if (obj->type == INSTANCE)
+        instance_object_bounds(i, lo, hi);
+    real slack = fmax(ray_offset(lo), ray_offset(hi));
+    for (int k = 0; k < 3; k++) {
+        lo[k] -= slack;
+        hi[k] += slack;
+    }
+}
+
+/**
+ * Checks whether bounds are inside the coarse grid, where the rays crossing them were recorded
+ */
+static boolean inside_cells(real *b) {
+    for (int k = 0; k < 3; k++) {
+        if (b[k] < cells_lo[k] || b[k + 3] > cells_hi[k])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Compares the objects and lights of two reads of the scene, see scene_diff()
+ * @return - false if no tile can be kept
+ */
+static boolean compare_scenes(SceneCopy *old, SceneDiff *diff) {
+    // objects are matched up by their order in the file, so adding or removing one starts over
+    if (old->nobjects != nobjects || old->nlights != nlights || old->ngrouped_objects != ngrouped_objects)
+        return false;
+    for (int i = 0; i < ngrouped_objects; i++) {
+        if (strcmp(old->grouped_objects[i].group, grouped_objects[i].group) != 0 ||
+            object_change(&old->grouped_objects[i], &grouped_objects[i]) != 0)
+            return false;
+    }
+    for (int i = 0; i < nobjects; i++) {
+        int change = object_change(&old->objects[i], &objects[i]);
+        if (change < 0)
+            return false;
+        diff->change[i] = change;
+        if (change == CHANGE_GEOMETRY) {
+            real *b = diff->bounds[diff->nmoved];
+            object_bounds(i, &b[0], &b[3]);
+            if (!inside_cells(b))
+                return false;   // no ray was recorded out there
+            diff->moved[diff->nmoved++] = i;
+        }
+    }
+    for (int i = 0; i < nlights; i++) {
+        if (same_light(&old->lights[i], &lights[i]))
+            continue;
+        // the light tree picks lights for every point from all of them, so any change can move its choices
+        if (render_options.light_mode != LIGHTS_ALL)
+            return false;
+        Light *both[2] = {&old->lights[i], &lights[i]};
+        for (int j = 0; j < 2; j++) {
+            real *reach = diff->light_reach[diff->nlight_reach++];
+            v3_copy(both[j]->position, reach);
+            reach[3] = both[j]->influence_radius + ray_offset(both[j]->position);
+        }
+    }
+    return true;
+}
+
+/**
+ * Compares the scene that was just read and prepared with the last read of the same file. If no tile can be kept
+ * the coarse grid is laid again over the scene as it is now
+ * @param old - the last read, set aside by scene_detach() and prepared before that
+ * @param diff - set to the differences, to be freed with scene_diff_free()
+ */
+void scene_diff(SceneCopy *old, SceneDiff *diff) {
+    memset(diff, '\0', sizeof(SceneDiff));
+    diff->change = calloc(nobjects + 1, 1);
+    diff->bounds = malloc(sizeof(*diff->bounds) * (nobjects + 1));
+    diff->moved = malloc(sizeof(int) * (nobjects + 1));
+    diff->light_reach = malloc(sizeof(*diff->light_reach) * (2 * nlights + 1));
+    if (!compare_scenes(old, diff)) {
+        diff->everything = true;
+        watch_cells_build();
+    }
+}
+
+void scene_diff_free(SceneDiff *diff) {
+    free(diff->change);
+    free(diff->bounds);
+    free(diff->moved);
+    free(diff->light_reach);
+    memset(diff, '\0', sizeof(SceneDiff));
+}
+
+/**
+ * Checks whether any cell in a box of cells is set
+ */
+static boolean any_cell(uint64_t *bits, const int lo[3], const int hi[3]) {
+    for (int z = lo[2]; z <= hi[2]; z++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            for (int x = lo[0]; x <= hi[0]; x++) {
+                int i = (z * cells_res[1] + y) * cells_res[0] + x;
+                if (bits[i >> 6] >> (i & 63) & 1)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether a light reaches any cell in a bit set. Points outside the grid were recorded in the nearest cell,
+ * which is no further from the light's nearest point in the grid than they are from the light, so the light is
+ * tested from there
+ */
+static boolean reaches_cell(uint64_t *bits, int words, real *reach) {
+    real center[3];
+    for (int k = 0; k < 3; k++)
+        center[k] = fmin(fmax(reach[k], cells_lo[k]), cells_hi[k]);
+    for (int w = 0; w < words; w++) {
+        for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+            if (reach[3] == INFINITY)
+                return true;
+            int i = w * 64 + __builtin_ctzll(word);
+            int c[3] = {i % cells_res[0], i / cells_res[0] % cells_res[1], i / (cells_res[0] * cells_res[1])};
+            real d2 = 0;
+            for (int k = 0; k < 3; k++) {
+                real lo = cells_lo[k] + c[k] * cells_size[k];
+                real d = fmax(fmax(lo - center[k], center[k] - (lo + cells_size[k])), 0);
+                d2 += d * d;
+            }
+            if (d2 <= reach[3] * reach[3])
+                return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether a tile has to be traced again after the scene changed
+ * @param diff - how the scene changed
+ * @param deps - what the tile's rays touched on its last render
+ * @return - true if any pixel of the tile can have changed
+ */
+boolean tile_dirty(SceneDiff *diff, TileDeps *deps) {
+    if (diff->everything || deps->words != cells_words)
+        return true;
+    for (int i = 0; i < deps->nobjects; i++) {
+        if (diff->change[deps->objects[i]] != 0)
+            return true;
+    }
+    for (int m = 0; m < diff->nmoved; m++) {
+        // widened by a little of a cell, for rays that pass right along a cell boundary
+        real *b = diff->bounds[m];
+        int lo[3], hi[3];
+        for (int k = 0; k < 3; k++) {
+            lo[k] = cell_of(b[k] - (real)0.01 * cells_size[k], k);
+            hi[k] = cell_of(b[k + 3] + (real)0.01 * cells_size[k], k);
+        }
+        if (any_cell(deps->crossed, lo, hi))
+            return true;
+    }
+    for (int l = 0; l < diff->nlight_reach; l++) {
+        if (reaches_cell(deps->lit, deps->words, diff->light_reach[l]))
+            return true;
+    }
+    return false;
+}
+
+#ifdef __linux__
+/**
+ * Starts watching a scene file. The directory is watched rather than the file, so that editors which save by
+ * writing a new file and renaming it over the old one are seen too
+ * @param path - the scene file
+ * @return - inotify descriptor to hand to watch_wait()
+ */
+int watch_open(const char *path) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: watch_open: Failed to start inotify\n");
+        exit(1);
+    }
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Error: watch_open: Failed to watch directory '%s'\n", dir);
+        exit(1);
+    }
+    free(dir);
+    return fd;
+}
+
+/**
+ * Waits until a scene file has been saved and then for WATCH_SETTLE_MS more without anything else being written
+ * @param fd - descriptor from watch_open()
+ * @param path - the scene file
+ */
+void watch_wait(int fd, const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash == NULL ? path : slash + 1;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    boolean saved = false;
+    while (!saved) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            fprintf(stderr, "Error: watch_wait: Failed to read inotify events\n");
+            exit(1);
+        }
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && strcmp(event->name, name) == 0)
+                saved = true;
+        }
+    }
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+        if (read(fd, buffer, sizeof(buffer)) <= 0)
+            break;
+    }
+}
+
+/**
+ * Reads and prepares a scene file in a child process, since read_json() and prepare_scene() exit on any error and a
+ * half edited file shouldn't end the watch. The child prints whatever error it finds
+ * @param path - the scene file
+ * @return - true if the scene can be read
+ */
+boolean scene_file_valid(const char *path) {
+    fflush(stdout);     // or the child would write out buffered output a second time as it exits
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+        return true;    // no child to try it in, let the real read find any error
+    if (pid == 0) {
+        FILE *json = fopen(path, "rb");
+        if (json == NULL) {
+            fprintf(stderr, "Error: scene_file_valid: Failed to open input file '%s'\n", path);
+            exit(1);
+        }
+        SceneCopy old;
+        scene_detach(&old);
+        init_lights();
+        init_objects();
+        read_json(json, path);
+        animate_scene(0);
+        prepare_scene();
+        exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#else
+int watch_open(const char *path) {
+    fprintf(stderr, "Error: watch_open: --watch needs inotify, which is only on Linux\n");
+    exit(1);
+}
+
+void watch_wait(int fd, const char *path) {
+}
+
+boolean scene_file_valid(const char *path) {
+    return true;
+}
+#endif
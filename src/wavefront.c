@@ -0,0 +1,422 @@
+/* wavefront.c - shades a batch of primary hits one bounce at a time instead of recursing per pixel. Every
+ * reflection and refraction ray of a bounce is queued before any of them is intersected, and so is every shadow ray,
+ * grouped by light. The queues can be sorted so that rays leaving from nearby points in similar directions are
+ * intersected back to back, which keeps traversal of the scene coherent.
+ *
+ * The color shade() computes is linear in the colors of its reflected and refracted children, so each queued hit
+ * carries the weight it contributes to its pixel and children are only traced when their weight is non-zero. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../include/wavefront.h"
+#include "../include/illumination.h"
+#include "../include/lighttree.h"
+#include "../include/arena.h"
+#include "../include/instance.h"
+
+/* a hit waiting to be shaded */
+typedef struct shade_item_t {
+    Ray ray;            // ray that made the hit, direction normalized
+    int obj;            // object that was hit
+    int triangle;       // triangle that was hit if it is a mesh, -1 otherwise
+    real t;             // distance along the ray
+    real ior;           // index of refraction the ray was travelling through
+    boolean in_sphere;  // whether the hit was from inside of a sphere
+    int depth;          // recursion level, 0 for primary hits
+    int pixel;          // index into the output colors
+    real weight[3];     // how much of this hit's color ends up in the pixel
+    real cutoff_weight; // the weight shade() gives the same hit, the product of the reflectivities and
+                        // refractivities on the way to it, which render_options.min_weight is compared against
+    int refl_ray;       // index of the queued reflection ray, -1 if it was not needed
+    int refr_ray;       // index of the queued refraction ray, -1 if it was not needed
+    real position[3];   // intersection point
+} ShadeItem;
+
+/* a ray waiting to be intersected */
+typedef struct queued_ray_t {
+    Ray ray;
+    int item;           // shade item that cast the ray
+    int self;           // object to skip, -1 for none
+    real max_dist;      // how far to look, INFINITY for secondary rays
+    real light_weight;      // for shadow rays, what the light's contribution is scaled by
+    int hit_obj;        // results of shoot()
+    real hit_t;
+    boolean hit_in_sphere;
+    int hit_triangle;
+} QueuedRay;
+
+/* growable arrays used by the batch */
+typedef struct ray_queue_t {
+    QueuedRay *rays;
+    int n, cap;
+} RayQueue;
+
+typedef struct item_list_t {
+    ShadeItem *items;
+    int n, cap;
+} ItemList;
+
+/* the queues and lists live in the calling thread's frame arena and are given back when its tile is done */
+static QueuedRay *queue_push(RayQueue *q) {
+    if (q->n == q->cap) {
+        int cap = q->cap ? q->cap * 2 : 256;
+        q->rays = arena_grow(&frame_arena, q->rays, sizeof(QueuedRay) * q->cap, sizeof(QueuedRay) * cap);
+        q->cap = cap;
+    }
+    return &q->rays[q->n++];
+}
+
+static ShadeItem *items_push(ItemList *l) {
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 256;
+        l->items = arena_grow(&frame_arena, l->items, sizeof(ShadeItem) * l->cap, sizeof(ShadeItem) * cap);
+        l->cap = cap;
+    }
+    return &l->items[l->n++];
+}
+
+/**
+ * Spreads the low 10 bits of v out so there are two zero bits between each of them
+ */
+static uint32_t spread_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/**
+ * Orders the rays in a queue for coherent traversal: by direction octant, then by the Morton code of the origin
+ * within the bounds of all of the queue's origins
+ * @param q - queue of rays
+ * @param order - filled with the indices of the rays in traversal order
+ */
+static void sort_rays(RayQueue *q, int *order) {
+    real lo[3] = {INFINITY, INFINITY, INFINITY};
+    real hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < q->n; i++) {
+        for (int k = 0; k < 3; k++) {
+            real o = q->rays[i].ray.origin[k];
+            if (o < lo[k]) lo[k] = o;
+            if (o > hi[k]) hi[k] = o;
+        }
+    }
+    real scale[3];
+    for (int k = 0; k < 3; k++)
+        scale[k] = hi[k] > lo[k] ? 1023.0 / (hi[k] - lo[k]) : 0;
+
+    uint32_t *keys = arena_alloc(&frame_arena, sizeof(uint32_t) * q->n * 2);
+    uint32_t *tmp_keys = keys + q->n;
+    int *tmp_order = arena_alloc(&frame_arena, sizeof(int) * q->n);
+    for (int i = 0; i < q->n; i++) {
+        Ray *r = &q->rays[i].ray;
+        uint32_t octant = (r->direction[0] < 0) | (r->direction[1] < 0) << 1 | (r->direction[2] < 0) << 2;
+        uint32_t morton = 0;
+        for (int k = 0; k < 3; k++)
+            morton |= spread_bits((uint32_t)((r->origin[k] - lo[k]) * scale[k])) << k;
+        keys[i] = octant << 29 | morton >> 1;
+        order[i] = i;
+    }
+
+    // least significant digit radix sort, 8 bits at a time
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count[257];
+        memset(count, 0, sizeof(count));
+        for (int i = 0; i < q->n; i++)
+            count[((keys[i] >> shift) & 0xff) + 1]++;
+        for (int d = 0; d < 256; d++)
+            count[d + 1] += count[d];
+        for (int i = 0; i < q->n; i++) {
+            int dst = count[(keys[i] >> shift) & 0xff]++;
+            tmp_keys[dst] = keys[i];
+            tmp_order[dst] = order[i];
+        }
+        memcpy(keys, tmp_keys, sizeof(uint32_t) * q->n);
+        memcpy(order, tmp_order, sizeof(int) * q->n);
+    }
+}
+
+/**
+ * Intersects every ray in a queue, in sorted order if asked
+ */
+static void trace_queue(RayQueue *q, boolean sort) {
+    if (q->n == 0)
+        return;
+    int *order = NULL;
+    if (sort) {
+        order = arena_alloc(&frame_arena, sizeof(int) * q->n);
+        sort_rays(q, order);
+    }
+    for (int k = 0; k < q->n; k++) {
+        QueuedRay *r = &q->rays[order ? order[k] : k];
+        shoot(&r->ray, r->self, r->max_dist, &r->hit_obj, &r->hit_t, &r->hit_in_sphere, &r->hit_triangle);
+    }
+}
+
+/* lights shaded at one hit, reused across hits */
+static __thread LightBatch lights_batch;
+
+/**
+ * Adds weight * term to a pixel color
+ */
+static inline void add_weighted(real color[3], real weight[3], real term[3]) {
+    color[0] += weight[0] * term[0];
+    color[1] += weight[1] * term[1];
+    color[2] += weight[2] * term[2];
+}
+
+/**
+ * Shades a batch of primary hits. Gives the same colors as calling shade() on each hit, except that every
+ * reflected and refracted ray carries the inside-of-sphere flag of its own hit
+ * @param rays - primary rays, one per hit
+ * @param hits - first hits of the rays
+ * @param n - number of rays
+ * @param colors - resulting color for each ray
+ * @param sort - whether to sort queued rays for coherence before intersecting them. Queues and other temporaries
+ * come from the calling thread's frame arena, which the caller resets once it is done with the colors
+ */
+void shade_batch(Ray *rays, FirstHit *hits, int n, real (*colors)[3], boolean sort) {
+    ItemList current = {NULL, 0, 0};
+    ItemList next = {NULL, 0, 0};
+    RayQueue secondary = {NULL, 0, 0};
+    RayQueue *shadows = arena_calloc(&frame_arena, nlights, sizeof(RayQueue));
+    boolean background_black = background_color[0] == 0 && background_color[1] == 0 && background_color[2] == 0;
+
+    for (int i = 0; i < n; i++) {
+        counters.samples++;
+        if (hits[i].t > 0 && hits[i].t != INFINITY && hits[i].obj != -1) {
+            v3_zero(colors[i]);
+            ShadeItem *item = items_push(&current);
+            item->ray = rays[i];
+            item->obj = hits[i].obj;
+            item->triangle = hits[i].triangle;
+            item->t = hits[i].t;
+            item->ior = 1;
+            item->in_sphere = hits[i].in_sphere;
+            item->depth = 0;
+            item->pixel = i;
+            item->weight[0] = item->weight[1] = item->weight[2] = 1;
+            item->cutoff_weight = 1;
+        }
+        else {
+            copy_color(background_color, colors[i]);
+        }
+    }
+
+    while (current.n > 0) {
+        secondary.n = 0;
+        for (int l = 0; l < nlights; l++)
+            shadows[l].n = 0;
+
+        // queue the reflection, refraction and shadow rays of every hit at this depth
+        for (int i = 0; i < current.n; i++) {
+            ShadeItem *item = &current.items[i];
+            Ray *ray = &item->ray;
+            item->refl_ray = -1;
+            item->refr_ray = -1;
+            if (item->depth > render_options.max_depth)
+                continue;   // shade() returns black past the recursion limit
+
+            v3_scale(ray->direction, item->t, item->position);
+            v3_add(item->position, ray->origin, item->position);
+            normalize(ray->direction);
+
+            real reflect = get_reflectivity(item->obj);
+            real refract = get_refractivity(item->obj);
+            boolean opaque = fabs(refract) < 0.00001 && fabs(reflect) < 0.00001;
+            // whether the object's own color depends on the secondary rays hitting anything
+            boolean need_hit_test = !opaque || !background_black;
+            boolean children = !opaque && item->depth + 1 <= render_options.max_depth;
+
+            V3 reflection = {0, 0, 0};
+            V3 refraction = {0, 0, 0};
+            boolean in_sphere = item->in_sphere;
+            reflection_vector(ray->direction, item->position, item->obj, item->triangle, reflection);
+            refraction_vector(ray->direction, item->position, item->obj, item->triangle, item->ior, refraction,
+                              &in_sphere);
+
+            if (need_hit_test || (children && reflect != 0)) {
+                item->refl_ray = secondary.n;
+                QueuedRay *q = queue_push(&secondary);
+                q->item = i;
+                q->self = -1;
+                q->max_dist = INFINITY;
+                // offset the origin a little along the ray so we don't hit the same spot again
+                v3_scale(reflection, ray_offset(item->position), q->ray.origin);
+                v3_add(q->ray.origin, item->position, q->ray.origin);
+                v3_copy(reflection, q->ray.direction);
+                normalize(q->ray.direction);
+            }
+            if (need_hit_test || (children && refract != 0)) {
+                item->refr_ray = secondary.n;
+                QueuedRay *q = queue_push(&secondary);
+                q->item = i;
+                q->self = -1;
+                q->max_dist = INFINITY;
+                v3_scale(refraction, ray_offset(item->position), q->ray.origin);
+                v3_add(q->ray.origin, item->position, q->ray.origin);
+                v3_copy(refraction, q->ray.direction);
+                normalize(q->ray.direction);
+            }
+            LightChoice *choices;
+            int nchoices = select_lights(item->position, &choices);
+            for (int c = 0; c < nchoices; c++) {
+                int l = choices != NULL ? choices[c].light : c;
+                Ray to_light;
+                v3_copy(item->position, to_light.origin);
+                V4 direction = v4_sub(v4_load(lights[l].position), v4_load(item->position));
+                real distance_to_light = v4_len(direction);
+                v4_store(v4_div(direction, distance_to_light), to_light.direction);
+                if (!light_reaches(&lights[l], to_light.direction, distance_to_light))
+                    continue;
+                QueuedRay *q = queue_push(&shadows[l]);
+                q->item = i;
+                q->self = item->obj;
+                q->ray = to_light;
+                q->max_dist = distance_to_light;
+                q->light_weight = choices != NULL ? choices[c].weight : 1;
+            }
+        }
+
+        trace_queue(&secondary, sort);
+        for (int l = 0; l < nlights; l++) {
+            if (render_options.shadows) {
+                trace_queue(&shadows[l], sort);
+                continue;
+            }
+            // without shadows nothing is ever in the way
+            for (int k = 0; k < shadows[l].n; k++)
+                shadows[l].rays[k].hit_obj = -1;
+        }
+
+        // add up what each hit contributes and turn the secondary hits into the next depth's items
+        next.n = 0;
+        for (int i = 0; i < current.n; i++) {
+            ShadeItem *item = &current.items[i];
+            if (item->depth > render_options.max_depth)
+                continue;
+            QueuedRay *refl = item->refl_ray >= 0 ? &secondary.rays[item->refl_ray] : NULL;
+            QueuedRay *refr = item->refr_ray >= 0 ? &secondary.rays[item->refr_ray] : NULL;
+            boolean refl_hit = refl != NULL && refl->hit_obj >= 0;
+            boolean refr_hit = refr != NULL && refr->hit_obj >= 0;
+            if (!refl_hit && !refr_hit)
+                continue;   // no local color, only the lights below
+
+            real reflect = get_reflectivity(item->obj);
+            real refract = get_refractivity(item->obj);
+            if (fabs(refract) < 0.00001 && fabs(reflect) < 0.00001) {
+                // opaque objects take the background color and drop their children
+                add_weighted(colors[item->pixel], item->weight, background_color);
+                continue;
+            }
+            real color_diff = 1.0 - reflect - refract;
+            if (fabs(color_diff) < 0.0001)
+                color_diff = 0;
+            real obj_color[3];
+            scale_color(hit_object(item->obj)->plane.diff_color, color_diff, obj_color);
+            add_weighted(colors[item->pixel], item->weight, obj_color);
+
+            if (item->depth + 1 > render_options.max_depth)
+                continue;
+            if (refl_hit && reflect != 0) {
+                // the reflected color lights this spot like a light with no attenuation coming from the direction
+                // shade() uses, so its weight is the diffuse and specular response to a white light scaled by reflect
+                Light refl_light;
+                V3 white = {1, 1, 1};
+                V3 response = {0, 0, 0};
+                Ray towards;
+                refl_light.type = OBJECT;
+                refl_light.color = white;
+                v3_copy(item->position, towards.origin);
+                v3_scale(refl->ray.direction, refl->hit_t, towards.direction);
+                v3_sub(towards.direction, item->position, towards.direction);
+                normalize(towards.direction);
+                direct_shade(&towards, item->obj, item->triangle, item->ray.direction, &refl_light, INFINITY,
+                             response);
+
+                ShadeItem *child = items_push(&next);
+                child->ray = refl->ray;
+                child->obj = refl->hit_obj;
+                child->triangle = refl->hit_triangle;
+                child->t = refl->hit_t;
+                child->ior = get_ior(refl->hit_obj);
+                child->in_sphere = refl->hit_in_sphere;
+                child->depth = item->depth + 1;
+                child->pixel = item->pixel;
+                for (int k = 0; k < 3; k++)
+                    child->weight[k] = item->weight[k] * response[k] * reflect;
+                child->cutoff_weight = item->cutoff_weight * reflect;
+            }
+            if (refr_hit && refract != 0) {
+                ShadeItem *child = items_push(&next);
+                child->ray = refr->ray;
+                child->obj = refr->hit_obj;
+                child->triangle = refr->hit_triangle;
+                child->t = refr->hit_t;
+                child->ior = get_ior(refr->hit_obj);
+                child->in_sphere = refr->hit_in_sphere;
+                child->depth = item->depth + 1;
+                child->pixel = item->pixel;
+                v3_scale(item->weight, refract, child->weight);
+                child->cutoff_weight = item->cutoff_weight * refract;
+            }
+        }
+
+        // group the shadow rays by the hit that cast them, then shade each hit's lights together
+        int *start = arena_calloc(&frame_arena, current.n + 1, sizeof(int));
+        for (int l = 0; l < nlights; l++) {
+            for (int k = 0; k < shadows[l].n; k++)
+                start[shadows[l].rays[k].item + 1]++;
+        }
+        for (int i = 0; i < current.n; i++)
+            start[i + 1] += start[i];
+        QueuedRay **grouped = arena_alloc(&frame_arena, sizeof(QueuedRay*) * start[current.n]);
+        int *grouped_light = arena_alloc(&frame_arena, sizeof(int) * start[current.n]);
+        for (int l = 0; l < nlights; l++) {
+            for (int k = 0; k < shadows[l].n; k++) {
+                int dst = start[shadows[l].rays[k].item]++;
+                grouped[dst] = &shadows[l].rays[k];
+                grouped_light[dst] = l;
+            }
+        }
+        // start[i] is now where the shadow rays of hit i end and those of hit i + 1 begin
+        for (int i = 0; i < current.n; i++) {
+            int first = i > 0 ? start[i - 1] : 0;
+            if (start[i] == first)
+                continue;
+            ShadeItem *item = &current.items[i];
+            lights_batch.n = 0;
+            for (int g = first; g < start[i]; g++) {
+                // lights with something in the way are masked out, it's shadow
+                QueuedRay *q = grouped[g];
+                light_batch_push(&lights_batch, grouped_light[g], q->ray.direction, q->max_dist,
+                                 q->hit_obj == -1 ? q->light_weight : 0);
+            }
+            real normal[3], diff_color[3], spec_color[3];
+            real light_color[3] = {0, 0, 0};
+            surface_shading(item->obj, item->triangle, item->position, normal, diff_color, spec_color);
+            shade_light_batch(&lights_batch, normal, item->ray.direction, diff_color, spec_color, light_color);
+            add_weighted(colors[item->pixel], item->weight, light_color);
+        }
+
+        // children with no weight left can't change the pixel, and those under render_options.min_weight are left
+        // black, the same as shade() leaves them
+        int kept = 0;
+        boolean cut = render_options.min_weight > 0;
+        for (int i = 0; i < next.n; i++) {
+            real *w = next.items[i].weight;
+            boolean weighty = (w[0] != 0 || w[1] != 0 || w[2] != 0) &&
+                              (!cut || next.items[i].cutoff_weight >= render_options.min_weight);
+            if (weighty)
+                next.items[kept++] = next.items[i];
+        }
+        next.n = kept;
+
+        ItemList swap = current;
+        current = next;
+        next = swap;
+    }
+}